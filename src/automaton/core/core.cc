@@ -303,8 +303,6 @@ int main(int argc, char* argv[]) {
     smart_protocol::load(proto_id, path);
   });
 
-  automaton::core::network::tcp_init();
-
   std::shared_ptr<automaton::core::network::simulation> sim = automaton::core::network::simulation::get_simulator();
   sim->simulation_start(100);
   cli.print(automaton_ascii_logo.c_str());
@@ -318,7 +316,7 @@ int main(int argc, char* argv[]) {
   std::unordered_map<std::string, std::pair<std::string, std::string> > rpc_commands;
   uint32_t rpc_port = 0;
   uint32_t updater_workers_number = 0;
-  uint32_t updater_workers_sleep_time = 0;
+  uint32_t tcp_threads = 0;
 
   std::ifstream i("automaton/core/coreinit.json");
   if (!i.is_open()) {
@@ -327,6 +325,9 @@ int main(int argc, char* argv[]) {
     nlohmann::json j;
     i >> j;
     i.close();
+    if (j.find("schema_cache_dir") != j.end()) {
+      smart_protocol::set_schema_cache_dir(j["schema_cache_dir"]);
+    }
     std::vector<std::vector<std::string>> protocols = j["protocols"];
     for (auto& p : protocols) {
       std::string pid = p[0];
@@ -359,10 +360,12 @@ int main(int argc, char* argv[]) {
     rpc_port = j["rpc_config"]["default_port"];
 
     updater_workers_number = j["updater_config"]["workers_number"];
-    updater_workers_sleep_time = j["updater_config"]["workers_sleep_time"];
+    tcp_threads = j["network_config"]["tcp_threads"];
   }
   i.close();
-  updater = new default_node_updater(updater_workers_number, updater_workers_sleep_time, std::set<std::string>());
+  automaton::core::network::tcp_init(tcp_threads);
+
+  updater = new default_node_updater(updater_workers_number, std::set<std::string>());
   updater->start();
 
   // Start dump_logs thread.
@@ -8,6 +8,7 @@ namespace cryptopp {
 
 Keccak_256_cryptopp::Keccak_256_cryptopp() {
   hash = new CryptoPP::Keccak_256;
+  transformation = hash;
 }
 
 Keccak_256_cryptopp::~Keccak_256_cryptopp() {
@@ -8,6 +8,7 @@ namespace cryptopp {
 
 RIPEMD160_cryptopp::RIPEMD160_cryptopp() {
   hash = new CryptoPP::RIPEMD160;
+  transformation = hash;
 }
 
 RIPEMD160_cryptopp::~RIPEMD160_cryptopp() {
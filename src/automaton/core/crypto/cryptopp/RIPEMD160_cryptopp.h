@@ -4,14 +4,14 @@
 #include <cryptopp/cryptlib.h>
 #include <cryptopp/ripemd.h>
 
-#include "automaton/core/crypto/hash_transformation.h"
+#include "automaton/core/crypto/cryptopp/hash_transformation_cryptopp.h"
 
 namespace automaton {
 namespace core {
 namespace crypto {
 namespace cryptopp {
 
-class RIPEMD160_cryptopp : public hash_transformation {
+class RIPEMD160_cryptopp : public hash_transformation_cryptopp {
  private:
   CryptoPP::RIPEMD160* hash;
  public:
@@ -8,6 +8,7 @@ namespace cryptopp {
 
 SHA256_cryptopp::SHA256_cryptopp() {
   hash = new CryptoPP::SHA256;
+  transformation = hash;
 }
 
 SHA256_cryptopp::~SHA256_cryptopp() {
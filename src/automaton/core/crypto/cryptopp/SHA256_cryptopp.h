@@ -4,14 +4,14 @@
 #include <cryptopp/cryptlib.h>
 #include <cryptopp/sha.h>
 
-#include "automaton/core/crypto/hash_transformation.h"
+#include "automaton/core/crypto/cryptopp/hash_transformation_cryptopp.h"
 
 namespace automaton {
 namespace core {
 namespace crypto {
 namespace cryptopp {
 
-class SHA256_cryptopp : public hash_transformation {
+class SHA256_cryptopp : public hash_transformation_cryptopp {
  private:
   CryptoPP::SHA256* hash;
  public:
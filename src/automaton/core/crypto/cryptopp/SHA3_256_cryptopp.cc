@@ -8,6 +8,7 @@ namespace cryptopp {
 
 SHA3_256_cryptopp::SHA3_256_cryptopp() {
   hash = new CryptoPP::SHA3_256;
+  transformation = hash;
 }
 
 SHA3_256_cryptopp::~SHA3_256_cryptopp() {
@@ -8,6 +8,7 @@ namespace cryptopp {
 
 SHA512_cryptopp::SHA512_cryptopp() {
   hash = new CryptoPP::SHA512;
+  transformation = hash;
 }
 
 SHA512_cryptopp::~SHA512_cryptopp() {
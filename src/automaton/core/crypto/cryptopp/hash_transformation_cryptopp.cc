@@ -0,0 +1,19 @@
+#include "automaton/core/crypto/cryptopp/hash_transformation_cryptopp.h"
+
+namespace automaton {
+namespace core {
+namespace crypto {
+namespace cryptopp {
+
+void hash_transformation_cryptopp::update_batch(const input_span * spans,
+                                                const size_t count) {
+  for (size_t i = 0; i < count; ++i) {
+    transformation->Update(spans[i].length == 0 ? nullptr : spans[i].data,
+                           spans[i].length);
+  }
+}
+
+}  // namespace cryptopp
+}  // namespace crypto
+}  // namespace core
+}  // namespace automaton
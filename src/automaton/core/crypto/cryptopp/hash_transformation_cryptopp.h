@@ -0,0 +1,29 @@
+#ifndef AUTOMATON_CORE_CRYPTO_CRYPTOPP_HASH_TRANSFORMATION_CRYPTOPP_H_
+#define AUTOMATON_CORE_CRYPTO_CRYPTOPP_HASH_TRANSFORMATION_CRYPTOPP_H_
+
+#include <cryptopp/cryptlib.h>
+
+#include "automaton/core/crypto/hash_transformation.h"
+
+namespace automaton {
+namespace core {
+namespace crypto {
+namespace cryptopp {
+
+// Base class for the hash functions backed by a CryptoPP::HashTransformation
+class hash_transformation_cryptopp : public hash_transformation {
+ public:
+  // Feeds the spans straight to the CryptoPP hash, one call for the batch.
+  void update_batch(const input_span* spans, const size_t count);
+
+ protected:
+  // The hash of the derived class, set by its constructor.
+  CryptoPP::HashTransformation* transformation = nullptr;
+};
+
+}  // namespace cryptopp
+}  // namespace crypto
+}  // namespace core
+}  // namespace automaton
+
+#endif  // AUTOMATON_CORE_CRYPTO_CRYPTOPP_HASH_TRANSFORMATION_CRYPTOPP_H_
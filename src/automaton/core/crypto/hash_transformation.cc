@@ -18,6 +18,13 @@ void hash_transformation::calculate_digest(const uint8_t * input,
   final(digest);
 }
 
+void hash_transformation::update_batch(const input_span * spans,
+                                       const size_t count) {
+  for (size_t i = 0; i < count; ++i) {
+    update(spans[i].data, spans[i].length);
+  }
+}
+
 }  // namespace crypto
 }  // namespace core
 }  // namespace automaton
@@ -12,6 +12,12 @@ namespace crypto {
 // Base class for hash functions
 class hash_transformation {
  public:
+  // A contiguous piece of input for update_batch().
+  struct input_span {
+    const uint8_t* data;
+    size_t length;
+  };
+
   // Updates the hash with additional input and computes the hash of the current
   // message.
   // Precondition digest_size == digest in bytes.
@@ -27,6 +33,12 @@ class hash_transformation {
   //      lenght:   the size of the buffer, in bytes .
   virtual void update(const uint8_t * input, const size_t length) = 0;
 
+  // Update a hash with several buffers, in order, with a single call.
+  // Equivalent to calling update() for each of the spans.
+  // IN:  spans:    array of input buffers.
+  //      count:    the number of spans.
+  virtual void update_batch(const input_span * spans, const size_t count);
+
   // Computes the hash of the current message.
   // Precondition digest_size == digest in bytes.
   // OUT:  digest:  a pointer to the buffer to receive the hash.
@@ -4,6 +4,8 @@ namespace automaton {
 namespace core {
 namespace data {
 
+msg_arena::~msg_arena() {}
+
 factory::~factory() {}
 
 }  // namespace data
@@ -14,6 +14,19 @@ namespace automaton {
 namespace core {
 namespace data {
 
+/**
+  Memory arena messages can be created in, see factory::new_arena(). Messages created in an arena and the sub messages
+  taken from them are allocated from it instead of the heap. The arena is freed at once when it and all messages
+  created in it are destroyed.
+*/
+class msg_arena {
+ public:
+  virtual ~msg_arena() = 0;
+
+  /** Returns the number of bytes allocated by the arena so far. */
+  virtual uint64_t get_space_allocated() const = 0;
+};
+
 /** Schema data structure interface.
 */
 class factory {
@@ -108,6 +121,21 @@ class factory {
   */
   virtual std::unique_ptr<msg> new_message_by_id(uint32_t message_type_id) = 0;
 
+  /**
+    Creates new arena for new_message_by_id().
+  */
+  virtual std::shared_ptr<msg_arena> new_arena() = 0;
+
+  /**
+    Creates new message from a schema with message_type_id in the given arena.
+    The arena must be created by this factory. If it is nullptr, the message is
+    allocated on the heap.
+
+    If the given message_type_id or arena is not valid, exception will be thrown.
+  */
+  virtual std::unique_ptr<msg> new_message_by_id(uint32_t message_type_id,
+      const std::shared_ptr<msg_arena>& arena) = 0;
+
   /**
     Creates new message from a schema name.
 
@@ -12,6 +12,12 @@ namespace data {
 
 /**
   Schema message interface
+
+  A message can be created in a msg_arena, see factory::new_arena(). Such a
+  message and the sub messages taken from it share the arena and keep all of
+  it alive, with every other message created in it, until the last of them is
+  destroyed. A message that is kept for long should be moved out with
+  move_to_heap().
 */
 class msg {
  public:
@@ -50,6 +56,19 @@ class msg {
   */
   virtual bool deserialize_message(const std::string& input) = 0;
 
+  /** Deserializes message from size bytes at data. Same as the string version,
+      but the bytes can be parsed where they are, e.g. in a network buffer,
+      without copying them into a string first.
+  */
+  virtual bool deserialize_message(const uint8_t* data, size_t size) = 0;
+
+  /**
+    Copies the message out of its arena onto the heap, so it no longer keeps
+    the arena alive. Sub messages taken from it before stay in the arena. Does
+    nothing if the message is on the heap.
+  */
+  virtual void move_to_heap() = 0;
+
   /**
     Serializes message to JSON string.
   */
@@ -174,6 +193,15 @@ class msg {
   virtual uint32_t get_field_tag(const std::string& name) const = 0;
 
   virtual schema::field_info get_field_info_by_tag(uint32_t field_tag) const = 0;
+
+  /**
+    Finds the field with the given name and returns its tag, type and whether it
+    is repeated. Returns false if there is no such field. Unlike
+    get_field_tag() and get_field_info_by_tag() it doesn't allocate, so it can
+    be used on every access by name, e.g. from scripts.
+  */
+  virtual bool find_field(const char* name, size_t length, uint32_t* field_tag, schema::field_type* type,
+      bool* is_repeated) const = 0;
 };
 
 }  // namespace data
@@ -126,13 +126,39 @@ protobuf_factory::~protobuf_factory() {
   delete pool;
 }
 
+void protobuf_factory::add_schema(const Descriptor* desc) {
+  schemas.push_back(dynamic_message_factory->GetPrototype(desc));
+  field_tables.emplace_back(new protobuf_field_table(desc));
+  schemas_names[desc->full_name()] = static_cast<uint32_t>(schemas.size()) - 1;
+}
+
+void protobuf_factory::link_field_tables(uint32_t first_schema_id) {
+  for (uint32_t i = first_schema_id; i < field_tables.size(); ++i) {
+    for (protobuf_field_table::field& f : field_tables[i]->fields) {
+      if (f.cpp_type != FieldDescriptor::CPPTYPE_MESSAGE) {
+        continue;
+      }
+      // Message types are in the same file or in an imported dependency
+      const string& type_name = f.fdesc->message_type()->full_name();
+      auto it = schemas_names.find(type_name);
+      if (it == schemas_names.end()) {
+        std::stringstream msg;
+        msg << "Message type <" << type_name << "> of field <" << f.fdesc->full_name() << "> was not imported";
+        LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
+        throw std::runtime_error(msg.str());
+      }
+      f.message_schema_id = it->second;
+      f.message_fields = field_tables[it->second].get();
+    }
+  }
+}
+
 void protobuf_factory::extract_nested_messages(const Descriptor* d) {
   CHECK_NOTNULL(d) << "Message descriptor is nullptr";
   uint32_t num_msg = d->nested_type_count();
   for (uint32_t i = 0; i < num_msg; i++) {
     const Descriptor* desc = d->nested_type(i);
-    schemas.push_back(dynamic_message_factory->GetPrototype(desc));
-    schemas_names[desc->full_name()] = static_cast<uint32_t>(schemas.size()) - 1;
+    add_schema(desc);
     extract_nested_messages(desc);
   }
 }
@@ -230,13 +256,31 @@ void protobuf_factory::import_from_file_proto(FileDescriptorProto* fdp,
     }
   }
 
+  files.push_back(fd);
+  uint32_t first_schema_id = static_cast<uint32_t>(schemas.size());
+  size_t first_enum_id = enums.size();
   for (uint32_t i = 0; i < number_messages; i++) {
     const Descriptor* desc = fd->message_type(i);
-    schemas.push_back(dynamic_message_factory->GetPrototype(desc));
-    schemas_names[desc->full_name()] = static_cast<uint32_t>(schemas.size()) - 1;
+    add_schema(desc);
     extract_nested_messages(desc);
     extract_nested_enums(desc);
   }
+  try {
+    link_field_tables(first_schema_id);
+  } catch (const std::runtime_error&) {
+    // Drop the schemas of the file, so none is left without its sub messages
+    for (uint32_t i = first_schema_id; i < schemas.size(); ++i) {
+      schemas_names.erase(schemas[i]->GetDescriptor()->full_name());
+    }
+    schemas.resize(first_schema_id);
+    field_tables.resize(first_schema_id);
+    for (size_t i = first_enum_id; i < enums.size(); ++i) {
+      enums_names.erase(enums[i]->full_name());
+    }
+    enums.resize(first_enum_id);
+    files.pop_back();
+    throw;
+  }
 
   uint32_t number_enums = fd->enum_type_count();
   for (uint32_t i = 0; i < number_enums; i++) {
@@ -256,6 +300,31 @@ void protobuf_factory::import_schema(schema* schema, const string& name, const s
   import_from_file_proto(pb_schema->get_file_descriptor_proto(), name, package);
 }
 
+void protobuf_factory::export_file_descriptor_set(std::string* output) const {
+  CHECK_NOTNULL(output);
+  google::protobuf::FileDescriptorSet fds;
+  for (const FileDescriptor* fd : files) {
+    fd->CopyTo(fds.add_file());
+  }
+  fds.SerializeToString(output);
+}
+
+void protobuf_factory::import_file_descriptor_set(const string& input) {
+  google::protobuf::FileDescriptorSet fds;
+  if (!fds.ParseFromString(input)) {
+    std::stringstream msg;
+    msg << "Invalid file descriptor set";
+    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
+    throw std::invalid_argument(msg.str());
+  }
+  for (int i = 0; i < fds.file_size(); ++i) {
+    FileDescriptorProto* fdp = fds.mutable_file(i);
+    string name = fdp->name();
+    string package = fdp->package();
+    import_from_file_proto(fdp, name, package);
+  }
+}
+
 std::string protobuf_factory::dump_message_schema(uint32_t schema_id) const {
   CHECK_LT(schema_id, schemas.size());
   CHECK_NOTNULL(schemas[schema_id]);
@@ -294,7 +363,30 @@ std::unique_ptr<msg> protobuf_factory::new_message_by_id(uint32_t schema_id) {
   CHECK_LT(schema_id, schemas.size());
   CHECK_NOTNULL(schemas[schema_id]);
   Message* m = schemas[schema_id]->New();
-  return std::unique_ptr<msg>(new protobuf_msg(m, this, schema_id));
+  return std::unique_ptr<msg>(new protobuf_msg(m, this, schema_id, field_tables[schema_id].get()));
+}
+
+std::shared_ptr<msg_arena> protobuf_factory::new_arena() {
+  return std::make_shared<protobuf_arena>();
+}
+
+std::unique_ptr<msg> protobuf_factory::new_message_by_id(uint32_t schema_id,
+    const std::shared_ptr<msg_arena>& arena) {
+  if (arena == nullptr) {
+    return new_message_by_id(schema_id);
+  }
+  auto pb_arena = std::dynamic_pointer_cast<protobuf_arena>(arena);
+  if (pb_arena == nullptr) {
+    std::stringstream msg;
+    msg << "Arena is not a protobuf arena";
+    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
+    throw std::invalid_argument(msg.str());
+  }
+  CHECK_LT(schema_id, schemas.size());
+  CHECK_NOTNULL(schemas[schema_id]);
+  Message* m = schemas[schema_id]->New(&pb_arena->arena);
+  return std::unique_ptr<msg>(new protobuf_msg(m, this, schema_id, field_tables[schema_id].get(),
+      std::move(pb_arena)));
 }
 
 std::unique_ptr<msg> protobuf_factory::new_message_by_name(const char* schema_name) {
@@ -509,13 +601,10 @@ string protobuf_factory::get_enum_field_type(uint32_t schema_id, uint32_t field_
 }
 
 uint32_t protobuf_factory::get_field_tag(uint32_t schema_id, const string& name) const {
-  CHECK_LT(schema_id, schemas.size());
-  CHECK_NOTNULL(schemas[schema_id]);
-  CHECK_NOTNULL(schemas[schema_id]->GetDescriptor());
-  const FieldDescriptor* fdesc =
-      schemas[schema_id]->GetDescriptor()->FindFieldByName(name);
-  if (fdesc) {
-    return fdesc->number();
+  CHECK_LT(schema_id, field_tables.size());
+  const protobuf_field_table::field* f = field_tables[schema_id]->find(name.data(), name.size());
+  if (f) {
+    return f->tag;
   }
   std::stringstream msg;
   msg << "No field with name: " << name;
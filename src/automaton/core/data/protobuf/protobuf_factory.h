@@ -19,6 +19,7 @@
 #include <vector>
 
 #include "automaton/core/data/factory.h"
+#include "automaton/core/data/protobuf/protobuf_field_table.h"
 #include "automaton/core/data/protobuf/protobuf_msg.h"
 #include "automaton/core/data/schema.h"
 
@@ -38,15 +39,27 @@ class protobuf_factory: public factory {
   /// Message schemas
   std::vector<const google::protobuf::Message*> schemas;
 
+  /// Accessor tables of the message schemas, parallel to schemas
+  std::vector<std::unique_ptr<protobuf_field_table>> field_tables;
+
   // Message instances
   // std::vector <protobuf_msg> messages;
 
+  /// Imported files in the order of import
+  std::vector<const google::protobuf::FileDescriptor*> files;
+
   /// Enum type name to index in vector enums
   std::map<std::string, uint32_t> enums_names;
 
   /// Enums
   std::vector<const google::protobuf::EnumDescriptor*> enums;
 
+  /// Adds the schema and the accessor table of a message
+  void add_schema(const google::protobuf::Descriptor* descriptor);
+
+  /// Sets the schema ids and tables of message fields in the tables from first_schema_id on
+  void link_field_tables(uint32_t first_schema_id);
+
   /// Extracts schemas of nested messages
   void extract_nested_messages(const google::protobuf::Descriptor* descriptor);
 
@@ -88,6 +101,21 @@ class protobuf_factory: public factory {
   */
   void import_schema(schema* schema, const std::string& name, const std::string& package);
 
+  /**
+    Serializes the definitions of all imported schemas as a
+    google::protobuf::FileDescriptorSet, in the order they were imported.
+  */
+  void export_file_descriptor_set(std::string* output) const;
+
+  /**
+    Imports schemas from a serialized google::protobuf::FileDescriptorSet, like
+    the one from export_file_descriptor_set(). This skips parsing .proto
+    definitions. Files are imported in order with their names and packages, so
+    dependencies must come first. If the input can't be parsed or a file can't
+    be imported, exception will be thrown.
+  */
+  void import_file_descriptor_set(const std::string& input);
+
   /**
     following functions are too complicated for mvp.
   **/
@@ -172,6 +200,19 @@ class protobuf_factory: public factory {
   */
   std::unique_ptr<msg> new_message_by_id(uint32_t schema_id);
 
+  /*
+    Creates new protobuf_arena.
+  */
+  std::shared_ptr<msg_arena> new_arena();
+
+  /*
+    Creates new message from a schema with schema_id in the given arena, which
+    must be a protobuf_arena. If arena is nullptr, the message is allocated on
+    the heap. If the given schema id or arena is not valid, exception will be
+    thrown.
+  */
+  std::unique_ptr<msg> new_message_by_id(uint32_t schema_id, const std::shared_ptr<msg_arena>& arena);
+
   /**
     Creates new message from a schema name.
 
@@ -0,0 +1,168 @@
+#include "automaton/core/data/protobuf/protobuf_field_table.h"
+
+#include <algorithm>
+#include <cstring>
+#include <utility>
+
+#include "automaton/core/data/protobuf/protobuf_factory.h"
+#include "automaton/core/io/io.h"
+
+using google::protobuf::Descriptor;
+using google::protobuf::FieldDescriptor;
+
+namespace automaton {
+namespace core {
+namespace data {
+namespace protobuf {
+
+/// Tags up to this are looked up in a dense array
+static const uint32_t MAX_DENSE_TAG = 1024;
+
+/// FNV-1a of the name, the seed selects a different hash function. The low
+/// bits of FNV-1a hardly depend on the seed, so they are mixed at the end.
+static uint32_t name_hash(uint32_t seed, const char* name, size_t length) {
+  uint32_t h = 2166136261U ^ seed;
+  for (size_t i = 0; i < length; ++i) {
+    h ^= static_cast<uint8_t>(name[i]);
+    h *= 16777619U;
+  }
+  h ^= h >> 16;
+  h *= 0x85ebca6bU;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35U;
+  h ^= h >> 16;
+  return h;
+}
+
+protobuf_field_table::protobuf_field_table(const Descriptor* desc): descriptor(desc) {
+  CHECK_NOTNULL(desc) << "Message descriptor is nullptr";
+  uint32_t field_count = desc->field_count();
+  uint32_t max_tag = 0;
+  fields.reserve(field_count);
+  for (uint32_t i = 0; i < field_count; ++i) {
+    const FieldDescriptor* fdesc = desc->field(i);
+    field f;
+    f.fdesc = fdesc;
+    f.name = fdesc->name();
+    f.tag = fdesc->number();
+    f.cpp_type = fdesc->cpp_type();
+    f.type = protobuf_factory::protobuf_ccptype_to_type.at(f.cpp_type);
+    f.is_repeated = fdesc->is_repeated();
+    f.message_schema_id = 0;
+    f.message_fields = nullptr;
+    fields.push_back(std::move(f));
+    max_tag = std::max(max_tag, fields.back().tag);
+  }
+
+  if (max_tag <= MAX_DENSE_TAG) {
+    by_tag.assign(max_tag + 1, -1);
+    for (uint32_t i = 0; i < field_count; ++i) {
+      by_tag[fields[i].tag] = i;
+    }
+  } else {
+    for (uint32_t i = 0; i < field_count; ++i) {
+      sorted_by_tag.push_back(i);
+    }
+    std::sort(sorted_by_tag.begin(), sorted_by_tag.end(), [this](uint32_t a, uint32_t b) {
+      return fields[a].tag < fields[b].tag;
+    });
+  }
+
+  build_name_hash();
+}
+
+void protobuf_field_table::build_name_hash() {
+  uint32_t size = static_cast<uint32_t>(fields.size());
+  if (size == 0) {
+    return;
+  }
+  // Buckets by the first hash, filled from the biggest one
+  std::vector<std::vector<uint32_t>> buckets(size);
+  for (uint32_t i = 0; i < size; ++i) {
+    buckets[name_hash(0, fields[i].name.data(), fields[i].name.size()) % size].push_back(i);
+  }
+  std::vector<uint32_t> order(size);
+  for (uint32_t i = 0; i < size; ++i) {
+    order[i] = i;
+  }
+  std::stable_sort(order.begin(), order.end(), [&buckets](uint32_t a, uint32_t b) {
+    return buckets[a].size() > buckets[b].size();
+  });
+
+  displacements.assign(size, 0);
+  by_name.assign(size, 0);
+  std::vector<bool> taken(size, false);
+  std::vector<uint32_t> slots;
+  uint32_t b = 0;
+  // Buckets with collisions get a seed which places all their names in free slots
+  for (; b < size && buckets[order[b]].size() > 1; ++b) {
+    const std::vector<uint32_t>& bucket = buckets[order[b]];
+    for (uint32_t d = 1;; ++d) {
+      slots.clear();
+      for (uint32_t i : bucket) {
+        uint32_t slot = name_hash(d, fields[i].name.data(), fields[i].name.size()) % size;
+        if (taken[slot] || std::find(slots.begin(), slots.end(), slot) != slots.end()) {
+          break;
+        }
+        slots.push_back(slot);
+      }
+      if (slots.size() == bucket.size()) {
+        displacements[order[b]] = d;
+        for (uint32_t i = 0; i < bucket.size(); ++i) {
+          taken[slots[i]] = true;
+          by_name[slots[i]] = bucket[i];
+        }
+        break;
+      }
+    }
+  }
+  // Buckets with a single name take any free slot directly
+  uint32_t free_slot = 0;
+  for (; b < size && buckets[order[b]].size() == 1; ++b) {
+    while (taken[free_slot]) {
+      ++free_slot;
+    }
+    taken[free_slot] = true;
+    by_name[free_slot] = buckets[order[b]][0];
+    displacements[order[b]] = -static_cast<int32_t>(free_slot) - 1;
+  }
+}
+
+const protobuf_field_table::field* protobuf_field_table::find(uint32_t tag) const {
+  if (!by_tag.empty() || sorted_by_tag.empty()) {
+    if (tag >= by_tag.size() || by_tag[tag] < 0) {
+      return nullptr;
+    }
+    return &fields[by_tag[tag]];
+  }
+  auto it = std::lower_bound(sorted_by_tag.begin(), sorted_by_tag.end(), tag, [this](uint32_t i, uint32_t t) {
+    return fields[i].tag < t;
+  });
+  if (it == sorted_by_tag.end() || fields[*it].tag != tag) {
+    return nullptr;
+  }
+  return &fields[*it];
+}
+
+const protobuf_field_table::field* protobuf_field_table::find(const char* name, size_t length) const {
+  uint32_t size = static_cast<uint32_t>(fields.size());
+  if (size == 0) {
+    return nullptr;
+  }
+  int32_t d = displacements[name_hash(0, name, length) % size];
+  uint32_t slot = d < 0 ? static_cast<uint32_t>(-d - 1) : name_hash(d, name, length) % size;
+  const field& f = fields[by_name[slot]];
+  if (f.name.size() != length || std::memcmp(f.name.data(), name, length) != 0) {
+    return nullptr;
+  }
+  return &f;
+}
+
+const Descriptor* protobuf_field_table::get_descriptor() const {
+  return descriptor;
+}
+
+}  // namespace protobuf
+}  // namespace data
+}  // namespace core
+}  // namespace automaton
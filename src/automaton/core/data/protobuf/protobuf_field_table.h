@@ -0,0 +1,82 @@
+#ifndef AUTOMATON_CORE_DATA_PROTOBUF_PROTOBUF_FIELD_TABLE_H_
+#define AUTOMATON_CORE_DATA_PROTOBUF_PROTOBUF_FIELD_TABLE_H_
+
+#include <google/protobuf/descriptor.h>
+
+#include <string>
+#include <vector>
+
+#include "automaton/core/data/schema.h"
+
+namespace automaton {
+namespace core {
+namespace data {
+namespace protobuf {
+
+class protobuf_factory;
+
+/**
+  Accessor table of a message schema. It is built once when the schema is
+  imported and lets messages find their fields without searching the
+  descriptor: by tag through a dense array and by name through a minimal
+  perfect hash.
+*/
+class protobuf_field_table {
+ public:
+  struct field {
+    const google::protobuf::FieldDescriptor* fdesc;
+    std::string name;
+    uint32_t tag;
+    google::protobuf::FieldDescriptor::CppType cpp_type;
+    schema::field_type type;
+    bool is_repeated;
+    /// Schema id and table of the message type, set only for message fields
+    uint32_t message_schema_id;
+    const protobuf_field_table* message_fields;
+  };
+
+  explicit protobuf_field_table(const google::protobuf::Descriptor* desc);
+
+  /**
+    Returns the field with the given tag or nullptr if there is no such field.
+  */
+  const field* find(uint32_t tag) const;
+
+  /**
+    Returns the field with the given name or nullptr if there is no such field.
+  */
+  const field* find(const char* name, size_t length) const;
+
+  const google::protobuf::Descriptor* get_descriptor() const;
+
+ private:
+  friend class protobuf_factory;
+
+  const google::protobuf::Descriptor* descriptor;
+
+  std::vector<field> fields;
+
+  /// Index in fields by tag, -1 if no such field. Used if the tags are small.
+  std::vector<int32_t> by_tag;
+
+  /// Indexes in fields sorted by tag. Used if the tags are too big for by_tag.
+  std::vector<uint32_t> sorted_by_tag;
+
+  /**
+    Minimal perfect hash of the names. The first hash of a name selects a
+    displacement. A displacement d >= 0 is the seed of the second hash which
+    gives the index in by_name. A negative one stores the index directly as
+    -d - 1.
+  */
+  std::vector<int32_t> displacements;
+  std::vector<uint32_t> by_name;
+
+  void build_name_hash();
+};
+
+}  // namespace protobuf
+}  // namespace data
+}  // namespace core
+}  // namespace automaton
+
+#endif  // AUTOMATON_CORE_DATA_PROTOBUF_PROTOBUF_FIELD_TABLE_H_
@@ -2,9 +2,10 @@
 
 #include <google/protobuf/util/json_util.h>
 
+#include <limits>
 #include <map>
+#include <utility>
 
-#include "automaton/core/data/protobuf/protobuf_factory.h"
 #include "automaton/core/io/io.h"
 
 #ifdef GetMessage
@@ -27,38 +28,88 @@ namespace core {
 namespace data {
 namespace protobuf {
 
-protobuf_msg::protobuf_msg(google::protobuf::Message * m, factory* msg_factory,
-    uint32_t schema_id): m(m), msg_factory(msg_factory), schema_id(schema_id) {}
-
-uint32_t protobuf_msg::get_schema_id() const {
-  return schema_id;
+uint64_t protobuf_arena::get_space_allocated() const {
+  return arena.SpaceAllocated();
 }
 
-factory* protobuf_msg::get_factory() const {
-  return msg_factory;
+protobuf_msg::protobuf_msg(google::protobuf::Message * m, factory* msg_factory,
+    uint32_t schema_id, const protobuf_field_table* fields, std::shared_ptr<protobuf_arena> arena):
+    arena(std::move(arena)), m(m), msg_factory(msg_factory), schema_id(schema_id), fields(fields) {}
+
+protobuf_msg::~protobuf_msg() {
+  if (arena != nullptr) {
+    // Freed with the arena
+    m.release();
+  }
 }
 
-string protobuf_msg::get_message_type() const {
-  CHECK(m != nullptr);
-  return m->GetTypeName();
+google::protobuf::Arena* protobuf_msg::get_arena() const {
+  return arena != nullptr ? &arena->arena : nullptr;
 }
 
-uint32_t protobuf_msg::get_repeated_field_size(uint32_t field_tag) const {
+const protobuf_field_table::field& protobuf_msg::get_field(uint32_t field_tag) const {
   CHECK_NOTNULL(m);
-  CHECK_NOTNULL(m->GetDescriptor());
-  const FieldDescriptor* fdesc = m->GetDescriptor()->FindFieldByNumber(field_tag);
-  if (fdesc == nullptr) {
+  CHECK_NOTNULL(fields);
+  const protobuf_field_table::field* f = fields->find(field_tag);
+  if (f == nullptr) {
     std::stringstream msg;
     msg << "No field with tag: " << field_tag;
     LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
     throw std::invalid_argument(msg.str());
   }
-  if (!(fdesc->is_repeated())) {
+  return *f;
+}
+
+const protobuf_field_table::field& protobuf_msg::get_field(uint32_t field_tag, bool repeated) const {
+  const protobuf_field_table::field& f = get_field(field_tag);
+  if (f.is_repeated != repeated) {
+    std::stringstream msg;
+    msg << (repeated ? "Field is not repeated!" : "Field is repeated!");
+    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
+    throw std::invalid_argument(msg.str());
+  }
+  return f;
+}
+
+const protobuf_field_table::field& protobuf_msg::get_field(uint32_t field_tag, bool repeated,
+    FieldDescriptor::CppType type) const {
+  // Type names in the errors
+  static const std::map<FieldDescriptor::CppType, const char*> type_names {
+    {FieldDescriptor::CPPTYPE_STRING, "blob"},
+    {FieldDescriptor::CPPTYPE_BOOL, "boolean"},
+    {FieldDescriptor::CPPTYPE_INT32, "int32"},
+    {FieldDescriptor::CPPTYPE_UINT32, "uint32"},
+    {FieldDescriptor::CPPTYPE_INT64, "int64"},
+    {FieldDescriptor::CPPTYPE_UINT64, "uint64"},
+    {FieldDescriptor::CPPTYPE_ENUM, "enum"},
+    {FieldDescriptor::CPPTYPE_MESSAGE, "message"},
+  };
+  // Repeated fields check the type first
+  const protobuf_field_table::field& f = repeated ? get_field(field_tag) : get_field(field_tag, false);
+  if (f.cpp_type != type) {
     std::stringstream msg;
-    msg << "Field is not repeated!";
+    msg << "Field is not " << type_names.at(type) << "!";
     LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
     throw std::invalid_argument(msg.str());
   }
+  return repeated ? get_field(field_tag, true) : f;
+}
+
+uint32_t protobuf_msg::get_schema_id() const {
+  return schema_id;
+}
+
+factory* protobuf_msg::get_factory() const {
+  return msg_factory;
+}
+
+string protobuf_msg::get_message_type() const {
+  CHECK(m != nullptr);
+  return m->GetTypeName();
+}
+
+uint32_t protobuf_msg::get_repeated_field_size(uint32_t field_tag) const {
+  const FieldDescriptor* fdesc = get_field(field_tag, true).fdesc;
   return m->GetReflection()->FieldSize(*m, fdesc);
 }
 
@@ -73,6 +124,26 @@ bool protobuf_msg::deserialize_message(const string& input) {
   return m->ParseFromString(input);
 }
 
+bool protobuf_msg::deserialize_message(const uint8_t* data, size_t size) {
+  CHECK_NOTNULL(m);
+  if (size > static_cast<size_t>(std::numeric_limits<int>::max())) {
+    return false;
+  }
+  return m->ParseFromArray(data, static_cast<int>(size));
+}
+
+void protobuf_msg::move_to_heap() {
+  if (arena == nullptr) {
+    return;
+  }
+  std::unique_ptr<Message> heap_m(m->New());
+  heap_m->CopyFrom(*m);
+  // The one in the arena is freed with it
+  m.release();
+  m = std::move(heap_m);
+  arena = nullptr;
+}
+
 bool protobuf_msg::to_json(string* output) const {
   CHECK_NOTNULL(output);
   CHECK_NOTNULL(m);
@@ -102,77 +173,17 @@ string protobuf_msg::to_string() const {
 }
 
 void protobuf_msg::set_blob(uint32_t field_tag, const string& value) {
-  CHECK_NOTNULL(m);
-  CHECK_NOTNULL(m->GetDescriptor());
-  const FieldDescriptor* fdesc = m->GetDescriptor()->FindFieldByNumber(field_tag);
-  if (fdesc == nullptr) {
-    std::stringstream msg;
-    msg << "No field with tag: " << field_tag;
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
-  if (fdesc->is_repeated()) {
-    std::stringstream msg;
-    msg << "Field is repeated!";
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
-  if (fdesc->cpp_type() != FieldDescriptor::CPPTYPE_STRING) {
-    std::stringstream msg;
-    msg << "Field is not blob!";
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
+  const FieldDescriptor* fdesc = get_field(field_tag, false, FieldDescriptor::CPPTYPE_STRING).fdesc;
   m->GetReflection()->SetString(m.get(), fdesc, value);
 }
 
 string protobuf_msg::get_blob(uint32_t field_tag) const {
-  CHECK_NOTNULL(m);
-  CHECK_NOTNULL(m->GetDescriptor());
-  const FieldDescriptor* fdesc = m->GetDescriptor()->FindFieldByNumber(field_tag);
-  if (fdesc == nullptr) {
-    std::stringstream msg;
-    msg << "No field with tag: " << field_tag;
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
-  if (fdesc->is_repeated()) {
-    std::stringstream msg;
-    msg << "Field is repeated!";
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
-  if (fdesc->cpp_type() != FieldDescriptor::CPPTYPE_STRING) {
-    std::stringstream msg;
-    msg << "Field is not blob!";
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
+  const FieldDescriptor* fdesc = get_field(field_tag, false, FieldDescriptor::CPPTYPE_STRING).fdesc;
   return m->GetReflection()->GetString(*m, fdesc);
 }
 
 void protobuf_msg::set_repeated_blob(uint32_t field_tag, const string& value, int32_t index) {
-  CHECK_NOTNULL(m);
-  CHECK_NOTNULL(m->GetDescriptor());
-  const FieldDescriptor* fdesc = m->GetDescriptor()->FindFieldByNumber(field_tag);
-  if (fdesc == nullptr) {
-    std::stringstream msg;
-    msg << "No field with tag: " << field_tag;
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
-  if (fdesc->cpp_type() != FieldDescriptor::CPPTYPE_STRING) {
-    std::stringstream msg;
-    msg << "Field is not blob!";
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
-  if (!(fdesc->is_repeated())) {
-    std::stringstream msg;
-    msg << "Field is not repeated!";
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
+  const FieldDescriptor* fdesc = get_field(field_tag, true, FieldDescriptor::CPPTYPE_STRING).fdesc;
   const Reflection* reflect = m->GetReflection();
   if (index >= 0 && index < reflect->FieldSize(*m, fdesc)) {
     reflect->SetRepeatedString(m.get(), fdesc, index, value);
@@ -182,27 +193,7 @@ void protobuf_msg::set_repeated_blob(uint32_t field_tag, const string& value, in
 }
 
 string protobuf_msg::get_repeated_blob(uint32_t field_tag, int32_t index) const {
-  CHECK_NOTNULL(m);
-  CHECK_NOTNULL(m->GetDescriptor());
-  const FieldDescriptor* fdesc = m->GetDescriptor()->FindFieldByNumber(field_tag);
-  if (fdesc == nullptr) {
-    std::stringstream msg;
-    msg << "No field with tag: " << field_tag;
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
-  if (fdesc->cpp_type() != FieldDescriptor::CPPTYPE_STRING) {
-    std::stringstream msg;
-    msg << "Field is not blob!";
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
-  if (!(fdesc->is_repeated())) {
-    std::stringstream msg;
-    msg << "Field is not repeated!";
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
+  const FieldDescriptor* fdesc = get_field(field_tag, true, FieldDescriptor::CPPTYPE_STRING).fdesc;
   const Reflection* reflect = m->GetReflection();
   if (index >= 0 && index < reflect->FieldSize(*m, fdesc)) {
     return reflect->GetRepeatedString(*m, fdesc, index);
@@ -217,78 +208,17 @@ string protobuf_msg::get_repeated_blob(uint32_t field_tag, int32_t index) const
 /// Int 32
 
 void protobuf_msg::set_int32(uint32_t field_tag, int32_t value) {
-  CHECK_NOTNULL(m);
-  CHECK_NOTNULL(m->GetDescriptor());
-  const FieldDescriptor* fdesc = m->GetDescriptor()->FindFieldByNumber(field_tag);
-  if (fdesc == nullptr) {
-    std::stringstream msg;
-    msg << "No field with tag: " << field_tag;
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
-  if (fdesc->is_repeated()) {
-    std::stringstream msg;
-    msg << "Field is repeated!";
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
-  if (fdesc->cpp_type() != FieldDescriptor::CPPTYPE_INT32) {
-    std::stringstream msg;
-    msg << "Field is not int32!";
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
+  const FieldDescriptor* fdesc = get_field(field_tag, false, FieldDescriptor::CPPTYPE_INT32).fdesc;
   m->GetReflection()->SetInt32(m.get(), fdesc, value);
 }
 
 int32_t protobuf_msg::get_int32(uint32_t field_tag) const {
-  CHECK_NOTNULL(m);
-  CHECK_NOTNULL(m->GetDescriptor());
-  const FieldDescriptor* fdesc = m->GetDescriptor()->FindFieldByNumber(field_tag);
-  if (fdesc == nullptr) {
-    std::stringstream msg;
-    msg << "No field with tag: " << field_tag;
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
-  if (fdesc->is_repeated()) {
-    std::stringstream msg;
-    msg << "Field is repeated!";
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
-  if (fdesc->cpp_type() != FieldDescriptor::CPPTYPE_INT32) {
-    std::stringstream msg;
-    msg << "Field is not int32!";
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
+  const FieldDescriptor* fdesc = get_field(field_tag, false, FieldDescriptor::CPPTYPE_INT32).fdesc;
   return m->GetReflection()->GetInt32(*m, fdesc);
 }
 
 void protobuf_msg::set_repeated_int32(uint32_t field_tag, int32_t value, int32_t index) {
-  CHECK_NOTNULL(m);
-  CHECK_NOTNULL(m->GetDescriptor());
-  const FieldDescriptor* fdesc = m->GetDescriptor()
-     ->FindFieldByNumber(field_tag);
-  if (fdesc == nullptr) {
-    std::stringstream msg;
-    msg << "No field with tag: " << field_tag;
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
-  if (fdesc->cpp_type() != FieldDescriptor::CPPTYPE_INT32) {
-    std::stringstream msg;
-    msg << "Field is not int32!";
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
-  if (!(fdesc->is_repeated())) {
-    std::stringstream msg;
-    msg << "Field is not repeated!";
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
+  const FieldDescriptor* fdesc = get_field(field_tag, true, FieldDescriptor::CPPTYPE_INT32).fdesc;
   const Reflection* reflect = m->GetReflection();
   if (index >= 0 && index < reflect->FieldSize(*m, fdesc)) {
     reflect->SetRepeatedInt32(m.get(), fdesc, index, value);
@@ -298,27 +228,7 @@ void protobuf_msg::set_repeated_int32(uint32_t field_tag, int32_t value, int32_t
 }
 
 int32_t protobuf_msg::get_repeated_int32(uint32_t field_tag, int32_t index) const {
-  CHECK_NOTNULL(m);
-  CHECK_NOTNULL(m->GetDescriptor());
-  const FieldDescriptor* fdesc = m->GetDescriptor()->FindFieldByNumber(field_tag);
-  if (fdesc == nullptr) {
-    std::stringstream msg;
-    msg << "No field with tag: " << field_tag;
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
-  if (fdesc->cpp_type() != FieldDescriptor::CPPTYPE_INT32) {
-    std::stringstream msg;
-    msg << "Field is not int32!";
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
-  if (!(fdesc->is_repeated())) {
-    std::stringstream msg;
-    msg << "Field is not repeated!";
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
+  const FieldDescriptor* fdesc = get_field(field_tag, true, FieldDescriptor::CPPTYPE_INT32).fdesc;
   const Reflection* reflect = m->GetReflection();
   if (index >= 0 && index < reflect->FieldSize(*m, fdesc)) {
     return reflect->GetRepeatedInt32(*m, fdesc, index);
@@ -333,78 +243,17 @@ int32_t protobuf_msg::get_repeated_int32(uint32_t field_tag, int32_t index) cons
 /// uint32_t 32
 
 void protobuf_msg::set_uint32(uint32_t field_tag, uint32_t value) {
-  CHECK_NOTNULL(m);
-  CHECK_NOTNULL(m->GetDescriptor());
-  const FieldDescriptor* fdesc = m->GetDescriptor()->FindFieldByNumber(field_tag);
-  if (fdesc == nullptr) {
-    std::stringstream msg;
-    msg << "No field with tag: " << field_tag;
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
-  if (fdesc->is_repeated()) {
-    std::stringstream msg;
-    msg << "Field is repeated!";
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
-  if (fdesc->cpp_type() != FieldDescriptor::CPPTYPE_UINT32) {
-    std::stringstream msg;
-    msg << "Field is not uint32!";
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
+  const FieldDescriptor* fdesc = get_field(field_tag, false, FieldDescriptor::CPPTYPE_UINT32).fdesc;
   m->GetReflection()->SetUInt32(m.get(), fdesc, value);
 }
 
 uint32_t protobuf_msg::get_uint32(uint32_t field_tag) const {
-  CHECK_NOTNULL(m);
-  CHECK_NOTNULL(m->GetDescriptor());
-  const FieldDescriptor* fdesc = m->GetDescriptor()->FindFieldByNumber(field_tag);
-  if (fdesc == nullptr) {
-    std::stringstream msg;
-    msg << "No field with tag: " << field_tag;
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
-  if (fdesc->is_repeated()) {
-    std::stringstream msg;
-    msg << "Field is repeated!";
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
-  if (fdesc->cpp_type() != FieldDescriptor::CPPTYPE_UINT32) {
-    std::stringstream msg;
-    msg << "Field is not uint32!";
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
+  const FieldDescriptor* fdesc = get_field(field_tag, false, FieldDescriptor::CPPTYPE_UINT32).fdesc;
   return m->GetReflection()->GetUInt32(*m, fdesc);
 }
 
 void protobuf_msg::set_repeated_uint32(uint32_t field_tag, uint32_t value, int32_t index) {
-  CHECK_NOTNULL(m);
-  CHECK_NOTNULL(m->GetDescriptor());
-  const FieldDescriptor* fdesc = m->GetDescriptor()
-     ->FindFieldByNumber(field_tag);
-  if (fdesc == nullptr) {
-    std::stringstream msg;
-    msg << "No field with tag: " << field_tag;
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
-  if (fdesc->cpp_type() != FieldDescriptor::CPPTYPE_UINT32) {
-    std::stringstream msg;
-    msg << "Field is not uint32!";
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
-  if (!(fdesc->is_repeated())) {
-    std::stringstream msg;
-    msg << "Field is not repeated!";
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
+  const FieldDescriptor* fdesc = get_field(field_tag, true, FieldDescriptor::CPPTYPE_UINT32).fdesc;
   const Reflection* reflect = m->GetReflection();
   if (index >= 0 && index < reflect->FieldSize(*m, fdesc)) {
     reflect->SetRepeatedUInt32(m.get(), fdesc, index, value);
@@ -414,27 +263,7 @@ void protobuf_msg::set_repeated_uint32(uint32_t field_tag, uint32_t value, int32
 }
 
 uint32_t protobuf_msg::get_repeated_uint32(uint32_t field_tag, int32_t index) const {
-  CHECK_NOTNULL(m);
-  CHECK_NOTNULL(m->GetDescriptor());
-  const FieldDescriptor* fdesc = m->GetDescriptor()->FindFieldByNumber(field_tag);
-  if (fdesc == nullptr) {
-    std::stringstream msg;
-    msg << "No field with tag: " << field_tag;
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
-  if (fdesc->cpp_type() != FieldDescriptor::CPPTYPE_UINT32) {
-    std::stringstream msg;
-    msg << "Field is not uint32!";
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
-  if (!(fdesc->is_repeated())) {
-    std::stringstream msg;
-    msg << "Field is not repeated!";
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
+  const FieldDescriptor* fdesc = get_field(field_tag, true, FieldDescriptor::CPPTYPE_UINT32).fdesc;
   const Reflection* reflect = m->GetReflection();
   if (index >= 0 && index < reflect->FieldSize(*m, fdesc)) {
     return reflect->GetRepeatedUInt32(*m, fdesc, index);
@@ -449,78 +278,17 @@ uint32_t protobuf_msg::get_repeated_uint32(uint32_t field_tag, int32_t index) co
 /// Int 64
 
 void protobuf_msg::set_int64(uint32_t field_tag, int64_t value) {
-  CHECK_NOTNULL(m);
-  CHECK_NOTNULL(m->GetDescriptor());
-  const FieldDescriptor* fdesc = m->GetDescriptor()->FindFieldByNumber(field_tag);
-  if (fdesc == nullptr) {
-    std::stringstream msg;
-    msg << "No field with tag: " << field_tag;
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
-  if (fdesc->is_repeated()) {
-    std::stringstream msg;
-    msg << "Field is repeated!";
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
-  if (fdesc->cpp_type() != FieldDescriptor::CPPTYPE_INT64) {
-    std::stringstream msg;
-    msg << "Field is not int64!";
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
+  const FieldDescriptor* fdesc = get_field(field_tag, false, FieldDescriptor::CPPTYPE_INT64).fdesc;
   m->GetReflection()->SetInt64(m.get(), fdesc, value);
 }
 
 int64_t protobuf_msg::get_int64(uint32_t field_tag) const {
-  CHECK_NOTNULL(m);
-  CHECK_NOTNULL(m->GetDescriptor());
-  const FieldDescriptor* fdesc = m->GetDescriptor()->FindFieldByNumber(field_tag);
-  if (fdesc == nullptr) {
-    std::stringstream msg;
-    msg << "No field with tag: " << field_tag;
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
-  if (fdesc->is_repeated()) {
-    std::stringstream msg;
-    msg << "Field is repeated!";
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
-  if (fdesc->cpp_type() != FieldDescriptor::CPPTYPE_INT64) {
-    std::stringstream msg;
-    msg << "Field is not int64!";
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
+  const FieldDescriptor* fdesc = get_field(field_tag, false, FieldDescriptor::CPPTYPE_INT64).fdesc;
   return m->GetReflection()->GetInt64(*m, fdesc);
 }
 
 void protobuf_msg::set_repeated_int64(uint32_t field_tag, int64_t value, int32_t index) {
-  CHECK_NOTNULL(m);
-  CHECK_NOTNULL(m->GetDescriptor());
-  const FieldDescriptor* fdesc = m->GetDescriptor()
-     ->FindFieldByNumber(field_tag);
-  if (fdesc == nullptr) {
-    std::stringstream msg;
-    msg << "No field with tag: " << field_tag;
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
-  if (fdesc->cpp_type() != FieldDescriptor::CPPTYPE_INT64) {
-    std::stringstream msg;
-    msg << "Field is not int64!";
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
-  if (!(fdesc->is_repeated())) {
-    std::stringstream msg;
-    msg << "Field is not repeated!";
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
+  const FieldDescriptor* fdesc = get_field(field_tag, true, FieldDescriptor::CPPTYPE_INT64).fdesc;
   const Reflection* reflect = m->GetReflection();
   if (index >= 0 && index < reflect->FieldSize(*m, fdesc)) {
     reflect->SetRepeatedInt64(m.get(), fdesc, index, value);
@@ -530,27 +298,7 @@ void protobuf_msg::set_repeated_int64(uint32_t field_tag, int64_t value, int32_t
 }
 
 int64_t protobuf_msg::get_repeated_int64(uint32_t field_tag, int32_t index) const {
-  CHECK_NOTNULL(m);
-  CHECK_NOTNULL(m->GetDescriptor());
-  const FieldDescriptor* fdesc = m->GetDescriptor()->FindFieldByNumber(field_tag);
-  if (fdesc == nullptr) {
-    std::stringstream msg;
-    msg << "No field with tag: " << field_tag;
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
-  if (fdesc->cpp_type() != FieldDescriptor::CPPTYPE_INT64) {
-    std::stringstream msg;
-    msg << "Field is not int64!";
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
-  if (!(fdesc->is_repeated())) {
-    std::stringstream msg;
-    msg << "Field is not repeated!";
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
+  const FieldDescriptor* fdesc = get_field(field_tag, true, FieldDescriptor::CPPTYPE_INT64).fdesc;
   const Reflection* reflect = m->GetReflection();
   if (index >= 0 && index < reflect->FieldSize(*m, fdesc)) {
     return reflect->GetRepeatedInt64(*m, fdesc, index);
@@ -565,77 +313,17 @@ int64_t protobuf_msg::get_repeated_int64(uint32_t field_tag, int32_t index) cons
 /// uint32_t 64
 
 void protobuf_msg::set_uint64(uint32_t field_tag, uint64_t value) {
-  CHECK_NOTNULL(m);
-  CHECK_NOTNULL(m->GetDescriptor());
-  const FieldDescriptor* fdesc = m->GetDescriptor()->FindFieldByNumber(field_tag);
-  if (fdesc == nullptr) {
-    std::stringstream msg;
-    msg << "No field with tag: " << field_tag;
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
-  if (fdesc->is_repeated()) {
-    std::stringstream msg;
-    msg << "Field is repeated!";
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
-  if (fdesc->cpp_type() != FieldDescriptor::CPPTYPE_UINT64) {
-    std::stringstream msg;
-    msg << "Field is not uint64!";
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
+  const FieldDescriptor* fdesc = get_field(field_tag, false, FieldDescriptor::CPPTYPE_UINT64).fdesc;
   m->GetReflection()->SetUInt64(m.get(), fdesc, value);
 }
 
 uint64_t protobuf_msg::get_uint64(uint32_t field_tag) const {
-  CHECK_NOTNULL(m);
-  CHECK_NOTNULL(m->GetDescriptor());
-  const FieldDescriptor* fdesc = m->GetDescriptor()->FindFieldByNumber(field_tag);
-  if (fdesc == nullptr) {
-    std::stringstream msg;
-    msg << "No field with tag: " << field_tag;
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
-  if (fdesc->is_repeated()) {
-    std::stringstream msg;
-    msg << "Field is repeated!";
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
-  if (fdesc->cpp_type() != FieldDescriptor::CPPTYPE_UINT64) {
-    std::stringstream msg;
-    msg << "Field is not uint64!";
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
+  const FieldDescriptor* fdesc = get_field(field_tag, false, FieldDescriptor::CPPTYPE_UINT64).fdesc;
   return m->GetReflection()->GetUInt64(*m, fdesc);
 }
 
 void protobuf_msg::set_repeated_uint64(uint32_t field_tag, uint64_t value, int32_t index) {
-  CHECK_NOTNULL(m);
-  CHECK_NOTNULL(m->GetDescriptor());
-  const FieldDescriptor* fdesc = m->GetDescriptor()->FindFieldByNumber(field_tag);
-  if (fdesc == nullptr) {
-    std::stringstream msg;
-    msg << "No field with tag: " << field_tag;
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
-  if (fdesc->cpp_type() != FieldDescriptor::CPPTYPE_UINT64) {
-    std::stringstream msg;
-    msg << "Field is not uint64!";
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
-  if (!(fdesc->is_repeated())) {
-    std::stringstream msg;
-    msg << "Field is not repeated!";
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
+  const FieldDescriptor* fdesc = get_field(field_tag, true, FieldDescriptor::CPPTYPE_UINT64).fdesc;
   const Reflection* reflect = m->GetReflection();
   if (index >= 0 && index < reflect->FieldSize(*m, fdesc)) {
     reflect->SetRepeatedUInt64(m.get(), fdesc, index, value);
@@ -645,27 +333,7 @@ void protobuf_msg::set_repeated_uint64(uint32_t field_tag, uint64_t value, int32
 }
 
 uint64_t protobuf_msg::get_repeated_uint64(uint32_t field_tag, int32_t index) const {
-  CHECK_NOTNULL(m);
-  CHECK_NOTNULL(m->GetDescriptor());
-  const FieldDescriptor* fdesc = m->GetDescriptor()->FindFieldByNumber(field_tag);
-  if (fdesc == nullptr) {
-    std::stringstream msg;
-    msg << "No field with tag: " << field_tag;
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
-  if (fdesc->cpp_type() != FieldDescriptor::CPPTYPE_UINT64) {
-    std::stringstream msg;
-    msg << "Field is not uint64!";
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
-  if (!(fdesc->is_repeated())) {
-    std::stringstream msg;
-    msg << "Field is not repeated!";
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
+  const FieldDescriptor* fdesc = get_field(field_tag, true, FieldDescriptor::CPPTYPE_UINT64).fdesc;
   const Reflection* reflect = m->GetReflection();
   if (index >= 0 && index < reflect->FieldSize(*m, fdesc)) {
     return reflect->GetRepeatedUInt64(*m, fdesc, index);
@@ -680,78 +348,17 @@ uint64_t protobuf_msg::get_repeated_uint64(uint32_t field_tag, int32_t index) co
 /// Boolean
 
 void protobuf_msg::set_boolean(uint32_t field_tag, bool value) {
-  CHECK_NOTNULL(m);
-  CHECK_NOTNULL(m->GetDescriptor());
-  const FieldDescriptor* fdesc = m->GetDescriptor()->FindFieldByNumber(field_tag);
-  if (fdesc == nullptr) {
-    std::stringstream msg;
-    msg << "No field with tag: " << field_tag;
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
-  if (fdesc->is_repeated()) {
-    std::stringstream msg;
-    msg << "Field is repeated!";
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
-  if (fdesc->cpp_type() != FieldDescriptor::CPPTYPE_BOOL) {
-    std::stringstream msg;
-    msg << "Field is not boolean!";
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
+  const FieldDescriptor* fdesc = get_field(field_tag, false, FieldDescriptor::CPPTYPE_BOOL).fdesc;
   m->GetReflection()->SetBool(m.get(), fdesc, value);
 }
 
 bool protobuf_msg::get_boolean(uint32_t field_tag) const {
-  CHECK_NOTNULL(m);
-  CHECK_NOTNULL(m->GetDescriptor());
-  const FieldDescriptor* fdesc = m->GetDescriptor()->FindFieldByNumber(field_tag);
-  if (fdesc == nullptr) {
-    std::stringstream msg;
-    msg << "No field with tag: " << field_tag;
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
-  if (fdesc->is_repeated()) {
-    std::stringstream msg;
-    msg << "Field is repeated!";
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
-  if (fdesc->cpp_type() != FieldDescriptor::CPPTYPE_BOOL) {
-    std::stringstream msg;
-    msg << "Field is not bool!";
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
+  const FieldDescriptor* fdesc = get_field(field_tag, false, FieldDescriptor::CPPTYPE_BOOL).fdesc;
   return m->GetReflection()->GetBool(*m, fdesc);
 }
 
 void protobuf_msg::set_repeated_boolean(uint32_t field_tag, bool value, int32_t index) {
-  CHECK_NOTNULL(m);
-  CHECK_NOTNULL(m->GetDescriptor());
-  const FieldDescriptor* fdesc = m->GetDescriptor()
-     ->FindFieldByNumber(field_tag);
-  if (fdesc == nullptr) {
-    std::stringstream msg;
-    msg << "No field with tag: " << field_tag;
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
-  if (fdesc->cpp_type() != FieldDescriptor::CPPTYPE_BOOL) {
-    std::stringstream msg;
-    msg << "Field is not boolean!";
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
-  if (!(fdesc->is_repeated())) {
-    std::stringstream msg;
-    msg << "Field is not repeated!";
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
+  const FieldDescriptor* fdesc = get_field(field_tag, true, FieldDescriptor::CPPTYPE_BOOL).fdesc;
   const Reflection* reflect = m->GetReflection();
   if (index >= 0 && index < reflect->FieldSize(*m, fdesc)) {
     reflect->SetRepeatedBool(m.get(), fdesc, index, value);
@@ -761,27 +368,7 @@ void protobuf_msg::set_repeated_boolean(uint32_t field_tag, bool value, int32_t
 }
 
 bool protobuf_msg::get_repeated_boolean(uint32_t field_tag, int32_t index) const {
-  CHECK_NOTNULL(m);
-  CHECK_NOTNULL(m->GetDescriptor());
-  const FieldDescriptor* fdesc = m->GetDescriptor()->FindFieldByNumber(field_tag);
-  if (fdesc == nullptr) {
-    std::stringstream msg;
-    msg << "No field with tag: " << field_tag;
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
-  if (fdesc->cpp_type() != FieldDescriptor::CPPTYPE_BOOL) {
-    std::stringstream msg;
-    msg << "Field is not boolean!";
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
-  if (!(fdesc->is_repeated())) {
-    std::stringstream msg;
-    msg << "Field is not repeated!";
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
+  const FieldDescriptor* fdesc = get_field(field_tag, true, FieldDescriptor::CPPTYPE_BOOL).fdesc;
   const Reflection* reflect = m->GetReflection();
   if (index >= 0 && index < reflect->FieldSize(*m, fdesc)) {
     return reflect->GetRepeatedBool(*m, fdesc, index);
@@ -797,31 +384,11 @@ bool protobuf_msg::get_repeated_boolean(uint32_t field_tag, int32_t index) const
 /// Message
 
 void protobuf_msg::set_message(uint32_t field_tag, const msg& sub_message) {
-  CHECK_NOTNULL(m);
-  CHECK_NOTNULL(m->GetDescriptor());
-  const FieldDescriptor* fdesc = m->GetDescriptor()->FindFieldByNumber(field_tag);
-  if (fdesc == nullptr) {
-    std::stringstream msg;
-    msg << "No field with tag: " << field_tag;
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
-  if (fdesc->is_repeated()) {
-    std::stringstream msg;
-    msg << "Field is repeated!";
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
-  if (fdesc->cpp_type() != FieldDescriptor::CPPTYPE_MESSAGE) {
-    std::stringstream msg;
-    msg << "Field is not message!";
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
-  string message_type = fdesc->message_type()->full_name();  // Error
+  const FieldDescriptor* fdesc = get_field(field_tag, false, FieldDescriptor::CPPTYPE_MESSAGE).fdesc;
   auto& sub_m = reinterpret_cast<const protobuf_msg&>(sub_message);
-  string sub_message_type = sub_m.m->GetDescriptor()->full_name();
-  if (message_type.compare(sub_message_type)) {
+  if (fdesc->message_type() != sub_m.m->GetDescriptor()) {
+    string message_type = fdesc->message_type()->full_name();
+    string sub_message_type = sub_m.m->GetDescriptor()->full_name();
     std::stringstream msg;
     msg << "Type of the given sub message (which is <" << sub_message_type <<
         ">) doesn't match the field type (which is <" << message_type << ">)";
@@ -831,30 +398,17 @@ void protobuf_msg::set_message(uint32_t field_tag, const msg& sub_message) {
   const Reflection* reflect = m->GetReflection();
   // creates copy of the sub message so that the field doesnt change if you
   // change the message outside
-  Message* copy = sub_m.m->New();
+  Message* copy = sub_m.m->New(get_arena());
   copy->CopyFrom(*sub_m.m.get());
   reflect->SetAllocatedMessage(m.get(), copy, fdesc);
 }
 
 // makes a COPY of the message and returns its id
 std::unique_ptr<msg> protobuf_msg::get_message(uint32_t field_tag) const {
-  CHECK_NOTNULL(m);
-  CHECK_NOTNULL(m->GetDescriptor());
-  const FieldDescriptor* fdesc = m->GetDescriptor()->FindFieldByNumber(field_tag);
-  if (fdesc == nullptr) {
-    std::stringstream msg;
-    msg << "No field with tag: " << field_tag;
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
-  if (fdesc->is_repeated()) {
-    std::stringstream msg;
-    msg << "Field is repeated!";
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
+  const protobuf_field_table::field& f = get_field(field_tag, false);
+  const FieldDescriptor* fdesc = f.fdesc;
   const Reflection* reflect = m->GetReflection();
-  if (fdesc->cpp_type() != FieldDescriptor::CPPTYPE_MESSAGE) {
+  if (f.cpp_type != FieldDescriptor::CPPTYPE_MESSAGE) {
     std::stringstream msg;
     msg << "Field is not message!";
     LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
@@ -863,37 +417,15 @@ std::unique_ptr<msg> protobuf_msg::get_message(uint32_t field_tag) const {
   if (!(reflect->HasField(*m, fdesc))) {
     return nullptr;
   }
-  // name resolution need to be done
-  // to get Dynamic Message Factory of the class containing the sub message
+  // The schema id and the table of the sub message are resolved on import
   const Message* original = &reflect->GetMessage(*m, fdesc);
-  Message* copy = original->New();
+  Message* copy = original->New(get_arena());
   copy->CopyFrom(*original);
-  return std::unique_ptr<msg>(new protobuf_msg(copy, msg_factory,
-      msg_factory->get_schema_id(copy->GetTypeName())));
+  return std::unique_ptr<msg>(new protobuf_msg(copy, msg_factory, f.message_schema_id, f.message_fields, arena));
 }
 
 void protobuf_msg::set_repeated_message(uint32_t field_tag, const msg& sub_message, int32_t index) {
-  CHECK_NOTNULL(m);
-  CHECK_NOTNULL(m->GetDescriptor());
-  const FieldDescriptor* fdesc = m->GetDescriptor()->FindFieldByNumber(field_tag);
-  if (fdesc == nullptr) {
-    std::stringstream msg;
-    msg << "No field with tag: " << field_tag;
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
-  if (fdesc->cpp_type() != FieldDescriptor::CPPTYPE_MESSAGE) {
-    std::stringstream msg;
-    msg << "Field is not message!";
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
-  if (!(fdesc->is_repeated())) {
-    std::stringstream msg;
-    msg << "Field is not repeated";
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
+  const FieldDescriptor* fdesc = get_field(field_tag, true, FieldDescriptor::CPPTYPE_MESSAGE).fdesc;
   auto& sub_m = reinterpret_cast<const protobuf_msg&>(sub_message);
   if (sub_m.m.get() == nullptr || sub_m.m->GetDescriptor() == nullptr) {
     std::stringstream msg;
@@ -901,9 +433,9 @@ void protobuf_msg::set_repeated_message(uint32_t field_tag, const msg& sub_messa
     LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
     throw std::runtime_error(msg.str());
   }
-  string message_type = fdesc->message_type()->full_name();  // Error
-  string sub_message_type = sub_m.m->GetDescriptor()->full_name();
-  if (message_type.compare(sub_message_type)) {
+  if (fdesc->message_type() != sub_m.m->GetDescriptor()) {
+    string message_type = fdesc->message_type()->full_name();
+    string sub_message_type = sub_m.m->GetDescriptor()->full_name();
     std::stringstream msg;
     msg << "Type of the given sub message (which is <" << sub_message_type <<
         ">) doesn't match the field type (which is <" << message_type << ">)";
@@ -914,7 +446,7 @@ void protobuf_msg::set_repeated_message(uint32_t field_tag, const msg& sub_messa
   if (index >= 0 && index < reflect->FieldSize(*m, fdesc)) {
     reflect->MutableRepeatedMessage(m.get(), fdesc, index)->CopyFrom(*sub_m.m.get());
   } else {
-    Message* copy = sub_m.m->New();
+    Message* copy = sub_m.m->New(get_arena());
     copy->CopyFrom(*sub_m.m.get());
     reflect->AddAllocatedMessage(m.get(), fdesc, copy);
   }
@@ -922,34 +454,15 @@ void protobuf_msg::set_repeated_message(uint32_t field_tag, const msg& sub_messa
 
 // Returns copy of the message
 std::unique_ptr<msg> protobuf_msg::get_repeated_message(uint32_t field_tag, int32_t index) const {
-  CHECK_NOTNULL(m);
-  CHECK_NOTNULL(m->GetDescriptor());
-  const FieldDescriptor* fdesc = m->GetDescriptor()->FindFieldByNumber(field_tag);
-  if (fdesc == nullptr) {
-    std::stringstream msg;
-    msg << "No field with tag: " << field_tag;
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
-  if (fdesc->cpp_type() != FieldDescriptor::CPPTYPE_MESSAGE) {
-    std::stringstream msg;
-    msg << "Field is not message!";
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
-  if (!(fdesc->is_repeated())) {
-    std::stringstream msg;
-    msg << "Field is not repeated!";
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
+  const protobuf_field_table::field& f = get_field(field_tag, true, FieldDescriptor::CPPTYPE_MESSAGE);
+  const FieldDescriptor* fdesc = f.fdesc;
   const Reflection* reflect = m->GetReflection();
   if (index >= 0 && index < reflect->FieldSize(*m, fdesc)) {
     const Message* original = &reflect->GetRepeatedMessage(*m, fdesc, index);
-    Message* copy = original->New();
+    Message* copy = original->New(get_arena());
     copy->CopyFrom(*original);
-    return std::unique_ptr<msg>(new protobuf_msg(copy, msg_factory,
-        msg_factory->get_schema_id(copy->GetTypeName())));
+    return std::unique_ptr<msg>(new protobuf_msg(copy, msg_factory, f.message_schema_id, f.message_fields,
+        arena));
   } else {
     std::stringstream msg;
     msg << "Index out of range: " << index;
@@ -959,27 +472,7 @@ std::unique_ptr<msg> protobuf_msg::get_repeated_message(uint32_t field_tag, int3
 }
 
 void protobuf_msg::set_enum(uint32_t field_tag, int32_t value) {
-  CHECK_NOTNULL(m);
-  CHECK_NOTNULL(m->GetDescriptor());
-  const FieldDescriptor* fdesc = m->GetDescriptor()->FindFieldByNumber(field_tag);
-  if (fdesc == nullptr) {
-    std::stringstream msg;
-    msg << "No field with tag: " << field_tag;
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
-  if (fdesc->is_repeated()) {
-    std::stringstream msg;
-    msg << "Field is repeated!";
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
-  if (fdesc->cpp_type() != FieldDescriptor::CPPTYPE_ENUM) {
-    std::stringstream msg;
-    msg << "Field is not enum!";
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
+  const FieldDescriptor* fdesc = get_field(field_tag, false, FieldDescriptor::CPPTYPE_ENUM).fdesc;
   const EnumDescriptor* edesc = fdesc->enum_type();
   if (edesc->FindValueByNumber(value) == nullptr) {
     std::stringstream msg;
@@ -991,52 +484,12 @@ void protobuf_msg::set_enum(uint32_t field_tag, int32_t value) {
 }
 
 int32_t protobuf_msg::get_enum(uint32_t field_tag) const {
-  CHECK_NOTNULL(m);
-  CHECK_NOTNULL(m->GetDescriptor());
-  const FieldDescriptor* fdesc = m->GetDescriptor()->FindFieldByNumber(field_tag);
-  if (fdesc == nullptr) {
-    std::stringstream msg;
-    msg << "No field with tag: " << field_tag;
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
-  if (fdesc->is_repeated()) {
-    std::stringstream msg;
-    msg << "Field is repeated!";
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
-  if (fdesc->cpp_type() != FieldDescriptor::CPPTYPE_ENUM) {
-    std::stringstream msg;
-    msg << "Field is not enum!";
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
+  const FieldDescriptor* fdesc = get_field(field_tag, false, FieldDescriptor::CPPTYPE_ENUM).fdesc;
   return m->GetReflection()->GetEnumValue(*m, fdesc);
 }
 
 void protobuf_msg::set_repeated_enum(uint32_t field_tag, int32_t value, int32_t index) {
-  CHECK_NOTNULL(m);
-  CHECK_NOTNULL(m->GetDescriptor());
-  const FieldDescriptor* fdesc = m->GetDescriptor()->FindFieldByNumber(field_tag);
-  if (fdesc == nullptr) {
-    std::stringstream msg;
-    msg << "No field with tag: " << field_tag;
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
-  if (fdesc->cpp_type() != FieldDescriptor::CPPTYPE_ENUM) {
-    std::stringstream msg;
-    msg << "Field is not enum!";
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
-  if (!(fdesc->is_repeated())) {
-    std::stringstream msg;
-    msg << "Field is not repeated!";
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
+  const FieldDescriptor* fdesc = get_field(field_tag, true, FieldDescriptor::CPPTYPE_ENUM).fdesc;
   const EnumDescriptor* edesc = fdesc->enum_type();
   if (edesc->FindValueByNumber(value) == nullptr) {
     std::stringstream msg;
@@ -1053,27 +506,7 @@ void protobuf_msg::set_repeated_enum(uint32_t field_tag, int32_t value, int32_t
 }
 
 int32_t protobuf_msg::get_repeated_enum(uint32_t field_tag, int32_t index) const {
-  CHECK_NOTNULL(m);
-  CHECK_NOTNULL(m->GetDescriptor());
-  const FieldDescriptor* fdesc = m->GetDescriptor()->FindFieldByNumber(field_tag);
-  if (fdesc == nullptr) {
-    std::stringstream msg;
-    msg << "No field with tag: " << field_tag;
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
-  if (fdesc->cpp_type() != FieldDescriptor::CPPTYPE_ENUM) {
-    std::stringstream msg;
-    msg << "Field is not enum!";
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
-  if (!(fdesc->is_repeated())) {
-    std::stringstream msg;
-    msg << "Field is not repeated!";
-    LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::invalid_argument(msg.str());
-  }
+  const FieldDescriptor* fdesc = get_field(field_tag, true, FieldDescriptor::CPPTYPE_ENUM).fdesc;
   const Reflection* reflect = m->GetReflection();
   if (index >= 0 && index < reflect->FieldSize(*m, fdesc)) {
     return m->GetReflection()->GetRepeatedEnumValue(*m, fdesc, index);
@@ -1086,11 +519,10 @@ int32_t protobuf_msg::get_repeated_enum(uint32_t field_tag, int32_t index) const
 }
 
 uint32_t protobuf_msg::get_field_tag(const std::string& name) const {
-  CHECK_NOTNULL(m);
-  CHECK_NOTNULL(m->GetDescriptor());
-  const FieldDescriptor* fdesc = m->GetDescriptor()->FindFieldByName(name);
-  if (fdesc) {
-    return fdesc->number();
+  CHECK_NOTNULL(fields);
+  const protobuf_field_table::field* f = fields->find(name.data(), name.size());
+  if (f) {
+    return f->tag;
   }
   std::stringstream msg;
   msg << "No field with name: " << name;
@@ -1099,26 +531,32 @@ uint32_t protobuf_msg::get_field_tag(const std::string& name) const {
 }
 
 schema::field_info protobuf_msg::get_field_info_by_tag(uint32_t field_tag) const {
-  CHECK_NOTNULL(m);
-  CHECK_NOTNULL(m->GetDescriptor());
-  const FieldDescriptor* fdesc = m->GetDescriptor()->FindFieldByNumber(field_tag);
-  schema::field_type type;
+  const protobuf_field_table::field& f = get_field(field_tag);
   string full_type = "";
-  if (fdesc->cpp_type() == FieldDescriptor::CPPTYPE_MESSAGE) {
-    full_type = fdesc->message_type()->full_name();
-    type = schema::message_type;
-  } else if (fdesc->cpp_type() == FieldDescriptor::CPPTYPE_ENUM) {
-    full_type = fdesc->enum_type()->full_name();
-    type = schema::enum_type;
-  } else {
-    type = protobuf_factory::protobuf_ccptype_to_type.at(fdesc->cpp_type());
+  if (f.cpp_type == FieldDescriptor::CPPTYPE_MESSAGE) {
+    full_type = f.fdesc->message_type()->full_name();
+  } else if (f.cpp_type == FieldDescriptor::CPPTYPE_ENUM) {
+    full_type = f.fdesc->enum_type()->full_name();
   }
   return schema::field_info(
-      fdesc->number(),
-      type,
-      fdesc->name(),
+      f.tag,
+      f.type,
+      f.name,
       full_type,
-      fdesc->is_repeated());
+      f.is_repeated);
+}
+
+bool protobuf_msg::find_field(const char* name, size_t length, uint32_t* field_tag, schema::field_type* type,
+    bool* is_repeated) const {
+  CHECK_NOTNULL(fields);
+  const protobuf_field_table::field* f = fields->find(name, length);
+  if (f == nullptr) {
+    return false;
+  }
+  *field_tag = f->tag;
+  *type = f->type;
+  *is_repeated = f->is_repeated;
+  return true;
 }
 
 }  // namespace protobuf
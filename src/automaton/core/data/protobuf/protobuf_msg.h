@@ -1,6 +1,7 @@
 #ifndef AUTOMATON_CORE_DATA_PROTOBUF_PROTOBUF_MSG_H_
 #define AUTOMATON_CORE_DATA_PROTOBUF_PROTOBUF_MSG_H_
 
+#include <google/protobuf/arena.h>
 #include <google/protobuf/compiler/parser.h>
 #include <google/protobuf/descriptor.h>
 #include <google/protobuf/descriptor.pb.h>
@@ -15,6 +16,7 @@
 
 #include "automaton/core/data/factory.h"
 #include "automaton/core/data/msg.h"
+#include "automaton/core/data/protobuf/protobuf_field_table.h"
 #include "automaton/core/data/schema.h"
 
 namespace automaton {
@@ -22,6 +24,16 @@ namespace core {
 namespace data {
 namespace protobuf {
 
+/**
+  Arena for protobuf messages, a wrapper around google::protobuf::Arena.
+*/
+class protobuf_arena : public msg_arena {
+ public:
+  google::protobuf::Arena arena;
+
+  uint64_t get_space_allocated() const;
+};
+
 /**
   Google Protobuf msg implementation.
 
@@ -30,9 +42,15 @@ namespace protobuf {
 class protobuf_msg : public msg {
  public:
   /**
-    Constructs a protobuf msg implementation.
+    Constructs a protobuf msg implementation. fields is the accessor table of
+    the schema, owned by the factory. If arena is given, m must be allocated in
+    it. The msg keeps the arena alive and messages it creates (sub messages) are
+    allocated in the same arena.
   */
-  protobuf_msg(google::protobuf::Message * m, factory* msg_factory, uint32_t schema_id);
+  protobuf_msg(google::protobuf::Message * m, factory* msg_factory, uint32_t schema_id,
+      const protobuf_field_table* fields, std::shared_ptr<protobuf_arena> arena = nullptr);
+
+  ~protobuf_msg();
 
   uint32_t get_schema_id() const;
 
@@ -63,6 +81,10 @@ class protobuf_msg : public msg {
   */
   bool deserialize_message(const std::string& input);
 
+  bool deserialize_message(const uint8_t* data, size_t size);
+
+  void move_to_heap();
+
   /**
     Serializes message to JSON string.
   */
@@ -186,10 +208,31 @@ class protobuf_msg : public msg {
 
   schema::field_info get_field_info_by_tag(uint32_t field_tag) const;
 
+  bool find_field(const char* name, size_t length, uint32_t* field_tag, schema::field_type* type,
+      bool* is_repeated) const;
+
  private:
+  // Declared before m, so it outlives it
+  std::shared_ptr<protobuf_arena> arena;
+  // Owned only when there is no arena
   std::unique_ptr<google::protobuf::Message> m;
   factory* msg_factory;
   uint32_t schema_id;
+  const protobuf_field_table* fields;
+
+  google::protobuf::Arena* get_arena() const;
+
+  /**
+    Returns the field with the given tag. Throws std::invalid_argument if there
+    is no such field, if it is repeated and repeated is false or the other way
+    around, or if its type is not the given one.
+  */
+  const protobuf_field_table::field& get_field(uint32_t field_tag) const;
+
+  const protobuf_field_table::field& get_field(uint32_t field_tag, bool repeated) const;
+
+  const protobuf_field_table::field& get_field(uint32_t field_tag, bool repeated,
+      google::protobuf::FieldDescriptor::CppType type) const;
 };
 
 }  // namespace protobuf
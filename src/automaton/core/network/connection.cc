@@ -16,6 +16,10 @@ std::shared_ptr<connection> connection::create(const std::string& type, connecti
   return nullptr;
 }
 
+void connection::async_send(std::shared_ptr<const std::string> message, uint32_t id) {
+  async_send(std::string(*message), id);
+}
+
 connection_id connection::get_id() {
   return id;
 }
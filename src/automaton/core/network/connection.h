@@ -111,12 +111,24 @@ class connection {
     Function that is used to send message to the remote peer. On_message_sent will(depending on the specific
     implementation) be invoked once the message was sent successfully
 
-    @param[in] message the message to be sent
+    @param[in] message the message to be sent. The connection takes ownership of it, pass it with std::move to avoid
+      copying it
     @param[in] id given by the user identifying this concrete message. It will be used when on_message_sent is
       called to inform the user about successfully sent message
       @see connection_handler::on_message_sent
   */
-  virtual void async_send(const std::string& message, uint32_t id = 0) = 0;
+  virtual void async_send(std::string message, uint32_t id = 0) = 0;
+
+  /**
+    Sends a message whose buffer may be shared, e.g. by all connections the same message is broadcast to. The buffer
+    must not be changed after the call. The default implementation copies the message and calls
+    async_send(std::string, uint32_t); implementations that can write from the shared buffer should override it.
+
+    @param[in] message the message to be sent
+    @param[in] id given by the user identifying this concrete message
+      @see connection_handler::on_message_sent
+  */
+  virtual void async_send(std::shared_ptr<const std::string> message, uint32_t id = 0);
 
   /**
     Function that is used to read incoming messages. Messages could be received but not read if this function was not
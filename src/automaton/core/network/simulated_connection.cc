@@ -1,6 +1,8 @@
 #include "automaton/core/network/simulated_connection.h"
 
-#include <cstdlib>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cstring>
 #include <iostream>
 #include <map>
@@ -8,6 +10,7 @@
 #include <regex>
 #include <set>
 #include <sstream>
+#include <stdexcept>
 #include <utility>
 
 #include "automaton/core/io/io.h"
@@ -21,14 +24,31 @@ namespace network {
 // TODO(kari): Remove comments or change logging level.
 // TODO(kari): Make thread safe.
 
-connection_params::connection_params():min_lag(0), max_lag(0), bandwidth(0) {}
+connection_params::connection_params():min_lag(0), max_lag(0), bandwidth(0), loss(0), jitter(0) {}
 acceptor_params::acceptor_params():max_connections(0), bandwidth(0) {}
 
+// LINK
+
+link_transmitter::link_transmitter(uint32_t bandwidth_):bandwidth(bandwidth_), free_time(0) {}
+
+uint64_t link_transmitter::transmit(uint64_t time, uint32_t size) {
+  std::lock_guard<std::mutex> lock(link_mutex);
+  if (bandwidth == 0) {
+    return time;
+  }
+  free_time = std::max(free_time, time * 1000) + (static_cast<uint64_t>(size) * 1000 + bandwidth - 1) / bandwidth;
+  return (free_time + 999) / 1000;
+}
+
 // SIMULATION
 
 std::shared_ptr<simulation> simulation::simulator;
 
-simulation::simulation():simulation_time(0), simulation_running(false) {
+simulation::simulation():next_seq(0), handler_threads(std::max(1u, std::thread::hardware_concurrency())),
+    workers_wanted(0), workers_busy(0), workers_stop(false), simulation_time(0), simulation_running(false),
+    last_connection_id(0), seed(std::chrono::system_clock::now().time_since_epoch().count()), tracing(false),
+    trace_time(0) {
+  rng.seed(seed);
   connection::register_connection_type("sim", [](connection_id id, const std::string& address,
       std::shared_ptr<connection::connection_handler> handler) {
     return std::shared_ptr<connection>(new simulated_connection(id, address, handler));
@@ -38,10 +58,17 @@ simulation::simulation():simulation_time(0), simulation_running(false) {
       std::shared_ptr<connection::connection_handler> connections_handler) {
     return std::shared_ptr<acceptor>(new simulated_acceptor(id, address, handler, connections_handler));
   });
-  std::srand(static_cast<unsigned>(std::time(nullptr)));
 }
 
 simulation::~simulation() {
+  {
+    std::lock_guard<std::mutex> lock(workers_mutex);
+    workers_stop = true;
+  }
+  workers_cv.notify_all();
+  for (auto& t : handler_workers) {
+    t.join();
+  }
 }
 
 void simulation::simulation_start(uint64_t millisec_step) {
@@ -78,6 +105,10 @@ void simulation::simulation_start(uint64_t millisec_step) {
         running_mutex.unlock();
       }
       process_handlers();
+      std::unique_lock<std::mutex> lock(handlers_tasks_mutex);
+      handlers_cv.wait_for(lock, std::chrono::milliseconds(10), [this]() {
+        return !handlers_tasks.empty();
+      });
     }
   });
 }
@@ -96,12 +127,187 @@ void simulation::add_task(uint64_t tm, std::function<void()> task) {
   if (tm <= simulation_time) {
     tm = simulation_time + 1;
   }
-  tasks[tm].push_back(task);
+  tasks.push_back({tm, next_seq++, std::move(task)});
+  std::push_heap(tasks.begin(), tasks.end(), event_after());
+}
+
+void simulation::add_handlers_task(const void* key, std::function<void()> task) {
+  {
+    std::lock_guard<std::mutex> lock(handlers_tasks_mutex);
+    handlers_tasks.emplace_back(key, std::move(task));
+  }
+  handlers_cv.notify_one();
 }
 
 void simulation::add_handlers_task(std::function<void()> task) {
-  std::lock_guard<std::mutex> lock(handlers_tasks_mutex);
-  handlers_tasks.push(task);
+  add_handlers_task(nullptr, std::move(task));
+}
+
+void simulation::set_handler_threads(uint32_t threads) {
+  handler_threads = std::max(1u, threads);
+}
+
+uint64_t simulation::set_seed(uint64_t new_seed) {
+  {
+    std::lock_guard<std::mutex> lock(connections_mutex);
+    if (connections.empty()) {
+      last_connection_id = 0;
+    }
+  }
+  std::lock_guard<std::mutex> lock(rng_mutex);
+  uint64_t old_seed = seed;
+  seed = new_seed;
+  rng.seed(seed);
+  return old_seed;
+}
+
+uint64_t simulation::get_seed() {
+  std::lock_guard<std::mutex> lock(rng_mutex);
+  return seed;
+}
+
+uint32_t simulation::random(uint32_t bound) {
+  if (bound == 0) {
+    return 0;
+  }
+  std::lock_guard<std::mutex> lock(rng_mutex);
+  return std::uniform_int_distribution<uint32_t>(0, bound - 1)(rng);
+}
+
+// Calls step at the given time and returns its next deadline, after that time
+static uint64_t run_step(const std::function<uint64_t(uint64_t time)>& step, uint64_t time) {
+  if (!step) {
+    return simulation::NO_DEADLINE;
+  }
+  uint64_t deadline = step(time);
+  return deadline > time ? deadline : time + 1;
+}
+
+const uint64_t simulation::NO_DEADLINE;
+
+uint64_t simulation::run_until(uint64_t time_, const std::function<uint64_t(uint64_t time)>& step) {
+  {
+    std::lock_guard<std::mutex> lock(running_mutex);
+    if (simulation_running) {
+      throw std::logic_error("Deterministic run while the simulation is running");
+    }
+  }
+  uint64_t events_processed = 0;
+  process_handlers(1);
+  uint64_t deadline = run_step(step, get_time());
+  while (true) {
+    process_handlers(1);
+    uint64_t next = deadline;
+    {
+      std::lock_guard<std::mutex> lock(tasks_mutex);
+      if (!tasks.empty() && tasks.front().time < next) {
+        next = tasks.front().time;
+      }
+    }
+    if (next == NO_DEADLINE || next > time_) {
+      break;
+    }
+    // Moves the clock to next even if only the deadline is there
+    events_processed += process(next);
+    process_handlers(1);
+    deadline = run_step(step, next);
+  }
+  return events_processed;
+}
+
+static void write_varint(uint64_t value, std::string* out) {
+  while (value >= 0x80) {
+    out->push_back(static_cast<char>((value & 0x7f) | 0x80));
+    value >>= 7;
+  }
+  out->push_back(static_cast<char>(value));
+}
+
+static uint64_t read_varint(const std::string& in, size_t* pos) {
+  uint64_t value = 0;
+  for (uint32_t shift = 0; shift < 64; shift += 7) {
+    if (*pos >= in.size()) {
+      throw std::invalid_argument("Truncated trace");
+    }
+    uint8_t b = static_cast<uint8_t>(in[(*pos)++]);
+    value |= static_cast<uint64_t>(b & 0x7f) << shift;
+    if ((b & 0x80) == 0) {
+      return value;
+    }
+  }
+  throw std::invalid_argument("Malformed varint in trace");
+}
+
+static const char TRACE_MAGIC[] = "ATR1";
+static const size_t TRACE_MAGIC_SIZE = 4;
+
+bool simulation::trace_record::operator==(const trace_record& other) const {
+  return time == other.time && type == other.type && source == other.source &&
+      destination == other.destination && size == other.size;
+}
+
+void simulation::start_trace() {
+  uint64_t current_seed = get_seed();
+  uint64_t now = get_time();
+  std::lock_guard<std::mutex> lock(trace_mutex);
+  trace.assign(TRACE_MAGIC, TRACE_MAGIC_SIZE);
+  write_varint(current_seed, &trace);
+  trace_time = now;
+  tracing = true;
+}
+
+std::string simulation::stop_trace() {
+  std::lock_guard<std::mutex> lock(trace_mutex);
+  tracing = false;
+  std::string result;
+  result.swap(trace);
+  return result;
+}
+
+void simulation::add_trace_record(uint8_t type, uint32_t source, uint32_t destination, uint32_t size) {
+  uint64_t now = get_time();
+  std::lock_guard<std::mutex> lock(trace_mutex);
+  if (!tracing) {
+    return;
+  }
+  write_varint(now - trace_time, &trace);
+  trace_time = now;
+  trace.push_back(static_cast<char>(type));
+  write_varint(source, &trace);
+  write_varint(destination, &trace);
+  if (type == TRACE_MESSAGE) {
+    write_varint(size, &trace);
+  }
+}
+
+std::vector<simulation::trace_record> simulation::parse_trace(const std::string& trace_, uint64_t* seed_) {
+  if (trace_.compare(0, TRACE_MAGIC_SIZE, TRACE_MAGIC) != 0) {
+    throw std::invalid_argument("Not a simulation trace");
+  }
+  size_t pos = TRACE_MAGIC_SIZE;
+  uint64_t trace_seed = read_varint(trace_, &pos);
+  if (seed_ != nullptr) {
+    *seed_ = trace_seed;
+  }
+  std::vector<trace_record> result;
+  uint64_t t = 0;
+  while (pos < trace_.size()) {
+    trace_record r;
+    t += read_varint(trace_, &pos);
+    r.time = t;
+    if (pos >= trace_.size()) {
+      throw std::invalid_argument("Truncated trace");
+    }
+    r.type = static_cast<uint8_t>(trace_[pos++]);
+    if (r.type < TRACE_REQUEST || r.type > TRACE_DISCONNECT) {
+      throw std::invalid_argument("Unknown event type in trace: " + std::to_string(r.type));
+    }
+    r.source = static_cast<uint32_t>(read_varint(trace_, &pos));
+    r.destination = static_cast<uint32_t>(read_varint(trace_, &pos));
+    r.size = r.type == TRACE_MESSAGE ? static_cast<uint32_t>(read_varint(trace_, &pos)) : 0;
+    result.push_back(r);
+  }
+  return result;
 }
 
 std::shared_ptr<simulation> simulation::get_simulator() {
@@ -113,6 +319,7 @@ std::shared_ptr<simulation> simulation::get_simulator() {
 }
 
 void simulation::handle_disconnect(uint32_t dest) {
+  add_trace_record(TRACE_DISCONNECT, 0, dest, 0);
   // LOG(DBUG) << "disconnect 0";
   /**
     This event is created when the other endpoint has called disconnect().
@@ -131,7 +338,7 @@ void simulation::handle_disconnect(uint32_t dest) {
   destination->set_state(connection::state::disconnected);
   std::weak_ptr<connection::connection_handler> c_handler = destination->get_handler();
   auto c_id = destination->get_id();
-  add_handlers_task([c_handler, c_id]() {
+  add_handlers_task(handler_key(destination->get_handler()), [c_handler, c_id]() {
     std::shared_ptr<connection::connection_handler> handler = c_handler.lock();
     if (handler != nullptr) {
       handler->on_disconnected(c_id);
@@ -148,6 +355,7 @@ void simulation::handle_disconnect(uint32_t dest) {
 }
 
 void simulation::handle_request(uint32_t src, uint32_t dest) {
+  add_trace_record(TRACE_REQUEST, src, dest, 0);
   // LOG(DBUG) << "attempt 0";
   /**
   This event is created when the other endpoint has called connect(). On_requested is called
@@ -168,8 +376,9 @@ void simulation::handle_request(uint32_t src, uint32_t dest) {
     std::weak_ptr<connection::connection_handler> c_handler = source->get_handler();
     std::shared_ptr<simulation> sim = simulation::get_simulator();
     auto c_id = source->get_id();
-    add_task(time_of_handling, [c_handler, c_id, sim]() {
-      sim->add_handlers_task([c_handler, c_id]() {
+    const void* key = handler_key(source->get_handler());
+    add_task(time_of_handling, [c_handler, c_id, sim, key]() {
+      sim->add_handlers_task(key, [c_handler, c_id]() {
         std::shared_ptr<connection::connection_handler> handler = c_handler.lock();
         if (handler != nullptr) {
           handler->on_connection_error(c_id, status::internal("No route to host"));
@@ -182,31 +391,30 @@ void simulation::handle_request(uint32_t src, uint32_t dest) {
   if (acceptor_->get_handler()->on_requested(acceptor_->get_id(), source_address, &cid)) {
     // LOG(DBUG) << "accepted";
     const connection_params& params = source->parameters;
-    // Getting the smaller bandwidth from both sides
-    auto bandwidth = acceptor_->parameters.bandwidth < source->parameters.bandwidth ?
-        acceptor_->parameters.bandwidth : source->parameters.bandwidth;
-    // Remote address of the other connection is 0 which means connect to that address is not possible.
+    // Both sides get the same link, the accepted side also shares the uplink of the acceptor. Remote address of the
+    // other connection is 0 which means connect to that address is not possible.
     std::stringstream ss;
-    ss << params.min_lag << ":" << params.max_lag << ":" << bandwidth << ":0";
+    ss << params.min_lag << ":" << params.max_lag << ":" << params.bandwidth << ":0:" << params.loss << ":" <<
+        params.jitter;
     std::string new_addr = ss.str();
     std::shared_ptr<simulated_connection> new_connection =
         std::make_shared<simulated_connection>(cid, new_addr, acceptor_->accepted_connections_handler);
     if (new_connection->init()) {
       add_connection(new_connection);
-      source->parameters.bandwidth = new_connection->parameters.bandwidth = bandwidth;
+      new_connection->uplink = acceptor_->uplink;
       source->remote_connection_id = new_connection->local_connection_id;
       new_connection->set_state(connection::state::connected);
       new_connection->remote_connection_id = source->local_connection_id;
       new_connection->set_time_stamp(static_cast<uint32_t>(time_of_handling));
       std::weak_ptr<acceptor::acceptor_handler> a_handler = acceptor_->get_handler();
       auto a_id = acceptor_->get_id();
-      add_handlers_task([a_handler, a_id, new_connection, source_address]() {
+      add_handlers_task(handler_key(acceptor_->get_handler()), [a_handler, a_id, new_connection, source_address]() {
         std::shared_ptr<acceptor::acceptor_handler> handler = a_handler.lock();
         if (handler != nullptr) {
           handler->on_connected(a_id, new_connection, source_address);
         }
       });
-      add_handlers_task([new_connection, cid](){
+      add_handlers_task(handler_key(new_connection->get_handler()), [new_connection, cid](){
         new_connection->get_handler()->on_connected(cid);
       });
       add_task(get_time() + 1, [new_connection](){
@@ -228,6 +436,7 @@ void simulation::handle_request(uint32_t src, uint32_t dest) {
 }
 
 void simulation::handle_message(uint32_t src, uint32_t dest, const std::string& msg) {
+  add_trace_record(TRACE_MESSAGE, src, dest, static_cast<uint32_t>(msg.size()));
   // LOG(DBUG) << "message 0";
   std::shared_ptr<simulated_connection> destination =
       std::dynamic_pointer_cast<simulated_connection>(get_connection(dest));
@@ -236,10 +445,8 @@ void simulation::handle_message(uint32_t src, uint32_t dest, const std::string&
   if (!destination || destination->get_state() != connection::state::connected) {
     LOG(WARNING) << "WARNING in handling send! Peer has disconnected or does not exist!";
     if (source) {
-      uint32_t t = static_cast<uint32_t>(get_time());
-      uint32_t ts = source->get_time_stamp();
-      uint64_t time_of_handling = (t > ts ? t : ts) + 1 + source->get_lag();
-      add_task(time_of_handling, std::bind(&simulation::handle_ack, sim, src, status::internal("Broken pipe")));
+      add_task(source->get_arrival_time(get_time()),
+          std::bind(&simulation::handle_ack, sim, src, status::internal("Broken pipe")));
     }
     return;
   }
@@ -255,23 +462,13 @@ void simulation::handle_message(uint32_t src, uint32_t dest, const std::string&
     // LOG(DBUG) << "message 01";
     return;
   }
-  source->sending_q_mutex.lock();
-  if (source->sending.size() && source->sending.front().message.size() == source->sending.front().bytes_send) {
-    source->sending_q_mutex.unlock();
-    uint32_t t = static_cast<uint32_t>(get_time());
-    uint32_t ts = destination->get_time_stamp();
-    uint64_t time_of_handling = (t > ts ? t : ts) + 1 + destination->get_lag();
-    destination->set_time_stamp(static_cast<uint32_t>(time_of_handling));
-    add_task(time_of_handling, std::bind(&simulation::handle_ack, sim, src, status::ok()));
-  } else if (source && source->get_state() == connection::state::connected) {
-    add_task(get_time() + 1, std::bind(&simulated_connection::handle_send, source));
-  }
-  source->sending_q_mutex.unlock();
+  add_task(destination->get_arrival_time(get_time()), std::bind(&simulation::handle_ack, sim, src, status::ok()));
   // LOG(DBUG) << "message 1";
   return;
 }
 
 void simulation::handle_accept(uint32_t dest) {
+  add_trace_record(TRACE_ACCEPT, 0, dest, 0);
   std::shared_ptr<simulated_connection> destination =
       std::dynamic_pointer_cast<simulated_connection>(get_connection(dest));
   if (!destination) {
@@ -279,7 +476,7 @@ void simulation::handle_accept(uint32_t dest) {
     return;
   }
   destination->set_state(connection::state::connected);
-  add_handlers_task([destination](){
+  add_handlers_task(handler_key(destination->get_handler()), [destination](){
     destination->get_handler()->on_connected(destination->get_id());
   });
   add_task(get_time() + 1, [destination](){
@@ -291,6 +488,7 @@ void simulation::handle_accept(uint32_t dest) {
 }
 
 void simulation::handle_refuse(uint32_t dest) {
+  add_trace_record(TRACE_REFUSE, 0, dest, 0);
   std::shared_ptr<simulated_connection> destination =
       std::dynamic_pointer_cast<simulated_connection>(get_connection(dest));
   // LOG(DBUG) << "refuse 0";
@@ -304,28 +502,27 @@ void simulation::handle_refuse(uint32_t dest) {
     destination->cancel_operations();
     destination->clear_queues();
   });
-  add_handlers_task([destination](){
+  add_handlers_task(handler_key(destination->get_handler()), [destination](){
     destination->get_handler()->on_connection_error(destination->get_id(), status::internal("Connection refused!"));
   });
   // LOG(DBUG) << "refuse 1";
 }
 
 void simulation::handle_ack(uint32_t dest, const status& s) {
+  add_trace_record(TRACE_ACK, 0, dest, 0);
   // LOG(DBUG) << "<handle_ack>";
   std::shared_ptr<simulated_connection> destination =
       std::dynamic_pointer_cast<simulated_connection>(get_connection(dest));
 
   if (destination) {
     destination->sending_q_mutex.lock();
-    if (destination->sending.size()) {
+    if (destination->packets_in_flight > 0) {
       uint32_t rid = destination->sending.front().id;
-      destination->sending.pop();
-      add_handlers_task([destination, rid, s](){
+      destination->sending.pop_front();
+      destination->packets_in_flight--;
+      add_handlers_task(handler_key(destination->get_handler()), [destination, rid, s](){
         destination->get_handler()->on_message_sent(destination->get_id(), rid, s);
       });
-      add_task(get_time() + 1, [destination]() {
-        destination->handle_send();
-      });
     }
     destination->sending_q_mutex.unlock();
   }
@@ -333,51 +530,127 @@ void simulation::handle_ack(uint32_t dest, const status& s) {
 
 uint32_t simulation::process(uint64_t time_) {
   // LOG(DBUG) << "process time: " << time_;
-  int events_processed = 0;
-  tasks_mutex.lock();
-
-  auto current_time = get_time();
-  // LOG(DBUG) << "Cur time: " << current_time << " process time: " << time_;
-  while (current_time <= time_) {
-    set_time(current_time);
-    if (tasks.count(current_time)) {
-      // LOG(DBUG) << "PROCESSING TIME: " << current_time;
-      for (auto& t : tasks.at(current_time)) {
-        events_processed++;
-        tasks_mutex.unlock();
-        try {
-          t();
-        } catch (const std::exception& e) {
-          LOG(WARNING) << e.what();
-        } catch (...) {
-          LOG(WARNING) << "Error occured";
-        }
-        tasks_mutex.lock();
-      }
-      tasks.erase(current_time);
+  uint32_t events_processed = 0;
+  std::unique_lock<std::mutex> lock(tasks_mutex);
+  while (!tasks.empty() && tasks.front().time <= time_) {
+    std::pop_heap(tasks.begin(), tasks.end(), event_after());
+    event e = std::move(tasks.back());
+    tasks.pop_back();
+    set_time(e.time);
+    events_processed++;
+    lock.unlock();
+    try {
+      e.task();
+    } catch (const std::exception& ex) {
+      LOG(WARNING) << ex.what();
+    } catch (...) {
+      LOG(WARNING) << "Error occured";
     }
-    current_time++;
+    lock.lock();
+  }
+  if (get_time() < time_) {
+    set_time(time_);
   }
-  tasks_mutex.unlock();
   return events_processed;
 }
 
+static void run_handler(const std::function<void()>& task) {
+  try {
+    task();
+  } catch (const std::exception& e) {
+    LOG(WARNING) << e.what();
+  } catch (...) {
+    LOG(WARNING) << "Error occured";
+  }
+}
+
 void simulation::process_handlers() {
-  handlers_tasks_mutex.lock();
-  while (handlers_tasks.size() > 0) {
-    auto t = handlers_tasks.front();
-    handlers_tasks.pop();
-    handlers_tasks_mutex.unlock();
-    try {
-      t();
-    } catch (const std::exception& e) {
-      LOG(WARNING) << e.what();
-    } catch (...) {
-      LOG(WARNING) << "Error occured";
+  process_handlers(handler_threads);
+}
+
+void simulation::process_handlers(uint32_t max_threads) {
+  while (true) {
+    std::vector<std::pair<const void*, std::function<void()> > > batch;
+    {
+      std::lock_guard<std::mutex> lock(handlers_tasks_mutex);
+      batch.swap(handlers_tasks);
+    }
+    if (batch.empty()) {
+      return;
+    }
+    if (max_threads <= 1) {
+      for (auto& t : batch) {
+        run_handler(t.second);
+      }
+      continue;
+    }
+    // Group the tasks by key, keeping their order
+    std::vector<std::vector<std::function<void()> > > groups;
+    std::unordered_map<const void*, size_t> group_of;
+    for (auto& t : batch) {
+      auto it = group_of.find(t.first);
+      if (it == group_of.end()) {
+        it = group_of.emplace(t.first, groups.size()).first;
+        groups.emplace_back();
+      }
+      groups[it->second].push_back(std::move(t.second));
+    }
+    std::atomic<size_t> next_group(0);
+    auto run_groups = [&groups, &next_group]() {
+      size_t i;
+      while ((i = next_group++) < groups.size()) {
+        for (auto& task : groups[i]) {
+          run_handler(task);
+        }
+      }
+    };
+    uint32_t threads = static_cast<uint32_t>(std::min<size_t>(max_threads, groups.size()));
+    if (threads <= 1) {
+      run_groups();
+    } else {
+      run_on_workers(run_groups, threads - 1);
     }
-    handlers_tasks_mutex.lock();
   }
-  handlers_tasks_mutex.unlock();
+}
+
+void simulation::run_on_workers(const std::function<void()>& job, uint32_t helpers) {
+  {
+    std::lock_guard<std::mutex> lock(workers_mutex);
+    while (handler_workers.size() + 1 < handler_threads) {
+      handler_workers.emplace_back([this]() {
+        std::unique_lock<std::mutex> worker_lock(workers_mutex);
+        while (true) {
+          workers_cv.wait(worker_lock, [this]() {
+            return workers_stop || workers_wanted > 0;
+          });
+          if (workers_stop) {
+            return;
+          }
+          workers_wanted--;
+          workers_busy++;
+          std::function<void()> worker_job = workers_job;
+          worker_lock.unlock();
+          worker_job();
+          worker_lock.lock();
+          workers_busy--;
+          if (workers_busy == 0) {
+            workers_done_cv.notify_all();
+          }
+        }
+      });
+    }
+    workers_job = job;
+    workers_wanted = helpers;
+  }
+  workers_cv.notify_all();
+  job();
+  std::unique_lock<std::mutex> lock(workers_mutex);
+  // All work is taken when job() returns, helpers that haven't started aren't needed
+  workers_wanted = 0;
+  workers_done_cv.wait(lock, [this]() {
+    return workers_busy == 0;
+  });
+  workers_job = nullptr;
 }
 
 uint64_t simulation::get_time() {
@@ -400,7 +673,6 @@ bool simulation::is_queue_empty() {
 }
 
 void simulation::add_connection(std::shared_ptr<connection> connection_) {
-  static uint32_t uid = 0;
   if (connection_) {
     std::lock_guard<std::mutex> lock(connections_mutex);
     auto lid = std::dynamic_pointer_cast<simulated_connection>(connection_)->local_connection_id;
@@ -410,8 +682,8 @@ void simulation::add_connection(std::shared_ptr<connection> connection_) {
         connections.erase(it);
       }
     }
-    connections[++uid] = connection_;
-    std::dynamic_pointer_cast<simulated_connection>(connection_)->local_connection_id = uid;
+    connections[++last_connection_id] = connection_;
+    std::dynamic_pointer_cast<simulated_connection>(connection_)->local_connection_id = last_connection_id;
   }
 }
 
@@ -463,7 +735,8 @@ simulated_connection::outgoing_packet::outgoing_packet(): bytes_send(0), id(0) {
 
 simulated_connection::simulated_connection(connection_id id, const std::string& address_,
     std::shared_ptr<connection_handler> handler_):
-    connection(id, handler_), remote_address(0), local_connection_id(0), remote_connection_id(0), time_stamp(0),
+    connection(id, handler_), remote_address(0), local_connection_id(0), remote_connection_id(0),
+    packets_in_flight(0), time_stamp(0),
     original_address(address_), connection_state(connection::state::invalid_state) {
 }
 
@@ -477,10 +750,11 @@ bool simulated_connection::init() {
         << original_address;
     return false;
   }
+  link = std::make_shared<link_transmitter>(parameters.bandwidth);
   return true;
 }
 
-void simulated_connection::async_send(const std::string& message, uint32_t msg_id = 0) {
+void simulated_connection::async_send(std::string message, uint32_t msg_id = 0) {
   // LOG(DBUG) << id << " <async_send>";
   if (message.size() < 1) {
     LOG(WARNING) << "Send called but no message: id -> " << msg_id;
@@ -494,12 +768,12 @@ void simulated_connection::async_send(const std::string& message, uint32_t msg_i
   }
   // LOG(DBUG) << "Send called with message <" << io::bin2hex(message) << ">";
   outgoing_packet packet;
-  packet.message = message;
+  packet.message = std::move(message);
   packet.bytes_send = 0;
   packet.id = msg_id;
   // LOG(DBUG) << id << " pushing message <" << io::bin2hex(message) << "> with id: " << msg_id;
   sending_q_mutex.lock();
-  sending.push(std::move(packet));
+  sending.push_back(std::move(packet));
   sending_q_mutex.unlock();
   if (get_state() == connection::state::connected) {
     std::shared_ptr<simulation> sim = simulation::get_simulator();
@@ -513,34 +787,36 @@ void simulated_connection::handle_send() {
   if (get_state() != connection::state::connected) {
     return;
   }
-  sending_q_mutex.lock();
-  /// nothing to send or waiting for ACK
-  if (sending.empty() || sending.front().message.size() == sending.front().bytes_send) {
-    sending_q_mutex.unlock();
-    // LOG(DBUG) << id << " </handle_send 1 >";
-    return;
-  }
-  outgoing_packet& packet = sending.front();
-  sending_q_mutex.unlock();
-  std::string message = "";
-  if (parameters.bandwidth >= (packet.message.size() - packet.bytes_send)) {
-    if (!packet.bytes_send) {
-      message = packet.message;
-    } else {
-      message = packet.message.substr(packet.bytes_send);
-    }
-  } else {
-      message = packet.message.substr(packet.bytes_send, parameters.bandwidth);
+  std::shared_ptr<simulation> sim = simulation::get_simulator();
+  uint64_t now = sim->get_time();
+  std::lock_guard<std::mutex> lock(sending_q_mutex);
+  // Everything queued is sent at once, the link delays each message after the ones before it
+  while (packets_in_flight < sending.size()) {
+    outgoing_packet& packet = sending[packets_in_flight++];
+    uint32_t size = static_cast<uint32_t>(packet.message.size());
+    packet.bytes_send = size;
+    uint64_t sent = transmit(now, size);
+    sim->add_task(get_arrival_time(sent),
+        std::bind(&simulation::handle_message, sim, local_connection_id, remote_connection_id, packet.message));
   }
-  packet.bytes_send += static_cast<int32_t>(message.size());
+  // LOG(DBUG) << "</handle_send>";
+}
+
+uint64_t simulated_connection::transmit(uint64_t time, uint32_t size) {
   std::shared_ptr<simulation> sim = simulation::get_simulator();
-  uint32_t t = static_cast<uint32_t>(sim->get_time());
-  uint32_t ts = get_time_stamp();
-  uint64_t time_of_handling = (t > ts ? t : ts) + 1 + get_lag();
-  set_time_stamp(static_cast<uint32_t>(time_of_handling));
-  sim->add_task(time_of_handling,
-      std::bind(&simulation::handle_message, sim, local_connection_id, remote_connection_id, message));
-  // LOG(DBUG) << "</handle_send 2>";
+  auto send_once = [this, size](uint64_t at) {
+    uint64_t sent = link->transmit(at, size);
+    return uplink ? std::max(sent, uplink->transmit(at, size)) : sent;
+  };
+  uint64_t sent = send_once(time);
+  // A lost message is sent again after the round trip timeout
+  while (parameters.loss > 0 && sim->random(1000) < parameters.loss) {
+    sent = send_once(sent + 2 * parameters.max_lag + 1);
+  }
+  if (parameters.jitter > 0) {
+    sent += sim->random(parameters.jitter + 1);
+  }
+  return sent;
 }
 
 void simulated_connection::handle_read() {
@@ -573,7 +849,7 @@ void simulated_connection::handle_read() {
       auto self = shared_from_this();
       std::shared_ptr<simulation> sim = simulation::get_simulator();
       sim->add_task(sim->get_time() + 1, std::bind(&simulated_connection::handle_read, self));
-      sim->add_handlers_task([self, next_packet]() {
+      sim->add_handlers_task(simulation::handler_key(handler), [self, next_packet]() {
         self->handler->on_message_received(self->id,
             next_packet.buffer, next_packet.bytes_read, next_packet.id);
       });
@@ -617,15 +893,23 @@ void simulated_connection::async_read(std::shared_ptr<char> buffer, uint32_t buf
 
 bool simulated_connection::parse_address(const std::string& address_, connection_params* params,
     uint32_t* parsed_remote_address) {
-  std::regex rgx_sim("(\\d+):(\\d+):(\\d+):(\\d+)");
+  std::regex rgx_sim("(\\d+):(\\d+):(\\d+):(\\d+)(?::(\\d+):(\\d+))?");
   std::smatch match;
   if (std::regex_match(address_.begin(), address_.end(), match, rgx_sim) &&
       std::stoul(match[1]) <= std::stoul(match[2]) &&
-      match.size() == 5) {
+      match.size() == 7) {
     params->min_lag = std::stoul(match[1]);
     params->max_lag = std::stoul(match[2]);
     params->bandwidth = std::stoul(match[3]);
     *parsed_remote_address = std::stoul(match[4]);
+    if (match[5].matched) {
+      params->loss = std::stoul(match[5]);
+      params->jitter = std::stoul(match[6]);
+      // Every message must get through eventually
+      if (params->loss >= 1000) {
+        return false;
+      }
+    }
     return true;
   }
   return false;
@@ -651,7 +935,17 @@ uint32_t simulated_connection::get_lag() const {
   if (parameters.min_lag == parameters.max_lag) {
     return parameters.min_lag;
   }
-  return std::rand() % (parameters.max_lag - parameters.min_lag) + parameters.min_lag;
+  return simulation::get_simulator()->random(parameters.max_lag - parameters.min_lag) + parameters.min_lag;
+}
+
+uint64_t simulated_connection::get_arrival_time(uint64_t time) {
+  uint64_t arrival = time + 1 + get_lag();
+  std::lock_guard<std::mutex> lock(time_stamp_mutex);
+  if (arrival < time_stamp) {
+    arrival = time_stamp;
+  }
+  time_stamp = static_cast<uint32_t>(arrival);
+  return arrival;
 }
 
 void simulated_connection::connect() {
@@ -692,7 +986,7 @@ void simulated_connection::disconnect() {
     });
     std::weak_ptr<connection::connection_handler> c_handler = handler;
     auto c_id = id;
-    sim->add_handlers_task([c_handler, c_id]() {
+    sim->add_handlers_task(simulation::handler_key(handler), [c_handler, c_id]() {
       std::shared_ptr<connection::connection_handler> handler = c_handler.lock();
       if (handler != nullptr) {
         handler->on_disconnected(c_id);
@@ -726,8 +1020,8 @@ void simulated_connection::clear_queues() {
   std::lock_guard<std::mutex> recv_lock(recv_buf_mutex);
   std::queue<incoming_packet> empty_reading;
   std::swap(reading, empty_reading);
-  std::queue<outgoing_packet> empty_sending;
-  std::swap(sending, empty_sending);
+  sending.clear();
+  packets_in_flight = 0;
   std::queue<std::string> empty_receive_buffer;
   std::swap(receive_buffer, empty_receive_buffer);
 }
@@ -741,14 +1035,15 @@ void simulated_connection::cancel_operations() {
   std::shared_ptr<simulation> sim = simulation::get_simulator();
   while (!sending.empty()) {
     auto m_id = sending.front().id;
-    sim->add_handlers_task([c_handler, c_id, m_id]() {
+    sim->add_handlers_task(simulation::handler_key(c_handler), [c_handler, c_id, m_id]() {
       c_handler->on_message_sent(c_id, m_id, status::aborted("Operation cancelled!"));
     });
-    sending.pop();
+    sending.pop_front();
   }
+  packets_in_flight = 0;
   uint32_t n = static_cast<uint32_t>(reading.size());
   while (n--) {
-    sim->add_handlers_task([c_handler, c_id]() {
+    sim->add_handlers_task(simulation::handler_key(c_handler), [c_handler, c_id]() {
       c_handler->on_connection_error(c_id, status::aborted("Operation read cancelled!"));
     });
   }
@@ -772,6 +1067,7 @@ bool simulated_acceptor::init() {
       LOG(WARNING) << "WARNING: Acceptor creation failed! Acceptor address should be > 0";
       return false;
     } else {
+      uplink = std::make_shared<link_transmitter>(parameters.bandwidth);
       simulation::get_simulator()->add_acceptor(address, shared_from_this());
     }
   } else {
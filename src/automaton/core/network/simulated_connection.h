@@ -1,11 +1,15 @@
 #ifndef AUTOMATON_CORE_NETWORK_SIMULATED_CONNECTION_H_
 #define AUTOMATON_CORE_NETWORK_SIMULATED_CONNECTION_H_
 
+#include <condition_variable>
+#include <deque>
 #include <functional>
 #include <memory>
 #include <mutex>
 #include <queue>
+#include <random>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <utility>
 #include <vector>
@@ -22,7 +26,12 @@ class simulated_acceptor;
 
 /**
   Acceptor address: (max connections):(bandwidth):(address)
-  Connection address: (min lag):(max lag):(bandwidth):(remote address)
+  Connection address: (min lag):(max lag):(bandwidth):(remote address)[:(loss):(jitter)]
+
+  Bandwidth is in bytes per millisecond, 0 means unlimited. The bandwidth of a connection is the capacity of its link,
+  the bandwidth of an acceptor is the uplink capacity shared by all connections it accepted. Loss is the chance in
+  1/1000 that a message is lost and sent again after a timeout, jitter is the maximum extra delay of a message in
+  milliseconds. Messages on a link always arrive in the order they were sent.
 */
 
 // these could be protobuf messages
@@ -30,6 +39,8 @@ struct connection_params {
   uint32_t min_lag;
   uint32_t max_lag;
   uint32_t bandwidth;
+  uint32_t loss;
+  uint32_t jitter;
   connection_params();
 };
 
@@ -39,6 +50,27 @@ struct acceptor_params {
   acceptor_params();
 };
 
+/**
+  Transmitter of a link. Messages are serialized onto it one after another at its bandwidth, so a message waits for
+  the ones sent before it.
+*/
+class link_transmitter {
+ public:
+  explicit link_transmitter(uint32_t bandwidth);
+
+  /**
+    Reserves the link for size bytes starting not before time and returns the time when the last byte is sent. Times
+    are in milliseconds.
+  */
+  uint64_t transmit(uint64_t time, uint32_t size);
+
+ private:
+  uint32_t bandwidth;
+  // Time in microseconds when the link is free
+  uint64_t free_time;
+  std::mutex link_mutex;
+};
+
 /**
   Singleton class running the simulation. Stores created acceptors, connections and simulation time. Handle event queue.
 */
@@ -56,15 +88,49 @@ class simulation {
   std::unordered_map<uint32_t, std::shared_ptr<acceptor> > acceptors;
   std::mutex acceptors_mutex;
 
+  struct event {
+    uint64_t time;
+    // Order of adding, keeps events with equal time FIFO
+    uint64_t seq;
+    std::function<void()> task;
+  };
+
+  struct event_after {
+    bool operator()(const event& a, const event& b) const {
+      return a.time != b.time ? a.time > b.time : a.seq > b.seq;
+    }
+  };
+
   /**
-    Priority queue storing the events that need to be handled at specific time. Lower time means higher priority.
-    If equal, FIFO.
+    Heap storing the events that need to be handled at specific time. Lower time means higher priority.
+    If equal, FIFO. process() jumps from one event time to the next.
   */
   std::mutex tasks_mutex;
-  std::unordered_map<uint64_t, std::vector<std::function<void()> > > tasks;
+  std::vector<event> tasks;
+  uint64_t next_seq;
 
+  /**
+    Handler tasks with the key of the handler they call. @see add_handlers_task
+  */
   std::mutex handlers_tasks_mutex;
-  std::queue<std::function<void()> > handlers_tasks;
+  std::condition_variable handlers_cv;
+  std::vector<std::pair<const void*, std::function<void()> > > handlers_tasks;
+
+  /**
+    Threads helping process_handlers() to run handlers of different keys in parallel. Started on first use.
+  */
+  uint32_t handler_threads;
+  std::vector<std::thread> handler_workers;
+  std::mutex workers_mutex;
+  std::condition_variable workers_cv;
+  std::condition_variable workers_done_cv;
+  std::function<void()> workers_job;
+  uint32_t workers_wanted;
+  uint32_t workers_busy;
+  bool workers_stop;
+
+  /** Runs job on the calling thread and on up to helpers worker threads, returns when all of them are done.*/
+  void run_on_workers(const std::function<void()>& job, uint32_t helpers);
 
   /**
     Simulation time. On create is 0.
@@ -86,7 +152,48 @@ class simulation {
   std::thread handlers_thread;
   std::mutex running_mutex;
 
+  /** Last connection id given by add_connection().*/
+  uint32_t last_connection_id;
+
+  /** Source of all randomness in the simulation. @see set_seed*/
+  std::mt19937_64 rng;
+  uint64_t seed;
+  std::mutex rng_mutex;
+
+  /** The trace being recorded and the time of its last record. @see start_trace*/
+  bool tracing;
+  std::string trace;
+  uint64_t trace_time;
+  std::mutex trace_mutex;
+
+  void add_trace_record(uint8_t type, uint32_t source, uint32_t destination, uint32_t size);
+
+  void process_handlers(uint32_t threads);
+
  public:
+  /** Types of the events in a trace.*/
+  enum trace_event_type {
+    TRACE_REQUEST = 1,
+    TRACE_ACCEPT = 2,
+    TRACE_REFUSE = 3,
+    TRACE_MESSAGE = 4,
+    TRACE_ACK = 5,
+    TRACE_DISCONNECT = 6,
+  };
+
+  /**
+    An event of a trace. Time is relative to the start of the trace. Size is the message size for TRACE_MESSAGE and
+    0 for the others.
+  */
+  struct trace_record {
+    uint64_t time;
+    uint8_t type;
+    uint32_t source;
+    uint32_t destination;
+    uint32_t size;
+    bool operator==(const trace_record& other) const;
+  };
+
   ~simulation();
 
   // TODO(kari): Make it work on exactly millisec_step milliseconds.
@@ -109,8 +216,77 @@ class simulation {
 
   void add_task(uint64_t tm, std::function<void()> task);
 
+  /**
+    Adds a task calling a handler. Tasks with the same key run in the order they were added, tasks with different keys
+    may run in parallel. The key is the object whose handler is called, @see handler_key. Tasks without a key run in
+    order with each other.
+  */
+  void add_handlers_task(const void* key, std::function<void()> task);
+
   void add_handlers_task(std::function<void()> task);
 
+  /**
+    Key of a handler for add_handlers_task. It is the address of the whole object, so the connection and acceptor
+    handlers of the same node get the same key.
+  */
+  template <typename T>
+  static const void* handler_key(const std::shared_ptr<T>& handler) {
+    return dynamic_cast<const void*>(handler.get());
+  }
+
+  /**
+    Sets how many threads run handlers of different keys in parallel. 1 runs all handlers on the thread calling
+    process_handlers(), in the order they were added. Should be called before handlers are processed. The default is
+    the number of hardware threads.
+  */
+  void set_handler_threads(uint32_t threads);
+
+  /**
+    Seeds the random generator used for the lags and returns the seed from the constructor or the last call. A run is
+    reproducible if it is started with the same seed in the same state. If there are no connections, their ids start
+    from 1 again, so a run can be repeated in the same process. The default seed is taken from the clock.
+  */
+  uint64_t set_seed(uint64_t new_seed);
+
+  uint64_t get_seed();
+
+  /** Returns a random number in [0, bound) from the seeded generator.*/
+  uint32_t random(uint32_t bound);
+
+  /** Returned by the step of run_until() when it has nothing to run before the next event.*/
+  static const uint64_t NO_DEADLINE = ~0ULL;
+
+  /**
+    Deterministic mode. Runs the simulation on the calling thread, without simulation_start(), until the next event
+    and the next deadline are after the given time or there are none. Time jumps from one event or deadline to the
+    next, so it runs as fast as the events can be handled. Handlers run one at a time in the order they were added.
+    step, if set, is called at the current time first and then after the events of each time, so nodes can be updated
+    on the virtual clock. It returns its next deadline, the time it has to be called at even if there are no events
+    then, or NO_DEADLINE. A deadline that isn't after the time of the call is taken as the next millisecond. Returns
+    the number of processed events. Throws std::logic_error if the real time simulation is running.
+
+    Nodes are not run by the simulation. node_scheduler and node_updater run them on the system clock, so a run with
+    nodes updated by them is not reproducible. Instead, don't start an updater and run the nodes from step: call
+    process_update(time) of the nodes whose get_time_to_update() has come and process_tasks() of the others, and
+    return the earliest get_time_to_update().
+  */
+  uint64_t run_until(uint64_t time, const std::function<uint64_t(uint64_t time)>& step = nullptr);
+
+  /**
+    Starts recording a trace of the network events: requests, accepts, refuses, messages, acks and disconnects. The
+    trace starts with the seed, so the run can be replayed with set_seed(). A trace already being recorded is dropped.
+  */
+  void start_trace();
+
+  /** Stops recording and returns the trace. @see parse_trace*/
+  std::string stop_trace();
+
+  /**
+    Decodes a trace. Each record is a varint time delta, the type byte, varint source and destination, and a varint
+    size for messages. Throws std::invalid_argument if the trace is malformed.
+  */
+  static std::vector<trace_record> parse_trace(const std::string& trace, uint64_t* seed);
+
   /** Returns current simulation time */
   uint64_t get_time();
 
@@ -118,10 +294,15 @@ class simulation {
   bool is_queue_empty();
 
   /**
-    Process all events from simulation_time to the given time.
+    Process all events from simulation_time to the given time. Time jumps to each event's time, so empty periods
+    cost nothing. Returns the number of processed events.
   */
   uint32_t process(uint64_t time);
 
+  /**
+    Runs the queued handler tasks, including the ones they add, until there are none. The queued tasks are run as a
+    batch: the tasks of one key run in order on one thread and different keys run in parallel.
+  */
   void process_handlers();
 
   // NOTE: This should be called only from simulation and simulated_connection. Should not be public but it is for now.
@@ -175,7 +356,13 @@ class simulated_connection: public connection, public std::enable_shared_from_th
 
   connection_params parameters;
 
-  std::queue<outgoing_packet> sending;
+  /** The link of the connection and, for accepted connections, the uplink of the acceptor.*/
+  std::shared_ptr<link_transmitter> link;
+  std::shared_ptr<link_transmitter> uplink;
+
+  /** Packets waiting for acknowledge are at the front of sending, the ones not sent yet follow them.*/
+  std::deque<outgoing_packet> sending;
+  uint32_t packets_in_flight;
   std::mutex sending_q_mutex;
   std::queue<incoming_packet> reading;
   std::mutex reading_q_mutex;
@@ -194,7 +381,9 @@ class simulated_connection: public connection, public std::enable_shared_from_th
 
   void disconnect();
 
-  void async_send(const std::string& message, uint32_t message_id);
+  using connection::async_send;
+
+  void async_send(std::string message, uint32_t message_id);
 
   void async_read(std::shared_ptr<char> buffer, uint32_t buffer_size, uint32_t num_bytes, uint32_t id);
 
@@ -209,6 +398,18 @@ class simulated_connection: public connection, public std::enable_shared_from_th
 
   uint32_t get_lag() const;
 
+  /**
+    Returns when something sent to the other endpoint at the given time arrives: after the lag, but not before what
+    was sent earlier.
+  */
+  uint64_t get_arrival_time(uint64_t time);
+
+  /**
+    Returns when a message of size bytes given to the connection at time has left it: after the link and the uplink
+    have sent it, the copies of it that were lost have timed out and the jitter has passed.
+  */
+  uint64_t transmit(uint64_t time, uint32_t size);
+
   std::shared_ptr<connection_handler> get_handler();
 
   void set_time_stamp(uint32_t t);
@@ -244,6 +445,7 @@ class simulated_acceptor: public acceptor, public std::enable_shared_from_this<s
   std::string original_address;
   acceptor_params parameters;
   std::shared_ptr<connection::connection_handler> accepted_connections_handler;
+  std::shared_ptr<link_transmitter> uplink;
 
   simulated_acceptor(acceptor_id id, const std::string& address_, std::shared_ptr<acceptor::acceptor_handler>
       handler_, std::shared_ptr<connection::connection_handler> accepted_connections_handler);
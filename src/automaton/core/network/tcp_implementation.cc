@@ -4,7 +4,10 @@
 #include <regex>
 #include <sstream>
 #include <thread>
+#include <unordered_map>
+#include <vector>
 
+#include <boost/asio/post.hpp>
 #include <boost/asio/read.hpp>
 
 #include "automaton/core/io/io.h"
@@ -37,16 +40,37 @@ int max_connections = 8;
 
 */
 
-static boost::asio::io_service asio_io_service;
-static boost::asio::io_service::work work_(asio_io_service);
-static std::thread* worker_thread;
+// Pool of io_services, each run by its own thread. All the connections and acceptors of one handler (a node) use
+// the same io_service for their whole life, so the callbacks of a handler always run on the same thread and never
+// concurrently.
+static std::vector<std::unique_ptr<boost::asio::io_service> > io_services;
+static std::vector<std::unique_ptr<boost::asio::io_service::work> > works;
+static std::vector<std::thread> worker_threads;
 static bool tcp_initialized = false;
 
+// Index in io_services of each handler, by the address of the handler object
+static std::unordered_map<const void*, uint32_t> handler_io_services;
+static uint32_t next_io_service = 0;
+static std::mutex handler_io_services_mutex;
+
+// Spreads the handlers evenly over the pool. A node is both the connection and the acceptor handler, the address of
+// the whole object gives its sockets the same io_service through either.
+template<class handler_type>
+static boost::asio::io_service& pick_io_service(const std::shared_ptr<handler_type>& handler) {
+  const void* key = dynamic_cast<const void*>(handler.get());
+  std::lock_guard<std::mutex> lock(handler_io_services_mutex);
+  auto it = handler_io_services.find(key);
+  if (it == handler_io_services.end()) {
+    it = handler_io_services.emplace(key, next_io_service++ % io_services.size()).first;
+  }
+  return *io_services[it->second];
+}
+
 // Connection functions
 
 tcp_connection::tcp_connection(connection_id id, const std::string& address_,
     std::shared_ptr<connection_handler> handler_):
-    connection(id, handler_), asio_socket{asio_io_service},
+    connection(id, handler_), asio_socket{pick_io_service(handler_)},
     connection_state(connection::state::invalid_state), address(address_) {
   if (!tcp_initialized) {
     std::stringstream msg;
@@ -95,7 +119,7 @@ bool tcp_connection::init() {
   if (tcp_initialized) {
     try {
       boost::system::error_code boost_error_code;
-      boost::asio::ip::tcp::resolver resolver{asio_io_service};
+      boost::asio::ip::tcp::resolver resolver{asio_socket.get_executor()};
       std::string ip, port;
       parse_address(address, &ip, &port);
       boost::asio::ip::tcp::resolver::iterator it = resolver.resolve(ip, port, boost_error_code);
@@ -148,46 +172,121 @@ void tcp_connection::connect() {
   }
 }
 
-void tcp_connection::async_send(const std::string& msg, uint32_t message_id) {
-  if (tcp_initialized && asio_socket.is_open() && msg.size() > 0) {
-    // LOG(DBUG) << "ASYNC SEND MSG ID" << message_id << " data: " << io::bin2hex(msg);
-    std::string* message = new std::string(msg);
-    std::shared_ptr<tcp_connection> self = shared_from_this();
-    std::shared_ptr<connection_handler> c_handler = handler;
-    connection_id cid = id;
-    std::string addr = address;
-    asio_socket.async_write_some(boost::asio::buffer(*message),
-        [self, c_handler, cid, addr, message_id, message](const boost::system::error_code& boost_error_code,
-        size_t bytes_transferred) {
-      // LOG(DBUG) << "ASYNC SEND CALLBACK " << bytes_transferred;
-      if (boost_error_code) {
-        LOG(WARNING) << addr << " -> " <<  boost_error_code.message();
-        if (boost_error_code == boost::asio::error::broken_pipe) {
-          c_handler->on_message_sent(cid, message_id, status::aborted(boost_error_code.message()));
-          // TODO(kari): ?? handle
-          self->disconnect();
-        } else if (boost_error_code == boost::asio::error::operation_aborted) {
-          c_handler->on_message_sent(cid, message_id, status::aborted("Operation cancelled!"));
-        } else {
-          c_handler->on_message_sent(cid, message_id, status::unknown(boost_error_code.message()));
-        }
-       // if (bytes_transferred < message.size())
-      } else {
-        c_handler->on_message_sent(cid, message_id, status::ok());
-      }
-      delete message;
-    });
+void tcp_connection::async_send(std::string msg, uint32_t message_id) {
+  outgoing_message m;
+  m.data = std::move(msg);
+  m.id = message_id;
+  queue_message(std::move(m));
+}
+
+void tcp_connection::async_send(std::shared_ptr<const std::string> msg, uint32_t message_id) {
+  outgoing_message m;
+  m.shared = std::move(msg);
+  m.id = message_id;
+  queue_message(std::move(m));
+}
+
+void tcp_connection::queue_message(outgoing_message m) {
+  if (tcp_initialized && m.bytes().size() > 0) {
+    // LOG(DBUG) << "ASYNC SEND MSG ID" << m.id << " data: " << io::bin2hex(m.bytes());
+    bool start_writing;
+    {
+      std::lock_guard<std::mutex> lock(send_mutex);
+      send_queue.push_back(std::move(m));
+      start_writing = !writing;
+      writing = true;
+    }
+    // Otherwise the message goes out with the next write, when the current one finishes. When the socket is closed
+    // the write fails it, after the messages queued before it.
+    if (start_writing) {
+      std::shared_ptr<tcp_connection> self = shared_from_this();
+      boost::asio::post(asio_socket.get_executor(), [self]() {
+        self->write_queued();
+      });
+    }
   } else if (!tcp_initialized) {
     LOG(WARNING) << address << " -> " <<  "Not initialized";
-    handler->on_message_sent(id, message_id, status::internal("Not initialized"));
+    handler->on_message_sent(id, m.id, status::internal("Not initialized"));
     // TODO(kari): what to do here? needs to be connected
-  } else if (msg.size() <= 0) {
+  } else {
     LOG(WARNING) << address << " -> " <<  "Message too short";
-    handler->on_message_sent(id, message_id, status::invalid_argument("Message too short"));
+    handler->on_message_sent(id, m.id, status::invalid_argument("Message too short"));
     // TODO(kari): what to do here? needs to be connected
-  } else {
-    LOG(WARNING) << address << " -> " <<  "Socket closed or not yet connected";
-    handler->on_message_sent(id, message_id, status::internal("Socket closed or not yet connected"));
+  }
+}
+
+void tcp_connection::write_queued() {
+  std::vector<boost::asio::const_buffer> buffers;
+  {
+    std::lock_guard<std::mutex> lock(send_mutex);
+    sending.swap(send_queue);
+    buffers.reserve(sending.size());
+    for (const outgoing_message& m : sending) {
+      buffers.push_back(boost::asio::buffer(m.bytes()));
+    }
+  }
+  std::shared_ptr<tcp_connection> self = shared_from_this();
+  bool open;
+  {
+    // disconnect() closes the socket under connection_mutex, from any thread
+    std::lock_guard<std::mutex> lock(connection_mutex);
+    open = asio_socket.is_open();
+    if (open) {
+      // The messages stay in sending until the write is finished, async_write takes care of short writes
+      boost::asio::async_write(asio_socket, buffers,
+          [self](const boost::system::error_code& boost_error_code, size_t bytes_transferred) {
+        // LOG(DBUG) << "ASYNC SEND CALLBACK " << bytes_transferred;
+        self->on_written(boost_error_code);
+      });
+    }
+  }
+  if (!open) {
+    // Like a failed write, after the callbacks of the messages before them
+    boost::asio::post(asio_socket.get_executor(), [self]() {
+      self->on_written(boost::asio::error::bad_descriptor);
+    });
+  }
+}
+
+void tcp_connection::on_written(const boost::system::error_code& boost_error_code) {
+  std::vector<outgoing_message> done;
+  bool more;
+  {
+    std::lock_guard<std::mutex> lock(send_mutex);
+    done.swap(sending);
+    if (boost_error_code) {
+      // The queued messages fail too, the connection can't be written to any more
+      for (outgoing_message& m : send_queue) {
+        done.push_back(std::move(m));
+      }
+      send_queue.clear();
+    }
+    more = !send_queue.empty();
+    writing = more;
+  }
+  if (more) {
+    write_queued();
+  }
+  std::shared_ptr<connection_handler> c_handler = handler;
+  status s = status::ok();
+  if (boost_error_code) {
+    LOG(WARNING) << address << " -> " <<  boost_error_code.message();
+    if (boost_error_code == boost::asio::error::broken_pipe) {
+      s = status::aborted(boost_error_code.message());
+    } else if (boost_error_code == boost::asio::error::operation_aborted) {
+      s = status::aborted("Operation cancelled!");
+    } else if (boost_error_code == boost::asio::error::bad_descriptor) {
+      s = status::internal("Socket closed or not yet connected");
+    } else {
+      s = status::unknown(boost_error_code.message());
+    }
+  }
+  for (const outgoing_message& m : done) {
+    c_handler->on_message_sent(id, m.id, s);
+  }
+  if (boost_error_code == boost::asio::error::broken_pipe) {
+    // TODO(kari): ?? handle
+    disconnect();
   }
 }
 
@@ -299,7 +398,7 @@ void tcp_connection::set_state(connection::state new_state) {
 
 tcp_acceptor::tcp_acceptor(acceptor_id id, const std::string& address, std::shared_ptr<acceptor_handler> handler,
     std::shared_ptr<connection::connection_handler> connections_handler_):
-    acceptor(id, handler), asio_acceptor{asio_io_service}, accepted_connections_handler(connections_handler_),
+    acceptor(id, handler), asio_acceptor{pick_io_service(handler)}, accepted_connections_handler(connections_handler_),
     acceptor_state(acceptor::state::invalid_state), address(address) {
   if (!tcp_initialized) {
     std::stringstream msg;
@@ -328,7 +427,7 @@ tcp_acceptor::~tcp_acceptor() {
 
 bool tcp_acceptor::init() {
   if (tcp_initialized) {
-    boost::asio::ip::tcp::resolver resolver{asio_io_service};
+    boost::asio::ip::tcp::resolver resolver{asio_acceptor.get_executor()};
     boost::system::error_code boost_error_code;
     std::string ip, port;
     parse_address(address, &ip, &port);
@@ -363,7 +462,8 @@ void tcp_acceptor::start_accepting() {
     std::shared_ptr<tcp_acceptor> self = shared_from_this();
     std::shared_ptr<acceptor_handler> a_handler = handler;
     std::shared_ptr<connection::connection_handler> ac_handler = accepted_connections_handler;
-    asio_acceptor.async_accept(asio_io_service, [self, a_handler, ac_handler]
+    // The accepted connection runs on the io_service of its handler
+    asio_acceptor.async_accept(pick_io_service(ac_handler), [self, a_handler, ac_handler]
         (const boost::system::error_code& boost_error_code, boost::asio::ip::tcp::socket socket_) {
        // LOG(DBUG) << "async_accept";
        if (!boost_error_code) {
@@ -438,7 +538,7 @@ void tcp_acceptor::set_state(acceptor::state new_state) {
 
 // Global functions
 
-void tcp_init() {
+void tcp_init(uint32_t threads) {
   if (tcp_initialized) {
     return;
   }
@@ -452,26 +552,50 @@ void tcp_init() {
     std::shared_ptr<connection::connection_handler> connections_handler) -> std::shared_ptr<acceptor> {
       return std::shared_ptr<acceptor>(new tcp_acceptor(id, address, handler, connections_handler));
     });
-  worker_thread = new std::thread([]() {
-    LOG(DBUG) << "asio_io_service starting...";
-    try {
-      asio_io_service.run();
-    } catch (const std::exception& ex) {
-      LOG(WARNING) << el::base::debug::StackTrace();
-      LOG(FATAL) << "ASIO THREAD EXCEPTION: " << ex.what();
-    } catch (...) {
-      LOG(FATAL) << "EXCEPTION!!!!";
+  if (threads == 0) {
+    threads = std::thread::hardware_concurrency();
+  }
+  if (threads == 0) {
+    threads = 1;
+  }
+  // After tcp_release the io_services are kept, connections that still exist refer to them
+  if (io_services.empty()) {
+    for (uint32_t i = 0; i < threads; ++i) {
+      io_services.emplace_back(new boost::asio::io_service());
     }
-    LOG(DBUG) << "asio_io_service stopped.";
-  });
+  }
+  // Set before the threads start, handlers left over from before a tcp_release run as soon as they do
   tcp_initialized = true;
+  for (auto& service : io_services) {
+    service->restart();
+    works.emplace_back(new boost::asio::io_service::work(*service));
+    boost::asio::io_service* s = service.get();
+    worker_threads.emplace_back([s]() {
+      LOG(DBUG) << "asio_io_service starting...";
+      try {
+        s->run();
+      } catch (const std::exception& ex) {
+        LOG(WARNING) << el::base::debug::StackTrace();
+        LOG(FATAL) << "ASIO THREAD EXCEPTION: " << ex.what();
+      } catch (...) {
+        LOG(FATAL) << "EXCEPTION!!!!";
+      }
+      LOG(DBUG) << "asio_io_service stopped.";
+    });
+  }
 }
 
 void tcp_release() {
-  LOG(DBUG) << "Stopping io_service";
-  asio_io_service.stop();
-  LOG(DBUG) << "joining worker_thread..";
-  worker_thread->join();
+  LOG(DBUG) << "Stopping io_services";
+  for (auto& service : io_services) {
+    service->stop();
+  }
+  LOG(DBUG) << "joining worker_threads..";
+  for (auto& t : worker_threads) {
+    t.join();
+  }
+  worker_threads.clear();
+  works.clear();
   LOG(DBUG) << "tcp_release done.";
   tcp_initialized = false;
 }
@@ -111,10 +111,22 @@ class tcp_connection: public connection, public std::enable_shared_from_this<tcp
     If any of the preconditions is not met on_message_sent() will be called with status, containing an error
     @see common::status
 
-    If an error occures during sending, on_message_sent() will be called with status, containing the error. If the error
-    is *broken pipe*, disconnect() will be called too.
+    Messages sent while a write is in progress are queued and written together with one gathered write once it
+    finishes. on_message_sent() is called for every message, in the order they were sent.
+
+    If an error occures during sending, on_message_sent() will be called with status, containing the error, for the
+    messages that were being written and the queued ones. If the error is *broken pipe*, disconnect() will be called
+    too.
   */
-  void async_send(const std::string& msg, uint32_t id);
+  void async_send(std::string msg, uint32_t id);
+
+  /**
+    @see connection::async_send
+
+    Same as async_send(std::string, uint32_t) but the message is written straight from the shared buffer, it is not
+    copied.
+  */
+  void async_send(std::shared_ptr<const std::string> msg, uint32_t id);
 
   /**
     @see connection::async_read
@@ -156,7 +168,33 @@ class tcp_connection: public connection, public std::enable_shared_from_this<tcp
   std::mutex connection_mutex;
   mutable std::mutex state_mutex;
 
+  struct outgoing_message {
+    std::string data;
+    // Set instead of data for a message shared with other connections
+    std::shared_ptr<const std::string> shared;
+    uint32_t id;
+
+    const std::string& bytes() const {
+      return shared ? *shared : data;
+    }
+  };
+
+  std::mutex send_mutex;
+  // Messages waiting for the current write to finish
+  std::vector<outgoing_message> send_queue;
+  // Messages being written
+  std::vector<outgoing_message> sending;
+  bool writing = false;
+
   void set_state(connection::state new_state);
+
+  void queue_message(outgoing_message m);
+
+  // Writes all queued messages with one gathered write, or fails them when the socket is closed. Runs on the
+  // io_service of the connection.
+  void write_queued();
+
+  void on_written(const boost::system::error_code& boost_error_code);
 };
 
 class tcp_acceptor:public acceptor, public std::enable_shared_from_this<tcp_acceptor> {
@@ -228,13 +266,18 @@ class tcp_acceptor:public acceptor, public std::enable_shared_from_this<tcp_acce
   Registers the connection and acceptor implementations with type "tcp".
   @see connection::register_connection_type
   @see acceptor::register_connection_type
-  Initialising asio io_service and work objects. New thread is created and io_service.run() called in it.
-  If a known exception happens while running the asio io_service, it will be logged.
+  Initialising a pool of asio io_services and work objects. Every io_service is run by its own thread. The connections
+  and acceptors of one handler are assigned to the same io_service of the pool, so all the callbacks of a handler are
+  called from that io_service's thread and never concurrently.
+  If a known exception happens while running an asio io_service, it will be logged.
+
+  @param[in] threads the number of io_service threads, 0 for one per hardware thread. It is ignored when the pool was
+    already created by an earlier call.
 */
-void tcp_init();
+void tcp_init(uint32_t threads = 0);
 
 /**
-  Stops the worker thread meaning all async operations will be cancelled. If this function is not called, segmentation
+  Stops the worker threads meaning all async operations will be cancelled. If this function is not called, segmentation
   fault will happen on program exit because of still running threads.
 */
 void tcp_release();
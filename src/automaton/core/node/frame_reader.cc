@@ -0,0 +1,93 @@
+#include "automaton/core/node/frame_reader.h"
+
+#include <cstring>
+#include <string>
+
+namespace automaton {
+namespace core {
+namespace node {
+
+frame_reader::frame_reader(uint32_t max_message_size): max_size(max_message_size) {}
+
+std::string frame_reader::frame(const std::string& message) {
+  uint32_t size = static_cast<uint32_t>(message.size());
+  std::string result;
+  result.reserve(HEADER_SIZE + message.size());
+  result.push_back(static_cast<char>((size >> 24) & 0xff));
+  result.push_back(static_cast<char>((size >> 16) & 0xff));
+  result.push_back(static_cast<char>((size >> 8) & 0xff));
+  result.push_back(static_cast<char>(size & 0xff));
+  result.append(message);
+  return result;
+}
+
+bool frame_reader::consume(const char* data, uint32_t size, const message_handler& handler) {
+  uint32_t pos = 0;
+  while (pos < size) {
+    if (!reading_message) {
+      uint32_t n = HEADER_SIZE - header_bytes;
+      if (n > size - pos) {
+        n = size - pos;
+      }
+      std::memcpy(header + header_bytes, data + pos, n);
+      header_bytes += n;
+      pos += n;
+      if (header_bytes < HEADER_SIZE) {
+        break;
+      }
+      header_bytes = 0;
+      uint32_t message_size = 0;
+      for (uint32_t i = 0; i < HEADER_SIZE; ++i) {
+        message_size = (message_size << 8) | (header[i] & 0xff);
+      }
+      if (message_size == 0 || message_size > max_size) {
+        return false;
+      }
+      if (message_size <= size - pos) {
+        handler(data + pos, message_size);
+        pos += message_size;
+        continue;
+      }
+      message.resize(message_size);
+      message_bytes = 0;
+      reading_message = true;
+    }
+    uint32_t n = static_cast<uint32_t>(message.size()) - message_bytes;
+    if (n > size - pos) {
+      n = size - pos;
+    }
+    std::memcpy(&message[message_bytes], data + pos, n);
+    message_bytes += n;
+    pos += n;
+    if (message_bytes == message.size()) {
+      deliver(handler);
+    }
+  }
+  return true;
+}
+
+uint32_t frame_reader::missing() const {
+  return reading_message ? static_cast<uint32_t>(message.size()) - message_bytes : 0;
+}
+
+std::shared_ptr<char> frame_reader::body() {
+  return std::shared_ptr<char>(shared_from_this(), &message[message_bytes]);
+}
+
+void frame_reader::body_received(const message_handler& handler) {
+  message_bytes = static_cast<uint32_t>(message.size());
+  deliver(handler);
+}
+
+void frame_reader::deliver(const message_handler& handler) {
+  reading_message = false;
+  handler(message.data(), static_cast<uint32_t>(message.size()));
+  // Don't hold on to the buffer of a rare large message
+  if (message.capacity() > KEEP_BUFFER_SIZE) {
+    std::string().swap(message);
+  }
+}
+
+}  // namespace node
+}  // namespace core
+}  // namespace automaton
@@ -0,0 +1,66 @@
+#ifndef AUTOMATON_CORE_NODE_FRAME_READER_H_
+#define AUTOMATON_CORE_NODE_FRAME_READER_H_
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+
+namespace automaton {
+namespace core {
+namespace node {
+
+// Splits the byte stream of a connection into messages. Every message is sent
+// with a 4 byte big endian size in front of it. Any number of messages can
+// arrive in one read and a message can be spread over many reads.
+class frame_reader: public std::enable_shared_from_this<frame_reader> {
+ public:
+  typedef std::function<void(const char* message, uint32_t size)> message_handler;
+
+  static const uint32_t HEADER_SIZE = 4;
+
+  explicit frame_reader(uint32_t max_message_size);
+
+  // Returns the message with its header in front of it
+  static std::string frame(const std::string& message);
+
+  // Processes received bytes and calls handler for every message completed by
+  // them. The message passed to the handler is only valid during the call. A
+  // message that is whole in data is passed in place, without copying it.
+  // Returns false if a header announces an empty message or one larger than
+  // the maximum size, the stream can't be read after that.
+  bool consume(const char* data, uint32_t size, const message_handler& handler);
+
+  // Number of bytes missing from the message being received, 0 if the next
+  // header is expected
+  uint32_t missing() const;
+
+  // Buffer for the missing bytes of the current message. Reading them into it
+  // directly avoids copying large messages through the receive buffer. The
+  // buffer keeps the reader alive.
+  std::shared_ptr<char> body();
+
+  // Completes the current message after all missing bytes were read into
+  // body().
+  void body_received(const message_handler& handler);
+
+ private:
+  // Messages up to this size keep their buffer for the next messages
+  static const uint32_t KEEP_BUFFER_SIZE = 1 << 20;
+
+  uint32_t max_size;
+  char header[HEADER_SIZE];
+  uint32_t header_bytes = 0;
+  // The message being received, its size is the size from the header
+  std::string message;
+  uint32_t message_bytes = 0;
+  bool reading_message = false;
+
+  void deliver(const message_handler& handler);
+};
+
+}  // namespace node
+}  // namespace core
+}  // namespace automaton
+
+#endif  // AUTOMATON_CORE_NODE_FRAME_READER_H_
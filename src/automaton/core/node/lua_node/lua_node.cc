@@ -42,11 +42,10 @@ void lua_node::init() {
   for (auto it : files) {
     lua_scripts.push_back(it.second);
   }
-  init_bindings(_proto->get_schemas(), lua_scripts, _proto->get_wire_msgs(), _proto->get_commands());
+  init_bindings(lua_scripts, _proto->get_wire_msgs(), _proto->get_commands());
 }
 
-void lua_node::init_bindings(vector<schema*> schemas,
-                         vector<string> lua_scripts,
+void lua_node::init_bindings(vector<string> lua_scripts,
                          vector<string> wire_msgs,
                          vector<string> commands) {
   engine.bind_core();
@@ -57,6 +56,19 @@ void lua_node::init_bindings(vector<schema*> schemas,
       send_message(peer_id, m, msg_id);
     });
 
+  // broadcast(msg, msg_id[, except_peer_id])
+  engine.set_function("broadcast",
+    [this](msg& m, uint32_t msg_id, sol::object except) {
+      if (except.is<uint32_t>()) {
+        peer_id except_id = except.as<uint32_t>();
+        broadcast(m, msg_id, [except_id](peer_id p) {
+          return p != except_id;
+        });
+      } else {
+        broadcast(m, msg_id);
+      }
+    });
+
   engine.set_function("log",
     [this](string logger, string msg) {
       // LOG(TRACE) << "[" << logger << "] " << msg;
@@ -157,17 +169,20 @@ void lua_node::script(const std::string& command, std::promise<std::string>* res
   });
 }
 
-void lua_node::s_on_blob_received(peer_id p_id, const string& blob) {
+void lua_node::s_on_blob_received(peer_id p_id, const char* blob, uint32_t size) {
   auto wire_id = blob[0];
   if (script_on_msg.count(wire_id) != 1) {
     LOG(FATAL) << "Invalid wire msg_id sent to us!";
     return;
   }
-  msg* m = get_wire_msg(blob).release();
+  std::shared_ptr<msg> m = get_wire_msg(blob, size);
   add_task([this, wire_id, p_id, m]() -> string {
     try {
+      // The script gets a reference of its own and can keep the message
       auto r = fresult("on_" + m->get_message_type(), script_on_msg[wire_id](p_id, m));
-      delete m;
+      if (m.use_count() > 1) {
+        held_msgs.push_back(m);
+      }
       return r;
     } catch (const std::exception& e) {
       LOG(WARNING) << e.what();
@@ -212,6 +227,19 @@ void lua_node::s_on_disconnected(peer_id p_id) {
 void lua_node::s_on_error(peer_id id, const std::string& message) {}
 
 void lua_node::s_update(uint64_t time) {
+  // Messages the script still holds after an update are kept, move them out of
+  // the wire arena so they don't keep it alive. Handler arguments that Lua
+  // hasn't collected yet hold references too, so the garbage is collected first
+  // and only the messages the script stored count.
+  if (!held_msgs.empty()) {
+    engine.collect_garbage();
+  }
+  for (auto& m : held_msgs) {
+    if (m.use_count() > 1) {
+      m->move_to_heap();
+    }
+  }
+  held_msgs.clear();
   try {
     if (script_on_update.valid()) {
       fresult("update", script_on_update(time));
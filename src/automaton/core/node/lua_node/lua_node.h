@@ -52,13 +52,16 @@ class lua_node : public node {
   std::unordered_map<std::string, sol::protected_function> script_on_cmd;
   sol::protected_function script_on_debug_html;
 
-  void init_bindings(std::vector<automaton::core::data::schema*> schemas,
-                     std::vector<std::string> lua_scripts,
+  // Received messages still referenced after their handler, checked again after
+  // a garbage collection on the next update. Guarded by script_mutex.
+  std::vector<std::shared_ptr<data::msg>> held_msgs;
+
+  void init_bindings(std::vector<std::string> lua_scripts,
                      std::vector<std::string> wire_msgs,
                      std::vector<std::string> commands);
 
   // Script handler functions
-  void s_on_blob_received(peer_id id, const std::string& blob);
+  void s_on_blob_received(peer_id id, const char* blob, uint32_t size);
   void s_on_msg_sent(peer_id c, uint32_t id, const common::status& s);
   void s_on_connected(peer_id id);
   void s_on_disconnected(peer_id id);
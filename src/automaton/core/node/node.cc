@@ -1,5 +1,6 @@
 #include "automaton/core/node/node.h"
 
+#include <algorithm>
 #include <chrono>
 #include <fstream>
 #include <iomanip>
@@ -38,10 +39,17 @@ namespace automaton {
 namespace core {
 namespace node {
 
-static const uint32_t MAX_MESSAGE_SIZE = 256;  // Maximum size of message in bytes
-static const uint32_t HEADER_SIZE = 3;
-static const uint32_t WAITING_HEADER = 1;
-static const uint32_t WAITING_MESSAGE = 2;
+static const uint32_t MAX_MESSAGE_SIZE = 64 << 20;  // Maximum size of message in bytes
+static const uint32_t RECEIVE_BUFFER_SIZE = 64 << 10;
+static const uint32_t READING_FRAMES = 1;
+static const uint32_t READING_BODY = 2;
+
+// Tasks run while holding script_mutex once
+static const uint64_t TASK_BATCH_SIZE = 64;
+
+// A wire message arena is replaced before the update if it grows beyond this.
+// A message kept by a script keeps its whole arena alive, so it is small.
+static const uint64_t WIRE_ARENA_MAX_SIZE = 64 << 10;
 
 std::unordered_map<string, std::shared_ptr<node> > node::nodes;
 
@@ -90,12 +98,11 @@ void node::remove_node(const string& id) {
     // Actions to prevent other threads (worker threads) from calling non-existent functions
     node->acceptor_->stop_accepting();
     node->acceptor_ = nullptr;
-    for (auto peer = node->known_peers.begin(); peer != node->known_peers.end(); ++peer) {
-      if (peer->second.connection != nullptr) {
-        peer->second.connection->disconnect();
+    for (auto& peer : node->peers.clear()) {
+      if (peer.connection != nullptr) {
+        peer.connection->disconnect();
       }
     }
-    node->known_peers.clear();
     nodes.erase(it);
   }
 }
@@ -117,8 +124,6 @@ void node::register_node_type(const std::string& type, factory_function func) {
 
 std::map<std::string, node::factory_function> node::node_factory;
 
-peer_info::peer_info(): id(0), address("") {}
-
 void html_escape(string *data) {
   using boost::algorithm::replace_all;
   replace_all(*data, "&",  "&amp;");
@@ -146,12 +151,22 @@ node::node(const string& id,
 node::~node() {}
 
 std::unique_ptr<msg> node::get_wire_msg(const std::string& blob) {
+  return get_wire_msg(blob.data(), static_cast<uint32_t>(blob.size()));
+}
+
+std::unique_ptr<msg> node::get_wire_msg(const char* blob, uint32_t size) {
+  CHECK_GT(size, 0U);
   auto wire_id = blob[0];
   auto msg_id = proto->get_factory_from_wire(wire_id);
   CHECK_GT(msg_id, -1);
   static std::shared_ptr<data::factory> factory = proto->get_factory();
-  std::unique_ptr<msg> m = factory->new_message_by_id(msg_id);
-  m->deserialize_message(blob.substr(1));
+  auto arena = std::atomic_load(&wire_arena);
+  if (arena == nullptr || arena->get_space_allocated() > WIRE_ARENA_MAX_SIZE) {
+    arena = factory->new_arena();
+    std::atomic_store(&wire_arena, arena);
+  }
+  std::unique_ptr<msg> m = factory->new_message_by_id(msg_id, arena);
+  m->deserialize_message(reinterpret_cast<const uint8_t*>(blob + 1), size - 1);
   return m;
 }
 
@@ -164,8 +179,19 @@ std::unique_ptr<data::msg> node::create_msg_by_id(uint32_t id, std::shared_ptr<d
 }
 
 void node::add_task(std::function<std::string()> task) {
-  std::lock_guard<std::mutex> lock(tasks_mutex);
-  tasks.push_back(task);
+  tasks.push(std::move(task));
+  auto listener = std::atomic_load(&task_listener);
+  if (listener != nullptr) {
+    (*listener)();
+  }
+}
+
+void node::set_task_listener(std::function<void()> listener) {
+  std::shared_ptr<std::function<void()>> l;
+  if (listener) {
+    l = std::make_shared<std::function<void()>>(std::move(listener));
+  }
+  std::atomic_store(&task_listener, l);
 }
 
 string node::get_id() const {
@@ -177,11 +203,11 @@ string node::get_protocol_id() const {
 }
 
 peer_info node::get_peer_info(peer_id pid) {
-  auto it = known_peers.find(pid);
-  if (it == known_peers.end()) {
-    return peer_info();
-  }
-  return it->second;
+  peer_info result;
+  peers.apply(pid, [&result](peer_info* info, bool connected) {
+    result = *info;
+  });
+  return result;
 }
 
 void node::log(const string& logger, const string& msg) {
@@ -256,6 +282,10 @@ void node::dump_logs(const string& html_file) {
   }
   log_mutex.unlock();
 
+  task_queue::metrics m = get_task_metrics();
+  f << "<p>Tasks: " << m.depth << " queued, " << m.popped << " done, wait avg "
+    << (m.popped > 0 ? m.total_wait_us / m.popped : 0) << "us max " << m.max_wait_us << "us</p>\n";
+
   f << "<hr />\n";
   f << s_debug_html();
   f << "<hr />\n";
@@ -280,32 +310,42 @@ void node::process_update(uint64_t current_time) {
   time_mutex.lock();
   time_to_update = current_time + update_time_slice;
   time_mutex.unlock();
+  // Messages received from now on go to a new arena
+  std::atomic_store(&wire_arena, std::shared_ptr<data::msg_arena>());
   script_mutex.lock();
   s_update(current_time);
   script_mutex.unlock();
-  while (true) {
-    tasks_mutex.lock();
-    if (tasks.empty()) {
-      tasks_mutex.unlock();
-      break;
-    }
-    auto task = tasks.front();
-    tasks.pop_front();
-    tasks_mutex.unlock();
-    script_mutex.lock();
-    try {
-      string result = task();
-      if (result.size() > 0) {
-        LOG(FATAL) << "TASK FAILED: " << result;
+  process_tasks();
+}
+
+void node::process_tasks() {
+  // The queue has a single consumer, but scripts can run a node while an
+  // updater does
+  lock_guard<mutex> consumer(tasks_mutex);
+  // Only the tasks queued so far are run, so a flood of messages can't keep
+  // the update going. script_mutex is released between batches to let
+  // commands in.
+  uint64_t remaining = tasks.size();
+  std::vector<task_queue::task> batch;
+  batch.reserve(TASK_BATCH_SIZE);
+  while (remaining > 0 && tasks.pop(std::min<uint64_t>(remaining, TASK_BATCH_SIZE), &batch) > 0) {
+    remaining -= batch.size();
+    lock_guard<mutex> lock(script_mutex);
+    for (auto& task : batch) {
+      try {
+        string result = task();
+        if (result.size() > 0) {
+          LOG(FATAL) << "TASK FAILED: " << result;
+        }
+      } catch (const std::exception& ex) {
+        LOG(FATAL) << "TASK FAILED: EXCEPTION1: " << ex.what();
+      } catch (string s) {
+        LOG(FATAL) << "TASK FAILED: EXCEPTION2: " << s;
+      } catch (...) {
+        LOG(FATAL) << "TASK FAILED: EXCEPTION DURING TASK EXECUTION!";
       }
-    } catch (const std::exception& ex) {
-      LOG(FATAL) << "TASK FAILED: EXCEPTION1: " << ex.what();
-    } catch (string s) {
-      LOG(FATAL) << "TASK FAILED: EXCEPTION2: " << s;
-    } catch (...) {
-      LOG(FATAL) << "TASK FAILED: EXCEPTION DURING TASK EXECUTION!";
     }
-    script_mutex.unlock();
+    batch.clear();
   }
 }
 
@@ -314,6 +354,14 @@ uint64_t node::get_time_to_update() {
   return time_to_update;
 }
 
+bool node::has_tasks() const {
+  return tasks.size() > 0;
+}
+
+task_queue::metrics node::get_task_metrics() const {
+  return tasks.get_metrics();
+}
+
 void node::send_message(peer_id p_id, const core::data::msg& msg, uint32_t msg_id) {
   auto msg_schema_id = msg.get_schema_id();
   auto wire_id = proto->get_wire_from_factory(msg_schema_id);
@@ -327,6 +375,42 @@ void node::send_message(peer_id p_id, const core::data::msg& msg, uint32_t msg_i
   }
 }
 
+uint32_t node::broadcast(const core::data::msg& msg, uint32_t msg_id, std::function<bool(peer_id)> peer_filter) {
+  auto msg_schema_id = msg.get_schema_id();
+  auto wire_id = proto->get_wire_from_factory(msg_schema_id);
+  CHECK_GT(wire_id, -1) << "Message " << msg.get_message_type() << " not part of the protocol";
+  string msg_blob;
+  if (!msg.serialize_message(&msg_blob)) {
+    LOG(WARNING) << "Could not serialize message!";
+    return 0;
+  }
+  msg_blob.insert(0, 1, static_cast<char>(wire_id));
+  return broadcast_blob(msg_blob, msg_id, std::move(peer_filter));
+}
+
+uint32_t node::broadcast_blob(const string& blob, uint32_t msg_id, std::function<bool(peer_id)> peer_filter) {
+  if (blob.size() > MAX_MESSAGE_SIZE) {
+    LOG(WARNING) << "Message size is " << blob.size() << " and is too big! Max message size is " << MAX_MESSAGE_SIZE;
+    return 0;
+  }
+  std::shared_ptr<const string> framed;
+  uint32_t sent = 0;
+  for (auto& peer : peers.list_connections()) {
+    if (peer_filter && !peer_filter(peer.first)) {
+      continue;
+    }
+    if (peer.second->get_state() != connection::state::connected) {
+      continue;
+    }
+    if (framed == nullptr) {
+      framed = std::make_shared<const string>(frame_reader::frame(blob));
+    }
+    peer.second->async_send(framed, msg_id);
+    ++sent;
+  }
+  return sent;
+}
+
 void node::send_blob(peer_id p_id, const string& blob, uint32_t msg_id) {
   // LOG(DBUG) << (acceptor_ ? acceptor_->get_address() : "N/A") <<
       // " sending message " << core::io::bin2hex(blob) << " to peer " << p_id;
@@ -336,84 +420,69 @@ void node::send_blob(peer_id p_id, const string& blob, uint32_t msg_id) {
     on_message_sent(p_id, msg_id, common::status::failed_precondition("Message size is too big!"));
     return;
   }
-  char buffer[3];
-  buffer[2] = blob_size & 0xff;
-  buffer[1] = (blob_size >> 8) & 0xff;
-  buffer[0] = (blob_size >> 16) & 0xff;
-  // TODO(kari): Find more effective way to do this
-  string new_message = string(buffer, 3) + blob;
-  // VLOG(9) << "LOCK " << this << " " << (acceptor_ ? acceptor_->get_address() : "N/A") << " peer " << p_id;
-  lock_guard<mutex> lock(peers_mutex);
-  if (connected_peers.find(p_id) == connected_peers.end()) {
+  string new_message = frame_reader::frame(blob);
+  std::shared_ptr<connection> connection_;
+  bool connected = false;
+  peers.apply(p_id, [&connection_, &connected](peer_info* info, bool c) {
+    connection_ = info->connection;
+    connected = c;
+  });
+  if (!connected) {
     LOG(WARNING) << "Peer " << p_id << " is not connected! Call connect first!";
     on_message_sent(p_id, msg_id, common::status::canceled("Peer is not connected!"));
     return;
   }
-  auto it = known_peers.find(p_id);
-  if (it == known_peers.end()) {
-    LOG(WARNING) << "Trying to send message to unknown peer " << p_id;
-    on_message_sent(p_id, msg_id, common::status::failed_precondition("Unknown peer!"));
-    return;
-  }
-  if (it->second.connection) {
-    if (it->second.connection->get_state() == connection::state::connected) {
-      it->second.connection->async_send(new_message, msg_id);
+  if (connection_) {
+    if (connection_->get_state() == connection::state::connected) {
+      connection_->async_send(std::move(new_message), msg_id);
     }
   } else {
     LOG(WARNING) << "No connection in peer " << p_id;
     on_message_sent(p_id, msg_id, common::status::not_found("Not connected!"));
   }
-  // VLOG(9) << "UNLOCK " << this << " " << (acceptor_ ? acceptor_->get_address() : "N/A") << " peer " << p_id;
 }
 
 bool node::connect(peer_id p_id) {
-// VLOG(9) << "LOCK " << this << " " << (acceptor_ ? acceptor_->get_address() : "N/A") << " peer " << p_id;
-  lock_guard<mutex> lock(peers_mutex);
-  if (connected_peers.find(p_id) != connected_peers.end()) {
+  std::shared_ptr<connection> connection_;
+  bool connected = false;
+  if (!peers.apply(p_id, [&connection_, &connected](peer_info* info, bool c) {
+    connection_ = info->connection;
+    connected = c;
+  })) {
+    LOG(WARNING) << "No such peer " << p_id;
+    return false;
+  }
+  if (connected) {
     LOG(WARNING) << "Peer " << p_id << " is already connected!";
-    VLOG(9) << "UNLOCK " << this << " " << (acceptor_ ? acceptor_->get_address() : "N/A") << " peer " << p_id;
     return false;
   }
-  auto it = known_peers.find(p_id);
-  if (it != known_peers.end()) {
-    if (it->second.connection == nullptr) {
-      LOG(WARNING) << "Connection does not exist!";
-      // VLOG(9) << "UNLOCK " << this << " " << (acceptor_ ? acceptor_->get_address() : "N/A") << " peer " << p_id;
-      return false;
-    }
-    if (it->second.connection->get_state() == connection::state::disconnected) {
-      it->second.connection->connect();
-      // VLOG(9) << "UNLOCK " << this << " " << (acceptor_ ? acceptor_->get_address() : "N/A") << " peer " << p_id;
-      return true;
-    }
-  } else {
-    LOG(WARNING) << "No such peer " << p_id;
+  if (connection_ == nullptr) {
+    LOG(WARNING) << "Connection does not exist!";
+    return false;
+  }
+  if (connection_->get_state() == connection::state::disconnected) {
+    connection_->connect();
+    return true;
   }
-  // VLOG(9) << "UNLOCK " << this << " " << (acceptor_ ? acceptor_->get_address() : "N/A") << " peer " << p_id;
   return false;
 }
 
 bool node::disconnect(peer_id p_id) {
-  // VLOG(9) << "LOCK " << this << " " << (acceptor_ ? acceptor_->get_address() : "N/A") << " peer " << p_id;
-  peers_mutex.lock();
-  auto it1 = connected_peers.find(p_id);
-  if (it1 != connected_peers.end()) {
-    auto it = known_peers.find(p_id);
-    if (it != known_peers.end()) {
-      std::shared_ptr<connection> connection = (it->second.connection);
-      // VLOG(9) << "UNLOCK " << this << " " << (acceptor_ ? acceptor_->get_address() : "N/A") << " peer " << p_id;
-      peers_mutex.unlock();
-      connection->disconnect();
-      return true;
-    } else {
-      // not in known peers
-    }
-  } else {
+  std::shared_ptr<connection> connection_;
+  bool connected = false;
+  peers.apply(p_id, [&connection_, &connected](peer_info* info, bool c) {
+    connection_ = info->connection;
+    connected = c;
+  });
+  if (!connected) {
     LOG(WARNING) << "Peer " << p_id << " is not connected!";
+    return false;
   }
-  // VLOG(9) << "UNLOCK " << this << " " << (acceptor_ ? acceptor_->get_address() : "N/A") << " peer " << p_id;
-  peers_mutex.unlock();
-  return false;
+  if (connection_ == nullptr) {
+    return false;
+  }
+  connection_->disconnect();
+  return true;
 }
 
 bool node::set_acceptor(const string& address) {
@@ -449,81 +518,58 @@ std::shared_ptr<network::acceptor> node::get_acceptor() {
 
 peer_id node::add_peer(const string& address) {
   // TODO(kari): Return 0 on error?
-  // VLOG(9) << "LOCK " << this << " " << (acceptor_ ? acceptor_->get_address() : "N/A") << " addr " << address;
-  lock_guard<mutex> lock(peers_mutex);
-  for (auto it = known_peers.begin(); it != known_peers.end(); ++it) {
-    if (it->second.address == address) {
-      LOG(WARNING) << "Already have peer " << address;
-      // VLOG(9) << "UNLOCK " << this << " " << (acceptor_ ? acceptor_->get_address() : "N/A") << " addr " << address;
-      return it->first;
+  bool added = false;
+  peer_id id = peers.add(address, [this](peer_info* info) {
+    info->id = get_next_peer_id();
+    info->connection = nullptr;
+    std::shared_ptr<connection> new_connection;
+    try {
+      string protocol, addr;
+      if (!address_parser(info->address, &protocol, &addr)) {
+        LOG(WARNING) << "Address was not parsed! " << info->address;
+      } else {
+        std::shared_ptr<node> self = shared_from_this();
+        new_connection = connection::create(protocol, info->id, addr, self);
+        if (new_connection != nullptr && !new_connection->init()) {
+          LOG(WARNING) << "Connection initialization failed! Connection was not created!";
+        }
+      }
+    } catch (std::exception& e) {
+      LOG(WARNING) << e.what();
     }
-  }
-  peer_info info;
-  info.address = address;
-  info.id = get_next_peer_id();
-  info.connection = nullptr;
-  info.buffer = std::shared_ptr<char>(new char[MAX_MESSAGE_SIZE], std::default_delete<char[]>());
-  std::shared_ptr<connection> new_connection;
-  try {
-    string protocol, addr;
-    if (!address_parser(address, &protocol, &addr)) {
-      LOG(WARNING) << "Address was not parsed! " << address;
+    if (new_connection == nullptr) {
+      LOG(WARNING) << "No new connection";
     } else {
-      std::shared_ptr<node> self = shared_from_this();
-      new_connection = connection::create(protocol, info.id, addr, self);
-      if (new_connection != nullptr && !new_connection->init()) {
-        LOG(WARNING) << "Connection initialization failed! Connection was not created!";
-      }
+      info->connection = new_connection;
     }
-  } catch (std::exception& e) {
-    LOG(WARNING) << e.what();
-  }
-  if (new_connection == nullptr) {
-    LOG(WARNING) << "No new connection";
-  } else {
-    info.connection = new_connection;
+  }, &added);
+  if (!added) {
+    LOG(WARNING) << "Already have peer " << address;
   }
-  known_peers[info.id] = std::move(info);
-  // VLOG(9) << "UNLOCK " << this << " " << (acceptor_ ? acceptor_->get_address() : "N/A") << " addr " << address;
-  return info.id;
+  return id;
 }
 
 void node::remove_peer(peer_id p_id) {
-  // VLOG(9) << "LOCK " << this << " " << (acceptor_ ? acceptor_->get_address() : "N/A") << " peer " << p_id;
-  peers_mutex.lock();
-  auto it1 = known_peers.find(p_id);
-  if (it1 != known_peers.end()) {
-    auto it2 = connected_peers.find(p_id);
-    if (it2 != connected_peers.end()) {
-      std::shared_ptr<connection> connection = (it1->second.connection);
-      // VLOG(9) << "UNLOCK " << this << " " << (acceptor_ ? acceptor_->get_address() : "N/A") << " peer " << p_id;
-      peers_mutex.unlock();
-      connection->disconnect();
-      // VLOG(9) << "LOCK " << this << " " << (acceptor_ ? acceptor_->get_address() : "N/A") << " peer " << p_id;
-      peers_mutex.lock();
-    }
-    known_peers.erase(it1);
+  std::shared_ptr<connection> connection_;
+  bool connected = false;
+  if (!peers.apply(p_id, [&connection_, &connected](peer_info* info, bool c) {
+    connection_ = info->connection;
+    connected = c;
+  })) {
+    return;
+  }
+  if (connected && connection_ != nullptr) {
+    connection_->disconnect();
   }
-  // VLOG(9) << "UNLOCK " << this << " " << (acceptor_ ? acceptor_->get_address() : "N/A") << " peer " << p_id;
-  peers_mutex.unlock();
+  peers.remove(p_id);
 }
 
 vector<peer_id> node::list_known_peers() {
-  // VLOG(9) << "LOCK " << this << " " << (acceptor_ ? acceptor_->get_address() : "N/A");
-  lock_guard<mutex> lock(peers_mutex);
-  vector<peer_id> res;
-  for (auto it = known_peers.begin(); it != known_peers.end(); ++it) {
-    res.push_back(it->first);
-  }
-  // VLOG(9) << "UNLOCK " << this << " " << (acceptor_ ? acceptor_->get_address() : "N/A");
-  return res;
+  return peers.list_known();
 }
 
 std::set<peer_id> node::list_connected_peers() {
-  // VLOG(9) << "LOCK " << this << " " << (acceptor_ ? acceptor_->get_address() : "N/A");
-  lock_guard<mutex> lock(peers_mutex);
-  // VLOG(9) << "UNLOCK " << this << " " << (acceptor_ ? acceptor_->get_address() : "N/A");
-  return connected_peers;
+  return peers.list_connected();
 }
 
 peer_id node::get_next_peer_id() {
@@ -554,69 +600,53 @@ bool node::address_parser(const string& s, string* protocol, string* address) {
 
 void node::on_message_received(peer_id c, std::shared_ptr<char> buffer, uint32_t bytes_read, uint32_t mid) {
   // LOG(DBUG) << "RECEIVED: " << core::io::bin2hex(string(buffer.get(), bytes_read)) << " from peer " << c;
+  std::shared_ptr<connection> connection_;
+  std::shared_ptr<frame_reader> reader;
+  std::shared_ptr<char> receive_buffer;
+  peers.apply(c, [&connection_, &reader, &receive_buffer](peer_info* info, bool connected) {
+    connection_ = info->connection;
+    reader = info->reader;
+    receive_buffer = info->buffer;
+  });
+  if (!connection_ || !reader || connection_->get_state() != connection::state::connected) {
+    s_on_error(c, "No such peer or peer disconnected!");
+    disconnect(c);
+    return;
+  }
+  auto handler = [this, c](const char* blob, uint32_t size) {
+    s_on_blob_received(c, blob, size);
+  };
   switch (mid) {
-    case WAITING_HEADER: {
-      if (bytes_read != HEADER_SIZE) {
-        LOG(WARNING) << "Wrong header size received";
-        s_on_error(c, "Wrong header size received");
-        disconnect(c);
-        return;
-      }
-      // TODO(kari): check if this peer still exists, the buffer could be invalid
-      // TODO(kari): make this loop
-      uint32_t message_size = 0;
-      message_size += (buffer.get()[2] & 0x000000ff);
-      message_size += ((buffer.get()[1] & 0x000000ff) << 8);
-      message_size += ((buffer.get()[0] & 0x000000ff) << 16);
-      // LOG(DBUG) << "MESSAGE SIZE: " << message_size;
-      if (!message_size || message_size > MAX_MESSAGE_SIZE) {
+    case READING_FRAMES: {
+      if (!reader->consume(buffer.get(), bytes_read, handler)) {
         LOG(WARNING) << "Invalid message size!";
         s_on_error(c, "Invalid message size!");
         disconnect(c);
         return;
-      } else {
-        // VLOG(9) << "LOCK " << this << " " << (acceptor_ ? acceptor_->get_address() : "N/A");
-        peers_mutex.lock();
-        auto it = known_peers.find(c);
-        if (it != known_peers.end() && it->second.connection && it->second.connection->get_state() ==
-            connection::state::connected) {
-          auto connection_ = it->second.connection;
-          // LOG(DBUG) << (acceptor_ ? acceptor_->get_address() : "N/A") << " waits message with size " << message_size
-          //     << " from peer " << c;
-          // VLOG(9) << "UNLOCK " << this << " " << (acceptor_ ? acceptor_->get_address() : "N/A");
-          peers_mutex.unlock();
-          connection_->async_read(buffer, MAX_MESSAGE_SIZE, message_size, WAITING_MESSAGE);
-        } else {
-        // VLOG(9) << "UNLOCK " << this << " " << (acceptor_ ? acceptor_->get_address() : "N/A");
-        peers_mutex.unlock();
-        s_on_error(c, "No such peer or peer disconnected!");
-        disconnect(c);
-        }
       }
     }
     break;
-    case WAITING_MESSAGE: {
-      string blob(buffer.get(), bytes_read);
-      // VLOG(9) << "LOCK " << this << " " << (acceptor_ ? acceptor_->get_address() : "N/A");
-      peers_mutex.lock();
-      auto it = known_peers.find(c);
-      if (it != known_peers.end() && it->second.connection && it->second.connection->get_state() ==
-          connection::state::connected) {
-        // LOG(DBUG) << (acceptor_ ? acceptor_->get_address() : "N/A") << " received message " <<
-        //     core::io::bin2hex(blob) << " from peer " << c;
-        // VLOG(9) << "UNLOCK " << this << " " << (acceptor_ ? acceptor_->get_address() : "N/A");
-        peers_mutex.unlock();
-        it->second.connection->async_read(buffer, MAX_MESSAGE_SIZE, HEADER_SIZE, WAITING_HEADER);
-        s_on_blob_received(c, blob);
-      } else {
-        // VLOG(9) << "UNLOCK " << this << " " << (acceptor_ ? acceptor_->get_address() : "N/A");
-        peers_mutex.unlock();
-        s_on_error(c, "No such peer or peer disconnected!");
+    case READING_BODY: {
+      if (bytes_read != reader->missing()) {
+        LOG(WARNING) << "Wrong message size received";
+        s_on_error(c, "Wrong message size received");
         disconnect(c);
+        return;
       }
+      reader->body_received(handler);
     }
     break;
-    default: {}
+    default: {
+      return;
+    }
+  }
+  // The rest of a large message is read straight into its buffer. Everything else goes through the receive buffer,
+  // so many small messages take a single read.
+  uint32_t missing = reader->missing();
+  if (missing > RECEIVE_BUFFER_SIZE) {
+    connection_->async_read(reader->body(), missing, missing, READING_BODY);
+  } else {
+    connection_->async_read(receive_buffer, RECEIVE_BUFFER_SIZE, 0, READING_FRAMES);
   }
 }
 
@@ -627,40 +657,32 @@ void node::on_message_sent(peer_id c, uint32_t id, const common::status& s) {
 }
 
 void node::on_connected(peer_id c) {
-  // VLOG(9) << "LOCK " << this << " " << (acceptor_ ? acceptor_->get_address() : "N/A") << " peer " << c;
-  peers_mutex.lock();
-  auto it = known_peers.find(c);
-  if (it == known_peers.end()) {
+  std::shared_ptr<connection> connection_;
+  std::shared_ptr<char> buffer;
+  if (!peers.apply(c, [&connection_, &buffer](peer_info* info, bool connected) {
+    if (!info->buffer) {
+      info->buffer = std::shared_ptr<char>(new char[RECEIVE_BUFFER_SIZE], std::default_delete<char[]>());
+    }
+    // Every connection starts a new stream
+    info->reader = std::make_shared<frame_reader>(MAX_MESSAGE_SIZE);
+    connection_ = info->connection;
+    buffer = info->buffer;
+  })) {
     LOG(WARNING) << "Connected to unknown peer " << c << " THIS SHOULD NEVER HAPPEN";
-    // VLOG(9) << "UNLOCK " << this << " " << (acceptor_ ? acceptor_->get_address() : "N/A") << " peer " << c
-        // << (it->second.address);
-    peers_mutex.unlock();
     return;
   }
   // LOG(DBUG) << "Connected to " << c;
-  connected_peers.insert(c);
-  it->second.connection->async_read(it->second.buffer, MAX_MESSAGE_SIZE, HEADER_SIZE, WAITING_HEADER);
-  // VLOG(9) << "UNLOCK " << this << " " << (acceptor_ ? acceptor_->get_address() : "N/A") << " peer " << c
-      // << (it->second.address);
-  peers_mutex.unlock();
+  peers.set_connected(c, true);
+  connection_->async_read(buffer, RECEIVE_BUFFER_SIZE, 0, READING_FRAMES);
   s_on_connected(c);
 }
 
 void node::on_disconnected(peer_id c) {
   // LOG(DBUG) << c << " -> on_disconnected";
-  // VLOG(9) << "LOCK " << this << " " << (acceptor_ ? acceptor_->get_address() : "N/A") << " peer " << c;
-  peers_mutex.lock();
-  auto it = connected_peers.find(c);
-  // If the address is not the id
-  if (it != connected_peers.end()) {
-    connected_peers.erase(it);
-    // VLOG(9) << "UNLOCK " << this << " " << (acceptor_ ? acceptor_->get_address() : "N/A") << " peer " << c;
-    peers_mutex.unlock();
+  if (peers.set_connected(c, false)) {
     s_on_disconnected(c);
   } else {
     LOG(WARNING) << "No such peer " << c;
-    // VLOG(9) << "UNLOCK " << this << " " << (acceptor_ ? acceptor_->get_address() : "N/A") << " peer " << c;
-    peers_mutex.unlock();
   }
 }
 
@@ -674,43 +696,26 @@ void node::on_connection_error(peer_id c, const common::status& s) {
 
 bool node::on_requested(acceptor_id a, const string& address, peer_id* id) {
   // LOG(DBUG) << "Requested connection to " << acceptor_->get_address() << " from " << address;
-  // VLOG(9) << "LOCK " << this << " " << (acceptor_ ? acceptor_->get_address() : "N/A") << " addr " << address;
-  lock_guard<mutex> lock(peers_mutex);
-  for (auto it = known_peers.begin(); it != known_peers.end(); ++it) {
-    if (it->second.address == address) {
-      LOG(WARNING) << "Already have peer " << address;
-      // VLOG(9) << "UNLOCK " << this << " " << (acceptor_ ? acceptor_->get_address() : "N/A") << " addr " << address;
-      return false;
-    }
+  bool added = false;
+  *id = peers.add(address, [this](peer_info* info) {
+    info->id = get_next_peer_id();
+    info->connection = nullptr;
+  }, &added);
+  if (!added) {
+    LOG(WARNING) << "Already have peer " << address;
   }
-  *id = get_next_peer_id();
-  peer_info info;
-  info.address = address;
-  info.id = *id;
-  info.connection = nullptr;
-  info.buffer = std::shared_ptr<char>(new char[MAX_MESSAGE_SIZE], std::default_delete<char[]>());
-  known_peers[*id] = std::move(info);
-  // VLOG(9) << "UNLOCK " << this << " " << (acceptor_ ? acceptor_->get_address() : "N/A") << " addr " << address;
-  return true;
+  return added;
 }
 
 void node::on_connected(acceptor_id a, std::shared_ptr<network::connection> c, const string& address) {
   peer_id id = c->get_id();
   // LOG(DBUG) << "Connected in acceptor " << acceptor_->get_address() << " peer with id " <<
   //     id << " (" << address << ')';
-  // VLOG(9) << "LOCK " << this << " " << (acceptor_ ? acceptor_->get_address() : "N/A") << " addr " << address;
-  peers_mutex.lock();
-  auto it = known_peers.find(id);
-  if (it == known_peers.end()) {
-    // VLOG(9) << "UNLOCK " << this << " " << (acceptor_ ? acceptor_->get_address() : "N/A") << " addr " << address;
-    peers_mutex.unlock();
+  if (!peers.apply(id, [&c](peer_info* info, bool connected) {
+    info->connection = c;
+  })) {
     LOG(WARNING) << "Connected to unknown peer " << id << " (" << address << ')' << " THIS SHOULD NEVER HAPPEN";
-    return;
   }
-  it->second.connection = std::shared_ptr<network::connection> (c);
-  // LOG(DBUG) << "Connected to " << address << " now " << c->get_address();
-  // VLOG(9) << "UNLOCK " << this << " " << (acceptor_ ? acceptor_->get_address() : "N/A") << " addr " << address;
-  peers_mutex.unlock();
 }
 
 void node::on_acceptor_error(acceptor_id a, const common::status& s)  {
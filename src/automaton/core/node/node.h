@@ -1,7 +1,6 @@
 #ifndef AUTOMATON_CORE_NODE_NODE_H_
 #define AUTOMATON_CORE_NODE_NODE_H_
 
-#include <deque>
 #include <functional>
 #include <future>
 #include <map>
@@ -15,22 +14,15 @@
 #include "automaton/core/data/msg.h"
 #include "automaton/core/network/acceptor.h"
 #include "automaton/core/network/connection.h"
+#include "automaton/core/node/frame_reader.h"
+#include "automaton/core/node/peer_table.h"
+#include "automaton/core/node/task_queue.h"
 #include "automaton/core/smartproto/smart_protocol.h"
 
 namespace automaton {
 namespace core {
 namespace node {
 
-typedef network::connection_id peer_id;
-
-struct peer_info {
-  peer_id id;
-  std::string address;
-  std::shared_ptr<network::connection> connection;
-  std::shared_ptr<char> buffer;
-  peer_info();
-};
-
 class node: public network::connection::connection_handler,
             public network::acceptor::acceptor_handler,
             public std::enable_shared_from_this<node> {
@@ -61,6 +53,14 @@ class node: public network::connection::connection_handler,
 
   void send_blob(peer_id id, const std::string& blob, uint32_t msg_id);
 
+  // Sends the message to every connected peer accepted by peer_filter, to all
+  // connected peers if there is no filter. The message is serialized once and
+  // all connections write it from the same buffer. Returns the number of peers
+  // it was sent to.
+  uint32_t broadcast(const data::msg& msg, uint32_t msg_id, std::function<bool(peer_id)> peer_filter = nullptr);
+
+  uint32_t broadcast_blob(const std::string& blob, uint32_t msg_id, std::function<bool(peer_id)> peer_filter = nullptr);
+
   bool connect(peer_id id);
 
   bool disconnect(peer_id id);
@@ -88,14 +88,32 @@ class node: public network::connection::connection_handler,
     return "";
   }
 
+  // Runs the script update and the queued tasks
   void process_update(uint64_t current_time);
 
+  // Runs the queued tasks only, for a node woken up before its update time.
+  // Safe to call from several threads, they take turns.
+  void process_tasks();
+
+  bool has_tasks() const;
+
   uint64_t get_time_to_update();
 
+  // The listener is called from add_task() after the task is queued, from the
+  // thread adding it, so an updater can run the node as soon as it has work.
+  // An empty function removes it.
+  void set_task_listener(std::function<void()> listener);
+
+  task_queue::metrics get_task_metrics() const;
+
  protected:
   node(const std::string& id, const std::string& proto_id);
 
   std::unique_ptr<data::msg> get_wire_msg(const std::string& blob);
+  // Parses the message in place, the first byte is its wire id. The message is
+  // created in wire_arena, one that is kept after its task should be moved out
+  // of it with msg::move_to_heap().
+  std::unique_ptr<data::msg> get_wire_msg(const char* blob, uint32_t size);
   uint32_t find_message_id(const std::string& name, std::shared_ptr<data::factory> factory);
   std::unique_ptr<data::msg> create_msg_by_id(uint32_t id, std::shared_ptr<data::factory> factory);
 
@@ -117,9 +135,7 @@ class node: public network::connection::connection_handler,
 
   // Network
   std::shared_ptr<network::acceptor> acceptor_;
-  std::mutex peers_mutex;
-  std::unordered_map<peer_id, peer_info> known_peers;
-  std::set<peer_id> connected_peers;
+  peer_table peers;
   std::mutex peer_ids_mutex;
 
   // Logging
@@ -130,8 +146,15 @@ class node: public network::connection::connection_handler,
 
   bool address_parser(const std::string& s, std::string* protocol, std::string* address);
 
+  task_queue tasks;
+  // Held while the tasks are run, so only one thread at a time pops them
   std::mutex tasks_mutex;
-  std::deque<std::function<std::string()>> tasks;
+  std::shared_ptr<std::function<void()>> task_listener;
+
+  // Arena the received messages are created in. It is replaced on every
+  // update and when it grows over 64KB, so the messages of one update are
+  // freed together once their tasks are done.
+  std::shared_ptr<data::msg_arena> wire_arena;
 
   std::shared_ptr<automaton::core::smartproto::smart_protocol> proto;
 
@@ -155,7 +178,8 @@ class node: public network::connection::connection_handler,
   void on_acceptor_error(network::acceptor_id a, const common::status& s);
 
   // Script handler functions
-  virtual void s_on_blob_received(peer_id id, const std::string& blob) {}
+  // The blob is only valid during the call, it points into the receive buffer
+  virtual void s_on_blob_received(peer_id id, const char* blob, uint32_t size) {}
   virtual void s_on_msg_sent(peer_id c, uint32_t id, const common::status& s) {}
   virtual void s_on_connected(peer_id id) {}
   virtual void s_on_disconnected(peer_id id) {}
@@ -0,0 +1,267 @@
+#include "automaton/core/node/node_scheduler.h"
+
+#include <chrono>
+#include <limits>
+
+namespace automaton {
+namespace core {
+namespace node {
+
+static const uint64_t NO_TIMER = std::numeric_limits<uint64_t>::max();
+
+static uint64_t current_time() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+node_scheduler::node_scheduler(uint32_t workers_number):
+    workers_number(workers_number > 0 ? workers_number : 1), running(false), next_home(0), next_timer(NO_TIMER),
+    ready(0), sleeping(0) {
+  for (uint32_t i = 0; i < this->workers_number; ++i) {
+    queues.push_back(std::make_unique<worker_queue>());
+  }
+}
+
+node_scheduler::~node_scheduler() {
+  stop();
+  std::lock_guard<std::mutex> lock(entries_mutex);
+  for (auto& it : entries) {
+    auto n = it.second->n.lock();
+    if (n != nullptr) {
+      n->set_task_listener(nullptr);
+    }
+  }
+}
+
+void node_scheduler::add_node(const std::string& node_id) {
+  auto n = node::get_node(node_id);
+  if (n == nullptr) {
+    return;
+  }
+  std::shared_ptr<entry> e;
+  {
+    std::lock_guard<std::mutex> lock(entries_mutex);
+    if (entries.count(node_id) > 0) {
+      return;
+    }
+    e = std::make_shared<entry>();
+    e->id = node_id;
+    e->n = n;
+    e->home = next_home++ % workers_number;
+    e->state = IDLE;
+    e->timer = 0;
+    entries[node_id] = e;
+  }
+  std::weak_ptr<node_scheduler> self = shared_from_this();
+  n->set_task_listener([self, e]() {
+    auto scheduler = self.lock();
+    if (scheduler != nullptr) {
+      scheduler->wake(e);
+    }
+  });
+  wake(e);
+}
+
+void node_scheduler::remove_node(const std::string& node_id) {
+  std::lock_guard<std::mutex> lock(entries_mutex);
+  auto it = entries.find(node_id);
+  if (it == entries.end()) {
+    return;
+  }
+  // Queued entries and timers of a removed node are dropped when reached
+  it->second->state = REMOVED;
+  auto n = it->second->n.lock();
+  if (n != nullptr) {
+    n->set_task_listener(nullptr);
+  }
+  entries.erase(it);
+}
+
+void node_scheduler::start() {
+  if (running.exchange(true)) {
+    return;
+  }
+  for (uint32_t i = 0; i < workers_number; ++i) {
+    workers.emplace_back(&node_scheduler::work, this, i);
+  }
+}
+
+void node_scheduler::stop() {
+  if (!running.exchange(false)) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(sched_mutex);
+    sched_cv.notify_all();
+  }
+  for (auto& t : workers) {
+    t.join();
+  }
+  workers.clear();
+}
+
+void node_scheduler::run_ready() {
+  fire_timers(current_time());
+  std::shared_ptr<entry> e;
+  while ((e = take(0)) != nullptr) {
+    run(0, e);
+  }
+}
+
+void node_scheduler::work(uint32_t w) {
+  while (running) {
+    uint64_t now = current_time();
+    if (now >= next_timer) {
+      fire_timers(now);
+    }
+    auto e = take(w);
+    if (e != nullptr) {
+      run(w, e);
+      continue;
+    }
+    std::unique_lock<std::mutex> lock(sched_mutex);
+    // enqueue() checks sleeping after increasing ready, so either this sees the
+    // new entry or it gets notified
+    sleeping++;
+    if (ready == 0 && running) {
+      if (timers.empty()) {
+        sched_cv.wait(lock);
+      } else {
+        sched_cv.wait_until(lock, std::chrono::system_clock::time_point(
+            std::chrono::milliseconds(timers.top().first)));
+      }
+    }
+    sleeping--;
+  }
+}
+
+void node_scheduler::wake(const std::shared_ptr<entry>& e) {
+  uint32_t s = e->state;
+  while (true) {
+    if (s == IDLE) {
+      if (e->state.compare_exchange_weak(s, QUEUED)) {
+        enqueue(e->home, e);
+        return;
+      }
+    } else if (s == RUNNING) {
+      if (e->state.compare_exchange_weak(s, WOKEN)) {
+        return;
+      }
+    } else {
+      // Already queued or removed
+      return;
+    }
+  }
+}
+
+void node_scheduler::enqueue(uint32_t w, const std::shared_ptr<entry>& e) {
+  {
+    std::lock_guard<std::mutex> lock(queues[w]->queue_mutex);
+    queues[w]->entries.push_back(e);
+  }
+  ready++;
+  notify();
+}
+
+std::shared_ptr<node_scheduler::entry> node_scheduler::take(uint32_t w) {
+  // The own queue is taken from the front, the others' from the back
+  for (uint32_t i = 0; i < workers_number; ++i) {
+    worker_queue& q = *queues[(w + i) % workers_number];
+    std::lock_guard<std::mutex> lock(q.queue_mutex);
+    if (q.entries.empty()) {
+      continue;
+    }
+    std::shared_ptr<entry> e;
+    if (i == 0) {
+      e = std::move(q.entries.front());
+      q.entries.pop_front();
+    } else {
+      e = std::move(q.entries.back());
+      q.entries.pop_back();
+    }
+    ready--;
+    return e;
+  }
+  return nullptr;
+}
+
+void node_scheduler::run(uint32_t w, const std::shared_ptr<entry>& e) {
+  uint32_t s = QUEUED;
+  if (!e->state.compare_exchange_strong(s, RUNNING)) {
+    return;
+  }
+  auto n = e->n.lock();
+  if (n == nullptr) {
+    e->state = REMOVED;
+    std::lock_guard<std::mutex> lock(entries_mutex);
+    auto it = entries.find(e->id);
+    if (it != entries.end() && it->second == e) {
+      entries.erase(it);
+    }
+    return;
+  }
+
+  uint64_t now = current_time();
+  if (now >= n->get_time_to_update()) {
+    n->process_update(now);
+  } else {
+    n->process_tasks();
+  }
+  set_timer(e, n->get_time_to_update());
+
+  s = RUNNING;
+  if (e->state.compare_exchange_strong(s, IDLE)) {
+    // process_tasks() leaves tasks added while it was running
+    if (n->has_tasks()) {
+      wake(e);
+    }
+  } else if (s == WOKEN && e->state.compare_exchange_strong(s, QUEUED)) {
+    enqueue(w, e);
+  }
+}
+
+void node_scheduler::set_timer(const std::shared_ptr<entry>& e, uint64_t time) {
+  std::lock_guard<std::mutex> lock(sched_mutex);
+  if (e->timer == time) {
+    return;
+  }
+  // A timer set before is left in the heap and skipped when it fires
+  e->timer = time;
+  timers.emplace(time, e);
+  if (time < next_timer) {
+    next_timer = time;
+    if (sleeping > 0) {
+      sched_cv.notify_one();
+    }
+  }
+}
+
+void node_scheduler::fire_timers(uint64_t now) {
+  std::vector<std::shared_ptr<entry>> due;
+  {
+    std::lock_guard<std::mutex> lock(sched_mutex);
+    while (!timers.empty() && timers.top().first <= now) {
+      const timer& t = timers.top();
+      if (t.second->timer == t.first) {
+        t.second->timer = 0;
+        due.push_back(t.second);
+      }
+      timers.pop();
+    }
+    next_timer = timers.empty() ? NO_TIMER : timers.top().first;
+  }
+  for (auto& e : due) {
+    wake(e);
+  }
+}
+
+void node_scheduler::notify() {
+  if (sleeping > 0) {
+    std::lock_guard<std::mutex> lock(sched_mutex);
+    sched_cv.notify_one();
+  }
+}
+
+}  // namespace node
+}  // namespace core
+}  // namespace automaton
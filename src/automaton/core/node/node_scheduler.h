@@ -0,0 +1,123 @@
+#ifndef AUTOMATON_CORE_NODE_NODE_SCHEDULER_H_
+#define AUTOMATON_CORE_NODE_NODE_SCHEDULER_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "automaton/core/node/node.h"
+
+namespace automaton {
+namespace core {
+namespace node {
+
+// Runs node updates on a pool of worker threads. A node is run when its update
+// time comes or when a task is added to it, so idle nodes cost nothing. Every
+// node has a home worker and a worker without work takes nodes queued for the
+// others. A node is never run by two workers at the same time.
+//
+// Must be created with std::make_shared, the nodes' task listeners hold weak
+// pointers to it.
+//
+// Update times are on the system clock. Simulations that need to be
+// reproducible run their nodes from simulation::run_until() instead.
+class node_scheduler: public std::enable_shared_from_this<node_scheduler> {
+ public:
+  explicit node_scheduler(uint32_t workers_number);
+
+  ~node_scheduler();
+
+  // The node must be launched already, otherwise it is ignored
+  void add_node(const std::string& node_id);
+
+  void remove_node(const std::string& node_id);
+
+  void start();
+
+  void stop();
+
+  // Runs the nodes that are ready on the calling thread
+  void run_ready();
+
+ private:
+  enum entry_state {
+    IDLE = 0,
+    QUEUED = 1,
+    RUNNING = 2,
+    // Woken up while running, will be queued again
+    WOKEN = 3,
+    REMOVED = 4,
+  };
+
+  struct entry {
+    std::string id;
+    std::weak_ptr<node> n;
+    uint32_t home;
+    std::atomic<uint32_t> state;
+    // Time of the timer set for the node, 0 if none. Guarded by sched_mutex.
+    uint64_t timer;
+  };
+
+  typedef std::pair<uint64_t, std::shared_ptr<entry>> timer;
+
+  struct timer_after {
+    bool operator()(const timer& a, const timer& b) const {
+      return a.first > b.first;
+    }
+  };
+
+  struct worker_queue {
+    std::mutex queue_mutex;
+    std::deque<std::shared_ptr<entry>> entries;
+  };
+
+  uint32_t workers_number;
+  std::vector<std::unique_ptr<worker_queue>> queues;
+  std::vector<std::thread> workers;
+  std::atomic<bool> running;
+
+  std::mutex entries_mutex;
+  std::unordered_map<std::string, std::shared_ptr<entry>> entries;
+  uint32_t next_home;
+
+  // Guards timers and is used by idle workers to wait
+  std::mutex sched_mutex;
+  std::condition_variable sched_cv;
+  std::priority_queue<timer, std::vector<timer>, timer_after> timers;
+  std::atomic<uint64_t> next_timer;
+  // Entries in the worker queues
+  std::atomic<int64_t> ready;
+  std::atomic<uint32_t> sleeping;
+
+  void work(uint32_t w);
+
+  void wake(const std::shared_ptr<entry>& e);
+
+  void enqueue(uint32_t w, const std::shared_ptr<entry>& e);
+
+  std::shared_ptr<entry> take(uint32_t w);
+
+  void run(uint32_t w, const std::shared_ptr<entry>& e);
+
+  void set_timer(const std::shared_ptr<entry>& e, uint64_t time);
+
+  void fire_timers(uint64_t now);
+
+  void notify();
+};
+
+}  // namespace node
+}  // namespace core
+}  // namespace automaton
+
+#endif  // AUTOMATON_CORE_NODE_NODE_SCHEDULER_H_
@@ -39,40 +39,40 @@ void node_updater::stop() {
   }
 }
 
-default_node_updater::default_node_updater(uint32_t workers_number, uint32_t sleep_time,
-    std::set<std::string> node_list):node_updater(workers_number, sleep_time, node_list) {}
+default_node_updater::default_node_updater(uint32_t workers_number, std::set<std::string> node_list):
+    node_updater(workers_number, 0, node_list),
+    scheduler(std::make_shared<node_scheduler>(workers_number)) {
+  for (auto& id : node_list) {
+    scheduler->add_node(id);
+  }
+}
+
+default_node_updater::~default_node_updater() {
+  stop();
+}
 
 void default_node_updater::update_function() {
-  for (auto nit = node_list.begin(); nit != node_list.end(); ++nit) {
-    if (!running) {
-      break;
-    }
-    std::string id = *nit;
-    map_lock.lock();
-    auto it = node_locks.find(id);
-    if (it == node_locks.end()) {
-      it = node_locks.emplace(id, std::make_unique<std::mutex>()).first;
-    }
-    bool locked = it->second->try_lock();
-    map_lock.unlock();
-    if (locked) {
-      auto node = node::get_node(id);
-      if (node != nullptr) {
-        uint64_t current_time = std::chrono::duration_cast<std::chrono::milliseconds>(
-            std::chrono::system_clock::now().time_since_epoch()).count();
-        if (current_time >= (node->get_time_to_update())) {
-          node->process_update(current_time);
-        }
-      } else {
-        remove_node(id);
-      }
-      map_lock.lock();
-      node_locks.at(id)->unlock();
-      map_lock.unlock();
-    } else {
-      continue;
-    }
-  }
+  scheduler->run_ready();
+}
+
+void default_node_updater::add_node(const std::string& node_id) {
+  node_updater::add_node(node_id);
+  scheduler->add_node(node_id);
+}
+
+void default_node_updater::remove_node(const std::string& node_id) {
+  node_updater::remove_node(node_id);
+  scheduler->remove_node(node_id);
+}
+
+void default_node_updater::start() {
+  running = true;
+  scheduler->start();
+}
+
+void default_node_updater::stop() {
+  running = false;
+  scheduler->stop();
 }
 
 node_updater_tests::node_updater_tests(uint32_t sleep_time, std::set<std::string> node_list):
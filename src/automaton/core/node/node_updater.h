@@ -8,11 +8,14 @@
 #include <vector>
 
 #include "automaton/core/node/node.h"
+#include "automaton/core/node/node_scheduler.h"
 
 namespace automaton {
 namespace core {
 namespace node {
 
+// Runs update_function() on workers_number threads, sleeping sleep_time
+// milliseconds between calls.
 class node_updater {
  public:
   node_updater(uint32_t workers_number, uint32_t sleep_time, std::set<std::string> node_list);
@@ -21,13 +24,13 @@ class node_updater {
 
   virtual void update_function() = 0;
 
-  void add_node(const std::string& node_id);
+  virtual void add_node(const std::string& node_id);
 
-  void remove_node(const std::string& node_id);
+  virtual void remove_node(const std::string& node_id);
 
-  void start();
+  virtual void start();
 
-  void stop();
+  virtual void stop();
 
  protected:
   bool running;
@@ -40,16 +43,27 @@ class node_updater {
   uint64_t sleep_time;
 };
 
+// Updates the nodes with a node_scheduler instead of polling them. A node is
+// run when its update time comes or as soon as a task is added to it, so
+// there is nothing to poll for.
 class default_node_updater : public node_updater {
  public:
-  default_node_updater(uint32_t workers_number, uint32_t sleep_time, std::set<std::string> node_list);
-  ~default_node_updater() {}
+  default_node_updater(uint32_t workers_number, std::set<std::string> node_list);
+  ~default_node_updater();
 
+  // Runs the nodes that are ready on the calling thread
   void update_function();
 
+  void add_node(const std::string& node_id);
+
+  void remove_node(const std::string& node_id);
+
+  void start();
+
+  void stop();
+
  private:
-  std::unordered_map<std::string, std::unique_ptr<std::mutex> > node_locks;
-  std::mutex map_lock;
+  std::shared_ptr<node_scheduler> scheduler;
 };
 
 class node_updater_tests : public node_updater {
@@ -0,0 +1,114 @@
+#include "automaton/core/node/peer_table.h"
+
+#include <utility>
+
+namespace automaton {
+namespace core {
+namespace node {
+
+peer_info::peer_info(): id(0), address("") {}
+
+peer_id peer_table::add(const std::string& address, const std::function<void(peer_info* info)>& init,
+    bool* added) {
+  std::lock_guard<std::mutex> lock(addresses_mutex);
+  auto it = addresses.find(address);
+  if (it != addresses.end()) {
+    *added = false;
+    return it->second;
+  }
+  peer_info info;
+  info.address = address;
+  init(&info);
+  peer_id id = info.id;
+  shard& s = shards[id % SHARDS];
+  {
+    std::lock_guard<std::mutex> shard_lock(s.shard_mutex);
+    s.peers[id] = std::move(info);
+  }
+  addresses[address] = id;
+  *added = true;
+  return id;
+}
+
+bool peer_table::remove(peer_id id) {
+  std::lock_guard<std::mutex> lock(addresses_mutex);
+  shard& s = shards[id % SHARDS];
+  std::lock_guard<std::mutex> shard_lock(s.shard_mutex);
+  auto it = s.peers.find(id);
+  if (it == s.peers.end()) {
+    return false;
+  }
+  auto a = addresses.find(it->second.address);
+  if (a != addresses.end() && a->second == id) {
+    addresses.erase(a);
+  }
+  s.peers.erase(it);
+  return true;
+}
+
+bool peer_table::set_connected(peer_id id, bool connected) {
+  shard& s = shards[id % SHARDS];
+  std::lock_guard<std::mutex> lock(s.shard_mutex);
+  if (!connected) {
+    return s.connected.erase(id) > 0;
+  }
+  if (s.connected.count(id) > 0) {
+    return true;
+  }
+  if (s.peers.count(id) > 0) {
+    s.connected.insert(id);
+  }
+  return false;
+}
+
+std::vector<peer_id> peer_table::list_known() {
+  std::vector<peer_id> result;
+  for (shard& s : shards) {
+    std::lock_guard<std::mutex> lock(s.shard_mutex);
+    for (auto& p : s.peers) {
+      result.push_back(p.first);
+    }
+  }
+  return result;
+}
+
+std::set<peer_id> peer_table::list_connected() {
+  std::set<peer_id> result;
+  for (shard& s : shards) {
+    std::lock_guard<std::mutex> lock(s.shard_mutex);
+    result.insert(s.connected.begin(), s.connected.end());
+  }
+  return result;
+}
+
+std::vector<std::pair<peer_id, std::shared_ptr<network::connection>>> peer_table::list_connections() {
+  std::vector<std::pair<peer_id, std::shared_ptr<network::connection>>> result;
+  for (shard& s : shards) {
+    std::lock_guard<std::mutex> lock(s.shard_mutex);
+    for (peer_id id : s.connected) {
+      auto it = s.peers.find(id);
+      if (it != s.peers.end() && it->second.connection != nullptr) {
+        result.emplace_back(id, it->second.connection);
+      }
+    }
+  }
+  return result;
+}
+
+std::vector<peer_info> peer_table::clear() {
+  std::vector<peer_info> result;
+  std::lock_guard<std::mutex> lock(addresses_mutex);
+  for (shard& s : shards) {
+    std::lock_guard<std::mutex> shard_lock(s.shard_mutex);
+    for (auto& p : s.peers) {
+      result.push_back(std::move(p.second));
+    }
+    s.peers.clear();
+  }
+  addresses.clear();
+  return result;
+}
+
+}  // namespace node
+}  // namespace core
+}  // namespace automaton
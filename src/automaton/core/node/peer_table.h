@@ -0,0 +1,96 @@
+#ifndef AUTOMATON_CORE_NODE_PEER_TABLE_H_
+#define AUTOMATON_CORE_NODE_PEER_TABLE_H_
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "automaton/core/network/connection.h"
+#include "automaton/core/node/frame_reader.h"
+
+namespace automaton {
+namespace core {
+namespace node {
+
+typedef network::connection_id peer_id;
+
+struct peer_info {
+  peer_id id;
+  std::string address;
+  std::shared_ptr<network::connection> connection;
+  // Receive buffer, allocated on the first connection
+  std::shared_ptr<char> buffer;
+  std::shared_ptr<frame_reader> reader;
+  peer_info();
+};
+
+// The peers of a node. Peers are split in shards by id and every shard has its
+// own lock, so handling messages from different peers doesn't serialize on one
+// lock. Only adding and removing peers takes the lock of the address index.
+//
+// A removed peer stays connected until set_connected(id, false), like its
+// connection, which reports the disconnect later.
+class peer_table {
+ public:
+  static const uint32_t SHARDS = 16;
+
+  // Calls f(peer_info* info, bool connected) under the lock of the peer's
+  // shard. f must not call back into the table. Returns false if the peer is
+  // not known.
+  template <typename F>
+  bool apply(peer_id id, F f) {
+    shard& s = shards[id % SHARDS];
+    std::lock_guard<std::mutex> lock(s.shard_mutex);
+    auto it = s.peers.find(id);
+    if (it == s.peers.end()) {
+      return false;
+    }
+    f(&it->second, s.connected.count(id) > 0);
+    return true;
+  }
+
+  // Adds a peer with the address unless one is already known. init fills in
+  // the new peer including its id and is called under the lock of the address
+  // index. Returns the id of the new or the known peer, *added tells which.
+  peer_id add(const std::string& address, const std::function<void(peer_info* info)>& init, bool* added);
+
+  bool remove(peer_id id);
+
+  // Returns true if the peer was connected before. A peer is only marked as
+  // connected if it is known.
+  bool set_connected(peer_id id, bool connected);
+
+  std::vector<peer_id> list_known();
+
+  std::set<peer_id> list_connected();
+
+  // The connections of the connected peers
+  std::vector<std::pair<peer_id, std::shared_ptr<network::connection>>> list_connections();
+
+  // Removes all peers and returns them
+  std::vector<peer_info> clear();
+
+ private:
+  struct alignas(64) shard {
+    std::mutex shard_mutex;
+    std::unordered_map<peer_id, peer_info> peers;
+    std::unordered_set<peer_id> connected;
+  };
+
+  shard shards[SHARDS];
+
+  std::mutex addresses_mutex;
+  std::unordered_map<std::string, peer_id> addresses;
+};
+
+}  // namespace node
+}  // namespace core
+}  // namespace automaton
+
+#endif  // AUTOMATON_CORE_NODE_PEER_TABLE_H_
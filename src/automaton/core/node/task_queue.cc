@@ -0,0 +1,121 @@
+#include "automaton/core/node/task_queue.h"
+
+#include <chrono>
+#include <utility>
+
+namespace automaton {
+namespace core {
+namespace node {
+
+static uint64_t now_us() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+task_queue::task_queue(): head(&stub), tail(&stub), pushed(0), popped(0), total_wait_us(0), max_wait_us(0) {
+  stub.next.store(nullptr, std::memory_order_relaxed);
+}
+
+task_queue::~task_queue() {
+  std::vector<task> rest;
+  while (pop(SIZE_MAX, &rest) > 0) {
+    rest.clear();
+  }
+}
+
+void task_queue::link(entry* e) {
+  e->next.store(nullptr, std::memory_order_relaxed);
+  entry* prev = head.exchange(e, std::memory_order_acq_rel);
+  // Between the exchange and this store the list is broken, pop_entry() sees
+  // the end of the list at prev until it is linked.
+  prev->next.store(e, std::memory_order_release);
+}
+
+void task_queue::push(task t) {
+  entry* e = new entry;
+  e->fn = std::move(t);
+  e->push_time_us = now_us();
+  pushed.fetch_add(1, std::memory_order_relaxed);
+  link(e);
+}
+
+task_queue::entry* task_queue::pop_entry() {
+  entry* first = tail;
+  entry* next = first->next.load(std::memory_order_acquire);
+  if (first == &stub) {
+    if (next == nullptr) {
+      return nullptr;
+    }
+    tail = next;
+    first = next;
+    next = next->next.load(std::memory_order_acquire);
+  }
+  if (next != nullptr) {
+    tail = next;
+    return first;
+  }
+  if (first != head.load(std::memory_order_acquire)) {
+    // A push is in progress
+    return nullptr;
+  }
+  // first is the last entry, put the stub behind it so it can be removed
+  link(&stub);
+  next = first->next.load(std::memory_order_acquire);
+  if (next != nullptr) {
+    tail = next;
+    return first;
+  }
+  return nullptr;
+}
+
+size_t task_queue::pop(size_t max_tasks, std::vector<task>* result) {
+  size_t n = 0;
+  uint64_t now = 0;
+  uint64_t wait = 0;
+  uint64_t max_wait = 0;
+  while (n < max_tasks) {
+    entry* e = pop_entry();
+    if (e == nullptr) {
+      break;
+    }
+    if (n == 0) {
+      now = now_us();
+    }
+    uint64_t w = now > e->push_time_us ? now - e->push_time_us : 0;
+    wait += w;
+    if (w > max_wait) {
+      max_wait = w;
+    }
+    result->push_back(std::move(e->fn));
+    delete e;
+    ++n;
+  }
+  if (n > 0) {
+    popped.fetch_add(n, std::memory_order_relaxed);
+    total_wait_us.fetch_add(wait, std::memory_order_relaxed);
+    if (max_wait > max_wait_us.load(std::memory_order_relaxed)) {
+      max_wait_us.store(max_wait, std::memory_order_relaxed);
+    }
+  }
+  return n;
+}
+
+uint64_t task_queue::size() const {
+  uint64_t p = popped.load(std::memory_order_relaxed);
+  uint64_t s = pushed.load(std::memory_order_relaxed);
+  return s > p ? s - p : 0;
+}
+
+task_queue::metrics task_queue::get_metrics() const {
+  metrics m;
+  m.popped = popped.load(std::memory_order_relaxed);
+  m.pushed = pushed.load(std::memory_order_relaxed);
+  m.depth = m.pushed > m.popped ? m.pushed - m.popped : 0;
+  m.total_wait_us = total_wait_us.load(std::memory_order_relaxed);
+  m.max_wait_us = max_wait_us.load(std::memory_order_relaxed);
+  return m;
+}
+
+}  // namespace node
+}  // namespace core
+}  // namespace automaton
@@ -0,0 +1,74 @@
+#ifndef AUTOMATON_CORE_NODE_TASK_QUEUE_H_
+#define AUTOMATON_CORE_NODE_TASK_QUEUE_H_
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace automaton {
+namespace core {
+namespace node {
+
+// Multi-producer single-consumer queue of node tasks. push() is lock free and
+// can be called from any thread, pop() must only be called by one thread at a
+// time. Tasks pushed by one thread are popped in the order they were pushed.
+class task_queue {
+ public:
+  typedef std::function<std::string()> task;
+
+  struct metrics {
+    // Tasks waiting in the queue
+    uint64_t depth;
+    uint64_t pushed;
+    uint64_t popped;
+    // Time the popped tasks spent in the queue
+    uint64_t total_wait_us;
+    uint64_t max_wait_us;
+  };
+
+  task_queue();
+  ~task_queue();
+
+  task_queue(const task_queue&) = delete;
+  task_queue& operator=(const task_queue&) = delete;
+
+  void push(task t);
+
+  // Appends up to max_tasks tasks to result and returns how many were added.
+  // A task whose push has not completed yet is left for the next call.
+  size_t pop(size_t max_tasks, std::vector<task>* result);
+
+  uint64_t size() const;
+
+  metrics get_metrics() const;
+
+ private:
+  struct entry {
+    std::atomic<entry*> next;
+    task fn;
+    uint64_t push_time_us;
+  };
+
+  // Producers append at head, the consumer removes from tail. stub keeps the
+  // list non-empty so producers never touch the consumer side.
+  std::atomic<entry*> head;
+  entry* tail;
+  entry stub;
+
+  std::atomic<uint64_t> pushed;
+  std::atomic<uint64_t> popped;
+  std::atomic<uint64_t> total_wait_us;
+  std::atomic<uint64_t> max_wait_us;
+
+  void link(entry* e);
+
+  entry* pop_entry();
+};
+
+}  // namespace node
+}  // namespace core
+}  // namespace automaton
+
+#endif  // AUTOMATON_CORE_NODE_TASK_QUEUE_H_
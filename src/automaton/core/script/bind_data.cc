@@ -15,88 +15,206 @@ namespace automaton {
 namespace core {
 namespace script {
 
+// Lazy view of a repeated field, returned when a script reads one. Elements are
+// read from the message when they are accessed, so getting the field, its
+// length or a single element doesn't copy the whole field into a table. The
+// view keeps a reference to the message object, like any Lua value holding it.
+// The object owns the message when it is pushed as a smart pointer, which is
+// how nodes give messages to scripts, so m lives as long as the view.
+// Indexes start from 1 like in Lua tables.
+class repeated_field {
+ public:
+  repeated_field(sol::object owner, uint32_t tag_id, schema::field_type type);
+
+  // Types that have views, others are read as nil
+  static bool is_supported(schema::field_type type);
+
+  uint32_t length() const;
+
+  // Returns nil if index is out of range
+  sol::object get(sol::this_state _L, int64_t index) const;
+
+  // Index length() + 1 adds an element
+  void set(int64_t index, sol::object value);
+
+  sol::table to_table(sol::this_state _L) const;
+
+ private:
+  sol::object owner;
+  msg* m;
+  uint32_t tag_id;
+  schema::field_type type;
+};
+
+// Looks up the field on every access, so it goes through the accessor table
+// of the message instead of get_field_tag() and get_field_info_by_tag(). The
+// name is a view of the Lua string and isn't copied.
+static void find_field(const msg& m, sol::string_view name, uint32_t* tag_id, schema::field_type* type,
+    bool* is_repeated) {
+  if (!m.find_field(name.data(), name.size(), tag_id, type, is_repeated)) {
+    std::stringstream ss;
+    ss << "No field with name: " << name;
+    LOG(WARNING) << ss.str();
+    throw std::invalid_argument(ss.str());
+  }
+}
+
+repeated_field::repeated_field(sol::object owner, uint32_t tag_id, schema::field_type type):
+    owner(owner), m(&owner.as<msg&>()), tag_id(tag_id), type(type) {}
+
+bool repeated_field::is_supported(schema::field_type type) {
+  switch (type) {
+    case schema::int32:
+    case schema::int64:
+    case schema::uint32:
+    case schema::uint64:
+    case schema::blob:
+    case schema::message_type:
+      return true;
+    default:
+      return false;
+  }
+}
+
+uint32_t repeated_field::length() const {
+  return m->get_repeated_field_size(tag_id);
+}
+
+sol::object repeated_field::get(sol::this_state _L, int64_t index) const {
+  if (index < 1 || index > length()) {
+    return sol::make_object(_L, sol::lua_nil);
+  }
+  int32_t i = static_cast<int32_t>(index - 1);
+  switch (type) {
+    case schema::int32:
+      return sol::make_object(_L, m->get_repeated_int32(tag_id, i));
+    case schema::int64:
+      return sol::make_object(_L, m->get_repeated_int64(tag_id, i));
+    case schema::uint32:
+      return sol::make_object(_L, m->get_repeated_uint32(tag_id, i));
+    case schema::uint64:
+      return sol::make_object(_L, m->get_repeated_uint64(tag_id, i));
+    case schema::blob:
+      return sol::make_object(_L, m->get_repeated_blob(tag_id, i));
+    case schema::message_type:
+      return sol::make_object(_L, m->get_repeated_message(tag_id, i));
+    default:
+      return sol::make_object(_L, sol::lua_nil);
+  }
+}
+
+void repeated_field::set(int64_t index, sol::object value) {
+  if (index < 1 || index > length() + 1) {
+    std::stringstream ss;
+    ss << "Index out of range: " << index;
+    LOG(WARNING) << ss.str();
+    throw std::out_of_range(ss.str());
+  }
+  // Setting one past the end adds an element
+  int32_t i = static_cast<int32_t>(index - 1);
+  switch (type) {
+    case schema::int32:
+      m->set_repeated_int32(tag_id, value.as<int32_t>(), i);
+      break;
+    case schema::int64:
+      m->set_repeated_int64(tag_id, value.as<int64_t>(), i);
+      break;
+    case schema::uint32:
+      m->set_repeated_uint32(tag_id, value.as<uint32_t>(), i);
+      break;
+    case schema::uint64:
+      m->set_repeated_uint64(tag_id, value.as<uint64_t>(), i);
+      break;
+    case schema::blob:
+      m->set_repeated_blob(tag_id, value.as<std::string>(), i);
+      break;
+    case schema::message_type:
+      m->set_repeated_message(tag_id, value.as<msg&>(), i);
+      break;
+    default:
+      break;
+  }
+}
+
+sol::table repeated_field::to_table(sol::this_state _L) const {
+  sol::state_view lua(_L);
+  uint32_t n = length();
+  sol::table result = lua.create_table(n, 0);
+  for (uint32_t i = 1; i <= n; ++i) {
+    result.add(get(_L, i));
+  }
+  return result;
+}
+
 void engine::bind_data() {
+  auto field_type = new_usertype<repeated_field>("repeated_field", sol::no_constructor);
+
+  field_type.set(sol::meta_function::length, &repeated_field::length);
+
+  // Fallback for keys that are not methods, only numbers are elements
+  field_type.set(sol::meta_function::index,
+    [](sol::this_state _L, const repeated_field& f, sol::object key) -> sol::object {
+      if (key.get_type() != sol::type::number) {
+        return sol::make_object(_L, sol::lua_nil);
+      }
+      return f.get(_L, key.as<int64_t>());
+    });
+
+  field_type.set(sol::meta_function::new_index,
+    [](repeated_field& f, int64_t index, sol::object value) {
+      f.set(index, value);
+    });
+
+  // pairs() goes over the elements in order, like ipairs()
+  field_type.set(sol::meta_function::pairs,
+    [](sol::this_state _L, sol::object self) {
+      auto next = [](sol::this_state _L, const repeated_field& f, sol::object key)
+          -> std::tuple<sol::object, sol::object> {
+        int64_t index = key.get_type() == sol::type::number ? key.as<int64_t>() + 1 : 1;
+        if (index > f.length()) {
+          return std::make_tuple(sol::make_object(_L, sol::lua_nil), sol::make_object(_L, sol::lua_nil));
+        }
+        return std::make_tuple(sol::make_object(_L, index), f.get(_L, index));
+      };
+      return std::make_tuple(next, self, sol::lua_nil);
+    });
+
+  field_type.set("to_table", &repeated_field::to_table);
+
   auto msg_type = new_usertype<msg>("msg");
 
   msg_type.set(sol::meta_function::index,
-    [this](sol::this_state _L, msg& m, std::string key) -> sol::object {
+    [](sol::this_state _L, sol::object self, sol::string_view key) -> sol::object {
       VLOG(9) << "Getting key: " << key;
-      sol::state_view lua(_L);
-      auto tag_id = m.get_field_tag(key);
-      auto fi = m.get_field_info_by_tag(tag_id);
-      auto ftype = fi.type;
+      msg& m = self.as<msg&>();
+      uint32_t tag_id;
+      schema::field_type ftype;
+      bool is_repeated;
+      find_field(m, key, &tag_id, &ftype, &is_repeated);
+      if (is_repeated) {
+        if (!repeated_field::is_supported(ftype)) {
+          return sol::make_object(_L, sol::lua_nil);
+        }
+        return sol::make_object(_L, repeated_field(self, tag_id, ftype));
+      }
       switch (ftype) {
         case schema::int32: {
-          if (fi.is_repeated) {
-            auto n = m.get_repeated_field_size(tag_id);
-            sol::table result = create_table();
-            for (uint32_t i = 0; i < n; i++) {
-              result.add(m.get_repeated_int32(tag_id, i));
-            }
-            return sol::make_object(_L, result);
-          } else {
-            return sol::make_object(_L, m.get_int32(tag_id));
-          }
+          return sol::make_object(_L, m.get_int32(tag_id));
         }
         case schema::int64: {
-          if (fi.is_repeated) {
-            auto n = m.get_repeated_field_size(tag_id);
-            sol::table result = create_table();
-            for (uint32_t i = 0; i < n; i++) {
-              result.add(m.get_repeated_int64(tag_id, i));
-            }
-            return sol::make_object(_L, result);
-          } else {
-            return sol::make_object(_L, m.get_int64(tag_id));
-          }
+          return sol::make_object(_L, m.get_int64(tag_id));
         }
         case schema::uint32: {
-          if (fi.is_repeated) {
-            auto n = m.get_repeated_field_size(tag_id);
-            sol::table result = create_table();
-            for (uint32_t i = 0; i < n; i++) {
-              result.add(m.get_repeated_uint32(tag_id, i));
-            }
-            return sol::make_object(_L, result);
-          } else {
-            return sol::make_object(_L, m.get_uint32(tag_id));
-          }
+          return sol::make_object(_L, m.get_uint32(tag_id));
         }
         case schema::uint64: {
-          if (fi.is_repeated) {
-            auto n = m.get_repeated_field_size(tag_id);
-            sol::table result = create_table();
-            for (uint32_t i = 0; i < n; i++) {
-              result.add(m.get_repeated_uint64(tag_id, i));
-            }
-            return result;
-          } else {
-            return sol::make_object(_L, m.get_uint64(tag_id));
-          }
+          return sol::make_object(_L, m.get_uint64(tag_id));
         }
         case schema::blob: {
-          if (fi.is_repeated) {
-            auto n = m.get_repeated_field_size(tag_id);
-            sol::table result = create_table();
-            for (uint32_t i = 0; i < n; i++) {
-              result.add(m.get_repeated_blob(tag_id, i));
-            }
-            return sol::make_object(_L, result);
-          } else {
-            return sol::make_object(_L, m.get_blob(tag_id));
-          }
+          return sol::make_object(_L, m.get_blob(tag_id));
         }
         case schema::message_type: {
-          if (fi.is_repeated) {
-            auto n = m.get_repeated_field_size(tag_id);
-            sol::table result = create_table();
-            for (uint32_t i = 0; i < n; i++) {
-              result.add(m.get_repeated_message(tag_id, i));
-            }
-            return sol::make_object(_L, result);
-          } else {
-            return sol::make_object(_L, m.get_message(tag_id));
-          }
+          return sol::make_object(_L, m.get_message(tag_id));
         }
         default: {
           return sol::make_object(_L, sol::lua_nil);
@@ -106,15 +224,16 @@ void engine::bind_data() {
     });
 
   msg_type.set(sol::meta_function::new_index,
-    [](sol::this_state _L, msg& m, std::string key, sol::object value) {
+    [](sol::this_state _L, msg& m, sol::string_view key, sol::object value) {
       VLOG(9) << "Setting key:" << key << " value: " << value.as<std::string>();
-      auto tag_id = m.get_field_tag(key);
-      auto fi = m.get_field_info_by_tag(tag_id);
-      auto ftype = fi.type;
+      uint32_t tag_id;
+      schema::field_type ftype;
+      bool is_repeated;
+      find_field(m, key, &tag_id, &ftype, &is_repeated);
       switch (ftype) {
         case schema::int32: {
           int n = value.as<int>();
-          if (fi.is_repeated) {
+          if (is_repeated) {
             m.set_repeated_int32(tag_id, n, -1);
           } else {
             m.set_int32(tag_id, n);
@@ -123,7 +242,7 @@ void engine::bind_data() {
         }
         case schema::int64: {
           auto n = value.as<int64_t>();
-          if (fi.is_repeated) {
+          if (is_repeated) {
             m.set_repeated_int64(tag_id, n, -1);
           } else {
             m.set_int64(tag_id, n);
@@ -132,7 +251,7 @@ void engine::bind_data() {
         }
         case schema::uint32: {
           auto n = value.as<uint32_t>();
-          if (fi.is_repeated) {
+          if (is_repeated) {
             m.set_repeated_uint32(tag_id, n, -1);
           } else {
             m.set_uint32(tag_id, n);
@@ -141,7 +260,7 @@ void engine::bind_data() {
         }
         case schema::uint64: {
           auto n = value.as<uint64_t>();
-          if (fi.is_repeated) {
+          if (is_repeated) {
             m.set_repeated_uint64(tag_id, n, -1);
           } else {
             m.set_uint64(tag_id, n);
@@ -151,7 +270,7 @@ void engine::bind_data() {
         case schema::blob: {
           // TOD(asen): Check whether string_view is faster.
           auto blob = value.as<std::string>();
-          if (fi.is_repeated) {
+          if (is_repeated) {
             m.set_repeated_blob(tag_id, blob, -1);
           } else {
             m.set_blob(tag_id, blob);
@@ -160,7 +279,7 @@ void engine::bind_data() {
         }
         case schema::message_type: {
           auto message = value.as<msg*>();
-          if (fi.is_repeated) {
+          if (is_repeated) {
             m.set_repeated_message(tag_id, *message, -1);
           } else {
             m.set_message(tag_id, *message);
@@ -219,7 +338,9 @@ void engine::bind_data() {
       return s;
     });
 
-  msg_type.set("deserialize", &msg::deserialize_message);
+  msg_type.set("deserialize", [](msg& m, const std::string& s) {
+      return m.deserialize_message(s);
+    });
 
   msg_type.set("to_json", [](msg& m) {
       std::string json;
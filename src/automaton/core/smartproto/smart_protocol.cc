@@ -4,12 +4,15 @@
 #include <string>
 #include <utility>
 
+#include <boost/filesystem.hpp>
 #include <json.hpp>
 
+#include "automaton/core/crypto/cryptopp/SHA256_cryptopp.h"
 #include "automaton/core/data/protobuf/protobuf_factory.h"
 #include "automaton/core/data/protobuf/protobuf_schema.h"
 #include "automaton/core/io/io.h"
 
+using automaton::core::crypto::cryptopp::SHA256_cryptopp;
 using automaton::core::data::protobuf::protobuf_schema;
 using automaton::core::data::protobuf::protobuf_factory;
 using automaton::core::data::schema;
@@ -20,9 +23,14 @@ namespace core {
 namespace smartproto {
 
 std::unordered_map<std::string, std::shared_ptr<smart_protocol> > smart_protocol::protocols;
+std::unordered_map<std::string, std::weak_ptr<data::factory>> smart_protocol::factories;
+std::mutex smart_protocol::factories_mutex;
 
-smart_protocol::smart_protocol() {
-  factory = std::shared_ptr<data::factory>(new protobuf_factory());
+smart_protocol::smart_protocol() {}
+
+static std::string& schema_cache_dir() {
+  static std::string dir;
+  return dir;
 }
 
 smart_protocol::~smart_protocol() {
@@ -63,7 +71,8 @@ bool smart_protocol::load(const std::string& id, const std::string& path) {
     i >> j;
     i.close();
     proto->update_time_slice = j["update_time_slice"];
-    std::vector<std::string> schemas_filenames = j["schemas"];
+    std::vector<std::string> filenames_list = j["schemas"];
+    proto->schemas_filenames = filenames_list;
     nlohmann::json filenames = j["files"];
     std::vector<std::string> wm = j["wire_msgs"];
     proto->wire_msgs = wm;
@@ -71,12 +80,10 @@ bool smart_protocol::load(const std::string& id, const std::string& path) {
       proto->commands.push_back({cmd[0], cmd[1], cmd[2]});
     }
 
-    for (uint32_t z = 0; z < schemas_filenames.size(); ++z) {
-      std::string file_content = get_file_contents((path + schemas_filenames[z]).c_str());
-      proto->msgs_defs[schemas_filenames[z]] = file_content;
-      proto->schemas.push_back(new protobuf_schema(file_content));
-      proto->factory->import_schema(proto->schemas.back(), "", "");
+    for (auto& schema_filename : proto->schemas_filenames) {
+      proto->msgs_defs[schema_filename] = get_file_contents((path + schema_filename).c_str());
     }
+    proto->init_factory();
 
     for (nlohmann::json::iterator it = filenames.begin(); it != filenames.end(); ++it) {
       std::unordered_map<std::string, std::string> extracted_files;
@@ -99,6 +106,82 @@ bool smart_protocol::load(const std::string& id, const std::string& path) {
   return true;
 }
 
+void smart_protocol::set_schema_cache_dir(const std::string& dir) {
+  std::lock_guard<std::mutex> lock(factories_mutex);
+  schema_cache_dir() = dir;
+  if (!dir.empty() && dir.back() != '/') {
+    schema_cache_dir() += '/';
+  }
+}
+
+void smart_protocol::init_factory() {
+  // The files are hashed in order with their sizes, later files can depend on
+  // earlier ones
+  SHA256_cryptopp hasher;
+  for (auto& schema_filename : schemas_filenames) {
+    const std::string& content = msgs_defs[schema_filename];
+    uint64_t size = content.size();
+    hasher.update(reinterpret_cast<const uint8_t*>(&size), sizeof(size));
+    hasher.update(reinterpret_cast<const uint8_t*>(content.data()), content.size());
+  }
+  std::string digest(hasher.digest_size(), '\0');
+  hasher.final(reinterpret_cast<uint8_t*>(&digest[0]));
+  std::string key = io::bin2hex(digest);
+
+  // Held until the factory is added, so loads of the same schemas build it once
+  std::lock_guard<std::mutex> factories_lock(factories_mutex);
+  auto it = factories.find(key);
+  if (it != factories.end()) {
+    factory = it->second.lock();
+    if (factory != nullptr) {
+      return;
+    }
+  }
+
+  std::shared_ptr<protobuf_factory> pb_factory(new protobuf_factory());
+  const std::string& cache_dir = schema_cache_dir();
+  std::string cache_path = cache_dir.empty() ? "" : cache_dir + key + ".fds";
+  bool cached = false;
+  if (!cache_path.empty()) {
+    std::ifstream cache_file(cache_path, std::ios::binary);
+    if (cache_file.is_open()) {
+      std::string cache(std::istreambuf_iterator<char>(cache_file), {});
+      try {
+        pb_factory->import_file_descriptor_set(cache);
+        cached = true;
+      } catch (const std::exception& e) {
+        LOG(WARNING) << "Invalid schema cache " << cache_path << ": " << e.what();
+        pb_factory.reset(new protobuf_factory());
+      }
+    }
+  }
+  if (!cached) {
+    std::lock_guard<std::mutex> lock(schemas_mutex);
+    for (auto& schema_filename : schemas_filenames) {
+      schemas.push_back(new protobuf_schema(msgs_defs[schema_filename]));
+      pb_factory->import_schema(schemas.back(), "", "");
+    }
+    if (!cache_path.empty()) {
+      std::string fds;
+      pb_factory->export_file_descriptor_set(&fds);
+      boost::system::error_code ec;
+      boost::filesystem::create_directories(cache_dir, ec);
+      std::string tmp_path = cache_path + ".tmp";
+      std::ofstream cache_file(tmp_path, std::ios::binary | std::ios::trunc);
+      if (cache_file.is_open() && cache_file.write(fds.data(), fds.size())) {
+        cache_file.close();
+        // Renamed into place, so a reader never sees a partial file
+        boost::filesystem::rename(tmp_path, cache_path, ec);
+      }
+      if (!cache_file || ec) {
+        LOG(WARNING) << "Could not write schema cache " << cache_path;
+      }
+    }
+  }
+  factory = pb_factory;
+  factories[key] = factory;
+}
+
 std::shared_ptr<data::factory> smart_protocol::get_factory() {
   return factory;
 }
@@ -108,6 +191,12 @@ std::unordered_map<std::string, std::string> smart_protocol::get_msgs_definition
 }
 
 std::vector<data::schema*> smart_protocol::get_schemas() {
+  std::lock_guard<std::mutex> lock(schemas_mutex);
+  if (schemas.empty()) {
+    for (auto& schema_filename : schemas_filenames) {
+      schemas.push_back(new protobuf_schema(msgs_defs[schema_filename]));
+    }
+  }
   return schemas;
 }
 
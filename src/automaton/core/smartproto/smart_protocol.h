@@ -2,6 +2,7 @@
 #define AUTOMATON_CORE_SMARTPROTO_SMART_PROTOCOL_H_
 
 #include <memory>
+#include <mutex>
 #include <string>
 #include <unordered_map>
 #include <vector>
@@ -29,10 +30,19 @@ class smart_protocol {
 
   static bool load(const std::string& id, const std::string& path);
 
+  /**
+    Directory for compiled schemas. When it is set, load() saves the schemas of
+    a protocol there as a FileDescriptorSet named after the hash of the schema
+    files, and later loads of the same schemas import it instead of parsing
+    the .proto files. Empty (the default) turns the cache off.
+  */
+  static void set_schema_cache_dir(const std::string& dir);
+
   ~smart_protocol();
 
   std::shared_ptr<data::factory> get_factory();
   std::unordered_map<std::string, std::string> get_msgs_definitions();
+  // Parsed on the first call, the factory doesn't need them
   std::vector<data::schema*> get_schemas();
   std::unordered_map<std::string, std::string> get_files(std::string files_type);
   std::vector<std::string> get_wire_msgs();
@@ -46,6 +56,12 @@ class smart_protocol {
  private:
   smart_protocol();
   static std::unordered_map<std::string, std::shared_ptr<smart_protocol>> protocols;
+  // Factories by schemas hash. Protocols with the same schemas share a factory,
+  // which is only read after the import.
+  static std::unordered_map<std::string, std::weak_ptr<data::factory>> factories;
+  // Guards factories and the schema cache directory
+  static std::mutex factories_mutex;
+
   std::string id;
   std::shared_ptr<data::factory> factory;
   uint32_t update_time_slice;
@@ -53,13 +69,18 @@ class smart_protocol {
   // files_type -> [file_name -> file]
   std::unordered_map<std::string, std::unordered_map<std::string, std::string> > files;
   std::unordered_map<std::string, std::string> msgs_defs;
+  std::vector<std::string> schemas_filenames;
   std::vector<data::schema*> schemas;
+  std::mutex schemas_mutex;
   std::vector<std::string> wire_msgs;
   std::vector<cmd> commands;
   std::string config_json;
 
   std::unordered_map<int32_t, int32_t> wire_to_factory;
   std::unordered_map<int32_t, int32_t> factory_to_wire;
+
+  // Creates or finds the factory with the schemas, in schemas_filenames order
+  void init_factory();
 };
 
 }  // namespace smartproto
@@ -0,0 +1,73 @@
+#include "automaton/core/state/hash_workers.h"
+
+#include <utility>
+
+namespace automaton {
+namespace core {
+namespace state {
+
+hash_workers::hash_workers(subtrie_hasher subtrie_task,
+    const std::vector<crypto::hash_transformation*>& hashers):
+    hash_subtrie(std::move(subtrie_task)), next_subtrie(0) {
+  for (crypto::hash_transformation* h : hashers) {
+    threads.emplace_back(&hash_workers::worker_loop, this, h);
+  }
+}
+
+hash_workers::~hash_workers() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  start_cv.notify_all();
+  for (auto& t : threads) {
+    t.join();
+  }
+}
+
+void hash_workers::run(const std::vector<uint32_t>& subtries,
+    crypto::hash_transformation* h) {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    work = &subtries;
+    next_subtrie = 0;
+    running = threads_count();
+    ++generation;
+  }
+  start_cv.notify_all();
+  take_work(h);
+  std::unique_lock<std::mutex> lock(mutex);
+  done_cv.wait(lock, [this]() { return running == 0; });
+  work = nullptr;
+}
+
+void hash_workers::worker_loop(crypto::hash_transformation* h) {
+  uint64_t seen_generation = 0;
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      start_cv.wait(lock, [this, seen_generation]() {
+        return stopping || generation != seen_generation;
+      });
+      if (stopping) {
+        return;
+      }
+      seen_generation = generation;
+    }
+    take_work(h);
+    std::lock_guard<std::mutex> lock(mutex);
+    if (--running == 0) {
+      done_cv.notify_one();
+    }
+  }
+}
+
+void hash_workers::take_work(crypto::hash_transformation* h) {
+  for (size_t i = next_subtrie++; i < work->size(); i = next_subtrie++) {
+    hash_subtrie((*work)[i], h);
+  }
+}
+
+}  // namespace state
+}  // namespace core
+}  // namespace automaton
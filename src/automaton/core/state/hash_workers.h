@@ -0,0 +1,110 @@
+#ifndef AUTOMATON_CORE_STATE_HASH_WORKERS_H_
+#define AUTOMATON_CORE_STATE_HASH_WORKERS_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "automaton/core/crypto/hash_transformation.h"
+
+namespace automaton {
+namespace core {
+namespace state {
+
+// Threads that rehash independent dirty subtries of a state trie. Starts one
+// thread per given hasher, which are reused by every run() and stopped when
+// the workers are destroyed. Ownership of the hashers is not taken.
+class hash_workers {
+ public:
+  // Rehashes the dirty nodes in the subtrie of the given node using the given
+  // hasher. Called from several threads at once for different subtries.
+  typedef std::function<void(uint32_t, crypto::hash_transformation*)>
+      subtrie_hasher;
+
+  // Below this many changed nodes rehashing is not worth waking the workers
+  // for.
+  static const uint32_t PARALLEL_HASHING_THRESHOLD = 4096;
+
+  // The dirty part of the trie is split into at least this many subtries per
+  // thread, so threads that finish early can take more work.
+  static const uint32_t SUBTRIES_PER_THREAD = 4;
+
+  hash_workers(subtrie_hasher subtrie_task,
+      const std::vector<crypto::hash_transformation*>& hashers);
+  ~hash_workers();
+
+  uint32_t threads_count() const {
+    return static_cast<uint32_t>(threads.size());
+  }
+
+  // Splits the dirty part of the trie below the root into subtries for the
+  // workers. for_each_dirty_child(node, f) has to call f with each dirty child
+  // of node. Returns the nodes above the subtries, which have to be rehashed
+  // deepest first after them.
+  template<typename for_each_dirty_child>
+  std::vector<uint32_t> split(for_each_dirty_child children,
+      std::vector<uint32_t>* subtries) const;
+
+  // Rehashes the given subtries on the workers and the calling thread, which
+  // uses the given hasher. Returns when all of them are done.
+  void run(const std::vector<uint32_t>& subtries,
+      crypto::hash_transformation* h);
+
+ private:
+  subtrie_hasher hash_subtrie;
+  std::vector<std::thread> threads;
+  std::mutex mutex;
+  std::condition_variable start_cv;
+  std::condition_variable done_cv;
+  // Set by run() and read by the workers after they are woken up
+  const std::vector<uint32_t>* work = nullptr;
+  std::atomic<size_t> next_subtrie;
+  uint64_t generation = 0;
+  uint32_t running = 0;
+  bool stopping = false;
+
+  void worker_loop(crypto::hash_transformation* h);
+  void take_work(crypto::hash_transformation* h);
+};
+
+template<typename for_each_dirty_child>
+std::vector<uint32_t> hash_workers::split(for_each_dirty_child children,
+    std::vector<uint32_t>* subtries) const {
+  // Dirty subtries of different nodes are independent. Split the dirty part
+  // of the trie level by level until there are enough of them to keep the
+  // threads busy, even if the root has few children.
+  const size_t target = (threads_count() + 1) * SUBTRIES_PER_THREAD;
+  std::vector<uint32_t> above;
+  subtries->assign(1, 0);
+  while (subtries->size() < target) {
+    std::vector<uint32_t> next_level;
+    bool deeper = false;
+    for (uint32_t cur_node : *subtries) {
+      size_t before = next_level.size();
+      children(cur_node, [&next_level](uint32_t child) {
+        next_level.push_back(child);
+      });
+      if (next_level.size() > before) {
+        above.push_back(cur_node);
+        deeper = true;
+      } else {
+        next_level.push_back(cur_node);
+      }
+    }
+    if (!deeper) {
+      break;
+    }
+    subtries->swap(next_level);
+  }
+  return above;
+}
+
+}  // namespace state
+}  // namespace core
+}  // namespace automaton
+
+#endif  // AUTOMATON_CORE_STATE_HASH_WORKERS_H_
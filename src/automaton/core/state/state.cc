@@ -1 +1,26 @@
 #include "automaton/core/state/state.h"
+
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace automaton {
+namespace core {
+namespace state {
+
+void state::apply_batch(
+    const std::vector<std::pair<std::string, std::string> >& entries) {
+  for (size_t i = 1; i < entries.size(); ++i) {
+    if (!(entries[i - 1].first < entries[i].first)) {
+      throw std::invalid_argument("Batch keys are not unique and sorted");
+    }
+  }
+  for (const auto& entry : entries) {
+    set(entry.first, entry.second);
+  }
+}
+
+}  // namespace state
+}  // namespace core
+}  // namespace automaton
@@ -2,6 +2,7 @@
 #define AUTOMATON_CORE_STATE_STATE_H_
 
 #include <string>
+#include <utility>
 #include <vector>
 
 namespace automaton {
@@ -17,10 +18,20 @@ class state {
   // Set the value at a given path
   virtual void set(const std::string& key, const std::string& value) = 0;
 
+  // Set the values of a batch of keys. Keys have to be unique and sorted in
+  // ascending byte order, an empty value erases the key like in set().
+  // Throws std::invalid_argument if the keys are not sorted.
+  virtual void apply_batch(
+      const std::vector<std::pair<std::string, std::string> >& entries);
+
   // Get the hash of a node at the given path. Empty std::string if no value is
   // set or there is no node at the given path
   virtual std::string get_node_hash(const std::string& path) = 0;
 
+  // Get the hash of the root node. Implementations may defer rehashing of
+  // changed nodes until a hash is requested or changes are committed.
+  virtual std::string root_hash() = 0;
+
   // Get the children as chars
   virtual std::vector<std::string> get_node_children(
       const std::string& path) = 0;
@@ -1,10 +1,18 @@
 #include "automaton/core/state/state_impl.h"
 
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define AUTOMATON_STATE_USE_SSE2
+#endif
+
 #include <algorithm>
+#include <cstring>
+#include <functional>
 #include <iomanip>
 #include <map>
 #include <set>
 #include <sstream>
+#include <stdexcept>
 #include <string>
 #include <utility>
 #include <vector>
@@ -20,17 +28,26 @@ namespace state {
 typedef std::basic_string<uint8_t> ustring;
 
 state_impl::state_impl(crypto::hash_transformation* hasher) {
+  if (hasher->digest_size() > MAX_HASH_SIZE) {
+    throw std::invalid_argument("Hash digest size is larger than " +
+        std::to_string(MAX_HASH_SIZE) + " bytes");
+  }
   nodes.push_back(state_impl::node());
   this->hasher = hasher;
+  digest_size = hasher->digest_size();
+  dirty_count = 0;
   nodes_current_state = 1;
-  calculate_hash(0);
+  calculate_hash(0, hasher);
   permanent_nodes_count = 1;
 }
 
+state_impl::~state_impl() {}
+
 std::string state_impl::get(const std::string& key) {
-  int32_t node_index = get_node_index(key);
+  const node_store& store = nodes;
+  int32_t node_index = find_node(store, key);
   //  std::cout << "index at key\"" << key << "\": " << node_index << std::endl;
-  return node_index == -1 ? "" : nodes[node_index].value;
+  return node_index == -1 ? "" : store[node_index].value;
 }
 void state_impl::set(const std::string& key, const std::string& value) {
   if (value == "") {
@@ -44,9 +61,9 @@ void state_impl::set(const std::string& key, const std::string& value) {
     uint8_t path_element = key[i];
     if (cur_prefix_index == nodes[cur_node].prefix.length()) {
       // If there is no prefix or there is prefix but we have reached the end
-      if (nodes[cur_node].children[path_element] != 0) {
+      if (nodes[cur_node].children.get(path_element) != 0) {
         // If there is child with the next path element continue on the path
-        cur_node = nodes[cur_node].children[path_element];
+        cur_node = nodes[cur_node].children.get(path_element);
       } else if (has_children(cur_node) ||
           nodes[cur_node].value != "" || cur_node == 0) {
         // This node has children, value set or is the root.
@@ -78,14 +95,14 @@ void state_impl::set(const std::string& key, const std::string& value) {
         // Set the current node as child of the new split node
         uint8_t path_to_child =
             (uint8_t)cur_node_prefix[cur_prefix_index];
-        nodes[split_node].children[path_to_child] = cur_node;
+        nodes[split_node].children.set(path_to_child, cur_node);
 
         // set prefix of split_node and cur_node
         nodes[split_node].prefix = cur_node_prefix.substr(0, cur_prefix_index);
         nodes[cur_node].prefix = cur_node_prefix.substr(cur_prefix_index);
 
-        // Recalculate the hash of the child part of the node that got split
-        calculate_hash(cur_node);
+        // Mark the child part of the node that got split for rehashing
+        mark_dirty(cur_node);
         // Create the new node from the split to the next path element
         cur_node = add_node(split_node, path_element);
         cur_prefix_index = 1;
@@ -109,48 +126,57 @@ void state_impl::set(const std::string& key, const std::string& value) {
 
     // Set the current node as child of the new split node
     const uint8_t path_to_child = cur_node_prefix[cur_prefix_index];
-    nodes[split_node].children[path_to_child] = cur_node;
+    nodes[split_node].children.set(path_to_child, cur_node);
 
     // set prefix of split_node and cur_node
     nodes[split_node].prefix = cur_node_prefix.substr(0, cur_prefix_index);
     nodes[cur_node].prefix = cur_node_prefix.substr(cur_prefix_index);
 
-    // Recalculate the hash of the child part of the node that got split
-    calculate_hash(cur_node);
+    // Mark the child part of the node that got split for rehashing
+    mark_dirty(cur_node);
     // Create the new node from the split to the next path element
     cur_node = split_node;
   }
 
   backup_nodes(cur_node);
-  // set the value and calculate the hash
+  // set the value and mark the path for rehashing
   nodes[cur_node].value = value;
-  calculate_hash(cur_node);
+  mark_dirty(cur_node);
+}
+
+void state_impl::apply_batch(
+    const std::vector<std::pair<std::string, std::string> >& entries) {
+  for (size_t i = 1; i < entries.size(); ++i) {
+    if (!(entries[i - 1].first < entries[i].first)) {
+      throw std::invalid_argument("Batch keys are not unique and sorted");
+    }
+  }
+  size_t i = 0;
+  while (i < entries.size()) {
+    if (entries[i].second.empty()) {
+      erase(entries[i].first);
+      ++i;
+      continue;
+    }
+    // Keys are applied in order, a run of keys with values at a time
+    size_t end = i + 1;
+    while (end < entries.size() && !entries[end].second.empty()) {
+      ++end;
+    }
+    apply_to_subtrie(0, 0, entries, i, end);
+    i = end;
+  }
 }
 
 std::string state_impl::get_node_hash(const std::string& path) {
+  update_hashes();
   int32_t node_index = get_node_index(path);
-  return node_index == -1 ? "" : nodes[node_index].hash;
+  return node_index == -1 ? "" : node_hash(node_index);
 }
 
   std::vector<std::string> state_impl::get_node_children(
       const std::string& path) {
-  std::vector<std::string> result;
-  int32_t node_index = get_node_index(path);
-  if (node_index == -1) {
-    std::stringstream msg;
-    msg << "No node at this path";
-    //  LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
-    throw std::out_of_range(msg.str());
-  }
-  uint8_t i = 0;
-  do {
-    if (nodes[node_index].children[i]) {
-      uint32_t child = nodes[node_index].children[i];
-      // TODO(Samir): potential bug ( big vs little endian)
-      result.push_back(std::string(nodes[child].prefix));
-    }
-  } while (++i != 0);
-  return result;
+  return node_children(nodes, path);
 }
 
 void state_impl::delete_node_tree(const std::string& path) {
@@ -165,40 +191,31 @@ void state_impl::delete_node_tree(const std::string& path) {
   backup_nodes(nodes[cur_node].parent);
   subtrie_mark_free(cur_node);
 
-  std::vector<uint8_t> children;
-  uint8_t i = 0;
   uint32_t parent = nodes[cur_node].parent;
   uint8_t path_from_parent = nodes[cur_node].prefix[0];
-  nodes[parent].children[path_from_parent] = 0;
+  nodes[parent].children.set(path_from_parent, 0);
   free_locations.insert(cur_node);
   // move_last_element_to(cur_node);
-  // Find out how many children does the parent have
-  children.clear();
   cur_node = parent;
   // TODO(Samir): add this and all child nodes to fragmented locations
-  do {
-    if (nodes[cur_node].children[i]) {
-      children.push_back(i);
-    }
-  } while (++i != 0);
   // If the parent of the deleted node has no prefix, has only one
   // child remaining and is not the root we will merge it with his child
   if (nodes[cur_node].value.length() == 0
-    && children.size() == 1 && cur_node != 0) {
+    && nodes[cur_node].children.size() == 1 && cur_node != 0) {
     parent = nodes[cur_node].parent;
-    uint32_t child = nodes[cur_node].children[children[0]];
+    uint32_t child = only_child(cur_node);
     backup_nodes(child);
     nodes[child].prefix.insert(0, nodes[cur_node].prefix);
     // link parent and child
     path_from_parent = nodes[cur_node].prefix[0];
-    nodes[parent].children[path_from_parent] = child;
+    nodes[parent].children.set(path_from_parent, child);
     nodes[child].parent = parent;
     free_locations.insert(cur_node);
     // add_fragmented_location(cur_node);
     // move_last_element_to(cur_node);
     cur_node = child;
   }
-  calculate_hash(cur_node);
+  mark_dirty(cur_node);
 }
 
 // 1. If multiple children -> set value to ""
@@ -216,29 +233,22 @@ void state_impl::erase(const std::string& path) {
   }
 
   backup_nodes(cur_node);
-  // Get the children of this node
-  std::vector<uint8_t> children;
-  uint8_t i = 0;
-  do {
-    if (nodes[cur_node].children[i]) {
-      children.push_back(i);
-    }
-  } while (++i != 0);
+  uint32_t children_count = nodes[cur_node].children.size();
 
   // If multiple children just erase the value
-  if (children.size() > 1) {
+  if (children_count > 1) {
     nodes[cur_node].value = "";
   // If one child -> merge prefix into child, link parent and child
-  } else if (children.size() == 1) {
+  } else if (children_count == 1) {
     uint32_t parent = nodes[cur_node].parent;
-    uint32_t child = nodes[cur_node].children[children[0]];
+    uint32_t child = only_child(cur_node);
     // backup the child before chaning it
     backup_nodes(child);
     // add the prefix of current node to the child
     nodes[child].prefix.insert(0, nodes[cur_node].prefix);
     // link parent and child
     uint8_t path_from_parent = nodes[cur_node].prefix[0];
-    nodes[parent].children[path_from_parent] = child;
+    nodes[parent].children.set(path_from_parent, child);
     nodes[child].parent = parent;
     // Remember empty elements for later use
     free_locations.insert(cur_node);
@@ -249,40 +259,39 @@ void state_impl::erase(const std::string& path) {
     // erase the link from parent
     uint32_t parent = nodes[cur_node].parent;
     uint8_t path_from_parent = nodes[cur_node].prefix[0];
-    nodes[parent].children[path_from_parent] = 0;
+    nodes[parent].children.set(path_from_parent, 0);
     free_locations.insert(cur_node);
     // move_last_element_to(cur_node);
-    // Find out how many children does the parent have
-    children.clear();
     cur_node = parent;
-    uint8_t z = 0;
-    do {
-      if (nodes[cur_node].children[z]) {
-        children.push_back(z);
-      }
-    } while (++z != 0);
     // If the parent of the deleted node has no prefix, has only one
     // child remaining and is not the root we will merge it with his child
     if (nodes[cur_node].value.length() == 0
-        && children.size() == 1 && cur_node != 0) {
+        && nodes[cur_node].children.size() == 1 && cur_node != 0) {
       parent = nodes[cur_node].parent;
-      uint32_t child = nodes[cur_node].children[children[0]];
+      uint32_t child = only_child(cur_node);
       backup_nodes(child);
       nodes[child].prefix.insert(0, nodes[cur_node].prefix);
 
       // link parent and child
       path_from_parent = nodes[cur_node].prefix[0];
-      nodes[parent].children[path_from_parent] = child;
+      nodes[parent].children.set(path_from_parent, child);
       nodes[child].parent = parent;
       free_locations.insert(cur_node);
       // move_last_element_to(cur_node);
       cur_node = child;
     }
   }
-  calculate_hash(cur_node);
+  mark_dirty(cur_node);
+}
+
+std::string state_impl::root_hash() {
+  update_hashes();
+  return node_hash(0);
 }
 
 void state_impl::commit_changes() {
+  // Hashes have to be up to date before nodes are moved around
+  update_hashes();
   // Erase backups
   backup.clear();
   if (free_locations.empty()) {
@@ -295,21 +304,22 @@ void state_impl::commit_changes() {
   auto rit_high = free_locations.rbegin();
   uint32_t empty_elements = static_cast<uint32_t>(free_locations.size());
   uint32_t last_element = static_cast<uint32_t>(nodes.size()) - 1;
+  const node_store& store = nodes;
   // Copy elements and skip if element is deleted
   while (*it_low != *rit_high) {
   // auto it_last_element = free_locations.find(last_element);
     if (last_element == *rit_high) {
       rit_high++;
     } else {
-      nodes[*it_low] = nodes[last_element];
-      uint32_t parent = nodes[last_element].parent;
-      uint8_t path_from_parent = nodes[last_element].prefix[0];
-      nodes[parent].children[path_from_parent] = *it_low;
+      nodes[*it_low] = store[last_element];
+      uint32_t parent = store[last_element].parent;
+      uint8_t path_from_parent = store[last_element].prefix[0];
+      nodes[parent].children.set(path_from_parent, *it_low);
       it_low++;
     }
     last_element--;
   }
-  nodes[*it_low] = nodes[last_element];
+  nodes[*it_low] = store[last_element];
 
   nodes.resize(nodes.size() - empty_elements);
   permanent_nodes_count = static_cast<uint32_t>(nodes.size());
@@ -317,11 +327,17 @@ void state_impl::commit_changes() {
 }
 
 void state_impl::discard_changes() {
+  // Nodes added since the last commit are dropped by resize, only the
+  // committed ones are restored
   for (auto it = backup.begin(); it != backup.end(); ++it) {
-    nodes[it->first] = it->second;
+    if (it->first < permanent_nodes_count) {
+      nodes[it->first] = it->second;
+    }
   }
+  backup.clear();
   nodes.resize(permanent_nodes_count);
   free_locations.clear();
+  dirty_count = 0;
 }
 
 uint32_t state_impl::hash_size() {
@@ -329,8 +345,9 @@ uint32_t state_impl::hash_size() {
 }
 
 void state_impl::print_subtrie(std::string path, std::string formated_path) {
+  const node_store& store = nodes;
   std::cout << formated_path << " prefix: " <<
-      io::bin2hex(nodes[get_node_index(path)].prefix) << " value: " << get(path)
+      io::bin2hex(store[get_node_index(path)].prefix) << " value: " << get(path)
       << " hash: " << io::bin2hex(get_node_hash(path)) << std::endl << std::endl;
   std::vector<std::string> children = get_node_children(path);
   for (auto i : children) {
@@ -340,8 +357,30 @@ void state_impl::print_subtrie(std::string path, std::string formated_path) {
 uint32_t state_impl::size() {
   return static_cast<uint32_t>(nodes.size());
 }
-// TODO(Samir): Remove all calls to substring
+
+std::shared_ptr<const state_impl::snapshot_view> state_impl::snapshot() {
+  update_hashes();
+  return std::shared_ptr<const snapshot_view>(
+      new snapshot_view(nodes, digest_size));
+}
+
+void state_impl::set_worker_hashers(
+    const std::vector<crypto::hash_transformation*>& hashers) {
+  workers.reset();
+  if (!hashers.empty()) {
+    workers.reset(new hash_workers(
+        [this](uint32_t cur_node, crypto::hash_transformation* h) {
+          update_subtrie_hashes(cur_node, h);
+        }, hashers));
+  }
+}
 int32_t state_impl::get_node_index(const std::string& path) {
+  return find_node(nodes, path);
+}
+
+// TODO(Samir): Remove all calls to substring
+int32_t state_impl::find_node(const node_store& store,
+    const std::string& path) {
   uint32_t cur_node = 0;
   uint32_t i;
   bool key_ended_at_edge = false;
@@ -349,23 +388,25 @@ int32_t state_impl::get_node_index(const std::string& path) {
     key_ended_at_edge = false;
     uint8_t path_element = path[i];
     // if no prefix keep looking
-    if ((int32_t)nodes[cur_node].prefix.length()-1 <= 0) {
-      if (nodes[cur_node].children[path_element] == 0) {
+    if ((int32_t)store[cur_node].prefix.length()-1 <= 0) {
+      uint32_t child = store[cur_node].children.get(path_element);
+      if (child == 0) {
         return -1;
       }
-      cur_node = nodes[cur_node].children[path_element];
+      cur_node = child;
       key_ended_at_edge = true;
     // else compare prefix with remaining path and decide what to do
     } else {
       // if prefix is shorter than remaining path, compare them.
-      if ((int32_t)nodes[cur_node].prefix.length()-1 <
+      if ((int32_t)store[cur_node].prefix.length()-1 <
           (int32_t)path.length() - (int32_t)i) {
-        if (nodes[cur_node].prefix == path.substr(i-1,
-            nodes[cur_node].prefix.length())) {
-          i += (int32_t)nodes[cur_node].prefix.length()-1;
+        if (store[cur_node].prefix == path.substr(i-1,
+            store[cur_node].prefix.length())) {
+          i += (int32_t)store[cur_node].prefix.length()-1;
           path_element = path[i];
-          if (nodes[cur_node].children[path_element]) {
-            cur_node = nodes[cur_node].children[path_element];
+          uint32_t child = store[cur_node].children.get(path_element);
+          if (child) {
+            cur_node = child;
             key_ended_at_edge = true;
           } else {
             return -1;
@@ -374,9 +415,9 @@ int32_t state_impl::get_node_index(const std::string& path) {
           return -1;
         }
       // if prefix length is equal to remaining path compare
-      } else if ((int32_t)nodes[cur_node].prefix.length()-1
+      } else if ((int32_t)store[cur_node].prefix.length()-1
             == (int32_t)path.length() - (int32_t)i) {
-        if (nodes[cur_node].prefix == path.substr(i-1)) {
+        if (store[cur_node].prefix == path.substr(i-1)) {
           return cur_node;
         } else {
           return -1;
@@ -387,20 +428,55 @@ int32_t state_impl::get_node_index(const std::string& path) {
       }
     }
   }
-  if (key_ended_at_edge && (int32_t)nodes[cur_node].prefix.length()-1) {
+  if (key_ended_at_edge && (int32_t)store[cur_node].prefix.length()-1) {
     return -1;
   }
   return cur_node;
 }
 
 
-bool state_impl::has_children(uint32_t node_index) {
-  for (uint32_t i = 0; i < 256; ++i) {
-    if (nodes[node_index].children[i]) {
-      return true;
-    }
+bool state_impl::has_children(uint32_t node_index) const {
+  return !nodes[node_index].children.empty();
+}
+
+std::string state_impl::node_hash(uint32_t node_index) const {
+  return node_hash(nodes, node_index, digest_size);
+}
+
+std::string state_impl::node_hash(const node_store& store, uint32_t node_index,
+    uint32_t digest_size) {
+  // If we are at root and we have no children the hash will be ""
+  if (!node_index && store[node_index].children.empty()) {
+    return "";
   }
-  return false;
+  return std::string(reinterpret_cast<const char*>(store[node_index].hash),
+      digest_size);
+}
+
+std::vector<std::string> state_impl::node_children(const node_store& store,
+    const std::string& path) {
+  std::vector<std::string> result;
+  int32_t node_index = find_node(store, path);
+  if (node_index == -1) {
+    std::stringstream msg;
+    msg << "No node at this path";
+    //  LOG(WARNING) << msg.str() << '\n' << el::base::debug::StackTrace();
+    throw std::out_of_range(msg.str());
+  }
+  store[node_index].children.for_each([&](uint8_t key, uint32_t child) {
+    // TODO(Samir): potential bug ( big vs little endian)
+    result.push_back(std::string(store[child].prefix));
+  });
+  return result;
+}
+
+
+uint32_t state_impl::only_child(uint32_t node_index) {
+  uint32_t result = 0;
+  nodes[node_index].children.for_each([&](uint8_t key, uint32_t child) {
+    result = child;
+  });
+  return result;
 }
 
 uint32_t state_impl::add_node(uint32_t from, uint8_t to) {
@@ -417,52 +493,207 @@ uint32_t state_impl::add_node(uint32_t from, uint8_t to) {
     nodes[new_node] = node();
     free_locations.erase(it_fragmented_locations);
   }
-  nodes[from].children[to] = new_node;
+  nodes[from].children.set(to, new_node);
   nodes[new_node].parent = from;
   nodes[new_node].prefix = std::string(reinterpret_cast<char*>(&to), 1);
   return new_node;
 }
 
-void state_impl::calculate_hash(uint32_t cur_node) {
-  const uint8_t *value, *prefix, *child_hash;
-  hasher->restart();  // just in case
-  // If we are at root and we have no children the hash will be ""
-  if (!cur_node && !has_children(cur_node)) {
-    nodes[cur_node].hash = "";
-    return;
+uint32_t state_impl::split_node(uint32_t cur_node, uint32_t at) {
+  const std::string cur_node_prefix = nodes[cur_node].prefix;
+  uint32_t split = add_node(nodes[cur_node].parent, cur_node_prefix[0]);
+  nodes[cur_node].parent = split;
+  nodes[split].children.set(cur_node_prefix[at], cur_node);
+  nodes[split].prefix = cur_node_prefix.substr(0, at);
+  nodes[cur_node].prefix = cur_node_prefix.substr(at);
+  return split;
+}
+
+void state_impl::apply_to_subtrie(uint32_t cur_node, uint32_t depth,
+    const std::vector<std::pair<std::string, std::string> >& entries,
+    size_t begin, size_t end) {
+  const node_store& store = nodes;
+  // Keys are sorted, only the first one can end at this node
+  if (entries[begin].first.length() == depth) {
+    backup_nodes(cur_node);
+    nodes[cur_node].value = entries[begin].second;
+    mark_dirty(cur_node);
+    ++begin;
+  }
+  size_t i = begin;
+  while (i < end) {
+    // The keys that continue with the same byte follow each other
+    const uint8_t path_element = entries[i].first[depth];
+    size_t group_end = i + 1;
+    while (group_end < end &&
+        static_cast<uint8_t>(entries[group_end].first[depth]) == path_element) {
+      ++group_end;
+    }
+    uint32_t child = store[cur_node].children.get(path_element);
+    if (child == 0) {
+      // Nothing here yet, build the subtrie of the group in one pass
+      backup_nodes(cur_node);
+      build_subtrie(cur_node, depth, entries, i, group_end);
+      mark_dirty(cur_node);
+    } else {
+      // Descend into the child as far as all keys of the group follow its
+      // prefix, splitting it where the first of them diverges
+      const std::string& prefix = store[child].prefix;
+      uint32_t common = static_cast<uint32_t>(prefix.length());
+      for (size_t j = i; j < group_end && common > 1; ++j) {
+        const std::string& key = entries[j].first;
+        uint32_t k = 1;
+        while (k < common && depth + k < key.length() &&
+            key[depth + k] == prefix[k]) {
+          ++k;
+        }
+        common = k;
+      }
+      if (common < prefix.length()) {
+        backup_nodes(child);
+        uint32_t split = split_node(child, common);
+        mark_dirty(child);
+        child = split;
+      }
+      apply_to_subtrie(child, depth + common, entries, i, group_end);
+    }
+    i = group_end;
   }
+}
 
-  // Hash the value
-  value =
-      reinterpret_cast<const uint8_t*>(nodes[cur_node].value.data());
-  uint32_t len = static_cast<uint32_t>(nodes[cur_node].value.length());
-  hasher->update(value, len);
-
-  // Hash the prefix
-  prefix =
-      reinterpret_cast<const uint8_t*>(nodes[cur_node].prefix.data());
-  len = static_cast<uint32_t>(nodes[cur_node].prefix.length());
-  hasher->update(prefix, len);
-
-  // Hash the children hashes
-  for (int i = 0; i < 256; i++) {
-    if (nodes[cur_node].children[i]) {
-      uint32_t child = nodes[cur_node].children[i];
-      child_hash =
-          reinterpret_cast<const uint8_t*>(nodes[child].hash.data());
-      len = static_cast<uint32_t>(nodes[child].hash.length());
-      hasher->update(child_hash, len);
+void state_impl::build_subtrie(uint32_t parent, uint32_t depth,
+    const std::vector<std::pair<std::string, std::string> >& entries,
+    size_t begin, size_t end) {
+  // The path from the parent to the node of the previous key. Each entry is a
+  // node and the length of the key up to the end of its prefix. Nodes popped
+  // from the path can't get more children and are hashed right away.
+  struct path_node {
+    uint32_t index;
+    uint32_t depth;
+  };
+  std::vector<path_node> path;
+  path.push_back({parent, depth});
+  for (size_t i = begin; i < end; ++i) {
+    const std::string& key = entries[i].first;
+    // Length of the common prefix with the previous key
+    uint32_t common = depth;
+    if (i > begin) {
+      const std::string& previous = entries[i - 1].first;
+      while (common < previous.length() &&
+          previous[common] == key[common]) {
+        ++common;
+      }
+    }
+    // Finish the nodes that start after the keys diverge
+    while (path.size() > 1 && path.back().depth -
+        nodes[path.back().index].prefix.length() >= common) {
+      calculate_hash(path.back().index, hasher);
+      path.pop_back();
+    }
+    // The keys diverge inside the prefix of the last node, split it
+    if (path.back().depth > common) {
+      uint32_t cur_node = path.back().index;
+      uint32_t split_at = common - (path.back().depth -
+          static_cast<uint32_t>(nodes[cur_node].prefix.length()));
+      uint32_t split = split_node(cur_node, split_at);
+      calculate_hash(cur_node, hasher);
+      path.back() = {split, common};
     }
+    // Keys are sorted, so the new leaf is the last child of its parent
+    uint32_t leaf = add_node(path.back().index, key[common]);
+    nodes[leaf].prefix = key.substr(common);
+    nodes[leaf].value = entries[i].second;
+    path.push_back({leaf, static_cast<uint32_t>(key.length())});
   }
-  uint8_t * digest = new uint8_t[hasher->digest_size()];
-  hasher->final(digest);
-  nodes[cur_node].hash = std::string(reinterpret_cast<char*>(digest),
-    hasher->digest_size());
+  while (path.size() > 1) {
+    calculate_hash(path.back().index, hasher);
+    path.pop_back();
+  }
+}
 
-  delete[] digest;
-  if (cur_node != 0) {
-    calculate_hash(nodes[cur_node].parent);
+void state_impl::mark_dirty(uint32_t cur_node) {
+  // Walk all the way to the root. Nodes may have been relinked under a new
+  // parent since they were marked, so a dirty node does not guarantee that
+  // its ancestors are dirty.
+  while (true) {
+    if (!nodes[cur_node].dirty) {
+      nodes[cur_node].dirty = true;
+      ++dirty_count;
+    }
+    if (cur_node == 0) {
+      break;
+    }
+    cur_node = nodes[cur_node].parent;
+  }
+}
+
+void state_impl::update_hashes() {
+  // Nodes are only read through store unless they are dirty, which keeps
+  // chunks shared with snapshots intact and makes it safe to hash from
+  // several threads.
+  const node_store& store = nodes;
+  if (!store[0].dirty) {
+    return;
+  }
+  if (!workers || dirty_count < hash_workers::PARALLEL_HASHING_THRESHOLD) {
+    update_subtrie_hashes(0, hasher);
+    dirty_count = 0;
+    return;
   }
+
+  // The nodes above the subtries are hashed afterwards on this thread,
+  // deepest first.
+  std::vector<uint32_t> subtries;
+  std::vector<uint32_t> above = workers->split(
+      [&store](uint32_t cur_node, const std::function<void(uint32_t)>& f) {
+        store[cur_node].children.for_each([&](uint8_t key, uint32_t child) {
+          if (store[child].dirty) {
+            f(child);
+          }
+        });
+      }, &subtries);
+  workers->run(subtries, hasher);
+  for (auto it = above.rbegin(); it != above.rend(); ++it) {
+    calculate_hash(*it, hasher);
+    nodes[*it].dirty = false;
+  }
+  dirty_count = 0;
+}
+
+void state_impl::update_subtrie_hashes(uint32_t cur_node,
+    crypto::hash_transformation* h) {
+  const node_store& store = nodes;
+  store[cur_node].children.for_each([&](uint8_t key, uint32_t child) {
+    if (store[child].dirty) {
+      update_subtrie_hashes(child, h);
+    }
+  });
+  calculate_hash(cur_node, h);
+  nodes[cur_node].dirty = false;
+}
+
+void state_impl::calculate_hash(uint32_t cur_node,
+    crypto::hash_transformation* h) {
+  // If we are at root and we have no children the hash will be ""
+  if (!cur_node && !has_children(cur_node)) {
+    return;
+  }
+
+  // Hash the value, the prefix and the children hashes in a single call
+  crypto::hash_transformation::input_span spans[2 + 256];
+  size_t count = 0;
+  const node_store& store = nodes;
+  node& n = nodes[cur_node];
+  spans[count++] = {reinterpret_cast<const uint8_t*>(n.value.data()),
+      n.value.length()};
+  spans[count++] = {reinterpret_cast<const uint8_t*>(n.prefix.data()),
+      n.prefix.length()};
+  n.children.for_each([&](uint8_t key, uint32_t child) {
+    spans[count++] = {store[child].hash, digest_size};
+  });
+  h->restart();  // just in case
+  h->update_batch(spans, count);
+  h->final(n.hash);
 }
 
 void state_impl::backup_nodes(uint32_t cur_node) {
@@ -476,16 +707,355 @@ void state_impl::backup_nodes(uint32_t cur_node) {
 }
 
 void state_impl::subtrie_mark_free(uint32_t cur_node) {
-  uint8_t child = 0;
+  const node_store& store = nodes;
   free_locations.insert(cur_node);
-  do {
-    if (nodes[cur_node].children[child]) {
-      subtrie_mark_free(nodes[cur_node].children[child]);
-    }
-  } while (++child != 0);
+  store[cur_node].children.for_each([&](uint8_t key, uint32_t child) {
+    subtrie_mark_free(child);
+  });
   return;
 }
 
+// node_store
+
+void state_impl::node_store::push_back(const node& n) {
+  if (count % CHUNK_SIZE == 0 && count / CHUNK_SIZE == chunks.size()) {
+    chunks.push_back(std::make_shared<chunk>());
+  }
+  ++count;
+  (*this)[count - 1] = n;
+}
+
+void state_impl::node_store::resize(uint32_t n) {
+  while (count < n) {
+    push_back(node());
+  }
+  count = n;
+  // Release chunks that are no longer used, the remaining nodes of the last
+  // chunk are overwritten by push_back.
+  chunks.resize((count + CHUNK_SIZE - 1) / CHUNK_SIZE);
+}
+
+// snapshot_view
+
+state_impl::snapshot_view::snapshot_view(const node_store& store,
+    uint32_t hash_bytes)
+    : nodes(store)
+    , digest_size(hash_bytes) {
+}
+
+std::string state_impl::snapshot_view::get(const std::string& key) const {
+  int32_t node_index = find_node(nodes, key);
+  return node_index == -1 ? "" : nodes[node_index].value;
+}
+
+std::string state_impl::snapshot_view::get_node_hash(
+    const std::string& path) const {
+  int32_t node_index = find_node(nodes, path);
+  return node_index == -1 ? "" : node_hash(nodes, node_index, digest_size);
+}
+
+std::vector<std::string> state_impl::snapshot_view::get_node_children(
+    const std::string& path) const {
+  return node_children(nodes, path);
+}
+
+std::string state_impl::snapshot_view::root_hash() const {
+  return node_hash(nodes, 0, digest_size);
+}
+
+uint32_t state_impl::snapshot_view::hash_size() const {
+  return digest_size;
+}
+
+uint32_t state_impl::snapshot_view::size() const {
+  return nodes.size();
+}
+
+// children_map
+
+state_impl::children_map::children_map()
+    : kind(NODE4)
+    , count(0) {
+}
+
+state_impl::children_map::children_map(const children_map& other)
+    : kind(other.kind)
+    , count(other.count) {
+  if (kind == NODE4) {
+    small = other.small;
+  } else {
+    block = new uint8_t[block_size(kind)];
+    std::memcpy(block, other.block, block_size(kind));
+  }
+}
+
+state_impl::children_map::children_map(children_map&& other) noexcept
+    : kind(other.kind)
+    , count(other.count) {
+  if (kind == NODE4) {
+    small = other.small;
+  } else {
+    block = other.block;
+    other.kind = NODE4;
+    other.count = 0;
+  }
+}
+
+state_impl::children_map& state_impl::children_map::operator=(
+    const children_map& other) {
+  if (this != &other) {
+    children_map copy(other);
+    *this = std::move(copy);
+  }
+  return *this;
+}
+
+state_impl::children_map& state_impl::children_map::operator=(
+    children_map&& other) noexcept {
+  if (this != &other) {
+    release();
+    kind = other.kind;
+    count = other.count;
+    if (kind == NODE4) {
+      small = other.small;
+    } else {
+      block = other.block;
+      other.kind = NODE4;
+      other.count = 0;
+    }
+  }
+  return *this;
+}
+
+state_impl::children_map::~children_map() {
+  release();
+}
+
+uint32_t state_impl::children_map::get(uint8_t key) const {
+  switch (kind) {
+    case NODE4:
+    case NODE16: {
+      int32_t pos = find_sorted(key);
+      return pos == -1 ? 0 : children()[pos];
+    }
+    case NODE48:
+      return block[key] ? children()[block[key] - 1] : 0;
+    case NODE256:
+      return children()[key];
+  }
+  return 0;
+}
+
+void state_impl::children_map::set(uint8_t key, uint32_t child) {
+  if (child == 0) {
+    remove(key);
+    return;
+  }
+  if (kind == NODE4 || kind == NODE16) {
+    int32_t pos = find_sorted(key);
+    if (pos != -1) {
+      children()[pos] = child;
+      return;
+    }
+  } else if (kind == NODE48 && block[key]) {
+    children()[block[key] - 1] = child;
+    return;
+  } else if (kind == NODE256) {
+    uint32_t* c = children();
+    if (c[key] == 0) {
+      ++count;
+    }
+    c[key] = child;
+    return;
+  }
+
+  // The key is not present, grow the node if it is full.
+  if (count == capacity(kind)) {
+    change_kind(static_cast<node_kind>(kind + 1));
+    if (kind == NODE256) {
+      children()[key] = child;
+      ++count;
+      return;
+    }
+  }
+
+  if (kind == NODE48) {
+    uint32_t* c = children();
+    uint32_t slot = 0;
+    while (c[slot]) {
+      ++slot;
+    }
+    c[slot] = child;
+    block[key] = static_cast<uint8_t>(slot + 1);
+  } else {
+    // Keep keys sorted so iteration is in key order.
+    uint8_t* k = keys();
+    uint32_t* c = children();
+    uint32_t pos = 0;
+    while (pos < count && k[pos] < key) {
+      ++pos;
+    }
+    std::memmove(k + pos + 1, k + pos, count - pos);
+    std::memmove(c + pos + 1, c + pos, (count - pos) * sizeof(uint32_t));
+    k[pos] = key;
+    c[pos] = child;
+  }
+  ++count;
+}
+
+uint8_t* state_impl::children_map::keys() {
+  return kind == NODE4 ? small.keys : block;
+}
+
+const uint8_t* state_impl::children_map::keys() const {
+  return kind == NODE4 ? small.keys : block;
+}
+
+uint32_t* state_impl::children_map::children() {
+  switch (kind) {
+    case NODE4:
+      return small.children;
+    case NODE16:
+      return reinterpret_cast<uint32_t*>(block + 16);
+    case NODE48:
+      return reinterpret_cast<uint32_t*>(block + 256);
+    case NODE256:
+      return reinterpret_cast<uint32_t*>(block);
+  }
+  return nullptr;
+}
+
+const uint32_t* state_impl::children_map::children() const {
+  return const_cast<children_map*>(this)->children();
+}
+
+int32_t state_impl::children_map::find_sorted(uint8_t key) const {
+  const uint8_t* k = keys();
+#ifdef AUTOMATON_STATE_USE_SSE2
+  if (kind == NODE16) {
+    __m128i cmp = _mm_cmpeq_epi8(_mm_set1_epi8(static_cast<char>(key)),
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(k)));
+    uint32_t mask = static_cast<uint32_t>(_mm_movemask_epi8(cmp)) &
+        ((1U << count) - 1);
+    if (mask == 0) {
+      return -1;
+    }
+    int32_t pos = 0;
+    while (!(mask & 1)) {
+      mask >>= 1;
+      ++pos;
+    }
+    return pos;
+  }
+#endif
+  for (uint32_t i = 0; i < count; ++i) {
+    if (k[i] == key) {
+      return static_cast<int32_t>(i);
+    }
+  }
+  return -1;
+}
+
+void state_impl::children_map::remove(uint8_t key) {
+  switch (kind) {
+    case NODE4:
+    case NODE16: {
+      int32_t pos = find_sorted(key);
+      if (pos == -1) {
+        return;
+      }
+      uint32_t tail = count - pos - 1;
+      std::memmove(keys() + pos, keys() + pos + 1, tail);
+      std::memmove(children() + pos, children() + pos + 1,
+          tail * sizeof(uint32_t));
+      break;
+    }
+    case NODE48:
+      if (!block[key]) {
+        return;
+      }
+      children()[block[key] - 1] = 0;
+      block[key] = 0;
+      break;
+    case NODE256:
+      if (!children()[key]) {
+        return;
+      }
+      children()[key] = 0;
+      break;
+  }
+  --count;
+  // Shrink with some slack below the smaller capacity, so a node that
+  // oscillates around a boundary is not converted on every change.
+  if (kind != NODE4 &&
+      count <= capacity(static_cast<node_kind>(kind - 1)) * 3 / 4) {
+    change_kind(static_cast<node_kind>(kind - 1));
+  }
+}
+
+void state_impl::children_map::change_kind(node_kind new_kind) {
+  uint8_t old_keys[256];
+  uint32_t old_children[256];
+  uint32_t n = 0;
+  for_each([&](uint8_t key, uint32_t child) {
+    old_keys[n] = key;
+    old_children[n] = child;
+    ++n;
+  });
+
+  release();
+  kind = new_kind;
+  if (kind != NODE4) {
+    block = new uint8_t[block_size(kind)];
+    std::memset(block, 0, block_size(kind));
+  }
+  uint8_t* k = kind == NODE48 ? nullptr : keys();
+  uint32_t* c = children();
+  for (uint32_t i = 0; i < n; ++i) {
+    switch (kind) {
+      case NODE4:
+      case NODE16:
+        k[i] = old_keys[i];
+        c[i] = old_children[i];
+        break;
+      case NODE48:
+        block[old_keys[i]] = static_cast<uint8_t>(i + 1);
+        c[i] = old_children[i];
+        break;
+      case NODE256:
+        c[old_keys[i]] = old_children[i];
+        break;
+    }
+  }
+  count = static_cast<uint16_t>(n);
+}
+
+void state_impl::children_map::release() {
+  if (kind != NODE4) {
+    delete[] block;
+    kind = NODE4;
+  }
+  count = 0;
+}
+
+uint32_t state_impl::children_map::capacity(node_kind k) {
+  static const uint32_t capacities[] = {4, 16, 48, 256};
+  return capacities[k];
+}
+
+size_t state_impl::children_map::block_size(node_kind k) {
+  switch (k) {
+    case NODE16:
+      return 16 + 16 * sizeof(uint32_t);
+    case NODE48:
+      return 256 + 48 * sizeof(uint32_t);
+    case NODE256:
+      return 256 * sizeof(uint32_t);
+    default:
+      return 0;
+  }
+}
+
 }  // namespace state
 }  // namespace core
 }  // namespace automaton
@@ -1,13 +1,17 @@
 #ifndef AUTOMATON_CORE_STATE_STATE_IMPL_H_
 #define AUTOMATON_CORE_STATE_STATE_IMPL_H_
 
+#include <atomic>
 #include <cstdint>
 #include <map>
+#include <memory>
 #include <set>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "automaton/core/crypto/hash_transformation.h"
+#include "automaton/core/state/hash_workers.h"
 #include "automaton/core/state/state.h"
 
 namespace automaton {
@@ -16,8 +20,17 @@ namespace state {
 
 class state_impl : public state {
  public:
+  // The largest digest size supported for node hashes.
+  static const uint32_t MAX_HASH_SIZE = 64;
+
+  class snapshot_view;
+
+  // Throws std::invalid_argument if the hasher's digest size is larger than
+  // MAX_HASH_SIZE.
   explicit state_impl(crypto::hash_transformation* hasher);
 
+  ~state_impl();
+
   // Get the value at given path. Empty string if no value is set or
   // there is no node at the given path
   std::string get(const std::string& key);
@@ -25,10 +38,21 @@ class state_impl : public state {
   // Set the value at a given path
   void set(const std::string& key, const std::string& value);
 
+  // Set the values of a sorted batch of keys. The batch is merged into the
+  // trie in one walk: each existing node on the way is visited once for all
+  // keys under it, and new subtries are built bottom-up with every new node
+  // hashed once. Keys with empty values are erased in order.
+  void apply_batch(
+      const std::vector<std::pair<std::string, std::string> >& entries);
+
   // Get the hash of a node at the given path. Empty std::string if no value is
   // set or there is no node at the given path
   std::string get_node_hash(const std::string& path);
 
+  // Get the hash of the root node, rehashing all nodes changed since the last
+  // time hashes were requested
+  std::string root_hash();
+
   // Get the children as chars //TODO(Samir:) change to to return sting path to
   // children with value.
   std::vector<std::string> get_node_children(const std::string& path);
@@ -53,27 +77,210 @@ class state_impl : public state {
 
   uint32_t size();
 
+  // Returns a read-only view of the current state, including uncommitted
+  // changes, that shares nodes with this state. Nodes are copied only when the
+  // state changes them afterwards, so the view is cheap to take and can be
+  // read from any number of threads without locking while the state is being
+  // modified. Call it after commit_changes() to snapshot a committed block.
+  std::shared_ptr<const snapshot_view> snapshot();
+
+  // Enables hashing independent subtrees in parallel when the number of
+  // changed nodes is large. Starts one worker thread per given hasher, which
+  // must be of the same type as the main one. The threads are reused by every
+  // rehash and stopped when the state is destroyed or the hashers are
+  // replaced. Ownership of the hashers is not taken.
+  void set_worker_hashers(const std::vector<crypto::hash_transformation*>&
+      hashers);
+
  private:
+  // Adaptive child table keyed by the next path byte. Small nodes keep up to 4
+  // sorted keys inline, larger ones move to a heap block laid out as a sorted
+  // 16-key table, a 48-slot table indexed by key, or a full 256-slot array.
+  // Children are always visited in ascending key order, so node hashes do not
+  // depend on the layout.
+  class children_map {
+   public:
+    children_map();
+    children_map(const children_map& other);
+    children_map(children_map&& other) noexcept;
+    children_map& operator=(const children_map& other);
+    children_map& operator=(children_map&& other) noexcept;
+    ~children_map();
+
+    // Returns the child at key or 0 if there is none.
+    uint32_t get(uint8_t key) const;
+
+    // Sets the child at key. Setting 0 removes the child.
+    void set(uint8_t key, uint32_t child);
+
+    uint32_t size() const {
+      return count;
+    }
+
+    bool empty() const {
+      return count == 0;
+    }
+
+    // Calls f(key, child) for every child in ascending key order.
+    template<typename F>
+    void for_each(F f) const;
+
+   private:
+    enum node_kind : uint8_t {
+      NODE4,
+      NODE16,
+      NODE48,
+      NODE256,
+    };
+
+    node_kind kind;
+    uint16_t count;
+    union {
+      // NODE4
+      struct {
+        uint8_t keys[4];
+        uint32_t children[4];
+      } small;
+      // NODE16: uint8_t keys[16], uint32_t children[16]
+      // NODE48: uint8_t index[256] (slot + 1, 0 if empty), uint32_t children[48]
+      // NODE256: uint32_t children[256]
+      uint8_t* block;
+    };
+
+    uint8_t* keys();
+    const uint8_t* keys() const;
+    uint32_t* children();
+    const uint32_t* children() const;
+    int32_t find_sorted(uint8_t key) const;
+    void remove(uint8_t key);
+    void change_kind(node_kind new_kind);
+    void release();
+    static uint32_t capacity(node_kind k);
+    static size_t block_size(node_kind k);
+  };
+
   struct node {
     uint32_t parent;
     std::string prefix;
-    std::string hash;
     std::string value;
-    uint32_t children[256];
+    // The first digest_size bytes hold the hash of the node
+    uint8_t hash[MAX_HASH_SIZE];
+    children_map children;
+    // The hash of this node or one of its descendants is out of date
+    bool dirty = false;
+  };
+
+  // Node storage split into fixed size chunks. Copies of the store share the
+  // chunks; a shared chunk is cloned the first time it is accessed through the
+  // non-const operator[]. Reads that don't modify nodes should go through a
+  // const reference so they don't unshare chunks.
+  class node_store {
+   public:
+    const node& operator[](uint32_t i) const {
+      return chunks[i / CHUNK_SIZE]->nodes[i % CHUNK_SIZE];
+    }
+
+    node& operator[](uint32_t i) {
+      std::shared_ptr<chunk>& c = chunks[i / CHUNK_SIZE];
+      if (c.use_count() > 1) {
+        c = std::make_shared<chunk>(*c);
+      } else {
+        // Pairs with the release of the last reader's reference.
+        std::atomic_thread_fence(std::memory_order_acquire);
+      }
+      return c->nodes[i % CHUNK_SIZE];
+    }
+
+    uint32_t size() const {
+      return count;
+    }
+
+    void push_back(const node& n);
+    void resize(uint32_t n);
+
+   private:
+    static const uint32_t CHUNK_SIZE = 256;
+    struct chunk {
+      node nodes[CHUNK_SIZE];
+    };
+    std::vector<std::shared_ptr<chunk> > chunks;
+    uint32_t count = 0;
+  };
+
+ public:
+  // Read-only view of the state at the time snapshot() was called.
+  class snapshot_view {
+   public:
+    // Same as the corresponding state methods.
+    std::string get(const std::string& key) const;
+    std::string get_node_hash(const std::string& path) const;
+    std::vector<std::string> get_node_children(const std::string& path) const;
+    std::string root_hash() const;
+    uint32_t hash_size() const;
+    uint32_t size() const;
+
+   private:
+    friend class state_impl;
+    snapshot_view(const node_store& store, uint32_t hash_bytes);
+
+    const node_store nodes;
+    const uint32_t digest_size;
   };
-  std::vector<node> nodes;
+
+ private:
+  node_store nodes;
   std::map<uint32_t, node> backup;
   std::set<uint32_t> free_locations;
   crypto::hash_transformation* hasher;
+  uint32_t digest_size;
+  // Threads that rehash subtries for update_hashes(), null until
+  // set_worker_hashers() is called
+  std::unique_ptr<hash_workers> workers;
+  // Number of nodes marked dirty since the hashes were last updated
+  uint32_t dirty_count;
   uint32_t nodes_current_state;
   uint32_t permanent_nodes_count;
 
   int32_t get_node_index(const std::string& path);
-  bool has_children(uint32_t node_index);
+  bool has_children(uint32_t node_index) const;
+  // Returns the hash of a node as a string, empty for the root of an empty trie
+  std::string node_hash(uint32_t node_index) const;
+
+  // Read-only algorithms shared with snapshot_view
+  static int32_t find_node(const node_store& nodes, const std::string& path);
+  static std::string node_hash(const node_store& nodes, uint32_t node_index,
+      uint32_t digest_size);
+  static std::vector<std::string> node_children(const node_store& nodes,
+      const std::string& path);
+  // Returns the child of a node known to have exactly one child
+  uint32_t only_child(uint32_t node_index);
   uint32_t add_node(uint32_t from, uint8_t to);
-  // This needs to be called at the end of set() and erase() to recalculate the
-  // hashes of all nodes from lowest child that was changed to the root
-  void calculate_hash(uint32_t cur_node);
+  // Moves the first at bytes of the prefix of cur_node into a new parent node
+  // and returns it
+  uint32_t split_node(uint32_t cur_node, uint32_t at);
+  // Applies the entries [begin, end) to the subtrie of cur_node. The keys have
+  // to be sorted, have values and start with the path to the end of the
+  // prefix of cur_node, which is depth bytes long.
+  void apply_to_subtrie(uint32_t cur_node, uint32_t depth,
+      const std::vector<std::pair<std::string, std::string> >& entries,
+      size_t begin, size_t end);
+  // Builds the subtrie of entries [begin, end) under parent. The keys have to
+  // be sorted, have values, be longer than depth and have the same byte at
+  // depth, for which the parent has no child yet.
+  void build_subtrie(uint32_t parent, uint32_t depth,
+      const std::vector<std::pair<std::string, std::string> >& entries,
+      size_t begin, size_t end);
+  // This needs to be called at the end of set() and erase() to mark all nodes
+  // from the lowest child that was changed to the root for rehashing. Hashes
+  // are recalculated by update_hashes() when they are requested.
+  void mark_dirty(uint32_t cur_node);
+  // Rehashes every dirty node exactly once, bottom-up
+  void update_hashes();
+  // Rehashes the dirty nodes in the subtrie of cur_node using the given hasher
+  void update_subtrie_hashes(uint32_t cur_node,
+      crypto::hash_transformation* h);
+  // Calculates the hash of a single node from its children's hashes
+  void calculate_hash(uint32_t cur_node, crypto::hash_transformation* h);
   // Create a backup starting from cur_node to root if they are not
   // in the backup map
   void backup_nodes(uint32_t cur_node);
@@ -81,6 +288,39 @@ class state_impl : public state {
   void subtrie_mark_free(uint32_t cur_node);
 };
 
+template<typename F>
+void state_impl::children_map::for_each(F f) const {
+  switch (kind) {
+    case NODE4:
+    case NODE16: {
+      const uint8_t* k = keys();
+      const uint32_t* c = children();
+      for (uint32_t i = 0; i < count; ++i) {
+        f(k[i], c[i]);
+      }
+      break;
+    }
+    case NODE48: {
+      const uint32_t* c = children();
+      for (uint32_t i = 0; i < 256; ++i) {
+        if (block[i]) {
+          f(static_cast<uint8_t>(i), c[block[i] - 1]);
+        }
+      }
+      break;
+    }
+    case NODE256: {
+      const uint32_t* c = children();
+      for (uint32_t i = 0; i < 256; ++i) {
+        if (c[i]) {
+          f(static_cast<uint8_t>(i), c[i]);
+        }
+      }
+      break;
+    }
+  }
+}
+
 }  // namespace state
 }  // namespace core
 }  // namespace automaton
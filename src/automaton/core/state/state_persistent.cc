@@ -1,10 +1,13 @@
 #include "automaton/core/state/state_persistent.h"
 
 #include <algorithm>
+#include <cstring>
+#include <functional>
 #include <iomanip>
 #include <map>
 #include <set>
 #include <sstream>
+#include <stdexcept>
 #include <string>
 #include <utility>
 #include <vector>
@@ -16,28 +19,45 @@ namespace automaton {
 namespace core {
 namespace state {
 
+// Writes go through nodes, which marks the records as changed. Reads should
+// use read_node() so unchanged records are not written again on commit.
 #define nodes (*p_nodes)
 typedef std::basic_string<unsigned char> ustring;
 
+const uint64_t state_persistent::node::VERSION;
 
 state_persistent::state_persistent(crypto::hash_transformation* hasher,
                                    storage::blobstore* bs,
-                                   storage::persistent_vector<node>* p_nodes
+                                   storage::persistent_vector<node>* p_nodes,
+                                   storage::write_ahead_log* log
                                   )
   :bs(bs),
-  p_nodes(p_nodes) {
-  bs->store(0, nullptr);
-  nodes.push_back(state_persistent::node());
+  p_nodes(p_nodes),
+  log(log) {
   this->hasher = hasher;
   nodes_current_state = 1;
-  calculate_hash(0);
+  if (nodes.size() != 0) {
+    if (p_nodes->get_format_version() != node::VERSION) {
+      throw std::runtime_error("Unsupported state nodes version " +
+          std::to_string(p_nodes->get_format_version()));
+    }
+    // Continue from the last committed state
+    permanent_nodes_count = static_cast<uint32_t>(nodes.size());
+    return;
+  }
+  p_nodes->set_format_version(node::VERSION);
+  nodes.push_back(state_persistent::node());
+  calculate_hash(0, hasher);
   permanent_nodes_count = 1;
+  if (log) {
+    log->commit(true);
+  }
 }
 
 std::string state_persistent::get(const std::string& key) {
   int32_t node_index = get_node_index(key);
   //  std::cout << "index at key\"" << key << "\": " << node_index << std::endl;
-  return node_index == -1 ? "" : nodes[node_index].get_value(bs);
+  return node_index == -1 ? "" : read_node(node_index).get_value(bs);
 }
 
 void state_persistent::set(const std::string& key, const std::string& value) {
@@ -50,13 +70,13 @@ void state_persistent::set(const std::string& key, const std::string& value) {
   unsigned int i = 0;
   for (; i < key.length(); ++i) {
     unsigned char path_element = key[i];
-    if (cur_prefix_index == nodes[cur_node].get_prefix(bs).length()) {
+    if (cur_prefix_index == read_node(cur_node).get_prefix(bs).length()) {
       // If there is no prefix or there is prefix but we have reached the end
-      if (nodes[cur_node].get_child(path_element, bs) != 0) {
+      if (read_node(cur_node).get_child(path_element, bs) != 0) {
         // If there is child with the next path element continue on the path
-        cur_node = nodes[cur_node].get_child(path_element, bs);
+        cur_node = read_node(cur_node).get_child(path_element, bs);
       } else if (has_children(cur_node) ||
-          nodes[cur_node].get_value(bs) != "" || cur_node == 0) {
+          read_node(cur_node).get_value(bs) != "" || cur_node == 0) {
         // This node has children, value set or is the root so
         // It can't be the final node.
         backup_nodes(cur_node);
@@ -64,7 +84,7 @@ void state_persistent::set(const std::string& key, const std::string& value) {
       } else {
         // this node has no children so it's the final node. The remainder
         // of the path will be the prefix including the path from parent
-        nodes[cur_node].set_prefix(nodes[cur_node].get_prefix(bs) + key.substr(i), bs);
+        set_prefix(cur_node, read_node(cur_node).get_prefix(bs) + key.substr(i));
         break;
       }
       cur_prefix_index = 1;
@@ -73,14 +93,14 @@ void state_persistent::set(const std::string& key, const std::string& value) {
       // If next path element does not match the next prefix element,
       // create a split node at the difference
       if (path_element !=
-          (unsigned char)nodes[cur_node].get_prefix(bs)[cur_prefix_index]) {
-        const std::string cur_node_prefix = nodes[cur_node].get_prefix(bs);
+          (unsigned char)read_node(cur_node).get_prefix(bs)[cur_prefix_index]) {
+        const std::string cur_node_prefix = read_node(cur_node).get_prefix(bs);
 
         // Backup necesery nodes before changes
         backup_nodes(cur_node);
         // Create the split_node and set up links with cur_node
-        uint32_t split_node = add_node(nodes[cur_node].get_parent(bs),
-            nodes[cur_node].get_prefix(bs)[0]);
+        uint32_t split_node = add_node(read_node(cur_node).get_parent(bs),
+            read_node(cur_node).get_prefix(bs)[0]);
         // Set split node as parent of cur_node
         nodes[cur_node].set_parent(split_node, bs);
         // Set the current node as child of the new split node
@@ -89,11 +109,11 @@ void state_persistent::set(const std::string& key, const std::string& value) {
         nodes[split_node].set_child(path_to_child, cur_node, bs);
 
         // set prefix of split_node and cur_node
-        nodes[split_node].set_prefix(cur_node_prefix.substr(0, cur_prefix_index), bs);
-        nodes[cur_node].set_prefix(cur_node_prefix.substr(cur_prefix_index), bs);
+        set_prefix(split_node, cur_node_prefix.substr(0, cur_prefix_index));
+        set_prefix(cur_node, cur_node_prefix.substr(cur_prefix_index));
 
-        // Recalculate the hash of the child part of the node that got split
-        calculate_hash(cur_node);
+        // Mark the child part of the node that got split for rehashing
+        mark_dirty(cur_node);
         // Create the new node from the split to the next path element
         cur_node = add_node(split_node, path_element);
         cur_prefix_index = 1;
@@ -104,14 +124,14 @@ void state_persistent::set(const std::string& key, const std::string& value) {
   }
 
   // We checked the whole key but there is still prefix left.
-  if ((nodes[cur_node].get_prefix(bs).length() != cur_prefix_index)
+  if ((read_node(cur_node).get_prefix(bs).length() != cur_prefix_index)
       && i == key.length()) {
     backup_nodes(cur_node);
-    const std::string cur_node_prefix = nodes[cur_node].get_prefix(bs);
+    const std::string cur_node_prefix = read_node(cur_node).get_prefix(bs);
 
     // Create the split_node and set up links with cur_node
-    uint32_t split_node = add_node(nodes[cur_node].get_parent(bs),
-        nodes[cur_node].get_prefix(bs)[0]);
+    uint32_t split_node = add_node(read_node(cur_node).get_parent(bs),
+        read_node(cur_node).get_prefix(bs)[0]);
     // Set split node as parent of cur_node
     nodes[cur_node].set_parent(split_node, bs);
 
@@ -120,24 +140,25 @@ void state_persistent::set(const std::string& key, const std::string& value) {
     nodes[split_node].set_child(path_to_child, cur_node, bs);
 
     // set prefix of split_node and cur_node
-    nodes[split_node].set_prefix(cur_node_prefix.substr(0, cur_prefix_index), bs);
-    nodes[cur_node].set_prefix(cur_node_prefix.substr(cur_prefix_index), bs);
+    set_prefix(split_node, cur_node_prefix.substr(0, cur_prefix_index));
+    set_prefix(cur_node, cur_node_prefix.substr(cur_prefix_index));
 
-    // Recalculate the hash of the child part of the node that got split
-    calculate_hash(cur_node);
+    // Mark the child part of the node that got split for rehashing
+    mark_dirty(cur_node);
     // Create the new node from the split to the next path element
     cur_node = split_node;
   }
 
   backup_nodes(cur_node);
-  // set the value and calculate the hash
-  nodes[cur_node].set_value(value, bs);
-  calculate_hash(cur_node);
+  // set the value and mark the path for rehashing
+  set_value(cur_node, value);
+  mark_dirty(cur_node);
 }
 
 std::string state_persistent::get_node_hash(const std::string& path) {
+  update_hashes();
   int32_t node_index = get_node_index(path);
-  return node_index == -1 ? "" : nodes[node_index].get_hash(bs);
+  return node_index == -1 ? "" : read_node(node_index).get_hash(bs);
 }
 
   std::vector<std::string> state_persistent::get_node_children(
@@ -149,10 +170,10 @@ std::string state_persistent::get_node_hash(const std::string& path) {
   }
   unsigned char i = 0;
   do {
-    if (nodes[node_index].get_child(i, bs)) {
-      uint32_t child = nodes[node_index].get_child(i, bs);
+    if (read_node(node_index).get_child(i, bs)) {
+      uint32_t child = read_node(node_index).get_child(i, bs);
       // TODO(Samir): potential bug ( big vs little endian)
-      result.push_back(std::string(nodes[child].get_prefix(bs)));
+      result.push_back(std::string(read_node(child).get_prefix(bs)));
     }
   } while (++i != 0);
   return result;
@@ -161,16 +182,16 @@ std::string state_persistent::get_node_hash(const std::string& path) {
 void state_persistent::delete_node_tree(const std::string& path) {
   // TODO(Samir): Implement delete subtrie ( subtrie of node with value only? )
   int32_t cur_node = get_node_index(path);
-  if (cur_node == -1 || nodes[cur_node].get_value(bs) == "") {
+  if (cur_node == -1 || read_node(cur_node).get_value(bs) == "") {
     throw std::out_of_range("In delete_node_tree: No set node at path: " + io::bin2hex(path));
   }
-  backup_nodes(nodes[cur_node].get_parent(bs));
+  backup_nodes(read_node(cur_node).get_parent(bs));
   subtrie_mark_free(cur_node);
 
   std::vector<unsigned char> children;
   unsigned char i = 0;
-  uint32_t parent = nodes[cur_node].get_parent(bs);
-  unsigned char path_from_parent = nodes[cur_node].get_prefix(bs)[0];
+  uint32_t parent = read_node(cur_node).get_parent(bs);
+  unsigned char path_from_parent = read_node(cur_node).get_prefix(bs)[0];
   nodes[parent].set_child(path_from_parent, 0, bs);
   free_locations.insert(cur_node);
   // move_last_element_to(cur_node);
@@ -179,25 +200,25 @@ void state_persistent::delete_node_tree(const std::string& path) {
   cur_node = parent;
   // TODO(Samir): add this and all child nodes to fragmented locations
   do {
-    if (nodes[cur_node].get_child(i, bs)) {
+    if (read_node(cur_node).get_child(i, bs)) {
       children.push_back(i);
     }
   } while (++i != 0);
   // If the parent of the deleted node has no prefix, has only one
   // child remaining and is not the root we will merge it with his child
-  if (nodes[cur_node].get_value(bs).length() == 0
+  if (read_node(cur_node).get_value(bs).length() == 0
       && children.size() == 1 && cur_node != 0) {
-    parent = nodes[cur_node].get_parent(bs);
-    uint32_t child = nodes[cur_node].get_child(children[0], bs);
+    parent = read_node(cur_node).get_parent(bs);
+    uint32_t child = read_node(cur_node).get_child(children[0], bs);
     backup_nodes(child);
 
     // set prefix
-    std::string new_perfix = nodes[child].get_prefix(bs);
-    new_perfix.insert(0, nodes[cur_node].get_prefix(bs));
-    nodes[child].set_prefix(new_perfix, bs);
+    std::string new_perfix = read_node(child).get_prefix(bs);
+    new_perfix.insert(0, read_node(cur_node).get_prefix(bs));
+    set_prefix(child, new_perfix);
 
     // link parent and child
-    path_from_parent = nodes[cur_node].get_prefix(bs)[0];
+    path_from_parent = read_node(cur_node).get_prefix(bs)[0];
     nodes[parent].set_child(path_from_parent, child, bs);
     nodes[child].set_parent(parent, bs);
     free_locations.insert(cur_node);
@@ -205,7 +226,7 @@ void state_persistent::delete_node_tree(const std::string& path) {
     // move_last_element_to(cur_node);
     cur_node = child;
   }
-  calculate_hash(cur_node);
+  mark_dirty(cur_node);
 }
 
 // 1. If multiple children -> set value to ""
@@ -215,7 +236,7 @@ void state_persistent::delete_node_tree(const std::string& path) {
 //      merge parent and its remaining child
 void state_persistent::erase(const std::string& path) {
   int32_t cur_node = get_node_index(path);
-  if (cur_node == -1 || nodes[cur_node].get_value(bs) == "") {
+  if (cur_node == -1 || read_node(cur_node).get_value(bs) == "") {
     throw std::out_of_range("In erase: No set node at path: " + io::bin2hex(path));
   }
 
@@ -224,26 +245,26 @@ void state_persistent::erase(const std::string& path) {
   std::vector<unsigned char> children;
   unsigned char i = 0;
   do {
-    if (nodes[cur_node].get_child(i, bs)) {
+    if (read_node(cur_node).get_child(i, bs)) {
       children.push_back(i);
     }
   } while (++i != 0);
 
   // If multiple children just erase the value
   if (children.size() > 1) {
-    nodes[cur_node].set_value("", bs);
+    set_value(cur_node, "");
   // If one child -> merge prefix into child, link parent and child
   } else if (children.size() == 1) {
-    uint32_t parent = nodes[cur_node].get_parent(bs);
-    uint32_t child = nodes[cur_node].get_child(children[0], bs);
+    uint32_t parent = read_node(cur_node).get_parent(bs);
+    uint32_t child = read_node(cur_node).get_child(children[0], bs);
     // backup the child before chaning it
     backup_nodes(child);
     // add the prefix of current node to the child
-    std::string new_perfix = nodes[child].get_prefix(bs);
-    new_perfix.insert(0, nodes[cur_node].get_prefix(bs));
-    nodes[child].set_prefix(new_perfix, bs);
+    std::string new_perfix = read_node(child).get_prefix(bs);
+    new_perfix.insert(0, read_node(cur_node).get_prefix(bs));
+    set_prefix(child, new_perfix);
     // link parent and child
-    unsigned char path_from_parent = nodes[cur_node].get_prefix(bs)[0];
+    unsigned char path_from_parent = read_node(cur_node).get_prefix(bs)[0];
     nodes[parent].set_child(path_from_parent, child, bs);
     nodes[child].set_parent(parent, bs);
     // Remember empty elements for later use
@@ -253,8 +274,8 @@ void state_persistent::erase(const std::string& path) {
   // If no child -> remove element and handle parent cases
   } else {
     // erase the link from parent
-    uint32_t parent = nodes[cur_node].get_parent(bs);
-    unsigned char path_from_parent = nodes[cur_node].get_prefix(bs)[0];
+    uint32_t parent = read_node(cur_node).get_parent(bs);
+    unsigned char path_from_parent = read_node(cur_node).get_prefix(bs)[0];
     nodes[parent].set_child(path_from_parent, 0, bs);
     free_locations.insert(cur_node);
     // move_last_element_to(cur_node);
@@ -263,23 +284,23 @@ void state_persistent::erase(const std::string& path) {
     cur_node = parent;
     unsigned char z = 0;
     do {
-      if (nodes[cur_node].get_child(z, bs)) {
+      if (read_node(cur_node).get_child(z, bs)) {
         children.push_back(z);
       }
     } while (++z != 0);
     // If the parent of the deleted node has no prefix, has only one
     // child remaining and is not the root we will merge it with his child
-    if (nodes[cur_node].get_value(bs).length() == 0
+    if (read_node(cur_node).get_value(bs).length() == 0
         && children.size() == 1 && cur_node != 0) {
-      parent = nodes[cur_node].get_parent(bs);
-      uint32_t child = nodes[cur_node].get_child(children[0], bs);
+      parent = read_node(cur_node).get_parent(bs);
+      uint32_t child = read_node(cur_node).get_child(children[0], bs);
       backup_nodes(child);
-      std::string new_perfix = nodes[child].get_prefix(bs);
-      new_perfix.insert(0, nodes[cur_node].get_prefix(bs));
-      nodes[child].set_prefix(new_perfix, bs);
+      std::string new_perfix = read_node(child).get_prefix(bs);
+      new_perfix.insert(0, read_node(cur_node).get_prefix(bs));
+      set_prefix(child, new_perfix);
 
       // link parent and child
-      path_from_parent = nodes[cur_node].get_prefix(bs)[0];
+      path_from_parent = read_node(cur_node).get_prefix(bs)[0];
       nodes[parent].set_child(path_from_parent, child, bs);
       nodes[child].set_parent(parent, bs);
       free_locations.insert(cur_node);
@@ -287,14 +308,37 @@ void state_persistent::erase(const std::string& path) {
       cur_node = child;
     }
   }
-  calculate_hash(cur_node);
+  mark_dirty(cur_node);
+}
+
+std::string state_persistent::root_hash() {
+  update_hashes();
+  return read_node(0).get_hash(bs);
 }
 
 void state_persistent::commit_changes() {
+  commit_changes(true);
+}
+
+void state_persistent::commit_changes(bool sync) {
+  // Hashes have to be up to date before nodes are moved around
+  update_hashes();
   // Erase backups
   backup.clear();
+  // Nothing refers to released blobs any more
+  for (uint32_t location : free_locations) {
+    release_blobs(read_node(location));
+  }
+  for (uint64_t id : released_blobs) {
+    bs->free(id);
+  }
+  released_blobs.clear();
+  created_blobs.clear();
   if (free_locations.empty()) {
     permanent_nodes_count = static_cast<uint32_t>(nodes.size());
+    if (log) {
+      log->commit(sync);
+    }
     return;
   }
   // If we have fragmented, move not deleted elements from
@@ -309,27 +353,39 @@ void state_persistent::commit_changes() {
     if (last_element == *rit_high) {
       rit_high++;
     } else {
-      nodes[*it_low] = nodes[last_element];
-      uint32_t parent = nodes[last_element].get_parent(bs);
-      uint8_t path_from_parent = nodes[last_element].get_prefix(bs)[0];
+      nodes[*it_low] = read_node(last_element);
+      uint32_t parent = read_node(last_element).get_parent(bs);
+      uint8_t path_from_parent = read_node(last_element).get_prefix(bs)[0];
       nodes[parent].set_child(path_from_parent, *it_low, bs);
       it_low++;
     }
     last_element--;
   }
-  nodes[*it_low] = nodes[last_element];
+  nodes[*it_low] = read_node(last_element);
 
   nodes.resize(nodes.size() - empty_elements);
   permanent_nodes_count = static_cast<uint32_t>(nodes.size());
   free_locations.clear();
+  if (log) {
+    log->commit(sync);
+  }
 }
 
 void state_persistent::discard_changes() {
   for (auto it = backup.begin(); it != backup.end(); ++it) {
-    nodes[it->first] = it->second;
+    if (it->first < permanent_nodes_count) {
+      nodes[it->first] = it->second;
+    }
   }
+  backup.clear();
   nodes.resize(permanent_nodes_count);
   free_locations.clear();
+  dirty_nodes.clear();
+  for (uint64_t id : created_blobs) {
+    bs->free(id);
+  }
+  created_blobs.clear();
+  released_blobs.clear();
 }
 
 uint32_t state_persistent::hash_size() {
@@ -338,7 +394,7 @@ uint32_t state_persistent::hash_size() {
 
 void state_persistent::print_subtrie(std::string path, std::string formated_path) {
   std::cout << formated_path << " prefix: " <<
-      io::bin2hex(nodes[get_node_index(path)].get_prefix(bs)) << " value: " << get(path)
+      io::bin2hex(read_node(get_node_index(path)).get_prefix(bs)) << " value: " << get(path)
       << " hash: " << io::bin2hex(get_node_hash(path)) << std::endl << std::endl;
   std::vector<std::string> children = get_node_children(path);
   for (auto i : children) {
@@ -350,6 +406,17 @@ uint32_t state_persistent::size() {
   return static_cast<uint32_t>(nodes.size());
 }
 
+void state_persistent::set_worker_hashers(
+    const std::vector<crypto::hash_transformation*>& hashers) {
+  workers.reset();
+  if (!hashers.empty()) {
+    workers.reset(new hash_workers(
+        [this](uint32_t cur_node, crypto::hash_transformation* h) {
+          update_subtrie_hashes(cur_node, h);
+        }, hashers));
+  }
+}
+
 // TODO(Samir): Remove all calls to substring
 int32_t state_persistent::get_node_index(const std::string& path) {
   uint32_t cur_node = 0;
@@ -359,23 +426,23 @@ int32_t state_persistent::get_node_index(const std::string& path) {
     key_ended_at_edge = false;
     uint8_t path_element = path[i];
     // if no prefix keep looking
-    if ((int32_t)nodes[cur_node].get_prefix(bs).length()-1 <= 0) {
-      if (nodes[cur_node].get_child(path_element, bs) == 0) {
+    if ((int32_t)read_node(cur_node).get_prefix(bs).length()-1 <= 0) {
+      if (read_node(cur_node).get_child(path_element, bs) == 0) {
         return -1;
       }
-      cur_node = nodes[cur_node].get_child(path_element, bs);
+      cur_node = read_node(cur_node).get_child(path_element, bs);
       key_ended_at_edge = true;
     // else compare prefix with remaining path and decide what to do
     } else {
       // if prefix is shorter than remaining path, compare them.
-      if ((int32_t)nodes[cur_node].get_prefix(bs).length()-1 <
+      if ((int32_t)read_node(cur_node).get_prefix(bs).length()-1 <
           (int32_t)path.length() - (int32_t)i) {
-        if (nodes[cur_node].get_prefix(bs) ==
-            path.substr(i-1, nodes[cur_node].get_prefix(bs).length())) {
-          i += (int32_t)nodes[cur_node].get_prefix(bs).length()-1;
+        if (read_node(cur_node).get_prefix(bs) ==
+            path.substr(i-1, read_node(cur_node).get_prefix(bs).length())) {
+          i += (int32_t)read_node(cur_node).get_prefix(bs).length()-1;
           path_element = path[i];
-          if (nodes[cur_node].get_child(path_element, bs)) {
-            cur_node = nodes[cur_node].get_child(path_element, bs);
+          if (read_node(cur_node).get_child(path_element, bs)) {
+            cur_node = read_node(cur_node).get_child(path_element, bs);
             key_ended_at_edge = true;
           } else {
             return -1;
@@ -384,9 +451,9 @@ int32_t state_persistent::get_node_index(const std::string& path) {
           return -1;
         }
       // if prefix length is equal to remaining path compare
-      } else if ((int32_t)nodes[cur_node].get_prefix(bs).length()-1
+      } else if ((int32_t)read_node(cur_node).get_prefix(bs).length()-1
             == (int32_t)path.length() - (int32_t)i) {
-        if (nodes[cur_node].get_prefix(bs) == path.substr(i-1)) {
+        if (read_node(cur_node).get_prefix(bs) == path.substr(i-1)) {
           return cur_node;
         } else {
           return -1;
@@ -397,16 +464,49 @@ int32_t state_persistent::get_node_index(const std::string& path) {
       }
     }
   }
-  if (key_ended_at_edge && (int32_t)nodes[cur_node].get_prefix(bs).length()-1) {
+  if (key_ended_at_edge && (int32_t)read_node(cur_node).get_prefix(bs).length()-1) {
     return -1;
   }
   return cur_node;
 }
 
 
+void state_persistent::set_prefix(uint32_t node_index,
+                                  const std::string& prefix) {
+  node& n = nodes[node_index];
+  if (n.prefix_.in_blobstore()) {
+    released_blobs.push_back(n.prefix_.blob_id);
+  }
+  n.set_prefix(prefix, bs);
+  if (n.prefix_.in_blobstore()) {
+    created_blobs.push_back(n.prefix_.blob_id);
+  }
+}
+
+void state_persistent::set_value(uint32_t node_index,
+                                 const std::string& value) {
+  node& n = nodes[node_index];
+  if (n.value_.in_blobstore()) {
+    released_blobs.push_back(n.value_.blob_id);
+  }
+  n.set_value(value, bs);
+  if (n.value_.in_blobstore()) {
+    created_blobs.push_back(n.value_.blob_id);
+  }
+}
+
+void state_persistent::release_blobs(const node& n) {
+  if (n.prefix_.in_blobstore()) {
+    released_blobs.push_back(n.prefix_.blob_id);
+  }
+  if (n.value_.in_blobstore()) {
+    released_blobs.push_back(n.value_.blob_id);
+  }
+}
+
 bool state_persistent::has_children(uint32_t node_index) {
   for (unsigned int i = 0; i < 256; ++i) {
-    if (nodes[node_index].get_child(static_cast<uint8_t>(i), bs)) {
+    if (read_node(node_index).get_child(static_cast<uint8_t>(i), bs)) {
       return true;
     }
   }
@@ -423,71 +523,115 @@ uint32_t state_persistent::add_node(uint32_t from, unsigned char to) {
     auto it_fragmented_locations =  free_locations.begin();
     backup_nodes(*it_fragmented_locations);
     new_node = *it_fragmented_locations;
+    release_blobs(read_node(new_node));
     // TODO(Samir): change to emplace(node)
     nodes[new_node] = node();
     free_locations.erase(it_fragmented_locations);
   }
   nodes[from].set_child(to, new_node, bs);
   nodes[new_node].set_parent(from, bs);
-  nodes[new_node].set_prefix(std::string(reinterpret_cast<char*>(&to), 1), bs);
+  set_prefix(new_node, std::string(reinterpret_cast<char*>(&to), 1));
   return new_node;
 }
 
-void state_persistent::calculate_hash(uint32_t cur_node) {
-  const uint8_t *value;
-  const uint8_t *prefix;
-  const uint8_t *child_hash;
+void state_persistent::mark_dirty(uint32_t cur_node) {
+  // Walk all the way to the root. Nodes may have been relinked under a new
+  // parent since they were marked, so a dirty node does not guarantee that
+  // its ancestors are dirty.
+  while (true) {
+    dirty_nodes.insert(cur_node);
+    if (cur_node == 0) {
+      break;
+    }
+    cur_node = read_node(cur_node).get_parent(bs);
+  }
+}
+
+void state_persistent::update_hashes() {
+  if (!dirty_nodes.count(0)) {
+    dirty_nodes.clear();
+    return;
+  }
+  // Marking a record as changed is not safe from several threads, so all of
+  // them are marked here and the hashes are written through marked_node()
+  for (uint32_t node_index : dirty_nodes) {
+    nodes[node_index];
+  }
+  if (!workers || dirty_nodes.size() < hash_workers::PARALLEL_HASHING_THRESHOLD) {
+    update_subtrie_hashes(0, hasher);
+    dirty_nodes.clear();
+    return;
+  }
 
-  uint32_t len = 0;
-  hasher->restart();  // just in case
+  // The nodes above the subtries are hashed afterwards on this thread,
+  // deepest first.
+  std::vector<uint32_t> subtries;
+  std::vector<uint32_t> above = workers->split(
+      [this](uint32_t cur_node, const std::function<void(uint32_t)>& f) {
+        for (int _i = 0; _i < 256; _i++) {
+          uint32_t child = read_node(cur_node).get_child(static_cast<uint8_t>(_i), bs);
+          if (child && dirty_nodes.count(child)) {
+            f(child);
+          }
+        }
+      }, &subtries);
+  workers->run(subtries, hasher);
+  for (auto it = above.rbegin(); it != above.rend(); ++it) {
+    calculate_hash(*it, hasher);
+  }
+  dirty_nodes.clear();
+}
+
+void state_persistent::update_subtrie_hashes(uint32_t cur_node,
+    crypto::hash_transformation* h) {
+  for (int _i = 0; _i < 256; _i++) {
+    uint32_t child = read_node(cur_node).get_child(static_cast<uint8_t>(_i), bs);
+    if (child && dirty_nodes.count(child)) {
+      update_subtrie_hashes(child, h);
+    }
+  }
+  calculate_hash(cur_node, h);
+}
+
+void state_persistent::calculate_hash(uint32_t cur_node,
+    crypto::hash_transformation* h) {
+  node& n = marked_node(cur_node);
   // If we are at root and we have no children the hash will be ""
   if (!cur_node && !has_children(cur_node)) {
-    nodes[cur_node].set_hash("", bs);
+    n.set_hash("", bs);
     return;
   }
 
-  // Hash the value
-  std::string str_value = nodes[cur_node].get_value(bs);
-  value =
-      reinterpret_cast<const uint8_t*>(str_value.data());
-  len = static_cast<uint32_t>(nodes[cur_node].get_value(bs).length());
-  hasher->update(value, len);
-
-  // Hash the prefix
-  std::string str_prefix = nodes[cur_node].get_prefix(bs);
-  prefix =
-      reinterpret_cast<const uint8_t*>(str_prefix.data());
-  len = static_cast<uint32_t>(nodes[cur_node].get_prefix(bs).length());
-  hasher->update(prefix, len);
-  // Hash the children hashes
+  // Hash the value, the prefix and the children hashes in a single call
+  std::string value = n.get_value(bs);
+  std::string prefix = n.get_prefix(bs);
+  crypto::hash_transformation::input_span spans[2 + 256];
+  size_t count = 0;
+  spans[count++] = {reinterpret_cast<const uint8_t*>(value.data()),
+      value.length()};
+  spans[count++] = {reinterpret_cast<const uint8_t*>(prefix.data()),
+      prefix.length()};
   for (int _i = 0; _i < 256; _i++) {
-    uint8_t i = static_cast<uint8_t>(_i);
-    if (nodes[cur_node].get_child(i, bs)) {
-      uint32_t child = nodes[cur_node].get_child(i, bs);
-
-      std::string str_child_hash = nodes[child].get_hash(bs);
-      child_hash = reinterpret_cast<const uint8_t*>(str_child_hash.data());
-      len = static_cast<uint32_t>(nodes[child].get_hash(bs).length());
-      hasher->update(child_hash, len);
+    uint32_t child = n.get_child(static_cast<uint8_t>(_i), bs);
+    if (child) {
+      const node& c = read_node(child);
+      spans[count++] = {c.hash_, c.hash_size_};
     }
   }
-  uint8_t * digest = new uint8_t[hasher->digest_size()];
-  hasher->final(digest);
-  nodes[cur_node].set_hash(
-      std::string(reinterpret_cast<char*>(digest), hasher->digest_size()), bs);
-  delete[] digest;
-  if (cur_node != 0) {
-    calculate_hash(nodes[cur_node].get_parent(bs));
-  }
+  std::string digest(h->digest_size(), '\0');
+  h->restart();  // just in case
+  h->update_batch(spans, count);
+  h->final(reinterpret_cast<uint8_t*>(&digest[0]));
+  n.set_hash(digest, bs);
 }
 
 void state_persistent::backup_nodes(uint32_t cur_node) {
   // Insert element if it is not in the map. If sucsessfully inserted keep
   // calling backup_nodes on the parent unless we have reached the root
   if (backup.insert(std::make_pair((int32_t)cur_node,
-      nodes[cur_node])).second && cur_node
+      read_node(cur_node))).second && cur_node
       && cur_node < permanent_nodes_count) {
-    backup_nodes(nodes[cur_node].get_parent(bs));
+    backup_nodes(read_node(cur_node).get_parent(bs));
   }
 }
 
@@ -495,58 +639,52 @@ void state_persistent::subtrie_mark_free(uint32_t cur_node) {
   uint8_t child = 0;
   free_locations.insert(cur_node);
   do {
-    if (nodes[cur_node].get_child(child, bs)) {
-      subtrie_mark_free(nodes[cur_node].get_child(child, bs));
+    if (read_node(cur_node).get_child(child, bs)) {
+      subtrie_mark_free(read_node(cur_node).get_child(child, bs));
     }
   } while (++child != 0);
   return;
 }
 
 
-uint32_t state_persistent::node::get_parent(storage::blobstore * _bs) {
-  uint32_t sz;
-  uint8_t* p_parent = _bs->get(parent_, &sz);
-  return *(reinterpret_cast<uint32_t*>(p_parent));
+uint32_t state_persistent::node::get_parent(storage::blobstore * _bs) const {
+  return parent_;
 }
 
-std::string state_persistent::node::get_prefix(storage::blobstore * _bs) {
-  uint32_t sz;
-  uint8_t* p_prefix = _bs->get(prefix_, &sz);
-  return std::string(reinterpret_cast<char*>(p_prefix), sz);
+std::string state_persistent::node::get_prefix(storage::blobstore * _bs) const {
+  return get_field(prefix_, _bs);
 }
 
-std::string state_persistent::node::get_hash(storage::blobstore * _bs) {
-  uint32_t sz;
-  uint8_t* p_hash = _bs->get(hash_, &sz);
-  return std::string(reinterpret_cast<char*>(p_hash), sz);
-  // return hash_;
+std::string state_persistent::node::get_hash(storage::blobstore * _bs) const {
+  return std::string(reinterpret_cast<const char*>(hash_), hash_size_);
 }
 
-std::string state_persistent::node::get_value(storage::blobstore * _bs) {
-  uint32_t sz;
-  uint8_t* p_value = _bs->get(value_, &sz);
-  return std::string(reinterpret_cast<char*>(p_value), sz);
+std::string state_persistent::node::get_value(storage::blobstore * _bs) const {
+  return get_field(value_, _bs);
 }
 
-uint32_t state_persistent::node::get_child(uint8_t child, storage::blobstore * _bs) {
+uint32_t state_persistent::node::get_child(uint8_t child, storage::blobstore * _bs) const {
   return children_[child];
 }
 
 void state_persistent::node::set_parent(uint32_t parent, storage::blobstore * _bs) {
-  parent_ = static_cast<uint32_t>(_bs->store(sizeof(uint32_t), reinterpret_cast<uint8_t*>(&parent)));
+  parent_ = parent;
 }
 
-void state_persistent::node::set_prefix(const std::string prefix, storage::blobstore * _bs) {
-  prefix_ = _bs->store(static_cast<uint32_t>(prefix.length()), reinterpret_cast<const uint8_t*>(prefix.data()));
+void state_persistent::node::set_prefix(const std::string& prefix, storage::blobstore * _bs) {
+  set_field(&prefix_, prefix, _bs);
 }
 
-void state_persistent::node::set_hash(const std::string hash, storage::blobstore * _bs) {
-  hash_ = _bs->store(static_cast<uint32_t>(hash.length()), reinterpret_cast<const uint8_t*>(hash.data()));
+void state_persistent::node::set_hash(const std::string& hash, storage::blobstore * _bs) {
+  if (hash.length() > MAX_HASH_SIZE) {
+    throw std::invalid_argument("Hash is larger than " + std::to_string(MAX_HASH_SIZE) + " bytes");
+  }
+  hash_size_ = static_cast<uint32_t>(hash.length());
+  std::memcpy(hash_, hash.data(), hash.length());
 }
 
-void state_persistent::node::set_value(const std::string value, storage::blobstore * _bs) {
-  value_ = _bs->store(static_cast<uint32_t>(value.length()),
-    reinterpret_cast<const uint8_t*>(value.data()));
+void state_persistent::node::set_value(const std::string& value, storage::blobstore * _bs) {
+  set_field(&value_, value, _bs);
 }
 
 void state_persistent::node::set_child(const uint8_t child,
@@ -555,6 +693,24 @@ void state_persistent::node::set_child(const uint8_t child,
   children_[child] = value;
 }
 
+std::string state_persistent::node::get_field(const field& f, storage::blobstore * _bs) {
+  if (!f.in_blobstore()) {
+    return std::string(reinterpret_cast<const char*>(f.data), f.length);
+  }
+  uint32_t sz;
+  uint8_t* p_data = _bs->get(f.blob_id, &sz);
+  return std::string(reinterpret_cast<char*>(p_data), sz);
+}
+
+void state_persistent::node::set_field(field* f, const std::string& data, storage::blobstore * _bs) {
+  f->length = static_cast<uint32_t>(data.length());
+  if (f->in_blobstore()) {
+    f->blob_id = _bs->store(f->length, reinterpret_cast<const uint8_t*>(data.data()));
+  } else {
+    std::memcpy(f->data, data.data(), data.length());
+  }
+}
+
 }  // namespace state
 }  // namespace core
 }  // namespace automaton
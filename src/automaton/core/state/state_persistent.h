@@ -3,14 +3,17 @@
 
 #include <cstdint>
 #include <map>
+#include <memory>
 #include <set>
 #include <string>
 #include <vector>
 
 #include "automaton/core/crypto/hash_transformation.h"
+#include "automaton/core/state/hash_workers.h"
 #include "automaton/core/state/state.h"
 #include "automaton/core/storage/persistent_blobstore.h"
 #include "automaton/core/storage/persistent_vector.h"
+#include "automaton/core/storage/write_ahead_log.h"
 
 namespace automaton {
 namespace core {
@@ -19,9 +22,15 @@ namespace state {
 class state_persistent : public state {
  public:
   class node;
+  // Opens the state stored in p_nodes and bs, or creates an empty one if
+  // p_nodes is empty. If log is set, p_nodes and bs have to be mapped with it
+  // and every commit_changes() is written to it as one transaction.
+  // Throws std::runtime_error if p_nodes was written with a different node
+  // record layout.
   state_persistent(crypto::hash_transformation* hasher,
                   storage::blobstore* bs,
-                  storage::persistent_vector<node>* p_nodes);
+                  storage::persistent_vector<node>* p_nodes,
+                  storage::write_ahead_log* log = nullptr);
 
   // Get the value at given path. Empty string if no value is set or
   // there is no node at the given path
@@ -34,6 +43,10 @@ class state_persistent : public state {
   // set or there is no node at the given path
   std::string get_node_hash(const std::string& path);
 
+  // Get the hash of the root node, rehashing all nodes changed since the last
+  // time hashes were requested
+  std::string root_hash();
+
   // Get the children as chars //TODO(Samir:) change to to return sting path to
   // children with value.
   std::vector<std::string> get_node_children(const std::string& path);
@@ -47,6 +60,10 @@ class state_persistent : public state {
   // finalizes the changes made by set
   void commit_changes();
 
+  // finalizes the changes made by set. If sync is false, making them durable
+  // is left to the group commit of the log.
+  void commit_changes(bool sync);
+
   // discards the changes made by set;
   void discard_changes();
 
@@ -58,35 +75,72 @@ class state_persistent : public state {
 
   uint32_t size();
 
+  // Enables hashing independent subtrees in parallel when the number of
+  // changed nodes is large, like state_impl::set_worker_hashers(). Starts one
+  // worker thread per given hasher, which must be of the same type as the main
+  // one. Ownership of the hashers is not taken.
+  void set_worker_hashers(const std::vector<crypto::hash_transformation*>&
+      hashers);
 
+  // Node record stored in the persistent vector. The parent, the hash and
+  // prefixes/values of up to INLINE_SIZE bytes are kept in the record itself,
+  // only longer prefixes/values are stored in the blobstore.
   class node {
    public:
-     uint32_t get_parent(storage::blobstore* bs);
+    // Version of this record layout. Files written before fields were inlined
+    // have no version.
+    static const uint64_t VERSION = 2;
+    static const uint32_t INLINE_SIZE = 40;
+    static const uint32_t MAX_HASH_SIZE = 64;
+
+    // Byte string stored inline if it fits, otherwise as a blob.
+    struct field {
+      uint32_t length = 0;
+      union {
+        uint8_t data[INLINE_SIZE] = {};
+        uint64_t blob_id;
+      };
+
+      bool in_blobstore() const {
+        return length > INLINE_SIZE;
+      }
+    };
 
-     std::string get_prefix(storage::blobstore* bs);
+     uint32_t get_parent(storage::blobstore* bs) const;
 
-     std::string get_hash(storage::blobstore* bs);
+     std::string get_prefix(storage::blobstore* bs) const;
 
-     std::string get_value(storage::blobstore* bs);
+     std::string get_hash(storage::blobstore* bs) const;
 
-     uint32_t get_child(uint8_t child, storage::blobstore* bs);
+     std::string get_value(storage::blobstore* bs) const;
+
+     uint32_t get_child(uint8_t child, storage::blobstore* bs) const;
 
      void set_parent(uint32_t parent, storage::blobstore* bs);
 
-     void  set_prefix(const std::string prefix, storage::blobstore* bs);
+     // Stores the prefix in the node or in bs. Blobs previously used by the
+     // prefix are not freed, this is left to the caller.
+     void  set_prefix(const std::string& prefix, storage::blobstore* bs);
 
-     void  set_hash(const std::string hash, storage::blobstore* bs);
+     void  set_hash(const std::string& hash, storage::blobstore* bs);
 
-     void set_value(const std::string value, storage::blobstore* bs);
+     // Stores the value in the node or in bs. Blobs previously used by the
+     // value are not freed, this is left to the caller.
+     void set_value(const std::string& value, storage::blobstore* bs);
 
      void set_child(const uint8_t child, const uint32_t value, storage::blobstore* bs);
 
    public:
     uint32_t parent_ = 0;
-    uint64_t prefix_ = 0;
-    uint64_t hash_ = 0;
-    uint64_t value_ = 0;
+    uint32_t hash_size_ = 0;
+    uint8_t hash_[MAX_HASH_SIZE] = {};
+    field prefix_;
+    field value_;
     uint32_t children_[256] = {};
+
+   private:
+    static std::string get_field(const field& f, storage::blobstore* bs);
+    static void set_field(field* f, const std::string& data, storage::blobstore* bs);
   };
 
  private:
@@ -94,18 +148,51 @@ class state_persistent : public state {
 
   storage::persistent_vector<node>* p_nodes;
 
+  storage::write_ahead_log* log;
+
   std::map<uint32_t, node> backup;
   std::set<uint32_t> free_locations;
+  // Blobs that were replaced or whose nodes were deleted since the last commit.
+  // They are freed on commit, as backups may still refer to them until then.
+  std::vector<uint64_t> released_blobs;
+  // Blobs created since the last commit, freed if the changes are discarded.
+  std::vector<uint64_t> created_blobs;
+  // Nodes whose hash or one of its descendants' hashes is out of date
+  std::set<uint32_t> dirty_nodes;
   crypto::hash_transformation* hasher;
+  // Threads that rehash subtries for update_hashes(), null until
+  // set_worker_hashers() is called
+  std::unique_ptr<hash_workers> workers;
   uint32_t nodes_current_state;
   uint32_t permanent_nodes_count;
 
+  // Read-only access to a node, doesn't mark its record as changed
+  const node& read_node(uint32_t node_index) const {
+    return static_cast<const storage::persistent_vector<node>&>(*p_nodes)[node_index];
+  }
+  // Write access to a node whose record update_hashes() already marked as
+  // changed. Unlike marking, this is safe from several threads.
+  node& marked_node(uint32_t node_index) {
+    return const_cast<node&>(read_node(node_index));
+  }
   int32_t get_node_index(const std::string& path);
   bool has_children(uint32_t node_index);
+  // Set the prefix or the value of a node keeping track of the blobs used.
+  void set_prefix(uint32_t node_index, const std::string& prefix);
+  void set_value(uint32_t node_index, const std::string& value);
+  // Mark the blobs used by the node as released
+  void release_blobs(const node& n);
   uint32_t add_node(uint32_t from, unsigned char to);
-  // This needs to be called at the end of set() and erase() to recalculate the
-  // hashes of all nodes from lowest child that was changed to the root
-  void calculate_hash(uint32_t cur_node);
+  // This needs to be called at the end of set() and erase() to mark all nodes
+  // from the lowest child that was changed to the root for rehashing. Hashes
+  // are recalculated by update_hashes() when they are requested.
+  void mark_dirty(uint32_t cur_node);
+  // Rehashes every dirty node exactly once, bottom-up
+  void update_hashes();
+  // Rehashes the dirty nodes in the subtrie of cur_node using the given hasher
+  void update_subtrie_hashes(uint32_t cur_node, crypto::hash_transformation* h);
+  // Calculates the hash of a single node from its children's hashes
+  void calculate_hash(uint32_t cur_node, crypto::hash_transformation* h);
   // Create a backup starting from cur_node to root if they are not
   // in the backup map
   void backup_nodes(uint32_t cur_node);
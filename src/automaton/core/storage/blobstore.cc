@@ -7,7 +7,7 @@ namespace core {
 namespace storage {
 
 blobstore::blobstore()
-    : next_free(0)
+    : next_free(1)
     , capacity(0) {
   // TODO(Samir): Remove from constructor and do it when creating blob
   storage = new uint32_t[1ULL << 28];
@@ -57,7 +57,7 @@ uint8_t* blobstore::get(const uint64_t id, uint32_t* size) {
   return reinterpret_cast<uint8_t*>(&storage[id + 1]);
 }
 
-bool blobstore::free(const uint32_t id) {
+bool blobstore::free(const uint64_t id) {
   // TODO(Samir): Change storage to unt8_t. Mark deleted nodes with *= -1
   storage[id] = 0;
   return 1;
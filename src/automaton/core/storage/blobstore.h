@@ -15,16 +15,17 @@ There are no protections. The pointer points to the internal memory.
 class blobstore{
  public:
   blobstore();
-  ~blobstore();
+  virtual ~blobstore();
 
   /**
   Stores the byte array pointed by data
 
-  @returns    uint64_t  returns the ID used to access it.
+  @returns    uint64_t  returns the ID used to access it. IDs are never 0,
+                        the first word of the storage is reserved.
   @param[in]  size      The size of the data pointed by data in bytes
   @param[out] data      Pointer to the data
   */
-  uint64_t store(const uint32_t size, const uint8_t* data);
+  virtual uint64_t store(const uint32_t size, const uint8_t* data);
 
   /**
   Used to get access to previously allocated blob.
@@ -34,7 +35,7 @@ class blobstore{
   @param[out] size      The size of the data pointed by the returned
   pointer in bytes
   */
-  uint8_t* get(const uint64_t id, uint32_t* size);
+  virtual uint8_t* get(const uint64_t id, uint32_t* size);
 
   /**
   Frees allocated blob.
@@ -42,7 +43,7 @@ class blobstore{
   @returns    bool      False if there is no allocated blob with the given id
   @param[in]  id        The ID returned by create_blob
   */
-  bool free(const uint32_t id);
+  virtual bool free(const uint64_t id);
 
  private:
   uint32_t* storage;
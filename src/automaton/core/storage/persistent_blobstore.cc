@@ -1,9 +1,10 @@
 #include "automaton/core/storage/persistent_blobstore.h"
 
+#include <cstring>
+#include <stdexcept>
 #include <string>
+#include <unordered_map>
 
-#include <boost/filesystem.hpp>
-#include <boost/iostreams/device/mapped_file.hpp>
 
 namespace automaton {
 namespace core {
@@ -11,17 +12,11 @@ namespace storage {
 
 persistent_blobstore::persistent_blobstore()
     : is_mapped(false)
-    // , header_size(1024)
-    , cur_version(10000)
-    , next_free(1024/4)
-    , capacity(1024) {
-  // TODO(samir): Remove from constructor and do it when creating blob
-  // storage = new uint32_t[1ULL << 28];
-  // capacity = 1ULL << 28;
+    , cur_version(10002) {
 }
 
 persistent_blobstore::~persistent_blobstore() {
-  mmf.close();
+  file.close();
 }
 
 uint8_t* persistent_blobstore::create_blob(const uint32_t size, uint64_t* id) {
@@ -30,24 +25,31 @@ uint8_t* persistent_blobstore::create_blob(const uint32_t size, uint64_t* id) {
   }
 
   uint32_t size_in_int32 =  size % 4 ? size / 4 + 1 : size / 4;
-  *id = next_free;
-  // When the capacity is not large enough to store the required blob,
-  // allocate a new memory block with double the size and copy the data.
-  if (next_free + size_in_int32 >= capacity) {
-    close_mapped_file();
-    capacity *= 2;
-    boost::filesystem::path boost_path(file_path);
-    boost::filesystem::resize_file(boost_path, capacity*sizeof(int32_t));
-    open_mapped_file();
+  size_in_int32 += size_in_int32 % 2;
+  if (size_in_int32 < MIN_BLOB_WORDS) {
+    size_in_int32 = MIN_BLOB_WORDS;
   }
-  // Save the size of the blob
-  storage[next_free] = size;
-  // set the pointer to point to the blob
-  uint8_t* out_blob_pointer = reinterpret_cast<uint8_t*>(&storage[next_free+1]);
-  // next free equal to byte after the end of the blob
-  next_free += size_in_int32 + 1;
 
-  return out_blob_pointer;
+  *id = pop_free(size_in_int32);
+  if (*id != 0) {
+    uint32_t* reused = word(*id);
+    // Give the tail back if it is large enough to hold another blob
+    if (reused[0] - size_in_int32 >= BLOB_HEADER_WORDS + MIN_BLOB_WORDS) {
+      uint32_t rest = reused[0] - size_in_int32 - BLOB_HEADER_WORDS;
+      reused[0] = size_in_int32;
+      push_free(*id + BLOB_HEADER_WORDS + size_in_int32, rest);
+    }
+    get_header()->free_words -= reused[0] + BLOB_HEADER_WORDS;
+  } else {
+    *id = append(BLOB_HEADER_WORDS + size_in_int32);
+    word(*id)[0] = size_in_int32;
+  }
+  uint32_t* blob = word(*id);
+  // Save the size of the blob
+  blob[1] = size;
+  changed(*id, BLOB_HEADER_WORDS + blob[0]);
+  changed(0, HEADER_WORDS);
+  return reinterpret_cast<uint8_t*>(&blob[BLOB_HEADER_WORDS]);
 }
 
 uint64_t persistent_blobstore::store(const uint32_t size, const uint8_t* data) {
@@ -57,7 +59,9 @@ uint64_t persistent_blobstore::store(const uint32_t size, const uint8_t* data) {
 
   uint64_t id = 0;
   uint8_t* blob = create_blob(size, &id);
-  std::memcpy(blob, data, size);
+  if (size > 0) {
+    std::memcpy(blob, data, size);
+  }
   return id;
 }
 
@@ -67,67 +71,192 @@ uint8_t* persistent_blobstore::get(const uint64_t id, uint32_t* size) {
   }
 
   // check if id is out of range
-  if (id+1 >= capacity) {
+  if (id < HEADER_WORDS || id + BLOB_HEADER_WORDS > get_header()->next_free) {
     throw std::out_of_range("Object out of range");
   }
-  *size = storage[id];
-  if (*size <= 0) {
+  uint32_t* blob = word(id);
+  *size = blob[1];
+  if (*size == FREE_BLOB) {
+    *size = 0;
+  }
+  if (*size == 0) {
     return nullptr;
   }
-  return reinterpret_cast<uint8_t*>(&storage[id + 1]);
+  return reinterpret_cast<uint8_t*>(&blob[BLOB_HEADER_WORDS]);
 }
 
-bool persistent_blobstore::free(const uint32_t id) {
+bool persistent_blobstore::free(const uint64_t id) {
   if (is_mapped == false) {
     throw std::logic_error("not mapped");;
   }
-  if (id + 1 >= capacity) {
+  if (id < HEADER_WORDS || id + BLOB_HEADER_WORDS > get_header()->next_free) {
     throw std::out_of_range("Object out of range");
   }
-  // TODO(samir): Change storage to unt8_t. Mark deleted nodes with *= -1
-  storage[id] = storage[id] * (-1);
-  return 1;
+  uint32_t* blob = word(id);
+  if (blob[1] == FREE_BLOB) {
+    return false;
+  }
+  push_free(id, blob[0]);
+  get_header()->free_words += blob[0] + BLOB_HEADER_WORDS;
+  changed(0, HEADER_WORDS);
+  return true;
+}
+
+std::unordered_map<uint64_t, uint64_t> persistent_blobstore::compact() {
+  if (is_mapped == false) {
+    throw std::logic_error("not mapped");;
+  }
+
+  std::unordered_map<uint64_t, uint64_t> moved;
+  header* h = get_header();
+  uint64_t end = h->next_free;
+  h->next_free = HEADER_WORDS;
+  h->free_words = 0;
+  std::memset(h->free_lists, 0, sizeof(h->free_lists));
+  uint64_t src = HEADER_WORDS;
+  while (src < end) {
+    uint32_t* blob = word(src);
+    uint32_t blob_words = blob[0] + BLOB_HEADER_WORDS;
+    if (blob[1] != FREE_BLOB) {
+      // append() never passes src, everything before it has been moved
+      uint64_t dst = append(blob_words);
+      if (src != dst) {
+        std::memmove(word(dst), blob, blob_words * sizeof(uint32_t));
+        changed(dst, blob_words);
+        moved[src] = dst;
+      }
+    }
+    src += blob_words;
+  }
+  changed(0, HEADER_WORDS);
+  file.shrink(h->next_free * sizeof(uint32_t));
+  return moved;
 }
 
-bool persistent_blobstore::map_file(std::string path) {
-  if (mmf.is_open() || is_mapped) {
+uint64_t persistent_blobstore::free_bytes() {
+  if (is_mapped == false) {
+    throw std::logic_error("not mapped");;
+  }
+  return get_header()->free_words * sizeof(uint32_t);
+}
+
+bool persistent_blobstore::map_file(std::string path, write_ahead_log* log) {
+  if (file.is_open() || is_mapped) {
     return false;
   }
 
   file_path = path;
 
-  if (boost::filesystem::exists(path)) {
-    mmf.open(path, boost::iostreams::mapped_file::mapmode::readwrite);
-    storage = reinterpret_cast<uint32_t*>(mmf.data());
-    capacity = mmf.size() / 4;
-    memcpy(&header_version, storage, sizeof(uint64_t));
+  // The starting size is 1KB by default (rounded up to the mapping
+  // alignment), we should add a option set the starting size
+  file.open(file_path, 1ULL << 10, log);
+  // A zero version is a new file, or one whose creation was never committed
+  if (get_header()->version != 0) {
+    header_version = get_header()->version;
+    if (header_version != cur_version) {
+      file.close();
+      throw std::runtime_error("Unsupported blobstore version " + std::to_string(header_version));
+    }
   } else {
-    boost::iostreams::mapped_file_params new_mmf(path);
-    new_mmf.flags = boost::iostreams::mapped_file::mapmode::readwrite;
-    // The starting size is 2KB by default, we should add a option set the starting size
-    new_mmf.new_file_size = 1ULL << 10;
-    capacity = new_mmf.new_file_size / 4;
-    mmf.open(new_mmf);
-    // write the version to the header of the new file
-    storage = reinterpret_cast<uint32_t*>(mmf.data());
-    uint64_t* header = reinterpret_cast<uint64_t*>(storage);
+    // write the header of the new file
+    std::memset(get_header(), 0, HEADER_WORDS * sizeof(uint32_t));
     header_version = cur_version;
-    *header = header_version;
+    get_header()->version = header_version;
+    get_header()->next_free = HEADER_WORDS;
+    changed(0, HEADER_WORDS);
   }
   is_mapped = true;
   return true;
 }
 
-void persistent_blobstore::close_mapped_file() {
-  mmf.close();
-  is_mapped = false;
+uint64_t persistent_blobstore::append(uint32_t words) {
+  header* h = get_header();
+  uint64_t id = h->next_free;
+  uint64_t segment_end = file.segment_end(id * sizeof(uint32_t)) / sizeof(uint32_t);
+  while (id + words > segment_end) {
+    // Keep the rest of the segment as a free blob. Blobs start at even
+    // words, so there is always room for its header.
+    if (id < segment_end) {
+      uint32_t rest = segment_end - id - BLOB_HEADER_WORDS;
+      uint32_t* blob = word(id);
+      blob[0] = rest;
+      blob[1] = FREE_BLOB;
+      changed(id, BLOB_HEADER_WORDS);
+      if (rest >= MIN_BLOB_WORDS) {
+        push_free(id, rest);
+      }
+      h->free_words += rest + BLOB_HEADER_WORDS;
+    }
+    id = segment_end;
+    segment_end = file.segment_end(id * sizeof(uint32_t)) / sizeof(uint32_t);
+  }
+  // When the file is not large enough to store the required blob, map new
+  // segments. Pointers into the existing ones stay valid.
+  file.grow((id + words) * sizeof(uint32_t));
+  h->next_free = id + words;
+  changed(0, HEADER_WORDS);
+  return id;
 }
 
-void persistent_blobstore::open_mapped_file() {
-  mmf.open(file_path, boost::iostreams::mapped_file::mapmode::readwrite);
-  storage = reinterpret_cast<uint32_t*>(mmf.data());
-  capacity = mmf.size() / 4;
-  is_mapped = true;
+uint32_t persistent_blobstore::size_class(uint64_t words) {
+  uint32_t k = 0;
+  while (words >>= 1) {
+    k++;
+  }
+  return k;
+}
+
+uint64_t persistent_blobstore::get_next(uint64_t id) {
+  uint64_t next;
+  std::memcpy(&next, word(id) + BLOB_HEADER_WORDS, sizeof(next));
+  return next;
+}
+
+void persistent_blobstore::set_next(uint64_t id, uint64_t next) {
+  std::memcpy(word(id) + BLOB_HEADER_WORDS, &next, sizeof(next));
+  changed(id + BLOB_HEADER_WORDS, sizeof(next) / sizeof(uint32_t));
+}
+
+void persistent_blobstore::push_free(uint64_t id, uint32_t words) {
+  uint64_t* head = &get_header()->free_lists[size_class(words)];
+  uint32_t* blob = word(id);
+  blob[0] = words;
+  blob[1] = FREE_BLOB;
+  changed(id, BLOB_HEADER_WORDS);
+  set_next(id, *head);
+  *head = id;
+  changed(0, HEADER_WORDS);
+}
+
+uint64_t persistent_blobstore::pop_free(uint32_t words) {
+  header* h = get_header();
+  uint32_t k = size_class(words);
+  // Blobs in the matching class may be too small, try the first few
+  uint64_t prev = 0;
+  uint64_t cur = h->free_lists[k];
+  for (uint32_t i = 0; cur != 0 && i < MAX_FIT_SCAN; ++i) {
+    if (word(cur)[0] >= words) {
+      if (prev == 0) {
+        h->free_lists[k] = get_next(cur);
+        changed(0, HEADER_WORDS);
+      } else {
+        set_next(prev, get_next(cur));
+      }
+      return cur;
+    }
+    prev = cur;
+    cur = get_next(cur);
+  }
+  // Any blob in a larger class is large enough
+  for (++k; k < SIZE_CLASSES; ++k) {
+    cur = h->free_lists[k];
+    if (cur != 0) {
+      h->free_lists[k] = get_next(cur);
+      changed(0, HEADER_WORDS);
+      return cur;
+    }
+  }
+  return 0;
 }
 
 }  //  namespace storage
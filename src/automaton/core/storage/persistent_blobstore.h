@@ -2,9 +2,10 @@
 #define AUTOMATON_CORE_STORAGE_PERSISTENT_BLOBSTORE_H__
 
 #include <string>
+#include <unordered_map>
 
-#include <boost/iostreams/device/mapped_file.hpp>
 #include "automaton/core/storage/blobstore.h"
+#include "automaton/core/storage/segmented_file.h"
 
 namespace automaton {
 namespace core {
@@ -13,6 +14,16 @@ namespace storage {
 /**
   persistent_blobstore interface.
   Can store and delete arbitrary length data in a memory mapped file.
+
+  Every blob is preceded by two 4 byte words: the capacity of the blob in
+  words and its size in bytes. Freed blobs are kept in size-class free lists
+  (class k holds blobs with capacity in [2^k, 2^(k+1)) words) whose heads are
+  stored in the file header, so their space is reused by later store calls.
+  compact() slides live blobs together and gives the unused space back.
+
+  The file grows by mapping new segments, so pointers returned by get() stay
+  valid until the next compact(). Blobs never span two segments, the space
+  left at the end of a segment is kept as a free blob.
 */
 class persistent_blobstore : public blobstore{
  public:
@@ -22,7 +33,8 @@ class persistent_blobstore : public blobstore{
   /**
     Stores the byte array pointed by data
 
-    @returns   uint64_t  returns the ID used to access it.
+    @returns   uint64_t  returns the ID used to access it. IDs are never 0,
+                         the file header takes the first words.
     @param[in] size      The size of the data pointed by data in bytes
     @param[in] data      Pointer to the data
   */
@@ -44,31 +56,85 @@ class persistent_blobstore : public blobstore{
     @returns    bool      False if there is no allocated blob with the given id
     @param[in]  id        The ID returned by create_blob
   */
-  bool free(const uint32_t id);
+  bool free(const uint64_t id);
+
   /**
-    TODO(Samir): document
+    Maps the file at path, creating it if it does not exist.
+
+    @returns   bool      False if a file is already mapped
+    @param[in] path      Path to the blob file
+    @param[in] log       Log that commits the changes, nullptr to write to the
+                         file directly. Blobs must not be changed through the
+                         pointers returned by get() when a log is used.
+    @throws    std::runtime_error if the file was written with a different
+                         format version
   */
-  bool map_file(std::string path);
+  bool map_file(std::string path, write_ahead_log* log = nullptr);
+
+  /**
+    Moves all live blobs to the beginning of the file, drops the free lists
+    and shrinks the file to fit. Pointers returned by get are invalidated.
+
+    @returns   std::unordered_map<uint64_t, uint64_t>  maps the old ID of
+               every moved blob to its new ID. Blobs that did not move are
+               not included.
+  */
+  std::unordered_map<uint64_t, uint64_t> compact();
+
+  /**
+    @returns   uint64_t  Number of bytes held by freed blobs, including
+                         their headers. Can be used to decide when to compact.
+  */
+  uint64_t free_bytes();
 
  private:
-  uint32_t* storage;
-  boost::iostreams::mapped_file mmf;
+  static const uint32_t HEADER_WORDS = 1024 / 4;
+  static const uint32_t BLOB_HEADER_WORDS = 2;
+  // Free blobs keep the ID of the next free blob in their first two words.
+  // Capacities are even so that every blob starts at an even word.
+  static const uint32_t MIN_BLOB_WORDS = 2;
+  static const uint32_t SIZE_CLASSES = 32;
+  // How many blobs of the matching size class are tried before falling back
+  // to a larger class
+  static const uint32_t MAX_FIT_SCAN = 8;
+  // Size of a freed blob
+  static const uint32_t FREE_BLOB = 0xFFFFFFFF;
+
+  struct header {
+    uint64_t version;
+    uint64_t next_free;
+    uint64_t free_words;
+    uint64_t free_lists[SIZE_CLASSES];
+  };
+  static_assert(sizeof(header) <= HEADER_WORDS * sizeof(uint32_t), "header does not fit");
+
+  segmented_file file;
   bool is_mapped = false;
-  // size_t header_size;
-  uint64_t cur_version = 10000;
+  uint64_t cur_version = 10002;
   uint64_t header_version;
   std::string file_path;
-  uint64_t next_free = 0;
-  uint64_t capacity;
-  // TODO(Samir): Handle free locations.
-  // One option is to use heap with the free locations stored by size
-  // Second option is to use linked list linking to the next free location
-  //  if next.location.ID == this.location.ID + length:
-  //    this.location.length += next.location.length
-  //  while
-
-  void close_mapped_file();
-  void open_mapped_file();
+
+  // Pointer to the word at index id
+  uint32_t* word(uint64_t id) {
+    return reinterpret_cast<uint32_t*>(file.at(id * sizeof(uint32_t)));
+  }
+  header* get_header() {
+    return reinterpret_cast<header*>(file.at(0));
+  }
+  // Has to be called for every range of words that is changed
+  void changed(uint64_t id, uint64_t words) {
+    file.mark_dirty(id * sizeof(uint32_t), words * sizeof(uint32_t));
+  }
+  // Reserves words at the end of the file without crossing a segment end
+  uint64_t append(uint32_t words);
+  static uint32_t size_class(uint64_t words);
+  uint64_t get_next(uint64_t id);
+  void set_next(uint64_t id, uint64_t next);
+  // Adds a blob with the given capacity to the free lists
+  void push_free(uint64_t id, uint32_t words);
+  // Finds a free blob with at least the given capacity and removes it from
+  // the free lists. Returns 0 if there is none.
+  uint64_t pop_free(uint32_t words);
 
   /**
   Creates a blob with a given size
@@ -1,89 +1,95 @@
 #include "automaton/core/storage/persistent_storage.h"
 
+#include <cstring>
+#include <stdexcept>
 #include <string>
 
-#include <boost/config/warning_disable.hpp>
-
-#include <boost/filesystem.hpp>
-#include <boost/iostreams/device/mapped_file.hpp>
 
 
 namespace automaton {
 namespace core {
 namespace storage {
 
-  persistent_storage::persistent_storage()
-    : cur_version(10000)
+persistent_storage::persistent_storage()
+    : cur_version(10001)
     , is_mapped(false)
-    , header_size(1024)
-    , capacity(0) {
+    , header_size(1024) {
 }
 
 persistent_storage::~persistent_storage() {
-  mmf.close();
+  file.close();
 }
 
 bool persistent_storage::store(const uint64_t at, const uint8_t* data) {
   if (is_mapped == false) {
     throw std::logic_error("not mapped");;
   }
-  uint64_t location = at * object_size + header_size;
-  // Increase capacity if necessary
-  while (location + object_size > capacity) {
-    close_mapped_file();
-    capacity *= 2;
-    boost::filesystem::path boost_path(file_path);
-    boost::filesystem::resize_file(boost_path, capacity);
-    open_mapped_file();
-  }
-  memcpy(storage + location, data, object_size);
+  uint64_t loc = location(at);
+  // Increase capacity if necessary, existing segments stay mapped
+  file.grow(loc + object_size);
+  memcpy(file.at(loc), data, object_size);
+  file.mark_dirty(loc, object_size);
   return true;
 }
 
 uint8_t* persistent_storage::get(const uint64_t at) {
+  const uint8_t* object = static_cast<const persistent_storage*>(this)->get(at);
+  file.mark_dirty(location(at), object_size);
+  return const_cast<uint8_t*>(object);
+}
+
+const uint8_t* persistent_storage::get(const uint64_t at) const {
   if (is_mapped == false) {
     throw std::logic_error("not mapped");;
   }
 
   // check if id is out of range
-  uint64_t location = at * object_size + header_size;
-  if (location >= capacity) {
+  uint64_t loc = location(at);
+  if (loc + object_size > file.size()) {
     throw std::out_of_range("index out of range");
   }
-  //-- *size = storage[id];
-  return reinterpret_cast<uint8_t*>(&storage[location]);
+  return file.at(loc);
 }
 
-bool persistent_storage::map_file(std::string path, size_t object_sz) {
-  if (mmf.is_open() || is_mapped) {
+bool persistent_storage::map_file(std::string path, size_t object_sz, write_ahead_log* log) {
+  if (file.is_open() || is_mapped) {
     return false;
   }
 
   file_path = path;
   object_size = object_sz;
 
-  if (boost::filesystem::exists(file_path)) {
-    mmf.open(file_path, boost::iostreams::mapped_file::mapmode::readwrite);
-    storage = reinterpret_cast<uint8_t*>(mmf.data());
-    capacity = mmf.size();
-    header = reinterpret_cast<uint64_t*>(storage);
+  // The starting size is 1MB by default, we should add a option set the starting size
+  file.open(file_path, 1ULL << 20, log);
+  header = reinterpret_cast<uint64_t*>(file.at(0));
+  // A zero version is a new file, or one whose creation was never committed
+  if (header[0] != 0) {
     header_version = header[0];
+    if (header_version != cur_version) {
+      file.close();
+      throw std::runtime_error("Unsupported storage version " + std::to_string(header_version));
+    }
   } else {
-    boost::iostreams::mapped_file_params new_mmf(file_path);
-    new_mmf.flags = boost::iostreams::mapped_file::mapmode::readwrite;
-    // The starting size is MB by default, we should add a option set the starting size
-    new_mmf.new_file_size = 1ULL << 20;
-    capacity = new_mmf.new_file_size;
-    mmf.open(new_mmf);
     // write the version to the header of the new file
-    storage = reinterpret_cast<uint8_t*>(mmf.data());
-    header = reinterpret_cast<uint64_t*>(storage);
     memset(header, 0, header_size);
     header_version = cur_version;
     header[0] = header_version;
+    header_changed();
+  }
+
+  // Objects are packed from the start of each segment, the first one starts
+  // after the header
+  segment_first[0] = 0;
+  for (uint32_t i = 0; i < MAX_SEGMENTS; ++i) {
+    uint64_t begin = i == 0 ? header_size : file.segment_begin(i);
+    uint64_t end = file.segment_begin(i + 1);
+    if (end <= begin || segment_first[i] == UINT64_MAX) {
+      // Past the largest file we can address
+      segment_first[i + 1] = UINT64_MAX;
+    } else {
+      segment_first[i + 1] = segment_first[i] + (end - begin) / object_size;
+    }
   }
-  header = reinterpret_cast<uint64_t*>(storage);
-  header_version = header[0];
   is_mapped = true;
   return true;
 }
@@ -92,18 +98,22 @@ bool persistent_storage::mapped() {
   return is_mapped;
 }
 
-void persistent_storage::close_mapped_file() {
-  mmf.close();
-  is_mapped = false;
+void persistent_storage::header_changed() {
+  file.mark_dirty(0, header_size);
 }
 
-void persistent_storage::open_mapped_file() {
-  mmf.open(file_path, boost::iostreams::mapped_file::mapmode::readwrite);
-  storage = reinterpret_cast<uint8_t*>(mmf.data());
-  capacity = mmf.size();
-  is_mapped = true;
-  header = reinterpret_cast<uint64_t*>(storage);
-  header_version = header[0];
+uint64_t persistent_storage::location(const uint64_t at) const {
+  uint32_t segment = file.segment_of(at * object_size + header_size);
+  if (segment >= MAX_SEGMENTS) {
+    segment = MAX_SEGMENTS - 1;
+  }
+  // The estimate ignores the unused space at the segment ends and can only
+  // be too low
+  while (at >= segment_first[segment + 1]) {
+    segment++;
+  }
+  uint64_t begin = segment == 0 ? header_size : file.segment_begin(segment);
+  return begin + (at - segment_first[segment]) * object_size;
 }
 
 }  //  namespace storage
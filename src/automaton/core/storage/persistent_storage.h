@@ -3,7 +3,7 @@
 
 #include <string>
 
-#include <boost/iostreams/device/mapped_file.hpp>
+#include "automaton/core/storage/segmented_file.h"
 
 namespace automaton {
 namespace core {
@@ -11,6 +11,8 @@ namespace storage {
 
 /**
   Storage interface for fixed size data using memory mapped file.
+  The file grows by mapping new segments, pointers returned by get() stay
+  valid while the storage is mapped. Objects never span two segments.
 */
 class persistent_storage {
  public:
@@ -27,7 +29,8 @@ class persistent_storage {
   bool store(const uint64_t at, const uint8_t* data);
 
   /**
-    Used to get access to previously allocated object.
+    Used to get access to previously allocated object. With a log the object
+    is assumed to be changed through the returned pointer.
 
     @returns    uint8_t*  pointer to the object or nullptr if id>=capacity
     @param[in]  at        The ID used to store
@@ -35,9 +38,23 @@ class persistent_storage {
   uint8_t* get(const uint64_t at);
 
   /**
-    TODO(Samir): document
+    Same as get() for objects that are only read. The object is not logged on
+    the next commit.
   */
-  bool map_file(std::string path, size_t object_sz);
+  const uint8_t* get(const uint64_t at) const;
+
+  /**
+    Maps the file at path, creating it if it does not exist.
+
+    @returns   bool      False if a file is already mapped
+    @param[in] path      Path to the file
+    @param[in] object_sz Size of the stored objects in bytes
+    @param[in] log       Log that commits the changes, nullptr to write to the
+                         file directly
+    @throws    std::runtime_error if the file was written with a different
+                         format version
+  */
+  bool map_file(std::string path, size_t object_sz, write_ahead_log* log = nullptr);
 
   /**
     Returns true if file is successfully mapped
@@ -54,23 +71,23 @@ class persistent_storage {
   */
   uint64_t* header;
 
+  // Has to be called after changing the header
+  void header_changed();
+
  private:
-  uint8_t* storage;
-  boost::iostreams::mapped_file mmf;
+  // Segments can hold up to 2^63 bytes
+  static const uint32_t MAX_SEGMENTS = 64;
+
+  segmented_file file;
   bool is_mapped = false;
   size_t object_size;
   size_t header_size;
   std::string file_path;
-  uint64_t capacity;
-  // TODO(Samir): Handle free locations.
-  // One option is to use heap with the free locations stored by size
-  // Second option is to use linked list linking to the next free location
-  //  if next.location.ID == this.location.ID + length:
-  //    this.location.length += next.location.length
-  //  while
-
-  void close_mapped_file();
-  void open_mapped_file();
+  // Index of the first object in each segment
+  uint64_t segment_first[MAX_SEGMENTS + 1];
+
+  // Offset of object at in the file
+  uint64_t location(const uint64_t at) const;
 };
 
 }  // namespace storage
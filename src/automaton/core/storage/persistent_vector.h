@@ -15,13 +15,25 @@ namespace storage {
 template<typename T>
 class persistent_vector : protected persistent_storage {
  public:
+  // The non-const operator marks the element as changed, elements that are
+  // only read should be accessed through a const reference.
   T& operator[](size_t n);
+  const T& operator[](size_t n) const;
   void push_back(const T& val);
-  bool map_file(std::string path);
+  bool map_file(std::string path, write_ahead_log* log = nullptr);
   size_t size() const;
   void resize(size_t n);
+
+  /**
+    Version of the layout of T chosen by the user of the vector, stored in the
+    file header. 0 for a new file or if none was set.
+  */
+  uint64_t get_format_version() const;
+  void set_format_version(uint64_t version);
+
  private:
   // header[8] is used to store next_free in the mapped file;
+  // header[9] stores the format version of T
   size_t next_free;
 };
 
@@ -33,6 +45,11 @@ inline T & persistent_vector<T>::operator[](size_t n) {
   return *(reinterpret_cast<T*>(get(n)));
 }
 
+template<typename T>
+inline const T & persistent_vector<T>::operator[](size_t n) const {
+  return *(reinterpret_cast<const T*>(get(n)));
+}
+
 template<typename T>
 void persistent_vector<T>::push_back(const T & val) {
   if (!mapped()) {
@@ -41,11 +58,12 @@ void persistent_vector<T>::push_back(const T & val) {
   store(next_free, reinterpret_cast<const uint8_t*>(&val));
   next_free++;
   header[8]++;
+  header_changed();
 }
 
 template<typename T>
-inline bool persistent_vector<T>::map_file(std::string path) {
-  if (!persistent_storage::map_file(path, sizeof(T))) {
+inline bool persistent_vector<T>::map_file(std::string path, write_ahead_log* log) {
+  if (!persistent_storage::map_file(path, sizeof(T), log)) {
     return false;
   }
   next_free = header[8];
@@ -61,6 +79,18 @@ template<typename T>
 void persistent_vector<T>::resize(size_t n) {
   next_free = n;
   header[8] = n;
+  header_changed();
+}
+
+template<typename T>
+uint64_t persistent_vector<T>::get_format_version() const {
+  return header[9];
+}
+
+template<typename T>
+void persistent_vector<T>::set_format_version(uint64_t version) {
+  header[9] = version;
+  header_changed();
 }
 
 }  // namespace storage
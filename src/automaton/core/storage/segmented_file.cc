@@ -0,0 +1,153 @@
+#include "automaton/core/storage/segmented_file.h"
+
+#include <fstream>
+#include <memory>
+#include <string>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+#include <boost/filesystem.hpp>
+#include <boost/iostreams/device/mapped_file.hpp>
+
+#include "automaton/core/storage/write_ahead_log.h"
+
+namespace automaton {
+namespace core {
+namespace storage {
+
+segmented_file::segmented_file()
+    : first_segment_size(0)
+    , file_size(0)
+    , physical_size(0)
+    , log(nullptr)
+    , page_size(0)
+    , committed_size(0) {
+}
+
+segmented_file::~segmented_file() {
+  close();
+}
+
+bool segmented_file::open(const std::string& path, uint64_t segment_size, write_ahead_log* wal) {
+  if (is_open()) {
+    return false;
+  }
+  file_path = path;
+  uint64_t alignment = boost::iostreams::mapped_file::alignment();
+  first_segment_size = (segment_size + alignment - 1) / alignment * alignment;
+  page_size = alignment;
+
+  uint64_t existing_size = 0;
+  if (boost::filesystem::exists(file_path)) {
+    existing_size = boost::filesystem::file_size(file_path);
+  } else {
+    std::ofstream create(file_path);
+  }
+  // Files always end on a segment boundary
+  file_size = first_segment_size;
+  while (file_size < existing_size) {
+    file_size *= 2;
+  }
+  if (file_size != existing_size) {
+    boost::filesystem::resize_file(file_path, file_size);
+  }
+  physical_size = file_size;
+  committed_size = file_size;
+  log = wal;
+  for (uint32_t i = 0; segment_begin(i) < file_size; ++i) {
+    map_segment(i);
+  }
+  if (log != nullptr) {
+    dirty_pages.assign((file_size / page_size + 63) / 64, 0);
+    log->attach(this);
+  }
+  return true;
+}
+
+void segmented_file::close() {
+  if (log != nullptr) {
+    log->detach(this);
+    log = nullptr;
+  }
+  bases.clear();
+  segments.clear();
+  dirty_pages.clear();
+  file_size = 0;
+}
+
+void segmented_file::grow(uint64_t min_size) {
+  if (min_size <= file_size) {
+    return;
+  }
+  uint64_t new_size = file_size;
+  while (new_size < min_size) {
+    new_size *= 2;
+  }
+  // The file can still be larger than the mapping if a shrink was not
+  // committed yet
+  if (new_size > physical_size) {
+    boost::filesystem::resize_file(file_path, new_size);
+    physical_size = new_size;
+  }
+  file_size = new_size;
+  for (uint32_t i = segments.size(); segment_begin(i) < file_size; ++i) {
+    map_segment(i);
+  }
+  if (log != nullptr) {
+    dirty_pages.resize((file_size / page_size + 63) / 64, 0);
+  }
+}
+
+void segmented_file::shrink(uint64_t min_size) {
+  uint64_t new_size = file_size;
+  while (new_size > first_segment_size && new_size / 2 >= min_size) {
+    new_size /= 2;
+  }
+  if (new_size == file_size) {
+    return;
+  }
+  while (segment_begin(segments.size() - 1) >= new_size) {
+    segments.pop_back();
+    bases.pop_back();
+  }
+  file_size = new_size;
+  if (log != nullptr) {
+    // Pages past the end are not written any more, the log truncates the
+    // file once the shrink is committed
+    dirty_pages.resize((file_size / page_size + 63) / 64);
+    for (uint64_t page = file_size / page_size; page < dirty_pages.size() * 64; ++page) {
+      dirty_pages[page / 64] &= ~(1ULL << (page % 64));
+    }
+  } else {
+    boost::filesystem::resize_file(file_path, new_size);
+    physical_size = new_size;
+  }
+}
+
+void segmented_file::map_segment(uint32_t segment) {
+  boost::iostreams::mapped_file_params params(file_path);
+  params.flags = log == nullptr ? boost::iostreams::mapped_file::mapmode::readwrite
+                                : boost::iostreams::mapped_file::mapmode::priv;
+  params.offset = segment_begin(segment);
+  params.length = segment_begin(segment + 1) - params.offset;
+  segments.emplace_back(new boost::iostreams::mapped_file(params));
+  bases.push_back(reinterpret_cast<uint8_t*>(segments.back()->data()));
+}
+
+void segmented_file::release_pages(uint64_t offset, uint64_t length) {
+#ifdef __linux__
+  for (uint64_t page = offset / page_size; page * page_size < offset + length; ++page) {
+    if (page * page_size >= file_size || dirty_pages[page / 64] & (1ULL << (page % 64))) {
+      continue;
+    }
+    // Pages never span segments, segments are multiples of the page size
+    madvise(at(page * page_size), page_size, MADV_DONTNEED);
+  }
+#endif
+}
+
+}  // namespace storage
+}  // namespace core
+}  // namespace automaton
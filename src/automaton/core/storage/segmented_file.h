@@ -0,0 +1,167 @@
+#ifndef AUTOMATON_CORE_STORAGE_SEGMENTED_FILE_H__
+#define AUTOMATON_CORE_STORAGE_SEGMENTED_FILE_H__
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <boost/iostreams/device/mapped_file.hpp>
+
+namespace automaton {
+namespace core {
+namespace storage {
+
+class write_ahead_log;
+
+/**
+  Memory mapped file that grows without remapping.
+
+  The file is mapped as a chain of segments. The first segment is
+  first_segment_size bytes and every following segment is as large as all
+  previous ones together, so the file doubles with each segment. Growing maps
+  only the new segment, which keeps every pointer returned by at() valid until
+  the segment containing it is dropped by shrink() or close().
+
+  Data can not span segments. Users have to place their records so that they
+  do not cross the boundaries returned by segment_end().
+
+  When opened with a write_ahead_log the file is mapped privately and changes
+  reach the file only through the log. Writers have to report the ranges
+  they change with mark_dirty().
+*/
+class segmented_file {
+ public:
+  segmented_file();
+  ~segmented_file();
+
+  /**
+    Maps the file at path, creating it if it does not exist.
+
+    @returns   bool      False if a file is already open
+    @param[in] path      Path to the file
+    @param[in] segment_size  Size of the first segment in bytes. Rounded up
+                         to the mapping alignment of the platform, has to be
+                         the same every time the file is opened.
+    @param[in] wal       Log that commits the changes, nullptr to write to the
+                         file directly
+  */
+  bool open(const std::string& path, uint64_t segment_size, write_ahead_log* wal = nullptr);
+
+  /**
+    Unmaps all segments.
+  */
+  void close();
+
+  /**
+    Returns true if the file is mapped
+  */
+  bool is_open() const {
+    return !segments.empty();
+  }
+
+  /**
+    Adds segments until the file is at least min_size bytes.
+  */
+  void grow(uint64_t min_size);
+
+  /**
+    Drops segments from the end while the file stays at least min_size bytes.
+    Pointers into the dropped segments become invalid. With a log the file is
+    truncated once the change is committed.
+  */
+  void shrink(uint64_t min_size);
+
+  /**
+    Records that the bytes in [offset, offset + length) were changed, so that
+    they are written by the next commit. Does nothing without a log.
+  */
+  void mark_dirty(uint64_t offset, uint64_t length) {
+    if (log == nullptr || length == 0) {
+      return;
+    }
+    for (uint64_t page = offset / page_size; page <= (offset + length - 1) / page_size; ++page) {
+      dirty_pages[page / 64] |= 1ULL << (page % 64);
+    }
+  }
+
+  /**
+    @returns   uint64_t  Size of the file in bytes
+  */
+  uint64_t size() const {
+    return file_size;
+  }
+
+  /**
+    @returns   uint8_t*  Pointer to the byte at offset. offset has to be < size()
+  */
+  uint8_t* at(uint64_t offset) {
+    if (offset < first_segment_size) {
+      return bases[0] + offset;
+    }
+    uint32_t segment = segment_of(offset);
+    return bases[segment] + (offset - segment_begin(segment));
+  }
+
+  const uint8_t* at(uint64_t offset) const {
+    return const_cast<segmented_file*>(this)->at(offset);
+  }
+
+  /**
+    @returns   uint64_t  Offset of the first byte after the segment that
+                         contains offset
+  */
+  uint64_t segment_end(uint64_t offset) const {
+    return segment_begin(segment_of(offset) + 1);
+  }
+
+  /**
+    @returns   uint64_t  Offset of the first byte of the given segment
+  */
+  uint64_t segment_begin(uint32_t segment) const {
+    return segment == 0 ? 0 : first_segment_size << (segment - 1);
+  }
+
+  /**
+    @returns   uint32_t  Index of the segment that contains offset
+  */
+  uint32_t segment_of(uint64_t offset) const {
+    uint64_t q = offset / first_segment_size;
+    uint32_t segment = 0;
+    while (q) {
+      q >>= 1;
+      segment++;
+    }
+    return segment;
+  }
+
+ private:
+  friend class write_ahead_log;
+
+  std::string file_path;
+  uint64_t first_segment_size;
+  uint64_t file_size;
+  // Size of the file on disk, can be larger than file_size until a shrink is
+  // committed
+  uint64_t physical_size;
+  write_ahead_log* log;
+  // Granularity of the dirty tracking
+  uint64_t page_size;
+  // One bit per page changed since the last commit
+  std::vector<uint64_t> dirty_pages;
+  // file_size at the last commit
+  uint64_t committed_size;
+  std::vector<std::unique_ptr<boost::iostreams::mapped_file> > segments;
+  // Cached segments[i]->data()
+  std::vector<uint8_t*> bases;
+
+  void map_segment(uint32_t segment);
+  // Drops the private copies of the pages in [offset, offset + length) that
+  // were not changed again, the next access reads them from the file.
+  void release_pages(uint64_t offset, uint64_t length);
+};
+
+}  // namespace storage
+}  // namespace core
+}  // namespace automaton
+
+#endif  // AUTOMATON_CORE_STORAGE_SEGMENTED_FILE_H__
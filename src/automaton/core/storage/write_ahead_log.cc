@@ -0,0 +1,341 @@
+#include "automaton/core/storage/write_ahead_log.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#include <boost/crc.hpp>
+#include <boost/filesystem.hpp>
+
+#include "automaton/core/storage/segmented_file.h"
+
+namespace automaton {
+namespace core {
+namespace storage {
+
+// Writes the buffered data of f to disk
+static void sync_file(std::FILE* f) {
+  if (std::fflush(f) != 0) {
+    throw std::runtime_error("Could not flush file");
+  }
+#ifdef _WIN32
+  int result = _commit(_fileno(f));
+#else
+  int result = fsync(fileno(f));
+#endif
+  if (result != 0) {
+    throw std::runtime_error("Could not sync file");
+  }
+}
+
+static void seek_file(std::FILE* f, uint64_t offset) {
+#ifdef _WIN32
+  int result = _fseeki64(f, static_cast<int64_t>(offset), SEEK_SET);
+#else
+  int result = fseeko(f, static_cast<off_t>(offset), SEEK_SET);
+#endif
+  if (result != 0) {
+    throw std::runtime_error("Could not seek in file");
+  }
+}
+
+static uint32_t checksum(const std::string& payload) {
+  boost::crc_32_type crc;
+  crc.process_bytes(payload.data(), payload.size());
+  return crc.checksum();
+}
+
+// Payload of every record: path length, path, offset, data
+static std::string encode(const std::string& path, uint64_t offset, const std::string& data) {
+  uint32_t path_length = static_cast<uint32_t>(path.size());
+  std::string payload;
+  payload.reserve(sizeof(path_length) + path.size() + sizeof(offset) + data.size());
+  payload.append(reinterpret_cast<const char*>(&path_length), sizeof(path_length));
+  payload.append(path);
+  payload.append(reinterpret_cast<const char*>(&offset), sizeof(offset));
+  payload.append(data);
+  return payload;
+}
+
+static bool decode(const std::string& payload, std::string* path, uint64_t* offset, std::string* data) {
+  uint32_t path_length;
+  if (payload.size() < sizeof(path_length)) {
+    return false;
+  }
+  std::memcpy(&path_length, payload.data(), sizeof(path_length));
+  if (payload.size() < sizeof(path_length) + path_length + sizeof(*offset)) {
+    return false;
+  }
+  *path = payload.substr(sizeof(path_length), path_length);
+  std::memcpy(offset, payload.data() + sizeof(path_length) + path_length, sizeof(*offset));
+  *data = payload.substr(sizeof(path_length) + path_length + sizeof(*offset));
+  return true;
+}
+
+write_ahead_log::write_ahead_log() {
+}
+
+write_ahead_log::~write_ahead_log() {
+  close();
+}
+
+bool write_ahead_log::open(const std::string& path) {
+  if (log != nullptr) {
+    return false;
+  }
+  log_path = path;
+  if (boost::filesystem::exists(log_path)) {
+    recover();
+  }
+  log = std::fopen(log_path.c_str(), "wb");
+  if (log == nullptr) {
+    throw std::runtime_error("Could not open " + log_path);
+  }
+  sync_file(log);
+  log_size = 0;
+  return true;
+}
+
+void write_ahead_log::close() {
+  if (log == nullptr) {
+    return;
+  }
+  flush();
+  checkpoint();
+  std::fclose(log);
+  log = nullptr;
+  for (segmented_file* file : files) {
+    file->log = nullptr;
+  }
+  files.clear();
+}
+
+void write_ahead_log::commit(bool sync) {
+  if (log == nullptr) {
+    throw std::logic_error("not open");
+  }
+  bool changed = false;
+  for (segmented_file* file : files) {
+    for (size_t w = 0; w < file->dirty_pages.size(); ++w) {
+      uint64_t bits = file->dirty_pages[w];
+      for (uint64_t page = w * 64; bits; ++page, bits >>= 1) {
+        uint64_t offset = page * file->page_size;
+        if (!(bits & 1) || offset >= file->file_size) {
+          continue;
+        }
+        pending_write pw;
+        pw.path = file->file_path;
+        pw.type = PAGE;
+        pw.offset = offset;
+        pw.data.assign(reinterpret_cast<char*>(file->at(offset)), file->page_size);
+        append(PAGE, encode(pw.path, pw.offset, pw.data));
+        pending.push_back(std::move(pw));
+        changed = true;
+      }
+      file->dirty_pages[w] = 0;
+    }
+    if (file->file_size < file->committed_size) {
+      pending_write pw;
+      pw.path = file->file_path;
+      pw.type = SIZE;
+      pw.offset = file->file_size;
+      append(SIZE, encode(pw.path, pw.offset, ""));
+      pending.push_back(std::move(pw));
+      changed = true;
+    }
+    file->committed_size = file->file_size;
+  }
+  if (changed) {
+    append(COMMIT, encode("", ++sequence, ""));
+    if (std::fflush(log) != 0) {
+      throw std::runtime_error("Could not write to " + log_path);
+    }
+    ++unsynced_commits;
+  }
+  if (sync || unsynced_commits >= group_commit_size) {
+    flush();
+  }
+}
+
+void write_ahead_log::flush() {
+  if (log == nullptr || unsynced_commits == 0) {
+    return;
+  }
+  sync_file(log);
+  unsynced_commits = 0;
+  // The changes are durable in the log, now they can go to the files
+  apply();
+  if (log_size >= checkpoint_size) {
+    checkpoint();
+  }
+}
+
+void write_ahead_log::set_group_commit_size(uint32_t commits) {
+  group_commit_size = commits == 0 ? 1 : commits;
+}
+
+void write_ahead_log::set_checkpoint_size(uint64_t bytes) {
+  checkpoint_size = bytes;
+}
+
+void write_ahead_log::attach(segmented_file* file) {
+  files.push_back(file);
+}
+
+void write_ahead_log::detach(segmented_file* file) {
+  files.erase(std::remove(files.begin(), files.end(), file), files.end());
+}
+
+void write_ahead_log::append(record_type type, const std::string& payload) {
+  record_header header;
+  header.type = type;
+  header.crc = checksum(payload);
+  header.length = payload.size();
+  if (std::fwrite(&header, sizeof(header), 1, log) != 1 ||
+      std::fwrite(payload.data(), 1, payload.size(), log) != payload.size()) {
+    throw std::runtime_error("Could not write to " + log_path);
+  }
+  log_size += sizeof(header) + payload.size();
+}
+
+void write_ahead_log::apply() {
+  for (const pending_write& w : pending) {
+    apply(w);
+  }
+  for (auto& data : data_files) {
+    if (std::fflush(data.second) != 0) {
+      throw std::runtime_error("Could not write to " + data.first);
+    }
+  }
+  // The private copies of the written pages are not needed any more
+  for (const pending_write& w : pending) {
+    if (w.type != PAGE) {
+      continue;
+    }
+    for (segmented_file* file : files) {
+      if (file->file_path == w.path) {
+        file->release_pages(w.offset, w.data.size());
+      }
+    }
+  }
+  pending.clear();
+}
+
+void write_ahead_log::apply(const pending_write& w) {
+  if (w.type == PAGE) {
+    std::FILE* f = data_file(w.path);
+    seek_file(f, w.offset);
+    if (std::fwrite(w.data.data(), 1, w.data.size(), f) != w.data.size()) {
+      throw std::runtime_error("Could not write to " + w.path);
+    }
+    return;
+  }
+  // Never truncate below what is mapped, the file may have grown again
+  // since the shrink was committed
+  uint64_t size = w.offset;
+  segmented_file* attached = nullptr;
+  for (segmented_file* file : files) {
+    if (file->file_path == w.path) {
+      attached = file;
+      size = std::max(size, file->file_size);
+    }
+  }
+  if (!boost::filesystem::exists(w.path) || boost::filesystem::file_size(w.path) <= size) {
+    return;
+  }
+  if (std::fflush(data_file(w.path)) != 0) {
+    throw std::runtime_error("Could not write to " + w.path);
+  }
+  boost::filesystem::resize_file(w.path, size);
+  if (attached != nullptr) {
+    attached->physical_size = size;
+  }
+}
+
+void write_ahead_log::checkpoint() {
+  for (auto& data : data_files) {
+    sync_file(data.second);
+    std::fclose(data.second);
+  }
+  data_files.clear();
+  // Everything in the log is in the files now
+  if (log != nullptr) {
+    std::FILE* cleared = std::freopen(log_path.c_str(), "wb", log);
+    if (cleared == nullptr) {
+      log = nullptr;
+      throw std::runtime_error("Could not clear " + log_path);
+    }
+    log = cleared;
+    sync_file(log);
+    log_size = 0;
+  }
+}
+
+void write_ahead_log::recover() {
+  std::FILE* in = std::fopen(log_path.c_str(), "rb");
+  if (in == nullptr) {
+    throw std::runtime_error("Could not open " + log_path);
+  }
+  std::vector<pending_write> transaction;
+  record_header header;
+  // Stop at the first incomplete or damaged record, it was written by the
+  // transaction that was interrupted
+  while (std::fread(&header, sizeof(header), 1, in) == 1) {
+    if (header.length > (1ULL << 32)) {
+      break;
+    }
+    std::string payload(header.length, '\0');
+    if (std::fread(&payload[0], 1, payload.size(), in) != payload.size() || checksum(payload) != header.crc) {
+      break;
+    }
+    pending_write w;
+    if (!decode(payload, &w.path, &w.offset, &w.data)) {
+      break;
+    }
+    if (header.type == COMMIT) {
+      sequence = w.offset;
+      for (pending_write& t : transaction) {
+        pending.push_back(std::move(t));
+      }
+      transaction.clear();
+    } else if (header.type == PAGE || header.type == SIZE) {
+      w.type = static_cast<record_type>(header.type);
+      transaction.push_back(std::move(w));
+    } else {
+      break;
+    }
+  }
+  std::fclose(in);
+  apply();
+  checkpoint();
+}
+
+std::FILE* write_ahead_log::data_file(const std::string& path) {
+  auto it = data_files.find(path);
+  if (it != data_files.end()) {
+    return it->second;
+  }
+  std::FILE* f = std::fopen(path.c_str(), "r+b");
+  if (f == nullptr) {
+    f = std::fopen(path.c_str(), "w+b");
+  }
+  if (f == nullptr) {
+    throw std::runtime_error("Could not open " + path);
+  }
+  data_files[path] = f;
+  return f;
+}
+
+}  // namespace storage
+}  // namespace core
+}  // namespace automaton
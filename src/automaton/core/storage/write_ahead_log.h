@@ -0,0 +1,131 @@
+#ifndef AUTOMATON_CORE_STORAGE_WRITE_AHEAD_LOG_H__
+#define AUTOMATON_CORE_STORAGE_WRITE_AHEAD_LOG_H__
+
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace automaton {
+namespace core {
+namespace storage {
+
+class segmented_file;
+
+/**
+  Write-ahead log that makes changes to memory mapped files atomic and
+  durable.
+
+  Files opened with a log are mapped privately, changes stay in memory until
+  commit() writes the changed pages of all attached files to the log as one
+  transaction. The pages are written to the files only after the log has been
+  synced, so the files on disk always reflect a prefix of the committed
+  transactions. open() replays the transactions found in the log into their
+  files, which repairs files left behind by a crash.
+
+  Commits that do not ask for a sync are grouped: the log is synced once
+  every group_commit_size commits or on flush(), so a crash can lose the
+  latest unsynced commits but never leaves a file torn.
+*/
+class write_ahead_log {
+ public:
+  write_ahead_log();
+  ~write_ahead_log();
+
+  /**
+    Opens the log at path, creating it if it does not exist. Committed
+    transactions found in the log are replayed into their files, which are
+    then synced before the log is cleared.
+
+    @returns   bool      False if the log is already open
+    @param[in] path      Path to the log file
+    @throws    std::runtime_error if the log or the files can not be written
+  */
+  bool open(const std::string& path);
+
+  /**
+    Flushes and closes the log. Files attached to it have to be closed first.
+  */
+  void close();
+
+  /**
+    Writes the pages changed in all attached files since the last commit as
+    one transaction.
+
+    @param[in] sync      If true, the transaction and all earlier ones are
+                         durable when commit returns. Otherwise syncing is
+                         left to the group commit.
+  */
+  void commit(bool sync);
+
+  /**
+    Makes all committed transactions durable.
+  */
+  void flush();
+
+  /**
+    Number of unsynced commits after which the log is synced. Defaults to 1.
+  */
+  void set_group_commit_size(uint32_t commits);
+
+  /**
+    Size of the log in bytes after which the files are synced and the log is
+    cleared. Defaults to 64MB.
+  */
+  void set_checkpoint_size(uint64_t bytes);
+
+ private:
+  friend class segmented_file;
+
+  enum record_type : uint32_t {
+    PAGE = 1,
+    SIZE = 2,
+    COMMIT = 3,
+  };
+
+  struct record_header {
+    uint32_t type;
+    uint32_t crc;
+    uint64_t length;
+  };
+
+  // A committed change waiting for the log to be synced
+  struct pending_write {
+    std::string path;
+    record_type type;
+    uint64_t offset;
+    std::string data;
+  };
+
+  std::string log_path;
+  std::FILE* log = nullptr;
+  uint64_t log_size = 0;
+  uint64_t sequence = 0;
+  uint32_t group_commit_size = 1;
+  uint32_t unsynced_commits = 0;
+  uint64_t checkpoint_size = 64ULL << 20;
+  std::vector<segmented_file*> files;
+  std::vector<pending_write> pending;
+  // Data files written since the last checkpoint, by path
+  std::map<std::string, std::FILE*> data_files;
+
+  void attach(segmented_file* file);
+  void detach(segmented_file* file);
+
+  void append(record_type type, const std::string& payload);
+  // Writes the pending changes to their files
+  void apply();
+  void apply(const pending_write& w);
+  // Syncs the data files and clears the log
+  void checkpoint();
+  // Replays the committed transactions in the log
+  void recover();
+  std::FILE* data_file(const std::string& path);
+};
+
+}  // namespace storage
+}  // namespace core
+}  // namespace automaton
+
+#endif  // AUTOMATON_CORE_STORAGE_WRITE_AHEAD_LOG_H__
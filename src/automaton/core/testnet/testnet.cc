@@ -1,5 +1,6 @@
 #include "automaton/core/testnet/testnet.h"
 
+#include <random>
 #include <set>
 
 #include "automaton/core/io/io.h"
@@ -73,7 +74,8 @@ void testnet::connect(const std::unordered_map<uint32_t, std::vector<uint32_t> >
     address = "tcp://127.0.0.1:";
     port = STARTING_PORT;
   } else {
-    address = "sim://1:20:10000:";
+    // Lag of 1 to 20 ms on a link of 1000 bytes/ms
+    address = "sim://1:20:1000:";
   }
 
   for (auto it = peers_list.begin(); it != peers_list.end(); it++) {
@@ -111,6 +113,7 @@ bool testnet::init() {
     address = "tcp://127.0.0.1:";
     port = STARTING_PORT;
   } else {
+    // Up to 100 connections sharing an uplink of 10000 bytes/ms
     address = "sim://100:10000:";
   }
   for (uint32_t i = 1; i <= number_nodes; ++i) {
@@ -151,6 +154,13 @@ std::unordered_map<uint32_t, std::vector<uint32_t> > create_connections_vector(u
 }
 
 std::unordered_map<uint32_t, std::vector<uint32_t> > create_rnd_connections_vector(uint32_t n, uint32_t p) {
+  return create_rnd_connections_vector(n, p, std::random_device()());
+}
+
+std::unordered_map<uint32_t, std::vector<uint32_t> > create_rnd_connections_vector(uint32_t n, uint32_t p,
+    uint64_t seed) {
+  std::mt19937_64 rng(seed);
+  std::uniform_int_distribution<uint32_t> peer(1, n);
   std::unordered_map<uint32_t, std::vector<uint32_t> > result;
   uint32_t k;
   if (p >= ((n + 1) / 2)) {
@@ -161,7 +171,7 @@ std::unordered_map<uint32_t, std::vector<uint32_t> > create_rnd_connections_vect
   for (uint32_t i = 1; i <= n; ++i) {
     std::set<uint32_t> peers;
     while (peers.size() < p) {
-      k = std::rand() % n + 1;
+      k = peer(rng);
       if (k == i) {continue;}
       peers.insert(k);
     }
@@ -54,6 +54,9 @@ class testnet {
 
 std::unordered_map<uint32_t, std::vector<uint32_t> > create_connections_vector(uint32_t n, uint32_t p);
 std::unordered_map<uint32_t, std::vector<uint32_t> > create_rnd_connections_vector(uint32_t n, uint32_t p);
+// Same as above but the result depends only on the seed
+std::unordered_map<uint32_t, std::vector<uint32_t> > create_rnd_connections_vector(uint32_t n, uint32_t p,
+    uint64_t seed);
 
 }  // namespace testnet
 }  // namespace core
@@ -75,8 +75,8 @@ std::string blockchain_cpp_node::process_cmd(const std::string& cmd, const std::
   return "";
 }
 
-void blockchain_cpp_node::s_on_blob_received(uint32_t id, const std::string& blob) {
-  msg* m = get_wire_msg(blob).release();
+void blockchain_cpp_node::s_on_blob_received(uint32_t id, const char* blob, uint32_t size) {
+  msg* m = get_wire_msg(blob, size).release();
   // TODO(kari): put a map [id->function]
   std::string msg_type = m->get_message_type();
   if (msg_type == "Hello") {
@@ -282,9 +282,14 @@ void blockchain_cpp_node::on_hello(uint32_t p_id, const std::string& name) {
 }
 
 void blockchain_cpp_node::gossip(uint32_t peer_from, uint32_t starting_block) {
-  for (uint32_t i : list_connected_peers()) {
-    if (i != peer_from) {
-      send_blocks(i, starting_block);
+  // Every block is serialized once for all peers
+  auto others = [peer_from](uint32_t p_id) {
+    return p_id != peer_from;
+  };
+  for (uint64_t i = starting_block - 1; i < blockchain.size(); ++i) {
+    std::unique_ptr<msg> block_msg = block_message(blockchain[static_cast<size_t>(i)]);
+    if (block_msg != nullptr) {
+      broadcast(*block_msg, 1, others);
     }
   }
 }
@@ -353,26 +358,33 @@ std::string blockchain_cpp_node::get_current_hash() const {
   return GENESIS_HASH;
 }
 
+std::unique_ptr<msg> blockchain_cpp_node::block_message(const std::string& hash) const {
+  block b = get_block(hash);
+  if (b.height == 0) {
+    return nullptr;
+  }
+  std::unique_ptr<msg> block_msg = factory->new_message_by_id(block_msg_id);
+  block_msg->set_blob(1, b.miner);
+  block_msg->set_blob(2, b.prev_hash);
+  block_msg->set_uint64(3, b.height);
+  block_msg->set_blob(4, b.nonce);
+  return block_msg;
+}
+
 void blockchain_cpp_node::send_block(uint32_t p_id, const std::string& hash) {
   // LOG(INFO) << nodeid << " sending block";
   if (LOG_ENABLED) {
     log(get_peer_name(p_id), "SEND | " + bin2hex(hash));
   }
   // Get block by hash && check if it's valid
-  block b = get_block(hash);
-  if (b.height == 0) {
+  std::unique_ptr<msg> block_msg = block_message(hash);
+  if (block_msg == nullptr) {
     if (LOG_ENABLED) {
       log(get_peer_name(p_id), "Trying to send invalid block or genesis block with hash " + bin2hex(hash));
     }
     return;
   }
-  msg* block_msg = create_msg_by_id(block_msg_id, factory).release();
-  block_msg->set_blob(1, b.miner);
-  block_msg->set_blob(2, b.prev_hash);
-  block_msg->set_uint64(3, b.height);
-  block_msg->set_blob(4, b.nonce);
   send_message(p_id, *block_msg, 1);
-  delete block_msg;
 }
 
 void blockchain_cpp_node::send_blocks(uint32_t p_id, uint32_t starting_block) {
@@ -65,7 +65,7 @@ class blockchain_cpp_node : public automaton::core::node::node {
   }
 
  private:
-  void s_on_blob_received(uint32_t id, const std::string& blob);
+  void s_on_blob_received(uint32_t id, const char* blob, uint32_t size);
   void s_on_msg_sent(uint32_t c, uint32_t id, const automaton::core::common::status& s);
   void s_on_connected(uint32_t id);
   void s_on_disconnected(uint32_t id);
@@ -83,6 +83,8 @@ class blockchain_cpp_node : public automaton::core::node::node {
   block get_block(const std::string& hash) const;
   std::string get_current_hash() const;
 
+  // Returns nullptr for an unknown or the genesis block
+  std::unique_ptr<automaton::core::data::msg> block_message(const std::string& hash) const;
   void send_block(uint32_t p_id, const std::string& hash);
   void send_blocks(uint32_t p_id, uint32_t starting_block);
 
@@ -15,7 +15,6 @@ using automaton::core::node::default_node_updater;
 using automaton::core::smartproto::smart_protocol;
 using automaton::core::testnet::testnet;
 
-auto WORKER_SLEEP_TIME_MS = 20;
 uint32_t WORKER_NUMBER = 10;
 
 /*
@@ -57,7 +56,7 @@ int main() {
       create_connections_vector(1000, 4));
 
   std::vector<std::string> ids = testnet::get_testnet("testnet")->list_nodes();
-  default_node_updater updater(WORKER_NUMBER, WORKER_SLEEP_TIME_MS, std::set<std::string>(ids.begin(), ids.end()));
+  default_node_updater updater(WORKER_NUMBER, std::set<std::string>(ids.begin(), ids.end()));
   updater.start();
 
   bool stop_logger = false;
@@ -12,12 +12,14 @@ end
 
 -- NETWORK SIMULATION DISCOVERY
 
+-- Up to 100 connections sharing an uplink of 10000 bytes/ms
 function sim_bind(i)
   return string.format("sim://100:10000:%d", i)
 end
 
+-- Lag of 1 to 20 ms on a link of 1000 bytes/ms
 function sim_addr(i)
-  return string.format("sim://1:20:10000:%d", i)
+  return string.format("sim://1:20:1000:%d", i)
 end
 
 function simulation(node_factory, NODES, PEERS, path)
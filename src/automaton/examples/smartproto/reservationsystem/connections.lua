@@ -9,11 +9,8 @@ function disconnected(peer_id)
   peers[peer_id] = nil
 end
 
+-- sends to all connected peers but peer_id, serializing msg once
 function gossip(peer_id, msg)
-  for k,v in pairs(peers) do
-    if k ~= 0 and k ~= peer_id and v.status == "connected" then
-      send(k, msg, current_message_id)
-      current_message_id = current_message_id + 1
-    end
-  end
+  broadcast(msg, current_message_id, peer_id)
+  current_message_id = current_message_id + 1
 end
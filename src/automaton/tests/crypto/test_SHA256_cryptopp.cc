@@ -74,6 +74,18 @@ TEST(SHA256_cryptopp, update_and_finish) {
   delete[] digest;
 }
 
+TEST(SHA256_cryptopp, update_batch) {
+  SHA256_cryptopp hasher;
+  uint8_t digest[32];
+  const uint8_t* a = reinterpret_cast<const uint8_t*>("a");
+  const uint8_t* bc = reinterpret_cast<const uint8_t*>("bc");
+  hash_transformation::input_span spans[] = {{a, 1}, {nullptr, 0}, {bc, 2}};
+  hasher.update_batch(spans, 3);
+  hasher.final(digest);
+  std::string result(reinterpret_cast<char*>(digest), sizeof(digest));
+  EXPECT_EQ(bin2hex(result), "BA7816BF8F01CFEA414140DE5DAE2223B00361A396177A9CB410FF61F20015AD");
+}
+
 TEST(SHA256_cryptopp, digest_size) {
   SHA256_cryptopp hasher;
   EXPECT_EQ(hasher.digest_size(), static_cast<size_t>(CryptoPP::SHA256::DIGESTSIZE));
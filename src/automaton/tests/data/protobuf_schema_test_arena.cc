@@ -0,0 +1,125 @@
+#include <memory>
+#include <string>
+
+#include "automaton/core/data/protobuf/protobuf_factory.h"
+#include "automaton/core/data/protobuf/protobuf_schema.h"
+#include "gtest/gtest.h"
+
+using automaton::core::data::msg;
+using automaton::core::data::msg_arena;
+using automaton::core::data::schema;
+using automaton::core::data::protobuf::protobuf_factory;
+using automaton::core::data::protobuf::protobuf_schema;
+
+class other_arena : public msg_arena {
+ public:
+  uint64_t get_space_allocated() const {
+    return 0;
+  }
+};
+
+TEST(protobuf_factory, arena_messages) {
+  /**
+    first_message {
+      string string_field = 1;
+      repeated int32 int32_field = 2;
+    }
+    second_message {
+      first_message message_field = 1;
+      repeated first_message repeated_message_field = 2;
+    }
+  **/
+  protobuf_schema custom_schema;
+  int m1 = custom_schema.create_message("first_message");
+  custom_schema.add_scalar_field(schema::field_info(1,
+      schema::blob, "string_field", "", false), m1);
+  custom_schema.add_scalar_field(schema::field_info(2,
+      schema::int32, "int32_field", "", true), m1);
+  custom_schema.add_message(m1);
+  int m2 = custom_schema.create_message("second_message");
+  custom_schema.add_message_field(schema::field_info(1,
+      schema::message_type, "message_field", "first_message", false), m2);
+  custom_schema.add_message_field(schema::field_info(2,
+      schema::message_type, "repeated_message_field", "first_message", true), m2);
+  custom_schema.add_message(m2);
+
+  protobuf_factory pb_factory;
+  pb_factory.import_schema(&custom_schema, "test", "");
+  uint32_t first_id = pb_factory.get_schema_id("first_message");
+  uint32_t second_id = pb_factory.get_schema_id("second_message");
+
+  std::unique_ptr<msg> sub;
+  std::unique_ptr<msg> repeated_sub;
+  std::string data;
+  {
+    auto arena = pb_factory.new_arena();
+    auto first = pb_factory.new_message_by_id(first_id, arena);
+    first->set_blob(1, "value");
+    first->set_repeated_int32(2, 7, -1);
+    EXPECT_GT(arena->get_space_allocated(), 0U);
+
+    auto second = pb_factory.new_message_by_id(second_id, arena);
+    second->set_message(1, *first);
+    second->set_repeated_message(2, *first, -1);
+    second->set_repeated_message(2, *first, -1);
+    // Setting copies, the field doesn't change with the original
+    first->set_blob(1, "changed");
+    second->serialize_message(&data);
+
+    sub = second->get_message(1);
+    repeated_sub = second->get_repeated_message(2, 1);
+  }
+  // The sub messages keep the arena alive
+  EXPECT_EQ(sub->get_blob(1), "value");
+  EXPECT_EQ(repeated_sub->get_repeated_int32(2, 0), 7);
+  sub = nullptr;
+  repeated_sub = nullptr;
+
+  // Heap and arena messages can be mixed
+  auto heap_msg = pb_factory.new_message_by_id(second_id, nullptr);
+  EXPECT_TRUE(heap_msg->deserialize_message(data));
+  EXPECT_EQ(heap_msg->get_repeated_field_size(2), 2U);
+  auto arena = pb_factory.new_arena();
+  auto arena_msg = pb_factory.new_message_by_id(second_id, arena);
+  arena_msg->set_message(1, *heap_msg->get_message(1));
+  EXPECT_EQ(arena_msg->get_message(1)->get_blob(1), "value");
+
+  EXPECT_THROW(pb_factory.new_message_by_id(first_id, std::make_shared<other_arena>()), std::invalid_argument);
+}
+
+TEST(protobuf_factory, move_to_heap) {
+  protobuf_schema custom_schema;
+  int m1 = custom_schema.create_message("first_message");
+  custom_schema.add_scalar_field(schema::field_info(1,
+      schema::blob, "string_field", "", false), m1);
+  custom_schema.add_message(m1);
+  int m2 = custom_schema.create_message("second_message");
+  custom_schema.add_message_field(schema::field_info(1,
+      schema::message_type, "message_field", "first_message", false), m2);
+  custom_schema.add_message(m2);
+
+  protobuf_factory pb_factory;
+  pb_factory.import_schema(&custom_schema, "test", "");
+  uint32_t first_id = pb_factory.get_schema_id("first_message");
+  uint32_t second_id = pb_factory.get_schema_id("second_message");
+
+  auto arena = pb_factory.new_arena();
+  std::weak_ptr<msg_arena> weak_arena = arena;
+  auto first = pb_factory.new_message_by_id(first_id, arena);
+  first->set_blob(1, "value");
+  auto second = pb_factory.new_message_by_id(second_id, arena);
+  second->set_message(1, *first);
+  arena = nullptr;
+  first = nullptr;
+
+  // The kept message no longer holds the arena
+  second->move_to_heap();
+  EXPECT_TRUE(weak_arena.expired());
+  EXPECT_EQ(second->get_message(1)->get_blob(1), "value");
+
+  // Nothing to do on the heap
+  second->move_to_heap();
+  std::string data;
+  EXPECT_TRUE(second->serialize_message(&data));
+  EXPECT_GT(data.size(), 0U);
+}
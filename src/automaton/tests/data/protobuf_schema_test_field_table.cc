@@ -0,0 +1,109 @@
+#include <string>
+
+#include "automaton/core/data/protobuf/protobuf_factory.h"
+#include "automaton/core/data/protobuf/protobuf_schema.h"
+#include "gtest/gtest.h"
+
+using automaton::core::data::msg;
+using automaton::core::data::schema;
+using automaton::core::data::protobuf::protobuf_factory;
+using automaton::core::data::protobuf::protobuf_schema;
+
+TEST(protobuf_factory, field_table) {
+  // Enough fields for names to collide in the first hash, and a big tag
+  protobuf_schema custom_schema;
+  int m1 = custom_schema.create_message("many_fields");
+  for (uint32_t i = 1; i <= 100; ++i) {
+    custom_schema.add_scalar_field(schema::field_info(i, schema::int32, "field" + std::to_string(i), "", false), m1);
+  }
+  custom_schema.add_scalar_field(schema::field_info(100000, schema::blob, "big", "", true), m1);
+  custom_schema.add_message(m1);
+  int m2 = custom_schema.create_message("sub_fields");
+  custom_schema.add_message_field(schema::field_info(1, schema::message_type, "sub", "many_fields", false), m2);
+  custom_schema.add_message_field(schema::field_info(2, schema::message_type, "subs", "many_fields", true), m2);
+  custom_schema.add_message(m2);
+  int m3 = custom_schema.create_message("empty");
+  custom_schema.add_message(m3);
+
+  protobuf_factory pb_factory;
+  pb_factory.import_schema(&custom_schema, "test", "");
+
+  auto many = pb_factory.new_message_by_name("many_fields");
+  uint32_t tag = 0;
+  schema::field_type type;
+  bool is_repeated = true;
+  for (uint32_t i = 1; i <= 100; ++i) {
+    std::string name = "field" + std::to_string(i);
+    EXPECT_TRUE(many->find_field(name.data(), name.size(), &tag, &type, &is_repeated));
+    EXPECT_EQ(tag, i);
+    EXPECT_EQ(type, schema::int32);
+    EXPECT_FALSE(is_repeated);
+    EXPECT_EQ(many->get_field_tag(name), i);
+    EXPECT_EQ(pb_factory.get_field_tag(many->get_schema_id(), name), i);
+    many->set_int32(i, i * 2);
+  }
+  EXPECT_TRUE(many->find_field("big", 3, &tag, &type, &is_repeated));
+  EXPECT_EQ(tag, 100000U);
+  EXPECT_EQ(type, schema::blob);
+  EXPECT_TRUE(is_repeated);
+  many->set_repeated_blob(100000, "value", -1);
+  EXPECT_EQ(many->get_repeated_blob(100000, 0), "value");
+  EXPECT_EQ(many->get_field_info_by_tag(100000).name, "big");
+
+  EXPECT_FALSE(many->find_field("field0", 6, &tag, &type, &is_repeated));
+  EXPECT_FALSE(many->find_field("field1x", 7, &tag, &type, &is_repeated));
+  EXPECT_FALSE(many->find_field("", 0, &tag, &type, &is_repeated));
+  EXPECT_THROW(many->get_field_tag("missing"), std::invalid_argument);
+  EXPECT_THROW(many->get_int32(101), std::invalid_argument);
+  EXPECT_THROW(many->get_int32(99999), std::invalid_argument);
+  EXPECT_THROW(many->get_field_info_by_tag(0), std::invalid_argument);
+
+  // Sub messages get the schema id and the table of their type
+  auto sub_fields = pb_factory.new_message_by_name("sub_fields");
+  sub_fields->set_message(1, *many);
+  sub_fields->set_repeated_message(2, *many, -1);
+  auto sub = sub_fields->get_message(1);
+  EXPECT_EQ(sub->get_schema_id(), many->get_schema_id());
+  EXPECT_EQ(sub->get_field_tag("field42"), 42U);
+  EXPECT_EQ(sub->get_int32(42), 84);
+  auto repeated_sub = sub_fields->get_repeated_message(2, 0);
+  EXPECT_EQ(repeated_sub->get_schema_id(), many->get_schema_id());
+  EXPECT_EQ(repeated_sub->get_repeated_blob(100000, 0), "value");
+  EXPECT_THROW(sub_fields->set_message(1, *sub_fields), std::invalid_argument);
+
+  auto empty = pb_factory.new_message_by_name("empty");
+  EXPECT_FALSE(empty->find_field("a", 1, &tag, &type, &is_repeated));
+  EXPECT_THROW(empty->get_field_tag("a"), std::invalid_argument);
+}
+
+// A dependency that failed to import is in the descriptor pool, but its
+// messages have no schemas to link fields of their type to
+TEST(protobuf_factory, unresolved_field_type) {
+  protobuf_schema base(R"(
+syntax = "proto3";
+message Part {
+  int32 x = 1;
+}
+message Choice {
+  oneof value {
+    int32 a = 1;
+  }
+}
+)");
+  protobuf_schema user;
+  int m1 = user.create_message("User");
+  user.add_message_field(schema::field_info(1, schema::message_type, "part", "base.Part", false), m1);
+  user.add_message(m1);
+  int e1 = user.create_enum("Kind");
+  user.add_enum_value(e1, "NONE", 0);
+  user.add_enum(e1, -1);
+  user.add_dependency("base");
+
+  protobuf_factory pb_factory;
+  EXPECT_THROW(pb_factory.import_schema(&base, "base", "base"), std::runtime_error);
+  EXPECT_THROW(pb_factory.import_schema(&user, "user", "user"), std::runtime_error);
+  // Nothing of the failed import is left
+  EXPECT_EQ(pb_factory.get_schemas_number(), 0U);
+  EXPECT_EQ(pb_factory.get_enums_number(), 0U);
+  EXPECT_THROW(pb_factory.new_message_by_name("user.User"), std::invalid_argument);
+}
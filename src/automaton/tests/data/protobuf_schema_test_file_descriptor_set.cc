@@ -0,0 +1,55 @@
+#include <string>
+
+#include "automaton/core/data/protobuf/protobuf_factory.h"
+#include "automaton/core/data/protobuf/protobuf_schema.h"
+#include "automaton/tests/data/proto_files.h"
+#include "gtest/gtest.h"
+
+using automaton::core::data::msg;
+using automaton::core::data::schema;
+using automaton::core::data::protobuf::protobuf_factory;
+using automaton::core::data::protobuf::protobuf_schema;
+
+TEST(protobuf_factory, file_descriptor_set) {
+  protobuf_factory pb_factory;
+  protobuf_schema loaded_schema(TEST_PROTO);
+  pb_factory.import_schema(&loaded_schema, "test", "");
+  protobuf_schema custom_schema;
+  int m1 = custom_schema.create_message("outer");
+  int m2 = custom_schema.create_message("inner");
+  custom_schema.add_scalar_field(schema::field_info(1, schema::int32, "value", "", false), m2);
+  custom_schema.add_nested_message(m1, m2);
+  custom_schema.add_message_field(schema::field_info(1, schema::message_type, "items", "outer.inner", true), m1);
+  custom_schema.add_message(m1);
+  pb_factory.import_schema(&custom_schema, "custom", "pkg");
+
+  std::string fds;
+  pb_factory.export_file_descriptor_set(&fds);
+  EXPECT_FALSE(fds.empty());
+
+  protobuf_factory cached_factory;
+  cached_factory.import_file_descriptor_set(fds);
+  ASSERT_EQ(cached_factory.get_schemas_number(), pb_factory.get_schemas_number());
+  for (uint32_t id = 0; id < pb_factory.get_schemas_number(); ++id) {
+    EXPECT_EQ(cached_factory.get_schema_name(id), pb_factory.get_schema_name(id));
+    EXPECT_EQ(cached_factory.dump_message_schema(id), pb_factory.dump_message_schema(id));
+  }
+
+  // Messages go from one factory to the other
+  auto inner = pb_factory.new_message_by_name("pkg.outer.inner");
+  inner->set_int32(1, 42);
+  auto outer = pb_factory.new_message_by_name("pkg.outer");
+  outer->set_repeated_message(1, *inner, -1);
+  std::string data;
+  outer->serialize_message(&data);
+  auto cached_outer = cached_factory.new_message_by_name("pkg.outer");
+  EXPECT_TRUE(cached_outer->deserialize_message(data));
+  EXPECT_EQ(cached_outer->get_repeated_message(1, 0)->get_int32(1), 42);
+  auto test_msg = cached_factory.new_message_by_name("TestMsg");
+  EXPECT_EQ(test_msg->get_field_tag("opt"), 3U);
+
+  // The same files can't be imported twice
+  EXPECT_THROW(cached_factory.import_file_descriptor_set(fds), std::runtime_error);
+  protobuf_factory invalid_factory;
+  EXPECT_THROW(invalid_factory.import_file_descriptor_set("\xff\xff"), std::invalid_argument);
+}
@@ -46,5 +46,15 @@ TEST(protobuf_factory, message_serialization) {
   EXPECT_EQ(msg2->get_repeated_int32(2, 0), 7);
   EXPECT_EQ(msg2->get_repeated_int32(2, 1), 11);
 
+  // Parsing in place from a buffer with other bytes around the message
+  std::string buffer = "x" + data + "yz";
+  auto msg3 = pb_factory.new_message_by_id(0);
+  EXPECT_TRUE(msg3->deserialize_message(reinterpret_cast<const uint8_t*>(buffer.data() + 1), data.size()));
+  EXPECT_EQ(msg3->get_blob(1), "value");
+  EXPECT_EQ(msg3->get_repeated_field_size(2), 2U);
+  EXPECT_EQ(msg3->get_repeated_int32(2, 1), 11);
+  auto msg4 = pb_factory.new_message_by_id(0);
+  EXPECT_FALSE(msg4->deserialize_message(reinterpret_cast<const uint8_t*>(buffer.data() + 1), data.size() - 1));
+
   google::protobuf::ShutdownProtobufLibrary();
 }
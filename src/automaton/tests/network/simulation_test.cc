@@ -0,0 +1,427 @@
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "automaton/core/network/simulated_connection.h"
+#include "gtest/gtest.h"
+
+using automaton::core::common::status;
+using automaton::core::network::acceptor;
+using automaton::core::network::acceptor_id;
+using automaton::core::network::connection;
+using automaton::core::network::connection_id;
+using automaton::core::network::connection_params;
+using automaton::core::network::link_transmitter;
+using automaton::core::network::simulated_acceptor;
+using automaton::core::network::simulated_connection;
+using automaton::core::network::simulation;
+
+// Events run in time order and the clock jumps to each of them
+TEST(simulation, events_run_in_time_order) {
+  auto sim = simulation::get_simulator();
+  uint64_t start = sim->get_time();
+  std::vector<std::pair<uint32_t, uint64_t> > ran;
+  for (uint32_t delay : {30, 10, 20, 1000000}) {
+    sim->add_task(start + delay, [sim, &ran, delay]() {
+      ran.push_back(std::make_pair(delay, sim->get_time()));
+    });
+  }
+  EXPECT_EQ(sim->process(start + 15), 1U);
+  EXPECT_EQ(sim->get_time(), start + 15);
+  EXPECT_EQ(sim->process(start + 100), 2U);
+  EXPECT_EQ(sim->get_time(), start + 100);
+  ASSERT_EQ(ran.size(), 3U);
+  EXPECT_EQ(ran[0], std::make_pair(10U, start + 10));
+  EXPECT_EQ(ran[1], std::make_pair(20U, start + 20));
+  EXPECT_EQ(ran[2], std::make_pair(30U, start + 30));
+
+  // A far event costs no more than a near one
+  EXPECT_EQ(sim->process(start + 1000000), 1U);
+  EXPECT_EQ(ran.back(), std::make_pair(1000000U, start + 1000000));
+  EXPECT_TRUE(sim->is_queue_empty());
+
+  // Events can't be added in the past, they run right after the current time
+  sim->add_task(start, [sim, &ran]() {
+    ran.push_back(std::make_pair(0U, sim->get_time()));
+  });
+  sim->process(start + 2000000);
+  EXPECT_EQ(ran.back(), std::make_pair(0U, start + 1000001));
+}
+
+// Events at the same time run in the order they were added, also when they are
+// added by other events
+TEST(simulation, equal_times_run_in_insertion_order) {
+  auto sim = simulation::get_simulator();
+  uint64_t at = sim->get_time() + 10;
+  std::vector<uint32_t> ran;
+  for (uint32_t i = 0; i < 100; ++i) {
+    sim->add_task(at, [sim, &ran, at, i]() {
+      ran.push_back(i);
+      if (i == 0) {
+        sim->add_task(at + 1, [&ran]() { ran.push_back(1000); });
+      }
+    });
+    // Earlier events in between
+    sim->add_task(at - 1 - i % 3, []() {});
+  }
+  sim->add_task(at + 1, [&ran]() { ran.push_back(1001); });
+  sim->process(at + 1);
+  ASSERT_EQ(ran.size(), 102U);
+  for (uint32_t i = 0; i < 100; ++i) {
+    EXPECT_EQ(ran[i], i);
+  }
+  // Both are at at + 1, the one added first runs first
+  EXPECT_EQ(ran[100], 1001U);
+  EXPECT_EQ(ran[101], 1000U);
+}
+
+// The deadlines returned by the step of run_until move the clock like events,
+// so nodes are updated also when the network is quiet
+TEST(simulation, run_until_advances_to_step_deadlines) {
+  auto sim = simulation::get_simulator();
+  uint64_t start = sim->get_time();
+  std::vector<uint64_t> steps;
+  std::vector<uint64_t> events;
+  sim->add_task(start + 250, [sim, &events]() {
+    events.push_back(sim->get_time());
+  });
+  // A node updated every 100ms
+  uint64_t processed = sim->run_until(start + 1000, [sim, &steps](uint64_t time) {
+    EXPECT_EQ(sim->get_time(), time);
+    steps.push_back(time);
+    return time - time % 100 + 100;
+  });
+  EXPECT_EQ(processed, 1U);
+  ASSERT_EQ(events.size(), 1U);
+  EXPECT_EQ(events[0], start + 250);
+  std::vector<uint64_t> expected = {start};
+  for (uint64_t t = start - start % 100 + 100; t <= start + 1000; t += 100) {
+    if (expected.back() < start + 250 && t > start + 250) {
+      expected.push_back(start + 250);
+    }
+    expected.push_back(t);
+  }
+  EXPECT_EQ(steps, expected);
+  EXPECT_EQ(sim->get_time(), expected.back());
+
+  // A deadline that has passed is taken as the next millisecond
+  steps.clear();
+  uint64_t now = sim->get_time();
+  sim->run_until(now + 3, [&steps](uint64_t time) {
+    steps.push_back(time);
+    return time;
+  });
+  EXPECT_EQ(steps, std::vector<uint64_t>({now, now + 1, now + 2, now + 3}));
+
+  // Without deadlines the run ends with the events
+  steps.clear();
+  now = sim->get_time();
+  sim->run_until(now + 1000, [&steps](uint64_t time) {
+    steps.push_back(time);
+    return simulation::NO_DEADLINE;
+  });
+  EXPECT_EQ(steps, std::vector<uint64_t>({now}));
+  EXPECT_EQ(sim->get_time(), now);
+}
+
+// Handler tasks of one key run in order, tasks of different keys run at the
+// same time on different threads
+TEST(simulation, handler_groups_run_in_parallel) {
+  auto sim = simulation::get_simulator();
+  const uint32_t KEYS = 4;
+  sim->set_handler_threads(KEYS);
+  int keys[KEYS];
+  std::vector<uint32_t> ran[KEYS];
+  std::atomic<uint32_t> started(0);
+  std::atomic<bool> all_started(true);
+  for (uint32_t i = 0; i < 400; ++i) {
+    uint32_t k = i % KEYS;
+    sim->add_handlers_task(&keys[k], [&, i, k]() {
+      if (i < KEYS) {
+        // Returns only when the first task of every key has started
+        started++;
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+        while (started < KEYS && std::chrono::steady_clock::now() < deadline) {
+          std::this_thread::yield();
+        }
+        all_started = all_started && started == KEYS;
+      }
+      ran[k].push_back(i);
+      // Added by a handler, runs in the next batch after the tasks of this one
+      if (i == k) {
+        sim->add_handlers_task(&keys[k], [&ran, k]() { ran[k].push_back(1000); });
+      }
+    });
+  }
+  sim->process_handlers();
+  EXPECT_TRUE(all_started);
+  for (uint32_t k = 0; k < KEYS; ++k) {
+    ASSERT_EQ(ran[k].size(), 101U);
+    for (uint32_t j = 0; j < 100; ++j) {
+      EXPECT_EQ(ran[k][j], j * KEYS + k);
+    }
+    EXPECT_EQ(ran[k][100], 1000U);
+  }
+  sim->set_handler_threads(std::thread::hardware_concurrency());
+}
+
+// One handler thread runs everything on the calling thread in the order it
+// was added, whatever the keys
+TEST(simulation, handlers_on_one_thread) {
+  auto sim = simulation::get_simulator();
+  sim->set_handler_threads(1);
+  int a, b;
+  std::vector<uint32_t> ran;
+  std::vector<std::thread::id> threads;
+  for (uint32_t i = 0; i < 10; ++i) {
+    sim->add_handlers_task(i % 3 ? &a : &b, [&ran, &threads, i]() {
+      ran.push_back(i);
+      threads.push_back(std::this_thread::get_id());
+    });
+  }
+  sim->process_handlers();
+  ASSERT_EQ(ran.size(), 10U);
+  for (uint32_t i = 0; i < 10; ++i) {
+    EXPECT_EQ(ran[i], i);
+    EXPECT_EQ(threads[i], std::this_thread::get_id());
+  }
+  sim->set_handler_threads(std::thread::hardware_concurrency());
+}
+
+// Both ends of a connection. The client sends numbers and the server echoes
+// them back.
+class echo_peer: public connection::connection_handler, public acceptor::acceptor_handler {
+ public:
+  std::shared_ptr<connection> c;
+  std::shared_ptr<char> buffer = std::shared_ptr<char>(new char[64], std::default_delete<char[]>());
+  bool server = false;
+
+  bool on_requested(acceptor_id a, const std::string& address, connection_id* id) {
+    *id = 1;
+    return true;
+  }
+  void on_connected(acceptor_id a, std::shared_ptr<connection> accepted, const std::string& address) {
+    c = accepted;
+  }
+  void on_acceptor_error(acceptor_id a, const status& s) {}
+  void on_connected(connection_id id) {
+    c->async_read(buffer, 64, 0, 0);
+  }
+  void on_message_received(connection_id id, std::shared_ptr<char> received, uint32_t bytes_read, uint32_t mid) {
+    if (server) {
+      c->async_send(std::string(received.get(), bytes_read), 0);
+    }
+    c->async_read(buffer, 64, 0, 0);
+  }
+  void on_message_sent(connection_id id, uint32_t mid, const status& s) {}
+  void on_disconnected(connection_id id) {}
+  void on_connection_error(connection_id id, const status& s) {}
+};
+
+// Connects clients to servers over links with random lags, exchanges messages,
+// disconnects and returns the trace
+static std::string traced_run(uint64_t seed) {
+  const uint32_t PAIRS = 10;
+  auto sim = simulation::get_simulator();
+  sim->set_seed(seed);
+  sim->start_trace();
+  std::vector<std::shared_ptr<echo_peer> > servers, clients;
+  std::vector<std::shared_ptr<acceptor> > acceptors;
+  for (uint32_t i = 1; i <= PAIRS; ++i) {
+    auto server = std::make_shared<echo_peer>();
+    server->server = true;
+    auto a = acceptor::create("sim", 1, "10:1000:" + std::to_string(100 + i), server, server);
+    EXPECT_TRUE(a->init());
+    a->start_accepting();
+    auto client = std::make_shared<echo_peer>();
+    client->c = connection::create("sim", i, "5:50:1000:" + std::to_string(100 + i), client);
+    EXPECT_TRUE(client->c->init());
+    client->c->connect();
+    servers.push_back(server);
+    clients.push_back(client);
+    acceptors.push_back(a);
+  }
+  sim->run_until(sim->get_time() + 200);
+  for (uint32_t k = 0; k < 20; ++k) {
+    for (auto& client : clients) {
+      client->c->async_send(std::to_string(k * 1000), k);
+    }
+  }
+  sim->run_until(sim->get_time() + 100000);
+  for (auto& client : clients) {
+    client->c->disconnect();
+  }
+  sim->run_until(sim->get_time() + 100000);
+  for (uint32_t i = 1; i <= PAIRS; ++i) {
+    acceptors[i - 1]->stop_accepting();
+    sim->remove_acceptor(100 + i);
+    clients[i - 1]->c = nullptr;
+    servers[i - 1]->c = nullptr;
+  }
+  return sim->stop_trace();
+}
+
+// The same seed gives the same run, and its trace decodes to the events of the
+// run
+TEST(simulation, seeded_runs_repeat_their_trace) {
+  std::string first = traced_run(42);
+  std::string second = traced_run(42);
+  EXPECT_EQ(first, second);
+  EXPECT_NE(first, traced_run(7));
+
+  uint64_t seed = 0;
+  auto records = simulation::parse_trace(first, &seed);
+  EXPECT_EQ(seed, 42U);
+  std::map<uint8_t, uint32_t> count;
+  uint64_t message_bytes = 0;
+  uint64_t last_time = 0;
+  for (auto& r : records) {
+    ++count[r.type];
+    EXPECT_GE(r.time, last_time);
+    last_time = r.time;
+    if (r.type == simulation::TRACE_MESSAGE) {
+      message_bytes += r.size;
+    } else {
+      EXPECT_EQ(r.size, 0U);
+    }
+  }
+  EXPECT_EQ(count[simulation::TRACE_REQUEST], 10U);
+  EXPECT_EQ(count[simulation::TRACE_ACCEPT], 10U);
+  EXPECT_EQ(count[simulation::TRACE_REFUSE], 0U);
+  // Every message is echoed, the server may echo several in one
+  EXPECT_EQ(message_bytes, 2U * 10 * (1 + 9 * 4 + 10 * 5));
+  EXPECT_GE(count[simulation::TRACE_MESSAGE], 200U);
+  EXPECT_EQ(count[simulation::TRACE_ACK], count[simulation::TRACE_MESSAGE]);
+  EXPECT_EQ(count[simulation::TRACE_DISCONNECT], 10U);
+  EXPECT_EQ(simulation::parse_trace(second, nullptr), records);
+}
+
+// Traces are the magic, the seed and varint encoded records
+TEST(simulation, parse_trace) {
+  // Seed 300, then a message of 200 bytes from 1 to 2 at time 5 and an ack to
+  // 1 at time 133
+  std::string trace("ATR1\xac\x02" "\x05\x04\x01\x02\xc8\x01" "\x80\x01\x05\x00\x01", 17);
+  uint64_t seed = 0;
+  auto records = simulation::parse_trace(trace, &seed);
+  EXPECT_EQ(seed, 300U);
+  ASSERT_EQ(records.size(), 2U);
+  simulation::trace_record message = {5, simulation::TRACE_MESSAGE, 1, 2, 200};
+  simulation::trace_record ack = {133, simulation::TRACE_ACK, 0, 1, 0};
+  EXPECT_TRUE(records[0] == message);
+  EXPECT_TRUE(records[1] == ack);
+
+  EXPECT_THROW(simulation::parse_trace("ATR2\x01", nullptr), std::invalid_argument);
+  EXPECT_THROW(simulation::parse_trace(trace.substr(0, 10), nullptr), std::invalid_argument);
+  EXPECT_THROW(simulation::parse_trace(trace.substr(0, 16), nullptr), std::invalid_argument);
+  std::string unknown_type = trace;
+  unknown_type[7] = 9;
+  EXPECT_THROW(simulation::parse_trace(unknown_type, nullptr), std::invalid_argument);
+}
+
+// A link sends one message after another at its bandwidth in bytes per
+// millisecond
+TEST(simulation, link_transmitter) {
+  link_transmitter link(10);
+  EXPECT_EQ(link.transmit(0, 100), 10U);
+  // Waits for the first message
+  EXPECT_EQ(link.transmit(0, 100), 20U);
+  // The link is idle by then, a part of a millisecond is rounded up
+  EXPECT_EQ(link.transmit(100, 5), 101U);
+  // Partial milliseconds add up
+  EXPECT_EQ(link.transmit(200, 5), 201U);
+  EXPECT_EQ(link.transmit(200, 5), 201U);
+
+  link_transmitter unlimited(0);
+  EXPECT_EQ(unlimited.transmit(7, 1000000), 7U);
+  EXPECT_EQ(unlimited.transmit(7, 1000000), 7U);
+}
+
+static std::shared_ptr<simulated_connection> create_connection(const std::string& address) {
+  auto c = std::dynamic_pointer_cast<simulated_connection>(connection::create("sim", 1, address, nullptr));
+  EXPECT_TRUE(c->init());
+  return c;
+}
+
+// A message is sent when both the link of the connection and the uplink of
+// the acceptor have sent it
+TEST(simulation, transmit_on_link_and_uplink) {
+  auto c = create_connection("0:0:10:1");
+  EXPECT_EQ(c->transmit(0, 100), 10U);
+  c->uplink = std::make_shared<link_transmitter>(5);
+  EXPECT_EQ(c->transmit(0, 100), 20U);
+  // The uplink is busy with the last message
+  EXPECT_EQ(c->transmit(0, 100), 40U);
+}
+
+// A lost message is sent again after the round trip timeout of 2 * max lag + 1
+TEST(simulation, transmit_loss_rate) {
+  auto sim = simulation::get_simulator();
+  sim->set_seed(1);
+  auto c = create_connection("5:5:0:1:250:0");
+  const uint32_t SENDS = 10000;
+  uint32_t lost = 0;
+  for (uint32_t i = 0; i < SENDS; ++i) {
+    uint64_t sent = c->transmit(0, 10);
+    EXPECT_EQ(sent % 11, 0U);
+    lost += sent > 0;
+  }
+  EXPECT_NEAR(static_cast<double>(lost) / SENDS, 0.25, 0.02);
+}
+
+// Jitter adds up to the given milliseconds
+TEST(simulation, transmit_jitter_bounds) {
+  auto sim = simulation::get_simulator();
+  sim->set_seed(1);
+  auto c = create_connection("0:0:0:1:0:7");
+  std::vector<uint32_t> seen(8, 0);
+  for (uint32_t i = 0; i < 1000; ++i) {
+    uint64_t sent = c->transmit(100, 10);
+    ASSERT_GE(sent, 100U);
+    ASSERT_LE(sent, 107U);
+    ++seen[sent - 100];
+  }
+  for (uint32_t j = 0; j < seen.size(); ++j) {
+    EXPECT_GT(seen[j], 0U) << j;
+  }
+}
+
+TEST(simulation, parse_address) {
+  auto c = create_connection("0:0:0:1");
+  connection_params params;
+  uint32_t remote = 0;
+  EXPECT_TRUE(c->parse_address("5:50:1000:12", &params, &remote));
+  EXPECT_EQ(params.min_lag, 5U);
+  EXPECT_EQ(params.max_lag, 50U);
+  EXPECT_EQ(params.bandwidth, 1000U);
+  EXPECT_EQ(remote, 12U);
+  EXPECT_EQ(params.loss, 0U);
+  EXPECT_EQ(params.jitter, 0U);
+
+  EXPECT_TRUE(c->parse_address("1:2:0:3:999:20", &params, &remote));
+  EXPECT_EQ(params.bandwidth, 0U);
+  EXPECT_EQ(remote, 3U);
+  EXPECT_EQ(params.loss, 999U);
+  EXPECT_EQ(params.jitter, 20U);
+
+  // Loss and jitter come together
+  EXPECT_FALSE(c->parse_address("1:2:3:4:5", &params, &remote));
+  // The lag range is empty
+  EXPECT_FALSE(c->parse_address("20:10:0:1", &params, &remote));
+  // Every message must get through
+  EXPECT_FALSE(c->parse_address("1:2:3:4:1000:0", &params, &remote));
+  EXPECT_FALSE(c->parse_address("1:2:3", &params, &remote));
+  EXPECT_FALSE(c->parse_address("1:2:x:4", &params, &remote));
+
+  auto a = std::dynamic_pointer_cast<simulated_acceptor>(acceptor::create("sim", 1, "10:0:1", nullptr, nullptr));
+  automaton::core::network::acceptor_params acceptor_params;
+  EXPECT_TRUE(a->parse_address("10:5000:7", &acceptor_params, &remote));
+  EXPECT_EQ(acceptor_params.max_connections, 10U);
+  EXPECT_EQ(acceptor_params.bandwidth, 5000U);
+  EXPECT_EQ(remote, 7U);
+  EXPECT_FALSE(a->parse_address("10:5000", &acceptor_params, &remote));
+}
@@ -0,0 +1,324 @@
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "automaton/core/network/tcp_implementation.h"
+#include "gtest/gtest.h"
+
+using automaton::core::common::status;
+using automaton::core::network::acceptor;
+using automaton::core::network::acceptor_id;
+using automaton::core::network::connection;
+using automaton::core::network::connection_id;
+
+static const uint32_t BUFFER_SIZE = 256;
+
+// Handles both the connections and the acceptor of one peer, like a node does.
+// Records the threads its callbacks run on and whether two of them overlapped.
+class test_peer: public connection::connection_handler, public acceptor::acceptor_handler {
+ public:
+  void on_message_received(connection_id c, std::shared_ptr<char> buffer, uint32_t bytes_read, uint32_t id) {
+    enter();
+    std::shared_ptr<connection> con;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      received[c] += std::string(buffer.get(), bytes_read);
+      con = connections[c];
+      changed.notify_all();
+    }
+    leave();
+    con->async_read(buffer, BUFFER_SIZE, 0, 0);
+  }
+
+  void on_message_sent(connection_id c, uint32_t id, const status& s) {
+    enter();
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      sent[c].push_back(id);
+      if (s.code != status::OK) {
+        failed.push_back(id);
+      }
+      changed.notify_all();
+    }
+    leave();
+  }
+
+  void on_connected(connection_id c) {
+    enter();
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      ++connected;
+      changed.notify_all();
+    }
+    leave();
+  }
+
+  void on_disconnected(connection_id c) {}
+
+  void on_connection_error(connection_id c, const status& s) {}
+
+  bool on_requested(acceptor_id a, const std::string& address, connection_id* id) {
+    std::lock_guard<std::mutex> lock(mutex);
+    *id = next_id++;
+    return true;
+  }
+
+  void on_connected(acceptor_id a, std::shared_ptr<connection> c, const std::string& address) {
+    enter();
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      connections[c->get_id()] = c;
+    }
+    leave();
+    if (close_accepted) {
+      c->disconnect();
+      return;
+    }
+    c->async_read(std::shared_ptr<char>(new char[BUFFER_SIZE], std::default_delete<char[]>()), BUFFER_SIZE, 0, 0);
+  }
+
+  void on_acceptor_error(acceptor_id a, const status& s) {}
+
+  // Waits until pred() holds, returns false after 10 seconds
+  template<class predicate>
+  bool wait(predicate pred) {
+    std::unique_lock<std::mutex> lock(mutex);
+    return changed.wait_for(lock, std::chrono::seconds(10), pred);
+  }
+
+  std::mutex mutex;
+  std::condition_variable changed;
+  std::map<connection_id, std::shared_ptr<connection>> connections;
+  std::map<connection_id, std::string> received;
+  std::map<connection_id, std::vector<uint32_t>> sent;
+  std::set<std::thread::id> threads;
+  uint32_t connected = 0;
+  // Ids of the messages that were not sent
+  std::vector<uint32_t> failed;
+  connection_id next_id = 1000;
+  // Accepted connections are closed right away instead of read
+  bool close_accepted = false;
+  std::atomic<bool> overlapped{false};
+
+ private:
+  std::atomic<uint32_t> active{0};
+
+  void enter() {
+    if (active++ > 0) {
+      overlapped = true;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      threads.insert(std::this_thread::get_id());
+    }
+    // Gives a concurrent callback time to show up
+    std::this_thread::sleep_for(std::chrono::microseconds(50));
+  }
+
+  void leave() {
+    --active;
+  }
+};
+
+// With several io_service threads the connections of a peer are spread over
+// the pool, but all the callbacks of the peer still run on one thread, one at a
+// time
+TEST(tcp_connection, callbacks_of_a_handler_never_overlap) {
+  automaton::core::network::tcp_init(4);
+  auto server = std::make_shared<test_peer>();
+  auto client = std::make_shared<test_peer>();
+  auto a = acceptor::create("tcp", 1, "127.0.0.1:0", server, server);
+  ASSERT_TRUE(a->init());
+  a->start_accepting();
+
+  const uint32_t CONNECTIONS = 8;
+  const uint32_t MESSAGES = 50;
+  std::vector<std::shared_ptr<connection>> connections;
+  for (uint32_t i = 0; i < CONNECTIONS; ++i) {
+    auto c = connection::create("tcp", i + 1, a->get_address(), client);
+    ASSERT_TRUE(c->init());
+    c->connect();
+    connections.push_back(c);
+  }
+  ASSERT_TRUE(client->wait([&client, CONNECTIONS]() { return client->connected == CONNECTIONS; }));
+  for (uint32_t m = 0; m < MESSAGES; ++m) {
+    for (auto& c : connections) {
+      c->async_send("message " + std::to_string(m) + ";", m);
+    }
+  }
+
+  std::string expected;
+  for (uint32_t m = 0; m < MESSAGES; ++m) {
+    expected += "message " + std::to_string(m) + ";";
+  }
+  EXPECT_TRUE(client->wait([&client, CONNECTIONS, MESSAGES]() {
+    uint32_t n = 0;
+    for (auto& s : client->sent) {
+      n += static_cast<uint32_t>(s.second.size());
+    }
+    return n == CONNECTIONS * MESSAGES;
+  }));
+  EXPECT_TRUE(server->wait([&server, &expected, CONNECTIONS]() {
+    if (server->received.size() != CONNECTIONS) {
+      return false;
+    }
+    for (auto& r : server->received) {
+      if (r.second.size() != expected.size()) {
+        return false;
+      }
+    }
+    return true;
+  }));
+  {
+    std::lock_guard<std::mutex> lock(server->mutex);
+    for (auto& r : server->received) {
+      EXPECT_EQ(r.second, expected) << "connection " << r.first;
+    }
+    EXPECT_EQ(server->threads.size(), 1U);
+  }
+  {
+    std::lock_guard<std::mutex> lock(client->mutex);
+    EXPECT_TRUE(client->failed.empty());
+    EXPECT_EQ(client->threads.size(), 1U);
+    // The two peers still use different threads of the pool
+    EXPECT_NE(*client->threads.begin(), *server->threads.begin());
+  }
+  EXPECT_FALSE(server->overlapped);
+  EXPECT_FALSE(client->overlapped);
+
+  for (auto& c : connections) {
+    c->disconnect();
+  }
+  a->stop_accepting();
+  automaton::core::network::tcp_release();
+}
+
+// Opens a connection from client to server
+static std::shared_ptr<connection> connect_peers(std::shared_ptr<test_peer> server, std::shared_ptr<test_peer> client,
+    std::shared_ptr<acceptor>* a) {
+  *a = acceptor::create("tcp", 1, "127.0.0.1:0", server, server);
+  if (!(*a)->init()) {
+    return nullptr;
+  }
+  (*a)->start_accepting();
+  auto c = connection::create("tcp", 1, (*a)->get_address(), client);
+  if (!c->init()) {
+    return nullptr;
+  }
+  c->connect();
+  if (!client->wait([&client]() { return client->connected == 1; })) {
+    return nullptr;
+  }
+  return c;
+}
+
+// Messages sent back to back are written together and arrive whole and in order
+TEST(tcp_connection, back_to_back_messages_arrive_intact) {
+  automaton::core::network::tcp_init(2);
+  auto server = std::make_shared<test_peer>();
+  auto client = std::make_shared<test_peer>();
+  std::shared_ptr<acceptor> a;
+  auto c = connect_peers(server, client, &a);
+  ASSERT_NE(c, nullptr);
+
+  const uint32_t MESSAGES = 2000;
+  std::string expected;
+  for (uint32_t i = 0; i < MESSAGES; ++i) {
+    // Some are larger than a read, a few larger than the socket buffers
+    std::string m(i % 100 == 0 ? 100000 + i : i % 7 * 50 + 1, static_cast<char>('a' + i % 26));
+    m[0] = static_cast<char>(i);
+    expected += m;
+    c->async_send(std::move(m), i);
+  }
+  EXPECT_TRUE(server->wait([&server, &expected]() {
+    return server->received.size() == 1 && server->received.begin()->second.size() >= expected.size();
+  }));
+  {
+    std::lock_guard<std::mutex> lock(server->mutex);
+    ASSERT_EQ(server->received.size(), 1U);
+    EXPECT_TRUE(server->received.begin()->second == expected);
+  }
+
+  c->disconnect();
+  a->stop_accepting();
+  automaton::core::network::tcp_release();
+}
+
+// on_message_sent is called once for every message, in the order they were sent
+TEST(tcp_connection, message_sent_once_per_message_in_order) {
+  automaton::core::network::tcp_init(2);
+  auto server = std::make_shared<test_peer>();
+  auto client = std::make_shared<test_peer>();
+  std::shared_ptr<acceptor> a;
+  auto c = connect_peers(server, client, &a);
+  ASSERT_NE(c, nullptr);
+
+  const uint32_t MESSAGES = 1000;
+  auto shared = std::make_shared<const std::string>(3000, 's');
+  for (uint32_t i = 0; i < MESSAGES; ++i) {
+    if (i % 2 == 0) {
+      c->async_send(shared, i);
+    } else {
+      c->async_send(std::string(i, 'o'), i);
+    }
+  }
+  ASSERT_TRUE(client->wait([&client, MESSAGES]() { return client->sent[1].size() >= MESSAGES; }));
+  {
+    std::lock_guard<std::mutex> lock(client->mutex);
+    ASSERT_EQ(client->sent[1].size(), MESSAGES);
+    for (uint32_t i = 0; i < MESSAGES; ++i) {
+      ASSERT_EQ(client->sent[1][i], i);
+    }
+    EXPECT_TRUE(client->failed.empty());
+  }
+
+  c->disconnect();
+  a->stop_accepting();
+  automaton::core::network::tcp_release();
+}
+
+// Once a write fails, every message queued behind it fails as well, each one
+// reported once and in order
+TEST(tcp_connection, write_error_fails_queued_messages) {
+  automaton::core::network::tcp_init(2);
+  auto server = std::make_shared<test_peer>();
+  server->close_accepted = true;
+  auto client = std::make_shared<test_peer>();
+  std::shared_ptr<acceptor> a;
+  auto c = connect_peers(server, client, &a);
+  ASSERT_NE(c, nullptr);
+
+  // More than the socket buffers hold, the peer resets the connection
+  // before it's all written
+  const uint32_t MESSAGES = 64;
+  auto large = std::make_shared<const std::string>(1 << 20, 'x');
+  for (uint32_t i = 0; i < MESSAGES; ++i) {
+    c->async_send(large, i);
+  }
+  ASSERT_TRUE(client->wait([&client, MESSAGES]() { return client->sent[1].size() >= MESSAGES; }));
+  {
+    std::lock_guard<std::mutex> lock(client->mutex);
+    ASSERT_EQ(client->sent[1].size(), MESSAGES);
+    for (uint32_t i = 0; i < MESSAGES; ++i) {
+      ASSERT_EQ(client->sent[1][i], i);
+    }
+    // The messages after the first failed one all failed
+    ASSERT_FALSE(client->failed.empty());
+    uint32_t first = client->failed[0];
+    ASSERT_EQ(client->failed.size(), MESSAGES - first);
+    for (uint32_t i = first; i < MESSAGES; ++i) {
+      EXPECT_EQ(client->failed[i - first], i);
+    }
+  }
+
+  c->disconnect();
+  a->stop_accepting();
+  automaton::core::network::tcp_release();
+}
@@ -0,0 +1,79 @@
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "automaton/core/node/frame_reader.h"
+#include "gtest/gtest.h"
+
+using automaton::core::node::frame_reader;
+
+// Many frames in one read and frames split at every byte give the same messages
+TEST(frame_reader, split_and_coalesced_frames) {
+  std::vector<std::string> sent = {"a", std::string(300, 'b'), "ccc", std::string(70000, 'd')};
+  std::string stream;
+  for (auto& m : sent) {
+    stream += frame_reader::frame(m);
+  }
+  EXPECT_EQ(stream.size(), 70304U + 4 * frame_reader::HEADER_SIZE);
+
+  std::vector<std::string> received;
+  std::vector<const char*> positions;
+  auto handler = [&received, &positions](const char* m, uint32_t size) {
+    received.push_back(std::string(m, size));
+    positions.push_back(m);
+  };
+  auto whole = std::make_shared<frame_reader>(1 << 20);
+  EXPECT_TRUE(whole->consume(stream.data(), static_cast<uint32_t>(stream.size()), handler));
+  EXPECT_EQ(received, sent);
+  // Whole messages are passed in place
+  ASSERT_EQ(positions.size(), 4U);
+  EXPECT_EQ(positions[0], stream.data() + frame_reader::HEADER_SIZE);
+  EXPECT_EQ(positions[3], stream.data() + stream.size() - sent[3].size());
+  EXPECT_EQ(whole->missing(), 0U);
+
+  received.clear();
+  auto bytes = std::make_shared<frame_reader>(1 << 20);
+  for (size_t i = 0; i < stream.size(); ++i) {
+    EXPECT_TRUE(bytes->consume(stream.data() + i, 1, handler));
+  }
+  EXPECT_EQ(received, sent);
+}
+
+// The rest of a large message can be read straight into the body buffer
+TEST(frame_reader, direct_body_read) {
+  std::string message(1 << 20, 'x');
+  message[100] = 'y';
+  message.back() = 'z';
+  std::string stream = frame_reader::frame(message) + frame_reader::frame("next");
+
+  std::vector<std::string> received;
+  auto handler = [&received](const char* m, uint32_t size) {
+    received.push_back(std::string(m, size));
+  };
+  auto reader = std::make_shared<frame_reader>(1 << 20);
+  EXPECT_TRUE(reader->consume(stream.data(), 1000, handler));
+  EXPECT_TRUE(received.empty());
+  uint32_t missing = reader->missing();
+  EXPECT_EQ(missing, message.size() + frame_reader::HEADER_SIZE - 1000);
+  std::shared_ptr<char> body = reader->body();
+  std::copy(stream.begin() + 1000, stream.begin() + 1000 + missing, body.get());
+  reader->body_received(handler);
+  ASSERT_EQ(received.size(), 1U);
+  EXPECT_EQ(received[0], message);
+
+  size_t rest = 1000 + missing;
+  EXPECT_TRUE(reader->consume(stream.data() + rest, static_cast<uint32_t>(stream.size() - rest), handler));
+  ASSERT_EQ(received.size(), 2U);
+  EXPECT_EQ(received[1], "next");
+}
+
+TEST(frame_reader, invalid_size) {
+  auto handler = [](const char* m, uint32_t size) {};
+  frame_reader small(16);
+  std::string too_big = frame_reader::frame(std::string(17, 'a'));
+  EXPECT_FALSE(small.consume(too_big.data(), static_cast<uint32_t>(too_big.size()), handler));
+  frame_reader empty(16);
+  std::string no_message = frame_reader::frame("");
+  EXPECT_FALSE(empty.consume(no_message.data(), static_cast<uint32_t>(no_message.size()), handler));
+}
@@ -0,0 +1,245 @@
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+#include "automaton/core/network/tcp_implementation.h"
+#include "automaton/core/node/node.h"
+#include "automaton/core/node/node_scheduler.h"
+#include "automaton/core/smartproto/smart_protocol.h"
+#include "gtest/gtest.h"
+
+using automaton::core::node::node;
+using automaton::core::node::node_scheduler;
+using automaton::core::smartproto::smart_protocol;
+
+static const char* PROTOCOLS_PATH = "build/node_scheduler_test/";
+
+// A node without a script. It records its updates and runs the tasks added to
+// it by the test.
+class stub_node: public node {
+ public:
+  struct update {
+    std::string id;
+    // The time the update was run at and the time it was due, 0 for the first
+    uint64_t time;
+    uint64_t due;
+  };
+
+  static std::mutex log_mutex;
+  static std::condition_variable log_changed;
+  static std::vector<update> updates;
+
+  stub_node(const std::string& id, const std::string& proto_id): node(id, proto_id) {}
+
+  static std::shared_ptr<node> create(const std::string& id, const std::string& proto_id) {
+    return std::make_shared<stub_node>(id, proto_id);
+  }
+
+  using node::add_task;
+
+  void init() {}
+
+  std::string s_debug_html() {
+    return "";
+  }
+
+  void s_update(uint64_t time) {
+    std::lock_guard<std::mutex> lock(log_mutex);
+    updates.push_back({get_id(), time, due});
+    due = get_time_to_update();
+    log_changed.notify_all();
+  }
+
+  // Waits until pred() holds, returns false after 10 seconds
+  template<class predicate>
+  static bool wait(predicate pred) {
+    std::unique_lock<std::mutex> lock(log_mutex);
+    return log_changed.wait_for(lock, std::chrono::seconds(10), pred);
+  }
+
+  // Adds a task that signals when it starts and returns when released
+  void add_blocking_task() {
+    add_task([this]() {
+      std::unique_lock<std::mutex> lock(log_mutex);
+      blocked = true;
+      log_changed.notify_all();
+      log_changed.wait(lock, [this]() { return !blocked; });
+      return "";
+    });
+  }
+
+  void release() {
+    std::lock_guard<std::mutex> lock(log_mutex);
+    blocked = false;
+    log_changed.notify_all();
+  }
+
+  // Adds a task that counts its runs
+  void add_counted_task() {
+    add_task([this]() {
+      std::lock_guard<std::mutex> lock(log_mutex);
+      ++tasks_run;
+      log_changed.notify_all();
+      return "";
+    });
+  }
+
+  // Guarded by log_mutex
+  bool blocked = false;
+  uint32_t tasks_run = 0;
+
+ private:
+  uint64_t due = 0;
+};
+
+std::mutex stub_node::log_mutex;
+std::condition_variable stub_node::log_changed;
+std::vector<stub_node::update> stub_node::updates;
+
+class node_scheduler_test: public ::testing::Test {
+ protected:
+  static void SetUpTestCase() {
+    automaton::core::network::tcp_init();
+    node::register_node_type("stub", &stub_node::create);
+    // Update time slices in milliseconds
+    for (uint32_t slice : {20, 30, 50, 1000000}) {
+      std::string path = PROTOCOLS_PATH + std::to_string(slice) + "/";
+      boost::filesystem::create_directories(path);
+      std::ofstream config(path + "config.json");
+      config << "{\"update_time_slice\": " << slice <<
+          ", \"schemas\": [], \"files\": {}, \"wire_msgs\": [], \"commands\": []}";
+      config.close();
+      smart_protocol::load("every_" + std::to_string(slice), path);
+    }
+  }
+
+  static void TearDownTestCase() {
+    automaton::core::network::tcp_release();
+    boost::filesystem::remove_all(PROTOCOLS_PATH);
+  }
+
+  void SetUp() {
+    std::lock_guard<std::mutex> lock(stub_node::log_mutex);
+    stub_node::updates.clear();
+  }
+
+  void TearDown() {
+    for (auto& id : launched) {
+      node::remove_node(id);
+    }
+  }
+
+  std::shared_ptr<stub_node> launch(const std::string& id, uint32_t slice) {
+    static uint32_t port = 12400;
+    bool launched_node = node::launch_node("stub", id, "every_" + std::to_string(slice),
+        "tcp://127.0.0.1:" + std::to_string(port++));
+    EXPECT_TRUE(launched_node);
+    launched.push_back(id);
+    return std::static_pointer_cast<stub_node>(node::get_node(id));
+  }
+
+  static uint32_t updates_of(const std::string& id) {
+    uint32_t count = 0;
+    for (auto& u : stub_node::updates) {
+      count += u.id == id;
+    }
+    return count;
+  }
+
+  std::vector<std::string> launched;
+};
+
+// A task added while the node runs wakes it again once it is done, without
+// waiting for the next update
+TEST_F(node_scheduler_test, wake_while_running) {
+  auto n = launch("wake", 1000000);
+  auto scheduler = std::make_shared<node_scheduler>(2);
+  scheduler->add_node("wake");
+  scheduler->start();
+  ASSERT_TRUE(stub_node::wait([]() { return updates_of("wake") == 1; }));
+
+  n->add_blocking_task();
+  ASSERT_TRUE(stub_node::wait([&n]() { return n->blocked; }));
+  n->add_counted_task();
+  // The second task is not taken while the first one blocks the node
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  {
+    std::lock_guard<std::mutex> lock(stub_node::log_mutex);
+    EXPECT_EQ(n->tasks_run, 0U);
+  }
+  n->release();
+  EXPECT_TRUE(stub_node::wait([&n]() { return n->tasks_run == 1; }));
+  scheduler->stop();
+  std::lock_guard<std::mutex> lock(stub_node::log_mutex);
+  EXPECT_EQ(updates_of("wake"), 1U);
+}
+
+// A node removed while it waits in a worker queue is not run. Adding it again
+// runs its tasks.
+TEST_F(node_scheduler_test, remove_while_queued) {
+  auto blocker = launch("blocker", 1000000);
+  auto removed = launch("removed", 1000000);
+  auto scheduler = std::make_shared<node_scheduler>(1);
+  scheduler->add_node("blocker");
+  scheduler->add_node("removed");
+  scheduler->start();
+  ASSERT_TRUE(stub_node::wait([]() { return updates_of("blocker") == 1 && updates_of("removed") == 1; }));
+
+  // Keep the only worker busy while the other node is queued and removed
+  blocker->add_blocking_task();
+  ASSERT_TRUE(stub_node::wait([&blocker]() { return blocker->blocked; }));
+  removed->add_counted_task();
+  scheduler->remove_node("removed");
+  // Queued after the removed node, so the worker passed it when this runs
+  blocker->add_counted_task();
+  blocker->release();
+  ASSERT_TRUE(stub_node::wait([&blocker]() { return blocker->tasks_run == 1; }));
+  {
+    std::lock_guard<std::mutex> lock(stub_node::log_mutex);
+    EXPECT_EQ(removed->tasks_run, 0U);
+  }
+  EXPECT_TRUE(removed->has_tasks());
+
+  scheduler->add_node("removed");
+  EXPECT_TRUE(stub_node::wait([&removed]() { return removed->tasks_run == 1; }));
+  scheduler->stop();
+}
+
+// Updates run when they are due, never before, and a single worker runs them
+// in the order they became due
+TEST_F(node_scheduler_test, timer_ordering) {
+  launch("every_20", 20);
+  launch("every_30", 30);
+  launch("every_50", 50);
+  auto scheduler = std::make_shared<node_scheduler>(1);
+  scheduler->add_node("every_20");
+  scheduler->add_node("every_30");
+  scheduler->add_node("every_50");
+  scheduler->start();
+  ASSERT_TRUE(stub_node::wait([]() { return updates_of("every_50") >= 6; }));
+  scheduler->stop();
+
+  std::lock_guard<std::mutex> lock(stub_node::log_mutex);
+  uint64_t last_due = 0;
+  uint32_t timed = 0;
+  for (auto& u : stub_node::updates) {
+    if (u.due == 0) {
+      continue;
+    }
+    EXPECT_GE(u.time, u.due) << u.id;
+    EXPECT_GE(u.due, last_due) << u.id;
+    last_due = u.due;
+    ++timed;
+  }
+  EXPECT_GE(timed, 15U);
+  EXPECT_GE(updates_of("every_20"), updates_of("every_50"));
+}
@@ -0,0 +1,247 @@
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+#include "automaton/core/data/factory.h"
+#include "automaton/core/data/msg.h"
+#include "automaton/core/network/tcp_implementation.h"
+#include "automaton/core/node/node.h"
+#include "automaton/core/smartproto/smart_protocol.h"
+#include "gtest/gtest.h"
+
+using automaton::core::data::msg;
+using automaton::core::node::node;
+using automaton::core::node::peer_id;
+using automaton::core::smartproto::smart_protocol;
+
+static const char* PROTOCOL_PATH = "build/node_test_protocol/";
+
+// Heap allocations of the process, counted to check the receive path
+static std::atomic<uint64_t> allocations(0);
+
+void* operator new(size_t size) {
+  ++allocations;
+  void* p = std::malloc(size == 0 ? 1 : size);
+  if (p == nullptr) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void operator delete(void* p) noexcept {
+  std::free(p);
+}
+
+// Records the messages and connections of a node
+class test_node: public node {
+ public:
+  test_node(const std::string& id, const std::string& proto_id): node(id, proto_id) {}
+
+  using node::add_task;
+  using node::get_wire_msg;
+
+  void init() {}
+
+  std::string s_debug_html() {
+    return "";
+  }
+
+  void s_on_blob_received(peer_id id, const char* blob, uint32_t size) {
+    std::lock_guard<std::mutex> lock(mutex);
+    received.push_back(std::string(blob, size));
+    changed.notify_all();
+  }
+
+  void s_on_connected(peer_id id) {
+    std::lock_guard<std::mutex> lock(mutex);
+    connected = true;
+    changed.notify_all();
+  }
+
+  // Waits until pred() holds, returns false after 10 seconds
+  template<class predicate>
+  bool wait(predicate pred) {
+    std::unique_lock<std::mutex> lock(mutex);
+    return changed.wait_for(lock, std::chrono::seconds(10), pred);
+  }
+
+  std::mutex mutex;
+  std::condition_variable changed;
+  std::vector<std::string> received;
+  bool connected = false;
+};
+
+// A protocol with no schemas, nodes of it only exchange blobs
+static void load_protocol(const std::string& id) {
+  boost::filesystem::create_directories(PROTOCOL_PATH);
+  std::ofstream config(std::string(PROTOCOL_PATH) + "config.json");
+  config << R"({"update_time_slice": 50, "schemas": [], "files": {}, "wire_msgs": [], "commands": []})";
+  config.close();
+  ASSERT_TRUE(smart_protocol::load(id, PROTOCOL_PATH));
+}
+
+// Messages larger than the receive buffer are read straight into the frame
+// reader's buffer and arrive whole and in order with the small ones around them
+TEST(node, large_messages_over_tcp) {
+  load_protocol("blobs");
+  automaton::core::network::tcp_init();
+  auto receiver = std::make_shared<test_node>("receiver", "blobs");
+  auto sender = std::make_shared<test_node>("sender", "blobs");
+  ASSERT_TRUE(receiver->set_acceptor("tcp://127.0.0.1:12377"));
+  peer_id p = sender->add_peer("tcp://127.0.0.1:12377");
+  ASSERT_TRUE(sender->connect(p));
+  ASSERT_TRUE(sender->wait([&sender]() { return sender->connected; }));
+
+  std::vector<std::string> sent;
+  sent.push_back("a");
+  // Larger than the 1MB the reader keeps its buffer for
+  std::string large(5 << 20, '\0');
+  for (size_t i = 0; i < large.size(); ++i) {
+    large[i] = static_cast<char>(i * 7 + i / 251);
+  }
+  sent.push_back(large);
+  // Just over the 64KB receive buffer
+  sent.push_back(std::string(70000, 'b'));
+  sent.push_back("c");
+  sent.push_back(large.substr(1000));
+  sent.push_back(std::string(300, 'd'));
+  for (uint32_t i = 0; i < sent.size(); ++i) {
+    sender->send_blob(p, sent[i], i + 1);
+  }
+
+  ASSERT_TRUE(receiver->wait([&receiver, &sent]() { return receiver->received.size() == sent.size(); }));
+  {
+    std::lock_guard<std::mutex> lock(receiver->mutex);
+    ASSERT_EQ(receiver->received.size(), sent.size());
+    for (size_t i = 0; i < sent.size(); ++i) {
+      EXPECT_EQ(receiver->received[i].size(), sent[i].size());
+      EXPECT_TRUE(receiver->received[i] == sent[i]) << "message " << i;
+    }
+  }
+
+  sender->disconnect(p);
+  receiver.reset();
+  sender.reset();
+  automaton::core::network::tcp_release();
+  boost::filesystem::remove_all(PROTOCOL_PATH);
+}
+
+// Scripts can run a node's tasks while its updater does. Each task runs once
+// and tasks of one producer run in order.
+TEST(node, concurrent_process_tasks) {
+  load_protocol("tasks");
+  auto n = std::make_shared<test_node>("tasks", "tasks");
+  const uint32_t TASKS = 20000;
+  std::vector<uint32_t> runs(TASKS, 0);
+  uint32_t last = 0;
+  bool ordered = true;
+  std::atomic<bool> producing(true);
+  std::thread producer([&]() {
+    for (uint32_t i = 0; i < TASKS; ++i) {
+      n->add_task([&runs, &last, &ordered, i]() {
+        // Tasks run under the node's script mutex
+        ++runs[i];
+        ordered = ordered && (i == 0 || last == i - 1);
+        last = i;
+        return "";
+      });
+    }
+    producing = false;
+  });
+  std::vector<std::thread> consumers;
+  for (uint32_t c = 0; c < 3; ++c) {
+    consumers.emplace_back([&n, &producing]() {
+      while (producing || n->has_tasks()) {
+        n->process_tasks();
+      }
+    });
+  }
+  producer.join();
+  for (auto& t : consumers) {
+    t.join();
+  }
+  n->process_tasks();
+  EXPECT_TRUE(ordered);
+  for (uint32_t i = 0; i < TASKS; ++i) {
+    ASSERT_EQ(runs[i], 1U) << "task " << i;
+  }
+  n.reset();
+  boost::filesystem::remove_all(PROTOCOL_PATH);
+}
+
+// Received messages are parsed into the node's wire arena. It takes far fewer
+// heap allocations per message than parsing each message on the heap, and a
+// message moved out of the arena outlives it.
+TEST(node, wire_messages_in_arena) {
+  boost::filesystem::create_directories(PROTOCOL_PATH);
+  std::ofstream schema(std::string(PROTOCOL_PATH) + "wire.proto");
+  schema << "syntax = \"proto3\";\n"
+      << "message Ping { string name = 1; repeated string tags = 2; bytes payload = 3; }\n";
+  schema.close();
+  std::ofstream config(std::string(PROTOCOL_PATH) + "config.json");
+  config << R"({"update_time_slice": 50, "schemas": ["wire.proto"], "files": {}, "wire_msgs": ["Ping"], )"
+      << R"("commands": []})";
+  config.close();
+  ASSERT_TRUE(smart_protocol::load("wire", PROTOCOL_PATH));
+  auto factory = smart_protocol::get_protocol("wire")->get_factory();
+  auto n = std::make_shared<test_node>("wire", "wire");
+
+  // Strings longer than the short string buffer take a heap allocation each in
+  // an arena too, these are short to count the rest
+  uint32_t ping_id = factory->get_schema_id("Ping");
+  auto ping = factory->new_message_by_id(ping_id);
+  ping->set_blob(1, "name");
+  for (int32_t i = 0; i < 8; ++i) {
+    ping->set_repeated_blob(2, "tag" + std::to_string(i), -1);
+  }
+  ping->set_blob(3, std::string(10, 'p'));
+  std::string blob(1, '\0');
+  std::string serialized;
+  ping->serialize_message(&serialized);
+  blob += serialized;
+
+  const uint32_t MESSAGES = 1000;
+  uint64_t before = allocations;
+  for (uint32_t i = 0; i < MESSAGES; ++i) {
+    auto m = factory->new_message_by_id(ping_id);
+    ASSERT_TRUE(m->deserialize_message(serialized));
+  }
+  uint64_t heap_allocations = allocations - before;
+
+  std::unique_ptr<msg> kept;
+  before = allocations;
+  for (uint32_t i = 0; i < MESSAGES; ++i) {
+    auto m = n->get_wire_msg(blob);
+    if (i == MESSAGES / 2) {
+      kept = std::move(m);
+    }
+  }
+  uint64_t arena_allocations = allocations - before;
+  EXPECT_LT(arena_allocations * 3, heap_allocations)
+      << arena_allocations << " allocations in the arena, " << heap_allocations << " on the heap";
+
+  // A new update starts a new arena, the kept message leaves the old one
+  kept->move_to_heap();
+  n->process_update(0);
+  for (uint32_t i = 0; i < MESSAGES; ++i) {
+    n->get_wire_msg(blob);
+  }
+  EXPECT_EQ(kept->get_blob(1), "name");
+  EXPECT_EQ(kept->get_repeated_field_size(2), 8U);
+  EXPECT_EQ(kept->get_repeated_blob(2, 7), "tag7");
+  EXPECT_EQ(kept->get_blob(3), std::string(10, 'p'));
+
+  kept = nullptr;
+  n.reset();
+  boost::filesystem::remove_all(PROTOCOL_PATH);
+}
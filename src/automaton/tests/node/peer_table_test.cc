@@ -0,0 +1,83 @@
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "automaton/core/node/peer_table.h"
+#include "gtest/gtest.h"
+
+using automaton::core::node::peer_id;
+using automaton::core::node::peer_info;
+using automaton::core::node::peer_table;
+
+TEST(peer_table, add_connect_remove) {
+  peer_table peers;
+  peer_id next = 0;
+  auto init = [&next](peer_info* info) {
+    info->id = ++next;
+  };
+  bool added = false;
+  EXPECT_EQ(peers.add("tcp://1", init, &added), 1U);
+  EXPECT_TRUE(added);
+  EXPECT_EQ(peers.add("tcp://2", init, &added), 2U);
+  EXPECT_TRUE(added);
+  EXPECT_EQ(peers.add("tcp://1", init, &added), 1U);
+  EXPECT_FALSE(added);
+  EXPECT_EQ(next, 2U);
+
+  std::string address;
+  EXPECT_TRUE(peers.apply(2, [&address](peer_info* info, bool connected) {
+    EXPECT_FALSE(connected);
+    address = info->address;
+  }));
+  EXPECT_EQ(address, "tcp://2");
+  EXPECT_FALSE(peers.apply(3, [](peer_info* info, bool connected) {}));
+
+  EXPECT_FALSE(peers.set_connected(1, true));
+  EXPECT_TRUE(peers.set_connected(1, true));
+  EXPECT_FALSE(peers.set_connected(3, true));
+  EXPECT_EQ(peers.list_connected(), std::set<peer_id>({1}));
+
+  // A removed peer stays connected until its connection reports the disconnect
+  EXPECT_TRUE(peers.remove(1));
+  EXPECT_FALSE(peers.remove(1));
+  EXPECT_EQ(peers.list_known(), std::vector<peer_id>({2}));
+  EXPECT_EQ(peers.list_connected(), std::set<peer_id>({1}));
+  EXPECT_TRUE(peers.set_connected(1, false));
+  EXPECT_TRUE(peers.list_connected().empty());
+
+  EXPECT_EQ(peers.add("tcp://1", init, &added), 3U);
+  EXPECT_TRUE(added);
+  EXPECT_EQ(peers.clear().size(), 2U);
+  EXPECT_TRUE(peers.list_known().empty());
+}
+
+TEST(peer_table, concurrent_access) {
+  const uint32_t THREADS = 4;
+  const uint32_t PEERS = 200;
+  peer_table peers;
+  std::vector<std::thread> threads;
+  for (uint32_t t = 0; t < THREADS; ++t) {
+    threads.emplace_back([&peers, t]() {
+      for (uint32_t i = 0; i < PEERS; ++i) {
+        peer_id id = t * PEERS + i + 1;
+        bool added = false;
+        peers.add("tcp://" + std::to_string(id), [id](peer_info* info) {
+          info->id = id;
+        }, &added);
+        EXPECT_TRUE(added);
+        peers.set_connected(id, true);
+        for (uint32_t r = 0; r < 50; ++r) {
+          EXPECT_TRUE(peers.apply(id, [](peer_info* info, bool connected) {
+            EXPECT_TRUE(connected);
+          }));
+        }
+      }
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  EXPECT_EQ(peers.list_known().size(), THREADS * PEERS);
+  EXPECT_EQ(peers.list_connected().size(), THREADS * PEERS);
+}
@@ -0,0 +1,74 @@
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "automaton/core/node/task_queue.h"
+#include "gtest/gtest.h"
+
+using automaton::core::node::task_queue;
+
+TEST(task_queue, batches_keep_order) {
+  task_queue q;
+  std::vector<std::string> run;
+  for (int i = 0; i < 10; ++i) {
+    q.push([i]() { return std::to_string(i); });
+  }
+  EXPECT_EQ(q.size(), 10U);
+
+  std::vector<task_queue::task> batch;
+  EXPECT_EQ(q.pop(4, &batch), 4U);
+  EXPECT_EQ(q.pop(100, &batch), 6U);
+  EXPECT_EQ(q.pop(100, &batch), 0U);
+  for (auto& t : batch) {
+    run.push_back(t());
+  }
+  EXPECT_EQ(run, std::vector<std::string>({"0", "1", "2", "3", "4", "5", "6", "7", "8", "9"}));
+
+  q.push([]() { return "again"; });
+  batch.clear();
+  ASSERT_EQ(q.pop(100, &batch), 1U);
+  EXPECT_EQ(batch[0](), "again");
+
+  task_queue::metrics m = q.get_metrics();
+  EXPECT_EQ(m.depth, 0U);
+  EXPECT_EQ(m.pushed, 11U);
+  EXPECT_EQ(m.popped, 11U);
+  EXPECT_GE(m.total_wait_us, m.max_wait_us);
+}
+
+// Every task pushed from several threads is popped once, in the order of its
+// thread
+TEST(task_queue, many_producers) {
+  const int PRODUCERS = 4;
+  const int TASKS = 20000;
+  task_queue q;
+  std::vector<std::thread> producers;
+  for (int p = 0; p < PRODUCERS; ++p) {
+    producers.emplace_back([&q, p]() {
+      for (int i = 0; i < TASKS; ++i) {
+        q.push([p, i]() { return std::to_string(p) + " " + std::to_string(i); });
+      }
+    });
+  }
+
+  std::vector<int> next(PRODUCERS, 0);
+  int popped = 0;
+  std::vector<task_queue::task> batch;
+  while (popped < PRODUCERS * TASKS) {
+    q.pop(64, &batch);
+    for (auto& t : batch) {
+      std::string s = t();
+      int p = std::stoi(s.substr(0, s.find(' ')));
+      int i = std::stoi(s.substr(s.find(' ') + 1));
+      EXPECT_EQ(i, next[p]);
+      next[p] = i + 1;
+      ++popped;
+    }
+    batch.clear();
+  }
+  for (auto& t : producers) {
+    t.join();
+  }
+  EXPECT_EQ(q.pop(64, &batch), 0U);
+  EXPECT_EQ(q.get_metrics().depth, 0U);
+}
@@ -3,12 +3,16 @@
 
 #include "automaton/core/crypto/cryptopp/SHA256_cryptopp.h"
 #include "automaton/core/data/protobuf/protobuf_factory.h"
+#include "automaton/core/data/protobuf/protobuf_schema.h"
 #include "automaton/core/io/io.h"
 #include "automaton/core/script/engine.h"
 
 #include "gtest/gtest.h"
 
+using automaton::core::data::msg;
+using automaton::core::data::schema;
 using automaton::core::data::protobuf::protobuf_factory;
+using automaton::core::data::protobuf::protobuf_schema;
 
 namespace automaton {
 namespace core {
@@ -51,5 +55,113 @@ TEST_F(test_script, module_registration) {
   }
 }
 
+TEST_F(test_script, repeated_field_view) {
+  protobuf_schema custom_schema;
+  int m1 = custom_schema.create_message("item");
+  custom_schema.add_scalar_field(schema::field_info(1, schema::blob, "name", "", false), m1);
+  custom_schema.add_message(m1);
+  int m2 = custom_schema.create_message("list");
+  custom_schema.add_scalar_field(schema::field_info(1, schema::int32, "numbers", "", true), m2);
+  custom_schema.add_message_field(schema::field_info(2, schema::message_type, "items", "item", true), m2);
+  custom_schema.add_message(m2);
+  auto data_factory = std::make_shared<protobuf_factory>();
+  data_factory->import_schema(&custom_schema, "test", "");
+
+  auto item = data_factory->new_message_by_name("item");
+  auto list = data_factory->new_message_by_name("list");
+  for (int32_t i = 1; i <= 3; ++i) {
+    list->set_repeated_int32(1, i * 10, -1);
+    item->set_blob(1, "item" + std::to_string(i));
+    list->set_repeated_message(2, *item, -1);
+  }
+
+  script::engine lua(data_factory);
+  lua.bind_core();
+  lua.script(R"(
+    function check(m)
+      local numbers = m.numbers
+      local out = #numbers .. " " .. numbers[2] .. " " .. tostring(numbers[4])
+      for i, v in pairs(numbers) do
+        out = out .. " " .. i .. ":" .. v
+      end
+      for _, v in ipairs(m.items) do
+        out = out .. " " .. v.name
+      end
+      numbers[1] = 5
+      numbers[#numbers + 1] = 40
+      out = out .. " " .. table.concat(numbers, ",")
+      local t = m.items:to_table()
+      out = out .. " " .. type(t) .. " " .. #t .. " " .. t[3].name
+      return out
+    end
+  )");
+  std::string result = lua["check"](list.get());
+  EXPECT_EQ(result, "3 20 nil 1:10 2:20 3:30 item1 item2 item3 5,20,30,40 table 3 item3");
+  EXPECT_EQ(list->get_repeated_field_size(1), 4U);
+  EXPECT_EQ(list->get_repeated_int32(1, 0), 5);
+
+  // A view kept by the script keeps the message it was given alive
+  lua.script(R"(
+    function keep(m)
+      kept = m.numbers
+    end
+    function read_kept()
+      return #kept .. " " .. kept[4] .. " " .. type(kept)
+    end
+  )");
+  std::shared_ptr<msg> shared = std::move(list);
+  lua["keep"](shared);
+  shared = nullptr;
+  lua.collect_garbage();
+  std::string kept = lua["read_kept"]();
+  EXPECT_EQ(kept, "4 40 userdata");
+}
+
+TEST_F(test_script, field_access_by_name) {
+  protobuf_schema custom_schema;
+  int m1 = custom_schema.create_message("inner");
+  custom_schema.add_scalar_field(schema::field_info(1, schema::blob, "label", "", false), m1);
+  custom_schema.add_message(m1);
+  int m2 = custom_schema.create_message("record");
+  custom_schema.add_scalar_field(schema::field_info(1, schema::int32, "count", "", false), m2);
+  custom_schema.add_scalar_field(schema::field_info(2, schema::uint32, "total", "", false), m2);
+  custom_schema.add_scalar_field(schema::field_info(3, schema::blob, "name", "", false), m2);
+  custom_schema.add_message_field(schema::field_info(4, schema::message_type, "inner", "inner", false), m2);
+  custom_schema.add_message(m2);
+  auto data_factory = std::make_shared<protobuf_factory>();
+  data_factory->import_schema(&custom_schema, "test", "");
+
+  auto record = data_factory->new_message_by_name("record");
+  auto inner = data_factory->new_message_by_name("inner");
+  record->set_int32(1, 7);
+  record->set_blob(3, "first");
+
+  script::engine lua(data_factory);
+  lua.bind_core();
+  lua.script(R"(
+    function access(m, inner)
+      local out = m.count .. " " .. m.name
+      m.count = m.count + 1
+      m.total = 4000000000
+      m.name = "second"
+      inner.label = "label"
+      m.inner = inner
+      out = out .. " " .. m.count .. " " .. m.total .. " " .. m.name .. " " .. m.inner.label
+      -- Unknown names are errors, both reading and writing
+      local ok, err = pcall(function() return m.missing end)
+      out = out .. " " .. tostring(ok) .. " " .. tostring(string.find(err, "No field with name: missing", 1, true) ~= nil)
+      ok, err = pcall(function() m.missing = 1 end)
+      out = out .. " " .. tostring(ok) .. " " .. tostring(string.find(err, "No field with name: missing", 1, true) ~= nil)
+      return out
+    end
+  )");
+  std::string result = lua["access"](record.get(), inner.get());
+  EXPECT_EQ(result, "7 first 8 4000000000 second label false true false true");
+  EXPECT_EQ(record->get_int32(1), 8);
+  EXPECT_EQ(record->get_uint32(2), 4000000000U);
+  EXPECT_EQ(record->get_blob(3), "second");
+  EXPECT_EQ(record->get_message(4)->get_blob(1), "label");
+}
+
 }  // namespace core
 }  // namespace automaton
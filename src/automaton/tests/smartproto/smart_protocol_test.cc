@@ -0,0 +1,127 @@
+#include <fstream>
+#include <memory>
+#include <string>
+
+#include <boost/filesystem.hpp>
+
+#include "automaton/core/crypto/cryptopp/SHA256_cryptopp.h"
+#include "automaton/core/data/protobuf/protobuf_factory.h"
+#include "automaton/core/data/protobuf/protobuf_schema.h"
+#include "automaton/core/io/io.h"
+#include "automaton/core/smartproto/smart_protocol.h"
+#include "gtest/gtest.h"
+
+using automaton::core::crypto::cryptopp::SHA256_cryptopp;
+using automaton::core::data::protobuf::protobuf_factory;
+using automaton::core::data::protobuf::protobuf_schema;
+using automaton::core::io::get_file_contents;
+using automaton::core::smartproto::smart_protocol;
+
+static const boost::filesystem::path TEST_DIR =
+    boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("smart_protocol_test_%%%%%%%%");
+
+class test_dir_environment: public ::testing::Environment {
+ public:
+  void SetUp() {
+    boost::filesystem::create_directories(TEST_DIR);
+  }
+
+  void TearDown() {
+    boost::filesystem::remove_all(TEST_DIR);
+  }
+};
+
+static ::testing::Environment* const test_dir = ::testing::AddGlobalTestEnvironment(new test_dir_environment());
+
+static std::string test_file(const std::string& name) {
+  return (TEST_DIR / name).string();
+}
+
+// Writes a protocol with one schema file to its own directory
+static std::string write_protocol(const std::string& id, const std::string& schema) {
+  std::string path = test_file(id) + "/";
+  boost::filesystem::create_directories(path);
+  std::ofstream schema_file(path + "schema.proto");
+  schema_file << schema;
+  schema_file.close();
+  std::ofstream config(path + "config.json");
+  config << R"({"update_time_slice": 50, "schemas": ["schema.proto"], "files": {}, "wire_msgs": [], "commands": []})";
+  config.close();
+  return path;
+}
+
+// Path of the cached schemas, named after the hash of the schema file with its
+// size in front
+static std::string cache_file(const std::string& schema) {
+  SHA256_cryptopp hasher;
+  uint64_t size = schema.size();
+  hasher.update(reinterpret_cast<const uint8_t*>(&size), sizeof(size));
+  hasher.update(reinterpret_cast<const uint8_t*>(schema.data()), schema.size());
+  std::string digest(hasher.digest_size(), '\0');
+  hasher.final(reinterpret_cast<uint8_t*>(&digest[0]));
+  return test_file("cache/" + automaton::core::io::bin2hex(digest) + ".fds");
+}
+
+static bool has_schema(const std::string& proto_id, const std::string& name) {
+  try {
+    smart_protocol::get_protocol(proto_id)->get_factory()->get_schema_id(name);
+    return true;
+  } catch (const std::exception& e) {
+    return false;
+  }
+}
+
+// Schemas not in the cache are parsed and saved there
+TEST(smart_protocol, schema_cache_miss_writes_file) {
+  smart_protocol::set_schema_cache_dir(test_file("cache"));
+  const std::string schema = "syntax = \"proto3\";\nmessage Miss { string name = 1; }\n";
+  ASSERT_FALSE(boost::filesystem::exists(cache_file(schema)));
+  ASSERT_TRUE(smart_protocol::load("miss", write_protocol("miss", schema)));
+  EXPECT_TRUE(has_schema("miss", "Miss"));
+
+  ASSERT_TRUE(boost::filesystem::exists(cache_file(schema)));
+  EXPECT_FALSE(boost::filesystem::exists(cache_file(schema) + ".tmp"));
+  protobuf_factory cached;
+  cached.import_file_descriptor_set(get_file_contents(cache_file(schema).c_str()));
+  EXPECT_NO_THROW(cached.get_schema_id("Miss"));
+  smart_protocol::set_schema_cache_dir("");
+}
+
+// Cached schemas are imported instead of parsing the schema files. The cache
+// here holds a different message than the schema file, to tell the two apart.
+TEST(smart_protocol, schema_cache_hit_reuses_file) {
+  smart_protocol::set_schema_cache_dir(test_file("cache"));
+  const std::string schema = "syntax = \"proto3\";\nmessage Hit { string name = 1; }\n";
+  protobuf_schema cached_schema("syntax = \"proto3\";\nmessage FromCache { string name = 1; }\n");
+  protobuf_factory cached;
+  cached.import_schema(&cached_schema, "", "");
+  std::string fds;
+  cached.export_file_descriptor_set(&fds);
+  boost::filesystem::create_directories(test_file("cache"));
+  std::ofstream(cache_file(schema), std::ios::binary) << fds;
+
+  ASSERT_TRUE(smart_protocol::load("hit", write_protocol("hit", schema)));
+  EXPECT_TRUE(has_schema("hit", "FromCache"));
+  EXPECT_FALSE(has_schema("hit", "Hit"));
+  EXPECT_EQ(get_file_contents(cache_file(schema).c_str()), fds);
+  smart_protocol::set_schema_cache_dir("");
+}
+
+// A cache file that can't be imported is replaced with the parsed schemas
+TEST(smart_protocol, schema_cache_corrupt_file_parses_schema) {
+  smart_protocol::set_schema_cache_dir(test_file("cache"));
+  const std::string schema = "syntax = \"proto3\";\nmessage Corrupt { string name = 1; }\n";
+  const std::string corrupt = "not a file descriptor set";
+  boost::filesystem::create_directories(test_file("cache"));
+  std::ofstream(cache_file(schema), std::ios::binary) << corrupt;
+
+  ASSERT_TRUE(smart_protocol::load("corrupt", write_protocol("corrupt", schema)));
+  EXPECT_TRUE(has_schema("corrupt", "Corrupt"));
+
+  std::string fds = get_file_contents(cache_file(schema).c_str());
+  EXPECT_NE(fds, corrupt);
+  protobuf_factory cached;
+  cached.import_file_descriptor_set(fds);
+  EXPECT_NO_THROW(cached.get_schema_id("Corrupt"));
+  smart_protocol::set_schema_cache_dir("");
+}
@@ -4,6 +4,7 @@
 #include <string>
 #include <utility>
 #include <vector>
+#include <boost/filesystem.hpp>
 #include "automaton/core/crypto/cryptopp/SHA256_cryptopp.h"
 #include "automaton/core/io/io.h"
 #include "automaton/core/storage/persistent_blobstore.h"
@@ -17,6 +18,28 @@ using automaton::core::state::state_persistent;
 using automaton::core::storage::blobstore;
 using automaton::core::storage::persistent_blobstore;
 using automaton::core::storage::persistent_vector;
+using automaton::core::storage::write_ahead_log;
+
+// Files of the tests go to a directory of their own, removed after the tests
+static const boost::filesystem::path TEST_DIR =
+    boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("state_persistent_test_%%%%%%%%");
+
+class test_dir_environment: public ::testing::Environment {
+ public:
+  void SetUp() {
+    boost::filesystem::create_directories(TEST_DIR);
+  }
+
+  void TearDown() {
+    boost::filesystem::remove_all(TEST_DIR);
+  }
+};
+
+static ::testing::Environment* const test_dir = ::testing::AddGlobalTestEnvironment(new test_dir_environment());
+
+static std::string test_file(const std::string& name) {
+  return (TEST_DIR / name).string();
+}
 
 TEST(state_persistent, set_and_get) {
   std::vector<std::pair<std::string, std::string> > tests;
@@ -34,10 +57,8 @@ TEST(state_persistent, set_and_get) {
   hash_transformation* hasher = new SHA256_cryptopp();
   persistent_blobstore* bs = new persistent_blobstore();
   persistent_vector<state_persistent::node>* pv = new persistent_vector<state_persistent::node>();
-  remove("build/mapped_file_set_and_get");
-  remove("build/mapped_vector_set_and_get");
-  bs->map_file("build/mapped_file_set_and_get");
-  pv->map_file("build/mapped_vector_set_and_get");
+  bs->map_file(test_file("mapped_file_set_and_get"));
+  pv->map_file(test_file("mapped_vector_set_and_get"));
   state_persistent state(hasher, bs, pv);
 
   // For each node added, check if the previous nodes are still correct
@@ -65,10 +86,8 @@ TEST(state_persistent, set_delete_and_get) {
   hash_transformation* hasher = new SHA256_cryptopp();
   persistent_blobstore* bs = new persistent_blobstore();
   persistent_vector<state_persistent::node>* pv = new persistent_vector<state_persistent::node>();
-  remove("build/mapped_file_set_delete_and_get");
-  remove("build/mapped_vector_set_delete_and_get");
-  bs->map_file("build/mapped_file_set_delete_and_get");
-  pv->map_file("build/mapped_vector_set_delete_and_get");
+  bs->map_file(test_file("mapped_file_set_delete_and_get"));
+  pv->map_file(test_file("mapped_vector_set_delete_and_get"));
   state_persistent state(hasher, bs, pv);
   // add all nodes
   for (unsigned int i = 0; i < tests.size(); i++) {
@@ -101,10 +120,8 @@ TEST(state_persistent, node_hash_add_erase) {
   hash_transformation* hasher = new SHA256_cryptopp();
   persistent_blobstore* bs = new persistent_blobstore();
   persistent_vector<state_persistent::node>* pv = new persistent_vector<state_persistent::node>();
-  remove("build/mapped_file_node_hash_add_erase");
-  remove("build/mapped_vector_node_hash_add_erase");
-  bs->map_file("build/mapped_file_node_hash_add_erase");
-  pv->map_file("build/mapped_vector_node_hash_add_erase");
+  bs->map_file(test_file("mapped_file_node_hash_add_erase"));
+  pv->map_file(test_file("mapped_vector_node_hash_add_erase"));
   state_persistent state(hasher, bs, pv);
 
   // Add keys/values to the state and add the root hash into a stack.
@@ -174,10 +191,8 @@ TEST(state_persistent, insert_and_delete_expect_blank) {
   hash_transformation* hasher = new SHA256_cryptopp();
   persistent_blobstore* bs = new persistent_blobstore();
   persistent_vector<state_persistent::node>* pv = new persistent_vector<state_persistent::node>();
-  remove("build/mapped_file_insert_and_delete_expect_blank");
-  remove("build/mapped_vector_insert_and_delete_expect_blank");
-  bs->map_file("build/mapped_file_insert_and_delete_expect_blank");
-  pv->map_file("build/mapped_vector_insert_and_delete_expect_blank");
+  bs->map_file(test_file("mapped_file_insert_and_delete_expect_blank"));
+  pv->map_file(test_file("mapped_vector_insert_and_delete_expect_blank"));
   state_persistent state(hasher, bs, pv);
 
   state.set("a", "1");
@@ -195,10 +210,8 @@ TEST(state_persistent, get_node_hash) {
   hash_transformation* hasher = new SHA256_cryptopp();
   persistent_blobstore* bs = new persistent_blobstore();
   persistent_vector<state_persistent::node>* pv = new persistent_vector<state_persistent::node>();
-  remove("build/mapped_file_get_node_hash");
-  remove("build/mapped_vector_get_node_hash");
-  bs->map_file("build/mapped_file_get_node_hash");
-  pv->map_file("build/mapped_vector_get_node_hash");
+  bs->map_file(test_file("mapped_file_get_node_hash"));
+  pv->map_file(test_file("mapped_vector_get_node_hash"));
   state_persistent state(hasher, bs, pv);
   EXPECT_EQ(state.get_node_hash(""), "");
 }
@@ -207,10 +220,8 @@ TEST(state_persistent, commit_changes) {
   hash_transformation* hasher = new SHA256_cryptopp();
   persistent_blobstore* bs = new persistent_blobstore();
   persistent_vector<state_persistent::node>* pv = new persistent_vector<state_persistent::node>();
-  remove("build/mapped_file_commit_changes");
-  remove("build/mapped_vector_commit_changes");
-  bs->map_file("build/mapped_file_commit_changes");
-  pv->map_file("build/mapped_vector_commit_changes");
+  bs->map_file(test_file("mapped_file_commit_changes"));
+  pv->map_file(test_file("mapped_vector_commit_changes"));
   state_persistent state(hasher, bs, pv);
 
   state.set("a", "1");
@@ -225,10 +236,8 @@ TEST(state_persistent, discard_changes) {
   hash_transformation* hasher = new SHA256_cryptopp();
   persistent_blobstore* bs = new persistent_blobstore();
   persistent_vector<state_persistent::node>* pv = new persistent_vector<state_persistent::node>();
-  remove("build/mapped_file_discard_changes");
-  remove("build/mapped_vector_discard_changes");
-  bs->map_file("build/mapped_file_discard_changes");
-  pv->map_file("build/mapped_vector_discard_changes");
+  bs->map_file(test_file("mapped_file_discard_changes"));
+  pv->map_file(test_file("mapped_vector_discard_changes"));
   state_persistent state(hasher, bs, pv);
   state.set("a", "1");
   state.set("b", "2");
@@ -242,10 +251,8 @@ TEST(state_persistent, delete_node_tree) {
   hash_transformation* hasher = new SHA256_cryptopp();
   persistent_blobstore* bs = new persistent_blobstore();
   persistent_vector<state_persistent::node>* pv = new persistent_vector<state_persistent::node>();
-  remove("build/mapped_file_delete_node_tree");
-  remove("build/mapped_vector_delete_node_tree");
-  bs->map_file("build/mapped_file_delete_node_tree");
-  pv->map_file("build/mapped_vector_delete_node_tree");
+  bs->map_file(test_file("mapped_file_delete_node_tree"));
+  pv->map_file(test_file("mapped_vector_delete_node_tree"));
   state_persistent state(hasher, bs, pv);
   state.set("aa", "1");
   state.set("aaa", "2");
@@ -263,10 +270,8 @@ TEST(state_persistent, delete_node_tree_plus_commit_discard_free_backup_add_node
   hash_transformation* hasher = new SHA256_cryptopp();
   persistent_blobstore* bs = new persistent_blobstore();
   persistent_vector<state_persistent::node>* pv = new persistent_vector<state_persistent::node>();
-  remove("build/mapped_file_delete_node_tree_plus_commit_discard_free_backup_add_node");
-  remove("build/mapped_vector_delete_node_tree_plus_commit_discard_free_backup_add_node");
-  bs->map_file("build/mapped_file_delete_node_tree_plus_commit_discard_free_backup_add_node");
-  pv->map_file("build/mapped_vector_delete_node_tree_plus_commit_discard_free_backup_add_node");
+  bs->map_file(test_file("mapped_file_delete_node_tree_plus_commit_discard_free_backup_add_node"));
+  pv->map_file(test_file("mapped_vector_delete_node_tree_plus_commit_discard_free_backup_add_node"));
   state_persistent state(hasher, bs, pv);
   state.set("aa", "1");
   state.set("aaa", "2");
@@ -308,14 +313,187 @@ TEST(state_persistent, delete_node_tree_plus_commit_discard_free_backup_add_node
 }
 
 
+TEST(state_persistent, long_fields_commit_and_discard) {
+  // Fields up to INLINE_SIZE bytes live in the node record, longer ones
+  // spill to the blobstore
+  std::string long_value(state_persistent::node::INLINE_SIZE + 1, 'v');
+  std::string long_key(3 * state_persistent::node::INLINE_SIZE, 'k');
+
+  hash_transformation* hasher = new SHA256_cryptopp();
+  persistent_blobstore* bs = new persistent_blobstore();
+  persistent_vector<state_persistent::node>* pv = new persistent_vector<state_persistent::node>();
+  bs->map_file(test_file("mapped_file_long_fields_commit_and_discard"));
+  pv->map_file(test_file("mapped_vector_long_fields_commit_and_discard"));
+  state_persistent state(hasher, bs, pv);
+
+  state.set("short", "1");
+  state.set(long_key, long_value);
+  state.set(long_key + "x", "2");
+  state.set("short" + long_value, long_value + "3");
+  state.commit_changes();
+  std::string committed_hash = state.get_node_hash("");
+
+  // Overwrite and split spilled fields, then roll back
+  state.set(long_key, "4");
+  state.set(long_key.substr(0, state_persistent::node::INLINE_SIZE + 5), long_value);
+  state.erase("short" + long_value);
+  state.discard_changes();
+  EXPECT_EQ(state.get("short"), "1");
+  EXPECT_EQ(state.get(long_key), long_value);
+  EXPECT_EQ(state.get(long_key + "x"), "2");
+  EXPECT_EQ(state.get("short" + long_value), long_value + "3");
+  EXPECT_EQ(state.get_node_hash(""), committed_hash);
+
+  // Same changes, committed this time
+  state.set(long_key, "4");
+  state.set(long_key.substr(0, state_persistent::node::INLINE_SIZE + 5), long_value);
+  state.erase("short" + long_value);
+  state.commit_changes();
+  EXPECT_EQ(state.get(long_key), "4");
+  EXPECT_EQ(state.get(long_key.substr(0, state_persistent::node::INLINE_SIZE + 5)), long_value);
+  EXPECT_EQ(state.get(long_key + "x"), "2");
+  EXPECT_EQ(state.get("short" + long_value), "");
+  EXPECT_EQ(state.get("short"), "1");
+}
+
+TEST(state_persistent, recover_from_log) {
+  std::string long_value(100, 'v');
+  std::string committed_hash;
+  {
+    // Leaked to simulate a crash, nothing is flushed on destruction
+    hash_transformation* hasher = new SHA256_cryptopp();
+    write_ahead_log* log = new write_ahead_log();
+    log->open(test_file("log_recover_from_log"));
+    log->set_group_commit_size(100);
+    persistent_blobstore* bs = new persistent_blobstore();
+    persistent_vector<state_persistent::node>* pv = new persistent_vector<state_persistent::node>();
+    bs->map_file(test_file("mapped_file_recover_from_log"), log);
+    pv->map_file(test_file("mapped_vector_recover_from_log"), log);
+    state_persistent* state = new state_persistent(hasher, bs, pv, log);
+    for (int i = 0; i < 100; i++) {
+      state->set("key" + std::to_string(i), i % 2 ? long_value : std::to_string(i));
+    }
+    state->commit_changes(false);
+    state->erase("key1");
+    state->set("key1000", "uncommitted");
+    state->commit_changes(false);
+    committed_hash = state->root_hash();
+    state->set("key2000", "uncommitted");
+    state->erase("key2");
+  }
+
+  hash_transformation* hasher = new SHA256_cryptopp();
+  write_ahead_log log;
+  log.open(test_file("log_recover_from_log"));
+  persistent_blobstore bs;
+  persistent_vector<state_persistent::node> pv;
+  bs.map_file(test_file("mapped_file_recover_from_log"), &log);
+  pv.map_file(test_file("mapped_vector_recover_from_log"), &log);
+  state_persistent state(hasher, &bs, &pv, &log);
+  EXPECT_EQ(state.root_hash(), committed_hash);
+  EXPECT_EQ(state.get("key1"), "");
+  EXPECT_EQ(state.get("key2"), "2");
+  EXPECT_EQ(state.get("key3"), long_value);
+  EXPECT_EQ(state.get("key1000"), "uncommitted");
+  EXPECT_EQ(state.get("key2000"), "");
+}
+
+TEST(state_persistent, nodes_file_version) {
+  SHA256_cryptopp hasher;
+  std::string committed_hash;
+  {
+    persistent_blobstore bs;
+    persistent_vector<state_persistent::node> pv;
+    bs.map_file(test_file("mapped_file_nodes_file_version"));
+    pv.map_file(test_file("mapped_vector_nodes_file_version"));
+    state_persistent state(&hasher, &bs, &pv);
+    EXPECT_EQ(pv.get_format_version(), state_persistent::node::VERSION);
+    state.set("key", std::string(100, 'v'));
+    state.commit_changes();
+    committed_hash = state.root_hash();
+  }
+  persistent_blobstore bs;
+  persistent_vector<state_persistent::node> pv;
+  bs.map_file(test_file("mapped_file_nodes_file_version"));
+  pv.map_file(test_file("mapped_vector_nodes_file_version"));
+  {
+    state_persistent state(&hasher, &bs, &pv);
+    EXPECT_EQ(state.root_hash(), committed_hash);
+    EXPECT_EQ(state.get("key"), std::string(100, 'v'));
+  }
+  // Files written before the version was stored have none
+  pv.set_format_version(0);
+  EXPECT_THROW(state_persistent(&hasher, &bs, &pv), std::runtime_error);
+}
+
+// Rehashing with workers gives the same hashes as on one thread, also when the
+// work has to be split below the root, and the hashes they write are committed
+// through the log.
+TEST(state_persistent, parallel_hashing) {
+  SHA256_cryptopp hasher, worker1, worker2, worker3;
+  std::string committed_hash;
+  {
+    persistent_blobstore serial_bs;
+    persistent_vector<state_persistent::node> serial_pv;
+    serial_bs.map_file(test_file("mapped_file_parallel_hashing_serial"));
+    serial_pv.map_file(test_file("mapped_vector_parallel_hashing_serial"));
+    state_persistent serial(&hasher, &serial_bs, &serial_pv);
+
+    write_ahead_log log;
+    log.open(test_file("log_parallel_hashing"));
+    persistent_blobstore bs;
+    persistent_vector<state_persistent::node> pv;
+    bs.map_file(test_file("mapped_file_parallel_hashing"), &log);
+    pv.map_file(test_file("mapped_vector_parallel_hashing"), &log);
+    state_persistent parallel(&hasher, &bs, &pv, &log);
+    parallel.set_worker_hashers({&worker1, &worker2, &worker3});
+
+    for (int32_t i = 0; i < 20000; ++i) {
+      std::string key = i < 10000 ? "a" + hash_key(i) : hash_key(i);
+      serial.set(key, std::to_string(i));
+      parallel.set(key, std::to_string(i));
+      if (i == 9999) {
+        EXPECT_EQ(parallel.root_hash(), serial.root_hash());
+      }
+    }
+    EXPECT_EQ(parallel.root_hash(), serial.root_hash());
+    for (int32_t i = 0; i < 20000; i += 2) {
+      std::string key = i < 10000 ? "a" + hash_key(i) : hash_key(i);
+      serial.erase(key);
+      parallel.erase(key);
+    }
+    serial.commit_changes();
+    parallel.commit_changes();
+    EXPECT_EQ(parallel.get_node_hash(""), serial.get_node_hash(""));
+    EXPECT_EQ(parallel.get_node_hash("a"), serial.get_node_hash("a"));
+
+    // Only the leaves are written, the nodes above them only get new hashes
+    for (int32_t i = 1; i < 20000; i += 2) {
+      std::string key = i < 10000 ? "a" + hash_key(i) : hash_key(i);
+      serial.set(key, "updated");
+      parallel.set(key, "updated");
+    }
+    serial.commit_changes();
+    parallel.commit_changes();
+    EXPECT_EQ(parallel.get_node_hash(""), serial.get_node_hash(""));
+    committed_hash = serial.root_hash();
+  }
+  write_ahead_log log;
+  log.open(test_file("log_parallel_hashing"));
+  persistent_blobstore bs;
+  persistent_vector<state_persistent::node> pv;
+  bs.map_file(test_file("mapped_file_parallel_hashing"), &log);
+  pv.map_file(test_file("mapped_vector_parallel_hashing"), &log);
+  state_persistent state(&hasher, &bs, &pv, &log);
+  EXPECT_EQ(state.root_hash(), committed_hash);
+}
+
 TEST(dummy_state, using_deleted_locations) {
   hash_transformation* hasher = new SHA256_cryptopp();
   persistent_blobstore* bs = new persistent_blobstore();
   persistent_vector<state_persistent::node>* pv = new persistent_vector<state_persistent::node>();
-  remove("build/mapped_file_using_deleted_locations");
-  remove("build/mapped_vector_using_deleted_locations");
-  bs->map_file("build/mapped_file_using_deleted_locations");
-  pv->map_file("build/mapped_vector_using_deleted_locations");
+  bs->map_file(test_file("mapped_file_using_deleted_locations"));
+  pv->map_file(test_file("mapped_vector_using_deleted_locations"));
   state_persistent state(hasher, bs, pv);
 
   state.set("a", "1");
@@ -1,7 +1,9 @@
+#include <algorithm>
 #include <string>
 #include <vector>
 #include <utility>
 #include <stack>
+#include <thread>
 #include "automaton/core/crypto/cryptopp/SHA256_cryptopp.h"
 #include "automaton/core/io/io.h"
 #include "automaton/core/state/state_impl.h"
@@ -189,6 +191,26 @@ TEST(state_impl, discard_changes) {
   EXPECT_EQ(s.get_node_hash(""), "");
 }
 
+// Backups of one discarded transaction must not be restored by the next one
+TEST(state_impl, repeated_discard_changes) {
+  SHA256_cryptopp hasher;
+  state_impl s(&hasher);
+  for (int32_t i = 0; i < 1000; ++i) {
+    s.set(hash_key(i), std::to_string(i));
+  }
+  s.commit_changes();
+  std::string committed_hash = s.root_hash();
+  for (int32_t round = 0; round < 5; ++round) {
+    for (int32_t i = 0; i < 2000; ++i) {
+      s.set(hash_key(1000 + round * 2000 + i), "x");
+    }
+    s.erase(hash_key(round));
+    s.discard_changes();
+    EXPECT_EQ(s.root_hash(), committed_hash);
+    EXPECT_EQ(s.get(hash_key(round)), std::to_string(round));
+  }
+}
+
 
 TEST(state_impl, delete_node_tree) {
   SHA256_cryptopp hash;
@@ -248,6 +270,261 @@ TEST(state_impl, delete_node_tree_plus_commit_discard_free_backup_add_node) {
 }
 
 
+// Nodes grow from 4 to 256 children and shrink back while keys are added and
+// erased. The root hash should only depend on the content of the trie.
+TEST(state_impl, wide_nodes_grow_and_shrink) {
+  SHA256_cryptopp hash;
+  state_impl s1(&hash);
+  state_impl s2(&hash);
+  for (uint32_t i = 0; i < 256; ++i) {
+    std::string key(1, static_cast<char>(i));
+    s1.set(key, std::to_string(i));
+    s2.set(key, std::to_string(i));
+    s1.set(key + "x", "child");
+  }
+  for (uint32_t i = 256; i > 0; --i) {
+    s2.set(std::string(1, static_cast<char>(i - 1)) + "x", "child");
+  }
+  EXPECT_EQ(s1.get_node_children("").size(), 256U);
+  EXPECT_EQ(s1.get_node_hash(""), s2.get_node_hash(""));
+
+  for (uint32_t i = 0; i < 256; ++i) {
+    std::string key(1, static_cast<char>(i));
+    EXPECT_EQ(s1.get(key), std::to_string(i));
+    EXPECT_EQ(s1.get(key + "x"), "child");
+    if (i % 8) {
+      s1.erase(key + "x");
+      s1.erase(key);
+    }
+  }
+  EXPECT_EQ(s1.get_node_children("").size(), 32U);
+
+  state_impl s3(&hash);
+  for (uint32_t i = 0; i < 256; i += 8) {
+    std::string key(1, static_cast<char>(i));
+    s3.set(key + "x", "child");
+    s3.set(key, std::to_string(i));
+  }
+  EXPECT_EQ(s1.get_node_hash(""), s3.get_node_hash(""));
+}
+
+// Hashes are only recalculated when requested. Requesting them after every
+// change, once at the end or with parallel workers should give the same root.
+TEST(state_impl, deferred_and_parallel_hashing) {
+  SHA256_cryptopp hash, worker1, worker2, worker3;
+  state_impl eager(&hash);
+  state_impl deferred(&hash);
+  state_impl parallel(&hash);
+  parallel.set_worker_hashers({&worker1, &worker2, &worker3});
+
+  for (int32_t i = 0; i < 20000; ++i) {
+    std::string key = hash_key(i);
+    std::string value = std::to_string(i);
+    eager.set(key, value);
+    eager.get_node_hash("");
+    deferred.set(key, value);
+    parallel.set(key, value);
+  }
+  EXPECT_EQ(deferred.root_hash(), eager.root_hash());
+  EXPECT_EQ(parallel.root_hash(), eager.root_hash());
+
+  for (int32_t i = 0; i < 20000; i += 2) {
+    eager.erase(hash_key(i));
+    eager.get_node_hash("");
+    deferred.erase(hash_key(i));
+    parallel.erase(hash_key(i));
+  }
+  deferred.commit_changes();
+  parallel.commit_changes();
+  EXPECT_EQ(deferred.get_node_hash(""), eager.root_hash());
+  EXPECT_EQ(parallel.get_node_hash(""), eager.root_hash());
+}
+
+// All keys share the first byte, so the work has to be split below the root.
+// The workers are reused across rehashes and can be replaced.
+TEST(state_impl, parallel_hashing_below_root) {
+  SHA256_cryptopp hash, worker1, worker2, worker3;
+  state_impl serial(&hash);
+  state_impl parallel(&hash);
+  parallel.set_worker_hashers({&worker1, &worker2});
+
+  for (int32_t round = 0; round < 3; ++round) {
+    for (int32_t i = round; i < 10000; i += 3) {
+      std::string key = "a" + hash_key(i);
+      serial.set(key, std::to_string(i));
+      parallel.set(key, std::to_string(i));
+    }
+    EXPECT_EQ(parallel.root_hash(), serial.root_hash());
+    if (round == 1) {
+      parallel.set_worker_hashers({&worker1, &worker2, &worker3});
+    }
+  }
+  for (int32_t i = 0; i < 10000; i += 2) {
+    serial.erase("a" + hash_key(i));
+    parallel.erase("a" + hash_key(i));
+  }
+  EXPECT_EQ(parallel.root_hash(), serial.root_hash());
+}
+
+// A snapshot keeps returning the state at the time it was taken while the
+// state is modified, including from other threads.
+TEST(state_impl, snapshot) {
+  SHA256_cryptopp hash;
+  state_impl s(&hash);
+  for (int32_t i = 0; i < 5000; ++i) {
+    s.set(hash_key(i), std::to_string(i));
+  }
+  s.commit_changes();
+  std::string root_hash = s.root_hash();
+  auto snapshot = s.snapshot();
+  EXPECT_EQ(snapshot->root_hash(), root_hash);
+  EXPECT_EQ(snapshot->size(), s.size());
+
+  std::vector<std::thread> readers;
+  for (int32_t t = 0; t < 4; ++t) {
+    readers.emplace_back([snapshot, root_hash]() {
+      for (int32_t i = 0; i < 5000; ++i) {
+        EXPECT_EQ(snapshot->get(hash_key(i)), std::to_string(i));
+      }
+      EXPECT_EQ(snapshot->get_node_hash(""), root_hash);
+    });
+  }
+  for (int32_t i = 0; i < 5000; i += 2) {
+    s.erase(hash_key(i));
+    s.set(hash_key(i + 5000), "new");
+  }
+  s.commit_changes();
+  for (auto& reader : readers) {
+    reader.join();
+  }
+
+  EXPECT_NE(s.root_hash(), root_hash);
+  EXPECT_EQ(s.get(hash_key(0)), "");
+  EXPECT_EQ(snapshot->get(hash_key(0)), "0");
+  EXPECT_EQ(snapshot->get(hash_key(5000)), "");
+  EXPECT_EQ(snapshot->root_hash(), root_hash);
+  s.discard_changes();
+  EXPECT_EQ(snapshot->root_hash(), root_hash);
+}
+
+// A sorted batch builds the same trie as setting the keys one by one, both
+// into an empty state and next to existing keys.
+TEST(state_impl, apply_batch) {
+  SHA256_cryptopp hash;
+  std::vector<std::pair<std::string, std::string> > entries;
+  for (int32_t i = 0; i < 10000; ++i) {
+    // Leave room for a new subtrie under the root
+    if (hash_key(i)[0] != 'x') {
+      entries.push_back(std::make_pair(hash_key(i), std::to_string(i)));
+    }
+  }
+  entries.push_back(std::make_pair("", "root"));
+  entries.push_back(std::make_pair("ab", "1"));
+  entries.push_back(std::make_pair("abc", "2"));
+  entries.push_back(std::make_pair("abd", "3"));
+  std::sort(entries.begin(), entries.end());
+
+  state_impl one_by_one(&hash);
+  for (auto& e : entries) {
+    one_by_one.set(e.first, e.second);
+  }
+  state_impl batch(&hash);
+  batch.apply_batch(entries);
+  EXPECT_EQ(batch.size(), one_by_one.size());
+  EXPECT_EQ(batch.root_hash(), one_by_one.root_hash());
+  EXPECT_EQ(batch.get_node_hash("ab"), one_by_one.get_node_hash("ab"));
+  for (auto& e : entries) {
+    EXPECT_EQ(batch.get(e.first), e.second);
+  }
+  batch.commit_changes();
+  std::string batch_hash = batch.root_hash();
+
+  // Add to and erase from the existing keys
+  std::vector<std::pair<std::string, std::string> > update;
+  update.push_back(std::make_pair("ab", ""));
+  update.push_back(std::make_pair("abe", "4"));
+  update.push_back(std::make_pair("xyz", "5"));
+  update.push_back(std::make_pair("xz", "6"));
+  for (auto& e : update) {
+    one_by_one.set(e.first, e.second);
+  }
+  batch.apply_batch(update);
+  EXPECT_EQ(batch.root_hash(), one_by_one.root_hash());
+  EXPECT_EQ(batch.get("xz"), "6");
+  EXPECT_EQ(batch.get("ab"), "");
+
+  batch.discard_changes();
+  EXPECT_EQ(batch.get("xz"), "");
+  EXPECT_EQ(batch.get("ab"), "1");
+  EXPECT_EQ(batch.get("xyz"), "");
+  EXPECT_EQ(batch.root_hash(), batch_hash);
+
+  std::reverse(update.begin(), update.end());
+  EXPECT_THROW(batch.apply_batch(update), std::invalid_argument);
+}
+
+// Batches merge into existing subtries: they add children to existing nodes,
+// split prefixes, set values of inner nodes and erase keys.
+TEST(state_impl, apply_batch_into_existing_keys) {
+  SHA256_cryptopp hash;
+  state_impl one_by_one(&hash);
+  state_impl batch(&hash);
+  // Short keys share prefixes with each other and with longer ones
+  std::vector<std::pair<std::string, std::string> > initial;
+  for (int32_t i = 0; i < 3000; ++i) {
+    initial.push_back(std::make_pair(hash_key(i).substr(0, 1 + i % 4),
+        std::to_string(i)));
+  }
+  std::sort(initial.begin(), initial.end());
+  initial.erase(std::unique(initial.begin(), initial.end(),
+      [](const std::pair<std::string, std::string>& a,
+          const std::pair<std::string, std::string>& b) {
+        return a.first == b.first;
+      }), initial.end());
+  for (auto& e : initial) {
+    one_by_one.set(e.first, e.second);
+  }
+  batch.apply_batch(initial);
+  ASSERT_EQ(batch.root_hash(), one_by_one.root_hash());
+  one_by_one.commit_changes();
+  batch.commit_changes();
+  std::string committed_hash = batch.root_hash();
+
+  std::vector<std::pair<std::string, std::string> > update;
+  for (int32_t i = 1500; i < 5000; ++i) {
+    update.push_back(std::make_pair(hash_key(i).substr(0, 1 + i % 6),
+        "u" + std::to_string(i)));
+  }
+  // Erase every tenth existing key
+  for (size_t i = 0; i < initial.size(); i += 10) {
+    update.push_back(std::make_pair(initial[i].first, ""));
+  }
+  std::sort(update.begin(), update.end());
+  update.erase(std::unique(update.begin(), update.end(),
+      [](const std::pair<std::string, std::string>& a,
+          const std::pair<std::string, std::string>& b) {
+        return a.first == b.first;
+      }), update.end());
+  for (auto& e : update) {
+    one_by_one.set(e.first, e.second);
+  }
+  batch.apply_batch(update);
+  EXPECT_EQ(batch.size(), one_by_one.size());
+  EXPECT_EQ(batch.root_hash(), one_by_one.root_hash());
+  for (auto& e : update) {
+    EXPECT_EQ(batch.get(e.first), one_by_one.get(e.first));
+  }
+  for (auto& e : initial) {
+    EXPECT_EQ(batch.get(e.first), one_by_one.get(e.first));
+  }
+
+  batch.discard_changes();
+  EXPECT_EQ(batch.root_hash(), committed_hash);
+  for (auto& e : initial) {
+    EXPECT_EQ(batch.get(e.first), e.second);
+  }
+}
+
 TEST(dummy_state, using_deleted_locations) {
   SHA256_cryptopp hash;
   state_impl s(&hash);
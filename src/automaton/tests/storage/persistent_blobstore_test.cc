@@ -1,13 +1,38 @@
 #include "automaton/core/storage/persistent_blobstore.h"
+#include <stdio.h>
 #include <cstring>
 #include <random>
+#include <string>
+#include <unordered_map>
 #include <vector>
 #include <iostream>
+#include <boost/filesystem.hpp>
 #include "automaton/core/io/io.h"
 #include "gtest/gtest.h"
 
 using automaton::core::storage::persistent_blobstore;
 
+// Files of the tests go to a directory of their own, removed after the tests
+static const boost::filesystem::path TEST_DIR =
+    boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("persistent_blobstore_test_%%%%%%%%");
+
+class test_dir_environment: public ::testing::Environment {
+ public:
+  void SetUp() {
+    boost::filesystem::create_directories(TEST_DIR);
+  }
+
+  void TearDown() {
+    boost::filesystem::remove_all(TEST_DIR);
+  }
+};
+
+static ::testing::Environment* const test_dir = ::testing::AddGlobalTestEnvironment(new test_dir_environment());
+
+static std::string test_file(const std::string& name) {
+  return (TEST_DIR / name).string();
+}
+
 TEST(persistent_blobstore, create_mapped_file) {
   std::vector<uint64_t> ids;
   std::vector<std::string> data;
@@ -22,7 +47,7 @@ TEST(persistent_blobstore, create_mapped_file) {
   data.push_back("data 9, data 9, data 9, data 9, data 9, data 9, data 9, data 9, data 9");
   {
     persistent_blobstore bs1;
-    bs1.map_file("build/mapped_file.txt");
+    bs1.map_file(test_file("mapped_file.txt"));
     for (size_t i = 0; i < data.size(); i++) {
       ids.push_back(bs1.store(data[i].size(), reinterpret_cast<const uint8_t*>(data[i].data())));
     }
@@ -30,7 +55,7 @@ TEST(persistent_blobstore, create_mapped_file) {
   uint32_t sz;
   uint8_t* pData;
   persistent_blobstore bs1;
-  bs1.map_file("build/mapped_file.txt");
+  bs1.map_file(test_file("mapped_file.txt"));
   for (size_t i = 0; i < data.size(); i++) {
     pData = bs1.get(ids[i], &sz);
     std::cout << std::string(reinterpret_cast<char*>(pData), sz) << std::endl;
@@ -41,3 +66,89 @@ TEST(persistent_blobstore, create_mapped_file) {
   //   std::cout << std::string(reinterpret_cast<char*>(pData), sz) << std::endl;
   // }
 }
+
+TEST(persistent_blobstore, free_and_reuse) {
+  std::string data(96, 'a');
+  uint64_t id1, id2, id3;
+  {
+    persistent_blobstore bs;
+    bs.map_file(test_file("mapped_file_free_and_reuse"));
+    id1 = bs.store(data.size(), reinterpret_cast<const uint8_t*>(data.data()));
+    id2 = bs.store(data.size(), reinterpret_cast<const uint8_t*>(data.data()));
+    EXPECT_EQ(bs.free_bytes(), 0U);
+    EXPECT_TRUE(bs.free(id1));
+    EXPECT_FALSE(bs.free(id1));
+    EXPECT_GT(bs.free_bytes(), data.size());
+    uint32_t sz = 1;
+    EXPECT_EQ(bs.get(id1, &sz), nullptr);
+    EXPECT_EQ(sz, 0U);
+  }
+  // Free lists survive remapping the file
+  persistent_blobstore bs;
+  bs.map_file(test_file("mapped_file_free_and_reuse"));
+  id3 = bs.store(40, reinterpret_cast<const uint8_t*>(data.data()));
+  EXPECT_EQ(id3, id1);
+  // The rest of the freed blob is reused as well
+  uint64_t id4 = bs.store(40, reinterpret_cast<const uint8_t*>(data.data()));
+  EXPECT_GT(id4, id1);
+  EXPECT_LT(id4, id2);
+  EXPECT_EQ(bs.free_bytes(), 0U);
+
+  uint32_t sz;
+  uint8_t* p_data = bs.get(id2, &sz);
+  EXPECT_EQ(std::string(reinterpret_cast<char*>(p_data), sz), data);
+  p_data = bs.get(id3, &sz);
+  EXPECT_EQ(std::string(reinterpret_cast<char*>(p_data), sz), data.substr(0, 40));
+}
+
+TEST(persistent_blobstore, compact) {
+  std::mt19937 rng(42);
+  std::vector<std::string> data;
+  std::vector<uint64_t> ids;
+  persistent_blobstore bs;
+  bs.map_file(test_file("mapped_file_compact"));
+  for (uint32_t i = 0; i < 2000; i++) {
+    data.push_back(std::string(rng() % 300, 'a' + i % 26));
+    ids.push_back(bs.store(data[i].size(), reinterpret_cast<const uint8_t*>(data[i].data())));
+  }
+  uintmax_t full_size = boost::filesystem::file_size(test_file("mapped_file_compact"));
+  // Keep every 10th blob
+  for (uint32_t i = 0; i < ids.size(); i++) {
+    if (i % 10) {
+      bs.free(ids[i]);
+    }
+  }
+  std::unordered_map<uint64_t, uint64_t> moved = bs.compact();
+  // Only the unused ends of the segments are left
+  EXPECT_LT(bs.free_bytes(), full_size / 100);
+  EXPECT_LT(boost::filesystem::file_size(test_file("mapped_file_compact")), full_size / 4);
+  for (uint32_t i = 0; i < ids.size(); i += 10) {
+    uint64_t id = moved.count(ids[i]) ? moved[ids[i]] : ids[i];
+    uint32_t sz;
+    uint8_t* p_data = bs.get(id, &sz);
+    EXPECT_EQ(std::string(reinterpret_cast<char*>(p_data), sz), data[i]);
+  }
+}
+
+TEST(persistent_blobstore, growth_keeps_pointers) {
+  persistent_blobstore bs;
+  bs.map_file(test_file("mapped_file_growth_keeps_pointers"));
+  std::string first_data(1000, 'f');
+  uint64_t first_id = bs.store(first_data.size(), reinterpret_cast<const uint8_t*>(first_data.data()));
+  uint32_t sz;
+  uint8_t* first = bs.get(first_id, &sz);
+
+  std::vector<uint64_t> ids;
+  std::vector<std::string> data;
+  for (uint32_t i = 0; i < 1000; i++) {
+    // Some blobs are larger than the first segments
+    data.push_back(std::string(i % 100 == 99 ? 100000 : 1000 + i, 'a' + i % 26));
+    ids.push_back(bs.store(data[i].size(), reinterpret_cast<const uint8_t*>(data[i].data())));
+  }
+  EXPECT_EQ(bs.get(first_id, &sz), first);
+  EXPECT_EQ(std::string(reinterpret_cast<char*>(first), sz), first_data);
+  for (uint32_t i = 0; i < ids.size(); i++) {
+    uint8_t* p_data = bs.get(ids[i], &sz);
+    EXPECT_EQ(std::string(reinterpret_cast<char*>(p_data), sz), data[i]);
+  }
+}
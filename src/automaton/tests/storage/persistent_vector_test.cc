@@ -0,0 +1,66 @@
+#include "automaton/core/storage/persistent_vector.h"
+#include <stdio.h>
+#include <cstring>
+#include <string>
+#include <boost/filesystem.hpp>
+#include "gtest/gtest.h"
+
+using automaton::core::storage::persistent_vector;
+
+// Files of the tests go to a directory of their own, removed after the tests
+static const boost::filesystem::path TEST_DIR =
+    boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("persistent_vector_test_%%%%%%%%");
+
+class test_dir_environment: public ::testing::Environment {
+ public:
+  void SetUp() {
+    boost::filesystem::create_directories(TEST_DIR);
+  }
+
+  void TearDown() {
+    boost::filesystem::remove_all(TEST_DIR);
+  }
+};
+
+static ::testing::Environment* const test_dir = ::testing::AddGlobalTestEnvironment(new test_dir_environment());
+
+static std::string test_file(const std::string& name) {
+  return (TEST_DIR / name).string();
+}
+
+// Size does not divide the segment sizes, so some objects would span two
+// segments if they were not packed per segment
+struct record {
+  uint64_t id;
+  char payload[1000];
+};
+
+TEST(persistent_vector, growth_keeps_references) {
+  const uint64_t n = 10000;
+  {
+    persistent_vector<record> v;
+    v.map_file(test_file("mapped_vector_growth_keeps_references"));
+    record r;
+    r.id = 0;
+    std::memset(r.payload, 'a', sizeof(r.payload));
+    v.push_back(r);
+    record& first = v[0];
+    for (uint64_t i = 1; i < n; i++) {
+      r.id = i;
+      std::memset(r.payload, 'a' + i % 26, sizeof(r.payload));
+      v.push_back(r);
+    }
+    // The file grew many times, the reference is still valid
+    EXPECT_EQ(&first, &v[0]);
+    first.id = n;
+  }
+  persistent_vector<record> v;
+  v.map_file(test_file("mapped_vector_growth_keeps_references"));
+  EXPECT_EQ(v.size(), n);
+  EXPECT_EQ(v[0].id, n);
+  for (uint64_t i = 1; i < n; i++) {
+    EXPECT_EQ(v[i].id, i);
+    EXPECT_EQ(v[i].payload[0], static_cast<char>('a' + i % 26));
+    EXPECT_EQ(v[i].payload[sizeof(v[i].payload) - 1], static_cast<char>('a' + i % 26));
+  }
+}
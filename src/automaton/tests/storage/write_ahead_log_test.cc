@@ -0,0 +1,158 @@
+#include "automaton/core/storage/write_ahead_log.h"
+#include <stdio.h>
+#include <cstring>
+#include <string>
+#include <boost/filesystem.hpp>
+#include "automaton/core/storage/persistent_blobstore.h"
+#include "automaton/core/storage/persistent_vector.h"
+#include "gtest/gtest.h"
+
+using automaton::core::storage::persistent_blobstore;
+using automaton::core::storage::persistent_vector;
+using automaton::core::storage::write_ahead_log;
+
+// Files of the tests go to a directory of their own, removed after the tests
+static const boost::filesystem::path TEST_DIR =
+    boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("write_ahead_log_test_%%%%%%%%");
+
+class test_dir_environment: public ::testing::Environment {
+ public:
+  void SetUp() {
+    boost::filesystem::create_directories(TEST_DIR);
+  }
+
+  void TearDown() {
+    boost::filesystem::remove_all(TEST_DIR);
+  }
+};
+
+static ::testing::Environment* const test_dir = ::testing::AddGlobalTestEnvironment(new test_dir_environment());
+
+static std::string test_file(const std::string& name) {
+  return (TEST_DIR / name).string();
+}
+
+static uint64_t store(persistent_blobstore* bs, const std::string& data) {
+  return bs->store(data.size(), reinterpret_cast<const uint8_t*>(data.data()));
+}
+
+static std::string get(persistent_blobstore* bs, uint64_t id) {
+  uint32_t sz;
+  uint8_t* p_data = bs->get(id, &sz);
+  return std::string(reinterpret_cast<char*>(p_data), sz);
+}
+
+// The objects of a "crashed" process are leaked, so nothing is flushed
+// on destruction.
+TEST(write_ahead_log, recovers_committed_transactions) {
+  uint64_t committed_id;
+  {
+    write_ahead_log* log = new write_ahead_log();
+    log->open(test_file("wal_recover_log"));
+    log->set_group_commit_size(100);
+    persistent_blobstore* bs = new persistent_blobstore();
+    persistent_vector<uint64_t>* pv = new persistent_vector<uint64_t>();
+    bs->map_file(test_file("wal_recover_blobs"), log);
+    pv->map_file(test_file("wal_recover_vector"), log);
+    committed_id = store(bs, std::string(100, 'c'));
+    for (uint64_t i = 0; i < 1000; i++) {
+      pv->push_back(i);
+    }
+    log->commit(false);
+    // Not committed
+    store(bs, std::string(100, 'u'));
+    (*pv)[0] = 1000;
+    pv->push_back(1000);
+  }
+  // Only the log has the committed changes
+  EXPECT_GT(boost::filesystem::file_size(test_file("wal_recover_log")), 0U);
+
+  write_ahead_log log;
+  log.open(test_file("wal_recover_log"));
+  persistent_blobstore bs;
+  persistent_vector<uint64_t> pv;
+  bs.map_file(test_file("wal_recover_blobs"), &log);
+  pv.map_file(test_file("wal_recover_vector"), &log);
+  EXPECT_EQ(get(&bs, committed_id), std::string(100, 'c'));
+  EXPECT_EQ(bs.free_bytes(), 0U);
+  EXPECT_EQ(pv.size(), 1000U);
+  for (uint64_t i = 0; i < pv.size(); i++) {
+    EXPECT_EQ(pv[i], i);
+  }
+  // The space of the lost blob is used again
+  EXPECT_EQ(store(&bs, "x"), committed_id + 2 + 26);
+}
+
+TEST(write_ahead_log, ignores_torn_transaction) {
+  {
+    write_ahead_log* log = new write_ahead_log();
+    log->open(test_file("wal_torn_log"));
+    log->set_group_commit_size(100);
+    persistent_vector<uint64_t>* pv = new persistent_vector<uint64_t>();
+    pv->map_file(test_file("wal_torn_vector"), log);
+    pv->push_back(1);
+    log->commit(false);
+    pv->push_back(2);
+    (*pv)[0] = 3;
+    log->commit(false);
+  }
+  // Cut the last record of the second transaction
+  std::string log_file = test_file("wal_torn_log");
+  boost::filesystem::resize_file(log_file, boost::filesystem::file_size(log_file) - 4);
+
+  write_ahead_log log;
+  log.open(test_file("wal_torn_log"));
+  persistent_vector<uint64_t> pv;
+  pv.map_file(test_file("wal_torn_vector"), &log);
+  EXPECT_EQ(pv.size(), 1U);
+  EXPECT_EQ(pv[0], 1U);
+}
+
+TEST(write_ahead_log, sync_commit_reaches_files) {
+  {
+    write_ahead_log log;
+    log.open(test_file("wal_sync_log"));
+    persistent_vector<uint64_t> pv;
+    pv.map_file(test_file("wal_sync_vector"), &log);
+    pv.push_back(7);
+    log.commit(true);
+    pv.push_back(8);
+    pv.push_back(9);
+    log.commit(true);
+    // Closed without a commit
+    pv[0] = 0;
+  }
+  persistent_vector<uint64_t> pv;
+  pv.map_file(test_file("wal_sync_vector"));
+  EXPECT_EQ(pv.size(), 3U);
+  EXPECT_EQ(pv[0], 7U);
+  EXPECT_EQ(pv[2], 9U);
+}
+
+// Elements read through a const reference are not written to the log
+TEST(write_ahead_log, reads_are_not_logged) {
+  write_ahead_log log;
+  log.open(test_file("wal_reads_log"));
+  persistent_vector<uint64_t> pv;
+  pv.map_file(test_file("wal_reads_vector"), &log);
+  for (uint64_t i = 0; i < 10000; i++) {
+    pv.push_back(i);
+  }
+  log.commit(true);
+  uint64_t committed_size = boost::filesystem::file_size(test_file("wal_reads_log"));
+
+  const persistent_vector<uint64_t>& read_only = pv;
+  uint64_t sum = 0;
+  for (uint64_t i = 0; i < read_only.size(); i++) {
+    sum += read_only[i];
+  }
+  EXPECT_EQ(sum, 10000U * 9999U / 2);
+  log.commit(true);
+  uint64_t read_size = boost::filesystem::file_size(test_file("wal_reads_log"));
+  // Only the commit record
+  EXPECT_LT(read_size - committed_size, 100U);
+
+  pv[5000] = 0;
+  log.commit(true);
+  EXPECT_GT(boost::filesystem::file_size(test_file("wal_reads_log")) - read_size, sizeof(uint64_t));
+}
@@ -34,7 +34,7 @@ TEST(testnet, test_all) {
   auto net = testnet::get_testnet("testnet");
   std::vector<std::string> ids = net->list_nodes();
 
-  default_node_updater updater(1, 20, std::set<std::string>(ids.begin(), ids.end()));
+  default_node_updater updater(1, std::set<std::string>(ids.begin(), ids.end()));
   updater.start();
 
   auto msg_factory = smart_protocol::get_protocol("chat")->get_factory();
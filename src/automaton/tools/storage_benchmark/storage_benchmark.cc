@@ -0,0 +1,452 @@
+// Benchmarks for the storage layer and the state implementations.
+//
+// Usage: automaton-storage-benchmark [--suite=all|vector|blobstore|state]
+//            [--keys=N] [--value-size=BYTES] [--commit-every=N]
+//            [--distribution=all|random|sequential|prefix] [--dir=PATH]
+//
+// Every benchmark prints one line per operation with the throughput, the
+// p50/p99 latencies per operation, the bytes it wrote to files and the
+// resident set size of the process after it finished. Bytes written are the
+// file pages the process dirtied, through mmap or write(), as counted by
+// /proc/self/io. They are 0 for the in-memory state_impl and on systems
+// without /proc/self/io.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+
+#include <boost/filesystem.hpp>
+
+#include "automaton/core/crypto/cryptopp/SHA256_cryptopp.h"
+#include "automaton/core/state/state_impl.h"
+#include "automaton/core/state/state_persistent.h"
+#include "automaton/core/storage/persistent_blobstore.h"
+#include "automaton/core/storage/persistent_vector.h"
+
+using automaton::core::crypto::cryptopp::SHA256_cryptopp;
+using automaton::core::state::state;
+using automaton::core::state::state_impl;
+using automaton::core::state::state_persistent;
+using automaton::core::storage::persistent_blobstore;
+using automaton::core::storage::persistent_vector;
+
+struct options {
+  std::string suite = "all";
+  std::string distribution = "all";
+  std::string dir = "build/benchmark";
+  uint64_t keys = 100000;
+  uint32_t value_size = 32;
+  uint64_t commit_every = 1000;
+};
+
+// Latency histogram with 32 buckets per power of two, about 3% precision.
+class histogram {
+ public:
+  histogram() : counts(64 + 64 * 32, 0), total(0) {}
+
+  // Adds count samples of the same latency
+  void add(uint64_t ns, uint64_t count = 1) {
+    counts[bucket(ns)] += count;
+    total += count;
+  }
+
+  uint64_t percentile(double p) const {
+    uint64_t rank = static_cast<uint64_t>(p * total);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < counts.size(); ++i) {
+      seen += counts[i];
+      if (seen > rank) {
+        return lower_bound(i);
+      }
+    }
+    return 0;
+  }
+
+ private:
+  std::vector<uint64_t> counts;
+  uint64_t total;
+
+  static uint32_t bucket(uint64_t ns) {
+    if (ns < 64) {
+      return static_cast<uint32_t>(ns);
+    }
+    uint32_t msb = 0;
+    for (uint64_t v = ns; v >>= 1;) {
+      msb++;
+    }
+    uint32_t shift = msb - 5;
+    return 64 + (shift - 1) * 32 + static_cast<uint32_t>((ns >> shift) - 32);
+  }
+
+  static uint64_t lower_bound(size_t i) {
+    if (i < 64) {
+      return i;
+    }
+    uint64_t shift = (i - 64) / 32 + 1;
+    return ((i - 64) % 32 + 32) << shift;
+  }
+};
+
+// Measures the latency of every operation of one kind and the bytes written
+// while doing them
+class timer {
+ public:
+  void start() {
+    begin = std::chrono::steady_clock::now();
+  }
+
+  // count is the number of operations done since start(), each of them is
+  // counted with the average latency
+  void stop(uint64_t count = 1) {
+    uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - begin).count();
+    latencies.add(ns / count, count);
+    total_ns += ns;
+    ops += count;
+  }
+
+  histogram latencies;
+  uint64_t total_ns = 0;
+  uint64_t ops = 0;
+  uint64_t bytes_written = 0;
+
+ private:
+  std::chrono::steady_clock::time_point begin;
+};
+
+static uint64_t splitmix64(uint64_t x) {
+  x += 0x9E3779B97F4A7C15ULL;
+  x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+  return x ^ (x >> 31);
+}
+
+static std::string big_endian(uint64_t x) {
+  std::string s(8, '\0');
+  for (int i = 7; i >= 0; --i) {
+    s[i] = static_cast<char>(x & 0xFF);
+    x >>= 8;
+  }
+  return s;
+}
+
+// The i-th key of the distribution. Keys are generated again when they are
+// read, so large datasets do not have to be kept in memory.
+static std::string make_key(const std::string& distribution, uint64_t i) {
+  if (distribution == "sequential") {
+    return big_endian(i);
+  } else if (distribution == "prefix") {
+    return "automaton/state/accounts/" + big_endian(splitmix64(i));
+  }
+  return big_endian(splitmix64(i));
+}
+
+static std::string make_value(uint64_t i, uint32_t size) {
+  std::string value(size, static_cast<char>('a' + i % 26));
+  std::memcpy(&value[0], &i, size < sizeof(i) ? size : sizeof(i));
+  return value;
+}
+
+static uint64_t current_rss() {
+#ifdef __linux__
+  std::FILE* f = std::fopen("/proc/self/statm", "r");
+  if (f == nullptr) {
+    return 0;
+  }
+  unsigned long pages = 0, resident = 0;  // NOLINT(runtime/int)
+  if (std::fscanf(f, "%lu %lu", &pages, &resident) != 2) {
+    resident = 0;
+  }
+  std::fclose(f);
+  return static_cast<uint64_t>(resident) * sysconf(_SC_PAGESIZE);
+#else
+  return 0;
+#endif
+}
+
+static uint64_t peak_rss() {
+#ifdef _WIN32
+  return 0;
+#else
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+  return usage.ru_maxrss;
+#else
+  return usage.ru_maxrss * 1024;
+#endif
+#endif
+}
+
+// Bytes of file pages dirtied by the process so far. Reading it costs a few
+// microseconds, so it is done around groups of operations.
+static uint64_t written_bytes() {
+#ifdef __linux__
+  std::ifstream io("/proc/self/io");
+  std::string name;
+  uint64_t value;
+  while (io >> name >> value) {
+    if (name == "write_bytes:") {
+      return value;
+    }
+  }
+#endif
+  return 0;
+}
+
+static void print_header() {
+  std::cout << std::left << std::setw(18) << "benchmark" << std::setw(12) << "dist"
+            << std::setw(12) << "op" << std::right << std::setw(14) << "ops/s"
+            << std::setw(12) << "p50 ns" << std::setw(12) << "p99 ns"
+            << std::setw(14) << "written MB" << std::setw(10) << "rss MB" << std::endl;
+}
+
+static void report(const std::string& name, const std::string& distribution,
+                   const std::string& op, const timer& t) {
+  double seconds = t.total_ns / 1e9;
+  std::cout << std::left << std::setw(18) << name << std::setw(12) << distribution
+            << std::setw(12) << op << std::right << std::fixed << std::setprecision(0)
+            << std::setw(14) << (seconds > 0 ? t.ops / seconds : 0)
+            << std::setw(12) << t.latencies.percentile(0.5)
+            << std::setw(12) << t.latencies.percentile(0.99)
+            << std::setprecision(1) << std::setw(14) << t.bytes_written / 1048576.0
+            << std::setw(10) << current_rss() / 1048576.0 << std::endl;
+}
+
+struct bench_record {
+  uint64_t key;
+  uint8_t payload[56];
+};
+
+static void bench_vector(const options& o, const std::string& distribution) {
+  std::string path = o.dir + "/vector_" + distribution;
+  std::remove(path.c_str());
+  persistent_vector<bench_record> v;
+  v.map_file(path);
+  timer push, read;
+  bench_record r;
+  std::memset(r.payload, 0, sizeof(r.payload));
+  uint64_t written = written_bytes();
+  for (uint64_t i = 0; i < o.keys; ++i) {
+    r.key = distribution == "sequential" ? i : splitmix64(i);
+    push.start();
+    v.push_back(r);
+    push.stop();
+  }
+  push.bytes_written = written_bytes() - written;
+  // Keeps the reads from being optimized away
+  volatile uint64_t sink = 0;
+  const persistent_vector<bench_record>& read_only = v;
+  written = written_bytes();
+  for (uint64_t i = 0; i < o.keys; ++i) {
+    uint64_t at = distribution == "sequential" ? i : splitmix64(i + o.keys) % o.keys;
+    read.start();
+    sink = read_only[at].key;
+    read.stop();
+  }
+  read.bytes_written = written_bytes() - written;
+  (void)sink;
+  report("vector", distribution, "push_back", push);
+  report("vector", distribution, "operator[]", read);
+}
+
+static void bench_blobstore(const options& o, const std::string& distribution) {
+  std::string path = o.dir + "/blobs_" + distribution;
+  std::remove(path.c_str());
+  persistent_blobstore bs;
+  bs.map_file(path);
+  timer store, get;
+  std::vector<uint64_t> ids;
+  ids.reserve(o.keys);
+  uint64_t written = written_bytes();
+  for (uint64_t i = 0; i < o.keys; ++i) {
+    std::string value = make_value(i, o.value_size);
+    store.start();
+    ids.push_back(bs.store(value.size(), reinterpret_cast<const uint8_t*>(value.data())));
+    store.stop();
+  }
+  store.bytes_written = written_bytes() - written;
+  uint32_t sz;
+  written = written_bytes();
+  for (uint64_t i = 0; i < o.keys; ++i) {
+    uint64_t at = distribution == "sequential" ? i : splitmix64(i + o.keys) % o.keys;
+    get.start();
+    bs.get(ids[at], &sz);
+    get.stop();
+  }
+  get.bytes_written = written_bytes() - written;
+  report("blobstore", distribution, "store", store);
+  report("blobstore", distribution, "get", get);
+}
+
+static void bench_state(const options& o, const std::string& distribution,
+                        const std::string& name, state* s) {
+  timer set, commit, get, discard;
+  // Writes between commits are counted for set
+  uint64_t written = written_bytes();
+  for (uint64_t i = 0; i < o.keys; ++i) {
+    std::string key = make_key(distribution, i);
+    std::string value = make_value(i, o.value_size);
+    set.start();
+    s->set(key, value);
+    set.stop();
+    if ((i + 1) % o.commit_every == 0 || i + 1 == o.keys) {
+      uint64_t before_commit = written_bytes();
+      set.bytes_written += before_commit - written;
+      commit.start();
+      s->commit_changes();
+      commit.stop();
+      written = written_bytes();
+      commit.bytes_written += written - before_commit;
+    }
+  }
+  written = written_bytes();
+  for (uint64_t i = 0; i < o.keys; ++i) {
+    std::string key = make_key(distribution, splitmix64(i + o.keys) % o.keys);
+    get.start();
+    s->get(key);
+    get.stop();
+  }
+  get.bytes_written = written_bytes() - written;
+  // Batches of new keys that are thrown away, their writes are not counted
+  uint64_t rounds = o.keys / o.commit_every < 100 ? o.keys / o.commit_every : 100;
+  for (uint64_t r = 0; r < rounds; ++r) {
+    for (uint64_t i = 0; i < o.commit_every; ++i) {
+      s->set(make_key(distribution, o.keys + r * o.commit_every + i), "x");
+    }
+    written = written_bytes();
+    discard.start();
+    s->discard_changes();
+    discard.stop();
+    discard.bytes_written += written_bytes() - written;
+  }
+  report(name, distribution, "set", set);
+  report(name, distribution, "commit", commit);
+  report(name, distribution, "get", get);
+  if (discard.ops) {
+    report(name, distribution, "discard", discard);
+  }
+}
+
+// Loads the same keys as bench_state in sorted batches of commit_every keys.
+// Batches after the first one merge into the subtries built before them.
+static void bench_state_batch(const options& o, const std::string& distribution,
+                              const std::string& name, state* s) {
+  timer batch;
+  std::vector<std::pair<std::string, std::string> > entries;
+  for (uint64_t i = 0; i < o.keys; ++i) {
+    entries.push_back(std::make_pair(make_key(distribution, i), make_value(i, o.value_size)));
+    if ((i + 1) % o.commit_every == 0 || i + 1 == o.keys) {
+      std::sort(entries.begin(), entries.end());
+      uint64_t written = written_bytes();
+      batch.start();
+      s->apply_batch(entries);
+      s->commit_changes();
+      batch.stop(entries.size());
+      batch.bytes_written += written_bytes() - written;
+      entries.clear();
+    }
+  }
+  report(name, distribution, "batch", batch);
+}
+
+static void bench_state_impl(const options& o, const std::string& distribution) {
+  SHA256_cryptopp hasher;
+  state_impl s(&hasher);
+  bench_state(o, distribution, "state_impl", &s);
+  state_impl loaded(&hasher);
+  bench_state_batch(o, distribution, "state_impl", &loaded);
+}
+
+static void bench_state_persistent(const options& o, const std::string& distribution) {
+  std::string blobs_path = o.dir + "/state_blobs_" + distribution;
+  std::string nodes_path = o.dir + "/state_nodes_" + distribution;
+  std::remove(blobs_path.c_str());
+  std::remove(nodes_path.c_str());
+  SHA256_cryptopp hasher;
+  persistent_blobstore bs;
+  persistent_vector<state_persistent::node> nodes;
+  bs.map_file(blobs_path);
+  nodes.map_file(nodes_path);
+  state_persistent s(&hasher, &bs, &nodes);
+  bench_state(o, distribution, "state_persistent", &s);
+}
+
+static bool parse(int argc, char* argv[], options* o) {
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    size_t eq = arg.find('=');
+    if (arg.compare(0, 2, "--") != 0 || eq == std::string::npos) {
+      return false;
+    }
+    std::string name = arg.substr(2, eq - 2);
+    std::string value = arg.substr(eq + 1);
+    if (name == "suite") {
+      o->suite = value;
+    } else if (name == "distribution") {
+      o->distribution = value;
+    } else if (name == "dir") {
+      o->dir = value;
+    } else if (name == "keys") {
+      o->keys = std::stoull(value);
+    } else if (name == "value-size") {
+      o->value_size = static_cast<uint32_t>(std::stoul(value));
+    } else if (name == "commit-every") {
+      o->commit_every = std::stoull(value);
+    } else {
+      return false;
+    }
+  }
+  return o->keys > 0 && o->commit_every > 0;
+}
+
+int main(int argc, char* argv[]) {
+  options o;
+  if (!parse(argc, argv, &o)) {
+    std::cerr << "Usage: " << argv[0] << " [--suite=all|vector|blobstore|state] [--keys=N]"
+              << " [--value-size=BYTES] [--commit-every=N]"
+              << " [--distribution=all|random|sequential|prefix] [--dir=PATH]" << std::endl;
+    return 1;
+  }
+  boost::filesystem::create_directories(o.dir);
+
+  std::vector<std::string> distributions;
+  if (o.distribution == "all") {
+    distributions = {"random", "sequential", "prefix"};
+  } else {
+    distributions = {o.distribution};
+  }
+
+  std::cout << "keys: " << o.keys << ", value size: " << o.value_size
+            << ", commit every: " << o.commit_every << std::endl;
+  print_header();
+  for (const std::string& distribution : distributions) {
+    if (o.suite == "all" || o.suite == "vector") {
+      bench_vector(o, distribution);
+    }
+    if (o.suite == "all" || o.suite == "blobstore") {
+      bench_blobstore(o, distribution);
+    }
+    if (o.suite == "all" || o.suite == "state") {
+      bench_state_impl(o, distribution);
+      bench_state_persistent(o, distribution);
+    }
+  }
+  std::cout << "peak rss MB: " << std::fixed << std::setprecision(1)
+            << peak_rss() / 1048576.0 << std::endl;
+  return 0;
+}